@@ -0,0 +1,24 @@
+// The solver-only executable: the same command line as lbm-fluid-sim, always headless.
+// It does not depend on GLFW/OpenGL, so it builds and runs on compute nodes without a display;
+// --output renders the video in software.
+
+#include <iostream>
+#include "cli.h"
+#include "headless.h"
+
+int main(int argc, char** argv)
+{
+    Args args = parse_args(argc, argv);
+    // A missing or malformed input or restart file
+    try
+    {
+        SimulationSetup setup = load_setup(args);
+        setup_profiler(args);
+        return run_headless(args, setup);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception occurred: " << e.what() << std::endl;
+        return -1;
+    }
+}
@@ -0,0 +1,483 @@
+// MLUPS benchmark over standard LBM test cases. Each case is built programmatically,
+// like sample_d2q9, and run over a sweep of grid sizes, thread counts, kernels and precisions.
+// Usage: lbm_benchmark [--cases cavity,taylor-green,channel,porous] [--sizes 256,512,1024]
+//                      [--threads 1,2,4] [--kernels four-pass,fused,soa,sparse,in-place,tiled]
+//                      [--precisions double,float,mixed] [--tiles 64x32,128x16] [--tile-steps 1,4]
+//                      [--executors par,pool] [--bind none|compact|spread]
+//                      [--steps N] [--format csv|json] [--output <file>]
+// The tiled kernel is run for every combination of tile size and steps per tile.
+// The par executor runs on the parallel algorithms, the pool executor on a pool of
+// workers with row-band partitions (see ExecutionParams).
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <array>
+#include <string>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <optional>
+#include <thread>
+
+#include "d2q9.h"
+
+// The parallel algorithms run on TBB with libstdc++; its global control limits the thread count
+#if __has_include(<tbb/global_control.h>)
+#include <tbb/global_control.h>
+#define LBM_BENCHMARK_HAS_THREAD_CONTROL 1
+#endif
+
+struct BenchmarkCase
+{
+    LBM<2>::LBMParams params;
+    D2Q9InitialConditions initials;
+};
+
+struct BenchmarkConfig
+{
+    std::vector<std::string> cases = {"cavity", "taylor-green", "channel", "porous"};
+    std::vector<size_t> sizes = {256, 512, 1024};
+    std::vector<size_t> threads = {std::max(1u, std::thread::hardware_concurrency())};
+    std::vector<std::string> kernels = {"four-pass", "fused", "soa", "sparse", "in-place", "tiled"};
+    std::vector<std::string> precisions = {"double"};
+    std::vector<std::array<size_t, 2>> tiles = {{64, 32}};
+    std::vector<size_t> tile_steps = {1, 4};
+    std::vector<std::string> executors = {"par"};
+    ThreadBinding binding = ThreadBinding::NONE;
+    size_t steps = 200;
+    std::string format = "csv";
+    std::optional<std::string> output_file;
+};
+
+struct BenchmarkResult
+{
+    std::string case_name;
+    size_t width, height;
+    size_t threads;
+    std::string executor;
+    std::string kernel;
+    std::string precision;
+    D2Q9Tiling tiling; // tiled kernel only
+    size_t steps;
+    double seconds;
+    double mlups;
+    double bytes_per_update;
+    double population_mb;
+    // Relative to the four-pass kernel on the same case, size, thread count and precision, if it was run
+    double relative_mlups = 0.0;
+    double relative_memory = 0.0;
+    LBM<2>::PhaseTimes phase_times;
+};
+
+static D2Q9InitialConditions uniform_initials(size_t total_size, std::array<double, 2> u)
+{
+    D2Q9InitialConditions initials;
+    initials.cell_type.resize(total_size, CellType::FLUID);
+    initials.initial_rho.resize(total_size, 1.0);
+    initials.initial_u.resize(total_size, u);
+    return initials;
+}
+
+// A square cavity with a lid moving along the north edge
+static BenchmarkCase cavity_case(size_t n)
+{
+    BenchmarkCase bc{{{n, n}, {false, false}, 0.6}, uniform_initials(n * n, {0.0, 0.0})};
+    for (size_t y = 0; y < n; y++)
+    {
+        for (size_t x = 0; x < n; x++)
+        {
+            const size_t idx = y * n + x;
+            if (y == n - 1)
+            {
+                bc.initials.cell_type[idx] = CellType::INFLOW;
+                bc.initials.initial_u[idx] = {0.1, 0.0};
+            }
+            else if (x == 0 || x == n - 1 || y == 0)
+                bc.initials.cell_type[idx] = CellType::SOLID;
+        }
+    }
+    return bc;
+}
+
+// A fully periodic Taylor-Green vortex
+static BenchmarkCase taylor_green_case(size_t n)
+{
+    const double u0 = 0.04;
+    const double k = 2.0 * M_PI / n;
+    BenchmarkCase bc{{{n, n}, {true, true}, 0.8}, uniform_initials(n * n, {0.0, 0.0})};
+    for (size_t y = 0; y < n; y++)
+    {
+        for (size_t x = 0; x < n; x++)
+        {
+            const size_t idx = y * n + x;
+            bc.initials.initial_u[idx] = {-u0 * std::cos(k * x) * std::sin(k * y),
+                                           u0 * std::sin(k * x) * std::cos(k * y)};
+            bc.initials.initial_rho[idx] = 1.0 - 0.75 * u0 * u0 * (std::cos(2 * k * x) + std::cos(2 * k * y));
+        }
+    }
+    return bc;
+}
+
+// A 2:1 channel between walls with a cylinder, an inflow on the west and an outflow on the east
+static BenchmarkCase channel_case(size_t n)
+{
+    const size_t nx = n, ny = std::max<size_t>(n / 2, 8);
+    const double cx = nx / 4.0, cy = ny / 2.0, radius = ny / 8.0;
+    BenchmarkCase bc{{{nx, ny}, {false, false}, 0.6}, uniform_initials(nx * ny, {0.1, 0.0})};
+    for (size_t y = 0; y < ny; y++)
+    {
+        for (size_t x = 0; x < nx; x++)
+        {
+            const size_t idx = y * nx + x;
+            if (y == 0 || y == ny - 1 || std::hypot(x - cx, y - cy) < radius)
+                bc.initials.cell_type[idx] = CellType::SOLID;
+            else if (x == 0)
+                bc.initials.cell_type[idx] = CellType::INFLOW;
+            else if (x == nx - 1)
+                bc.initials.cell_type[idx] = CellType::OUTFLOW;
+        }
+    }
+    return bc;
+}
+
+// A periodic porous medium of randomly placed overlapping disks (about 40% solid)
+static BenchmarkCase porous_case(size_t n)
+{
+    BenchmarkCase bc{{{n, n}, {true, true}, 0.8}, uniform_initials(n * n, {0.05, 0.0})};
+    std::mt19937 rng(12345);
+    std::uniform_real_distribution<double> coord(0.0, static_cast<double>(n));
+    const double radius = std::max(2.0, n / 64.0);
+    const size_t n_disks = static_cast<size_t>(0.5 * n * n / (M_PI * radius * radius));
+
+    for (size_t disk = 0; disk < n_disks; disk++)
+    {
+        const double cx = coord(rng), cy = coord(rng);
+        const int r = static_cast<int>(std::ceil(radius));
+        for (int dy = -r; dy <= r; dy++)
+        {
+            for (int dx = -r; dx <= r; dx++)
+            {
+                if (dx * dx + dy * dy > radius * radius) continue;
+                const size_t x = (static_cast<int>(cx) + dx + n) % n;
+                const size_t y = (static_cast<int>(cy) + dy + n) % n;
+                bc.initials.cell_type[y * n + x] = CellType::SOLID;
+            }
+        }
+    }
+    return bc;
+}
+
+static BenchmarkCase make_case(const std::string& name, size_t n)
+{
+    if (name == "cavity") return cavity_case(n);
+    if (name == "taylor-green") return taylor_green_case(n);
+    if (name == "channel") return channel_case(n);
+    if (name == "porous") return porous_case(n);
+    throw std::runtime_error("Unknown benchmark case: " + name);
+}
+
+static D2Q9Kernel parse_kernel(const std::string& name)
+{
+    if (name == "four-pass") return D2Q9Kernel::FOUR_PASS;
+    if (name == "fused") return D2Q9Kernel::FUSED;
+    if (name == "soa") return D2Q9Kernel::SOA;
+    if (name == "sparse") return D2Q9Kernel::SPARSE;
+    if (name == "in-place") return D2Q9Kernel::IN_PLACE;
+    if (name == "tiled") return D2Q9Kernel::TILED;
+    throw std::runtime_error("Unknown kernel: " + name);
+}
+
+// The minimal memory traffic of a lattice update, in bytes: every phase streams through
+// the arrays it touches once. Index lists and boundary cells are not counted.
+static double bytes_per_update(D2Q9Kernel kernel, size_t storage_bytes, size_t scalar_bytes, size_t tile_steps)
+{
+    const double f = 9.0 * storage_bytes;
+    const double macroscopic = 3.0 * scalar_bytes;
+    const double cell_type = sizeof(CellType);
+
+    switch (kernel)
+    {
+        case D2Q9Kernel::FUSED:
+            // Pull f, write f_new and rho/u
+            return 2 * f + macroscopic + cell_type;
+        case D2Q9Kernel::IN_PLACE:
+            // Read and write f in place, write rho/u
+            return 2 * f + macroscopic + cell_type;
+        case D2Q9Kernel::TILED:
+            // The fused sweep, with the grid read and written once per block of tile_steps steps
+            return (2 * f + macroscopic + cell_type) / tile_steps;
+        case D2Q9Kernel::SOA:
+            // Collide (f, rho/u, mask), stream (f, f_new), moments (f, rho/u, mask)
+            return (2 * f + macroscopic + scalar_bytes) + 2 * f + (f + 2 * macroscopic + scalar_bytes);
+        case D2Q9Kernel::SPARSE:
+            // Collide (f, rho/u, grid index), stream (f, f_new, links), moments (f, rho/u, grid index)
+            return (2 * f + macroscopic + sizeof(size_t)) + (2 * f + 9 * sizeof(uint32_t))
+                   + (f + macroscopic + sizeof(size_t));
+        default:
+            // Collide (f, rho/u), stream (f, f_new, cell type), moments (f, rho/u, cell type)
+            return (2 * f + macroscopic) + (2 * f + cell_type) + (f + macroscopic + cell_type);
+    }
+}
+
+template <typename Precision>
+static BenchmarkResult run_benchmark(const std::string& case_name, const BenchmarkCase& bc,
+                                     const std::string& kernel, const D2Q9Tiling& tiling,
+                                     const ExecutionParams& execution, size_t steps)
+{
+    LBM<2>::LBMParams params = bc.params;
+    params.execution = execution;
+    D2Q9<Precision> lbm(params, bc.initials, parse_kernel(kernel), tiling);
+
+    // Warm up the caches and the thread pool
+    lbm.advance(10);
+
+    typename LBM<2, typename D2Q9<Precision>::Scalar>::PhaseTimes times;
+    auto start = std::chrono::steady_clock::now();
+    if (kernel == "tiled" && tiling.time_steps > 1)
+    {
+        // The temporal blocks span several steps, there are no phases to time
+        lbm.advance(steps);
+        times.fused = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    else
+    {
+        for (size_t step = 0; step < steps; step++)
+            lbm.step_timed(times);
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    BenchmarkResult result;
+    result.case_name = case_name;
+    result.width = bc.params.dimensions[0];
+    result.height = bc.params.dimensions[1];
+    result.kernel = kernel;
+    result.tiling = tiling;
+    result.steps = steps;
+    result.seconds = seconds;
+    result.mlups = lbm.get_total_size() * steps / seconds * 1e-6;
+    result.bytes_per_update = bytes_per_update(parse_kernel(kernel),
+                                               sizeof(typename D2Q9<Precision>::Storage),
+                                               sizeof(typename D2Q9<Precision>::Scalar),
+                                               kernel == "tiled" ? tiling.time_steps : 1);
+    result.population_mb = lbm.get_population_bytes() * 1e-6;
+    result.phase_times = {times.collide, times.stream, times.boundary, times.macroscopic, times.fused};
+    return result;
+}
+
+// Compares every result with the four-pass run of the same configuration
+static void add_relative_figures(std::vector<BenchmarkResult>& results)
+{
+    for (BenchmarkResult& r : results)
+    {
+        for (const BenchmarkResult& ref : results)
+        {
+            if (ref.kernel != "four-pass" || ref.case_name != r.case_name || ref.width != r.width
+                || ref.threads != r.threads || ref.executor != r.executor || ref.precision != r.precision)
+                continue;
+            r.relative_mlups = r.mlups / ref.mlups;
+            r.relative_memory = r.population_mb / ref.population_mb;
+        }
+    }
+}
+
+static std::vector<std::string> split(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+static std::vector<size_t> split_sizes(const std::string& list)
+{
+    std::vector<size_t> values;
+    for (const std::string& item : split(list))
+        values.push_back(std::stoul(item));
+    return values;
+}
+
+static std::vector<std::array<size_t, 2>> split_tiles(const std::string& list)
+{
+    std::vector<std::array<size_t, 2>> tiles;
+    for (const std::string& item : split(list))
+    {
+        const size_t x_pos = item.find('x');
+        if (x_pos == std::string::npos)
+            throw std::runtime_error("The tile size should read WxH, got " + item);
+        tiles.push_back({std::stoul(item.substr(0, x_pos)), std::stoul(item.substr(x_pos + 1))});
+    }
+    return tiles;
+}
+
+static BenchmarkConfig parse_config(int argc, char** argv)
+{
+    BenchmarkConfig config;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--cases" && i + 1 < argc)
+            config.cases = split(argv[++i]);
+        else if (arg == "--sizes" && i + 1 < argc)
+            config.sizes = split_sizes(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            config.threads = split_sizes(argv[++i]);
+        else if (arg == "--kernels" && i + 1 < argc)
+            config.kernels = split(argv[++i]);
+        else if (arg == "--precisions" && i + 1 < argc)
+            config.precisions = split(argv[++i]);
+        else if (arg == "--tiles" && i + 1 < argc)
+            config.tiles = split_tiles(argv[++i]);
+        else if (arg == "--tile-steps" && i + 1 < argc)
+            config.tile_steps = split_sizes(argv[++i]);
+        else if (arg == "--executors" && i + 1 < argc)
+            config.executors = split(argv[++i]);
+        else if (arg == "--bind" && i + 1 < argc)
+            config.binding = parse_thread_binding(argv[++i]);
+        else if (arg == "--steps" && i + 1 < argc)
+            config.steps = std::stoul(argv[++i]);
+        else if (arg == "--format" && i + 1 < argc)
+            config.format = argv[++i];
+        else if (arg == "--output" && i + 1 < argc)
+            config.output_file = argv[++i];
+        else
+            std::cerr << "Unsupported command line argument: " << arg << std::endl;
+    }
+    return config;
+}
+
+static void write_csv(std::ostream& out, const std::vector<BenchmarkResult>& results)
+{
+    out << "case,width,height,threads,executor,kernel,tile_width,tile_height,tile_steps,precision,steps,seconds,mlups,bytes_per_update,bandwidth_gbs,"
+           "population_mb,relative_mlups,relative_memory,collide_s,stream_s,boundary_s,macroscopic_s,fused_s\n";
+    for (const BenchmarkResult& r : results)
+    {
+        out << r.case_name << "," << r.width << "," << r.height << "," << r.threads << "," << r.executor << ","
+            << r.kernel << "," << r.tiling.width << "," << r.tiling.height << "," << r.tiling.time_steps << ","
+            << r.precision << "," << r.steps << "," << r.seconds << ","
+            << r.mlups << "," << r.bytes_per_update << "," << r.mlups * r.bytes_per_update * 1e-3 << ","
+            << r.population_mb << "," << r.relative_mlups << "," << r.relative_memory << ","
+            << r.phase_times.collide << "," << r.phase_times.stream << ","
+            << r.phase_times.boundary << "," << r.phase_times.macroscopic << ","
+            << r.phase_times.fused << "\n";
+    }
+}
+
+static void write_json(std::ostream& out, const std::vector<BenchmarkResult>& results)
+{
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& r = results[i];
+        out << "  {\"case\": \"" << r.case_name << "\", \"width\": " << r.width << ", \"height\": " << r.height
+            << ", \"threads\": " << r.threads << ", \"executor\": \"" << r.executor << "\", \"kernel\": \"" << r.kernel << "\""
+            << ", \"tile\": {\"width\": " << r.tiling.width << ", \"height\": " << r.tiling.height
+            << ", \"steps\": " << r.tiling.time_steps << "}, \"precision\": \""
+            << r.precision << "\", \"steps\": " << r.steps << ", \"seconds\": " << r.seconds
+            << ", \"mlups\": " << r.mlups << ", \"bytes_per_update\": " << r.bytes_per_update
+            << ", \"bandwidth_gbs\": " << r.mlups * r.bytes_per_update * 1e-3
+            << ", \"population_mb\": " << r.population_mb << ", \"relative_mlups\": " << r.relative_mlups
+            << ", \"relative_memory\": " << r.relative_memory
+            << ", \"phases\": {\"collide\": " << r.phase_times.collide << ", \"stream\": " << r.phase_times.stream
+            << ", \"boundary\": " << r.phase_times.boundary << ", \"macroscopic\": " << r.phase_times.macroscopic
+            << ", \"fused\": " << r.phase_times.fused << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkConfig config = parse_config(argc, argv);
+    std::vector<BenchmarkResult> results;
+
+#ifndef LBM_BENCHMARK_HAS_THREAD_CONTROL
+    std::cerr << "The thread count cannot be controlled in this build; all runs use the default." << std::endl;
+#endif
+
+    try
+    {
+        for (const std::string& case_name : config.cases)
+        for (size_t size : config.sizes)
+        {
+            const BenchmarkCase bc = make_case(case_name, size);
+            for (size_t threads : config.threads)
+            {
+#ifdef LBM_BENCHMARK_HAS_THREAD_CONTROL
+                tbb::global_control thread_limit(tbb::global_control::max_allowed_parallelism, threads);
+#endif
+                for (const std::string& executor : config.executors)
+                for (const std::string& kernel : config.kernels)
+                for (const std::string& precision : config.precisions)
+                {
+                    // The SIMD kernels of the SoA layout are double precision only
+                    if (kernel == "soa" && precision != "double") continue;
+
+                    if (executor != "par" && executor != "pool")
+                        throw std::runtime_error("Unknown executor: " + executor);
+                    const ExecutionParams execution = executor == "pool" ? ExecutionParams{threads, config.binding}
+                                                                         : ExecutionParams{};
+
+                    // Only the tiled kernel is swept over the tilings
+                    std::vector<D2Q9Tiling> tilings = {D2Q9Tiling{}};
+                    if (kernel == "tiled")
+                    {
+                        tilings.clear();
+                        for (const auto& tile : config.tiles)
+                            for (size_t tile_steps : config.tile_steps)
+                                tilings.push_back({tile[0], tile[1], tile_steps});
+                    }
+
+                    for (const D2Q9Tiling& tiling : tilings)
+                    {
+                        BenchmarkResult result;
+                        if (precision == "float")
+                            result = run_benchmark<float>(case_name, bc, kernel, tiling, execution, config.steps);
+                        else if (precision == "mixed")
+                            result = run_benchmark<MixedPrecision>(case_name, bc, kernel, tiling, execution, config.steps);
+                        else
+                            result = run_benchmark<double>(case_name, bc, kernel, tiling, execution, config.steps);
+                        result.threads = threads;
+                        result.executor = executor;
+                        result.precision = precision;
+                        results.push_back(result);
+
+                        std::cerr << case_name << " " << size << " threads=" << threads << " " << executor << " " << kernel;
+                        if (kernel == "tiled")
+                            std::cerr << " " << tiling.width << "x" << tiling.height << "/" << tiling.time_steps;
+                        std::cerr << " " << precision << ": " << result.mlups << " MLUPS, "
+                                  << result.population_mb << " MB of populations" << std::endl;
+                    }
+                }
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception occurred: " << e.what() << std::endl;
+        return -1;
+    }
+
+    add_relative_figures(results);
+
+    std::ofstream file;
+    if (config.output_file)
+    {
+        file.open(*config.output_file);
+        if (!file.is_open())
+        {
+            std::cerr << "Failed to open output file " << *config.output_file << std::endl;
+            return -1;
+        }
+    }
+    std::ostream& out = config.output_file ? file : std::cout;
+
+    if (config.format == "json")
+        write_json(out, results);
+    else
+        write_csv(out, results);
+    return 0;
+}
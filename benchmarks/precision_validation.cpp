@@ -0,0 +1,192 @@
+// Compares the double, single and mixed precision D2Q9 lattices on two cases
+// with analytic solutions: a Poiseuille channel and a decaying Taylor-Green vortex.
+// Usage: precision_validation [--steps N]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <array>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <functional>
+
+#include "d2q9.h"
+
+struct ValidationCase
+{
+    std::string name;
+    LBM<2>::LBMParams params;
+    D2Q9InitialConditions initials;
+    size_t steps;
+    // The analytic velocity at (x, y) after the given number of steps
+    std::function<std::array<double, 2>(size_t x, size_t y, size_t steps)> analytic_u;
+};
+
+struct ValidationResult
+{
+    double mlups;
+    double l2_error;
+    std::vector<std::array<double, 2>> u;
+};
+
+// A channel between two walls, driven by the parabolic profile prescribed on the west and east edges.
+// The bounce-back walls sit halfway between the solid rows and the first fluid rows.
+ValidationCase poiseuille_case(size_t steps)
+{
+    const size_t nx = 64, ny = 34;
+    const double u_max = 0.05;
+    const double height = ny - 2;
+    auto profile = [=](size_t y)
+    {
+        const double yw = static_cast<double>(y) - 0.5;
+        return 4.0 * u_max * yw * (height - yw) / (height * height);
+    };
+
+    ValidationCase vc{"poiseuille", {{nx, ny}, {false, false}, 0.8}, {}, steps, nullptr};
+    vc.initials.cell_type.resize(nx * ny, CellType::FLUID);
+    vc.initials.initial_rho.resize(nx * ny, 1.0);
+    vc.initials.initial_u.resize(nx * ny, {0.0, 0.0});
+
+    for (size_t y = 0; y < ny; y++)
+    {
+        for (size_t x = 0; x < nx; x++)
+        {
+            const size_t idx = y * nx + x;
+            if (y == 0 || y == ny - 1)
+                vc.initials.cell_type[idx] = CellType::SOLID;
+            else if (x == 0 || x == nx - 1)
+            {
+                vc.initials.cell_type[idx] = CellType::INFLOW;
+                vc.initials.initial_u[idx] = {profile(y), 0.0};
+            }
+        }
+    }
+
+    vc.analytic_u = [=](size_t, size_t y, size_t) -> std::array<double, 2>
+    {
+        if (y == 0 || y == ny - 1) return {0.0, 0.0};
+        return {profile(y), 0.0};
+    };
+    return vc;
+}
+
+// A periodic Taylor-Green vortex, decaying as exp(-2 nu k^2 t)
+ValidationCase taylor_green_case(size_t steps)
+{
+    const size_t n = 128;
+    const double u0 = 0.04;
+    const double tau = 0.8;
+    const double nu = (tau - 0.5) / 3.0;
+    const double k = 2.0 * M_PI / n;
+
+    ValidationCase vc{"taylor-green", {{n, n}, {true, true}, tau}, {}, steps, nullptr};
+    vc.initials.cell_type.resize(n * n, CellType::FLUID);
+    vc.initials.initial_rho.resize(n * n);
+    vc.initials.initial_u.resize(n * n);
+
+    for (size_t y = 0; y < n; y++)
+    {
+        for (size_t x = 0; x < n; x++)
+        {
+            const size_t idx = y * n + x;
+            vc.initials.initial_u[idx] = {-u0 * std::cos(k * x) * std::sin(k * y),
+                                           u0 * std::sin(k * x) * std::cos(k * y)};
+            vc.initials.initial_rho[idx] = 1.0 - 0.75 * u0 * u0 * (std::cos(2 * k * x) + std::cos(2 * k * y));
+        }
+    }
+
+    vc.analytic_u = [=](size_t x, size_t y, size_t t) -> std::array<double, 2>
+    {
+        const double decay = std::exp(-2.0 * nu * k * k * t);
+        return {-u0 * decay * std::cos(k * x) * std::sin(k * y),
+                 u0 * decay * std::sin(k * x) * std::cos(k * y)};
+    };
+    return vc;
+}
+
+template <typename Precision>
+ValidationResult run_case(const ValidationCase& vc)
+{
+    D2Q9<Precision> lbm(vc.params, vc.initials);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t step = 0; step < vc.steps; step++)
+        lbm.step();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    ValidationResult result;
+    result.mlups = lbm.get_total_size() * vc.steps / elapsed.count() * 1e-6;
+
+    const size_t nx = vc.params.dimensions[0];
+    double err_sq = 0.0, ref_sq = 0.0;
+    for (size_t idx = 0; idx < lbm.get_total_size(); idx++)
+    {
+        const auto& u = lbm.get_velocity()[idx];
+        result.u.push_back({static_cast<double>(u[0]), static_cast<double>(u[1])});
+
+        if (lbm.get_cell_type(idx) != CellType::FLUID) continue;
+        const auto u_ref = vc.analytic_u(idx % nx, idx / nx, vc.steps);
+        err_sq += std::pow(u[0] - u_ref[0], 2) + std::pow(u[1] - u_ref[1], 2);
+        ref_sq += u_ref[0] * u_ref[0] + u_ref[1] * u_ref[1];
+    }
+    result.l2_error = std::sqrt(err_sq / ref_sq);
+    return result;
+}
+
+double max_deviation(const std::vector<std::array<double, 2>>& a, const std::vector<std::array<double, 2>>& b)
+{
+    double deviation = 0.0;
+    for (size_t idx = 0; idx < a.size(); idx++)
+        deviation = std::max({deviation, std::abs(a[idx][0] - b[idx][0]), std::abs(a[idx][1] - b[idx][1])});
+    return deviation;
+}
+
+int main(int argc, char** argv)
+{
+    size_t steps = 10000;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--steps" && i + 1 < argc)
+            steps = std::stoul(argv[++i]);
+        else
+            std::cerr << "Unsupported command line argument: " << arg << std::endl;
+    }
+
+    std::cout << std::left << std::setw(14) << "case"
+              << std::setw(10) << "precision"
+              << std::setw(16) << "bytes/cell (f)"
+              << std::setw(10) << "MLUPS"
+              << std::setw(14) << "L2 error"
+              << "max |u - u_double|" << std::endl;
+
+    for (const ValidationCase& vc : {poiseuille_case(steps), taylor_green_case(steps)})
+    {
+        const ValidationResult reference = run_case<double>(vc);
+        const std::array<std::pair<std::string, ValidationResult>, 3> results =
+        {{
+            {"double", reference},
+            {"float", run_case<float>(vc)},
+            {"mixed", run_case<MixedPrecision>(vc)}
+        }};
+        const std::array<size_t, 3> population_bytes =
+        {
+            2 * sizeof(D2Q9<double>::StoredState),
+            2 * sizeof(D2Q9<float>::StoredState),
+            2 * sizeof(D2Q9<MixedPrecision>::StoredState)
+        };
+
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const auto& [precision, result] = results[i];
+            std::cout << std::left << std::setw(14) << vc.name
+                      << std::setw(10) << precision
+                      << std::setw(16) << population_bytes[i]
+                      << std::setw(10) << std::fixed << std::setprecision(2) << result.mlups
+                      << std::setw(14) << std::scientific << std::setprecision(3) << result.l2_error
+                      << max_deviation(result.u, reference.u) << std::endl;
+        }
+    }
+    return 0;
+}
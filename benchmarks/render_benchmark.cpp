@@ -0,0 +1,101 @@
+// Measures the frames per second of the software renderer of the headless video output
+// at 1080p and 4K: a smooth field with a disc of obstacles on a grid, upscaled to the frame,
+// and the tracers splatted over it.
+// Usage: render_benchmark [--grid 400x200] [--frames N] [--tracers N]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <array>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <random>
+
+#include "software_renderer.h"
+
+struct Resolution
+{
+    std::string name;
+    size_t width, height;
+};
+
+int main(int argc, char** argv)
+{
+    size_t grid_width = 400, grid_height = 200;
+    size_t frames = 100;
+    size_t num_tracers = 5000;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--grid" && i + 1 < argc)
+        {
+            const std::string grid = argv[++i];
+            const size_t x = grid.find('x');
+            grid_width = std::stoul(grid.substr(0, x));
+            grid_height = std::stoul(grid.substr(x + 1));
+        }
+        else if (arg == "--frames" && i + 1 < argc)
+            frames = std::stoul(argv[++i]);
+        else if (arg == "--tracers" && i + 1 < argc)
+            num_tracers = std::stoul(argv[++i]);
+        else
+        {
+            std::cerr << "Unsupported command line argument: " << arg << std::endl;
+            return -1;
+        }
+    }
+
+    const size_t total_size = grid_width * grid_height;
+    std::vector<float> field(total_size), mask(total_size, 0.0f);
+    for (size_t y = 0; y < grid_height; y++)
+    {
+        for (size_t x = 0; x < grid_width; x++)
+        {
+            const float fx = static_cast<float>(x) / grid_width, fy = static_cast<float>(y) / grid_height;
+            field[y * grid_width + x] = 0.5f + 0.5f * std::sin(12.0f * fx) * std::cos(7.0f * fy);
+            const float dx = fx - 0.25f, dy = fy - 0.5f;
+            if (dx * dx + dy * dy < 0.01f)
+                mask[y * grid_width + x] = 1.0f;
+        }
+    }
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> along_x(0.0f, grid_width), along_y(0.0f, grid_height);
+    std::vector<std::array<float, 2>> tracers(num_tracers);
+    for (auto& position : tracers)
+        position = {along_x(rng), along_y(rng)};
+
+    std::cout << "Software renderer (" << SoftwareRenderer::simd_isa() << "), "
+              << grid_width << "x" << grid_height << " grid, " << num_tracers << " tracers, "
+              << frames << " frames" << std::endl;
+
+    const std::vector<Resolution> resolutions = {{"1080p", 1920, 1080}, {"4K", 3840, 2160}};
+    for (const Resolution& resolution : resolutions)
+    {
+        SoftwareRenderer renderer(resolution.width, resolution.height, grid_width, grid_height, {false, false});
+        // One frame to warm up the caches and the thread pool of the parallel algorithms
+        renderer.render(field, mask);
+
+        using Clock = std::chrono::steady_clock;
+        double field_seconds = 0.0, tracer_seconds = 0.0;
+        for (size_t frame = 0; frame < frames; frame++)
+        {
+            const auto start = Clock::now();
+            renderer.render(field, mask);
+            const auto rendered = Clock::now();
+            renderer.render_tracers(tracers, {1.0f, 1.0f, 1.0f, 1.0f}, 3.0f);
+            const auto end = Clock::now();
+            field_seconds += std::chrono::duration<double>(rendered - start).count();
+            tracer_seconds += std::chrono::duration<double>(end - rendered).count();
+        }
+
+        const double megapixels = resolution.width * resolution.height * 1e-6;
+        std::cout << std::left << std::setw(6) << resolution.name << std::right << std::fixed << std::setprecision(1)
+                  << "  " << frames / (field_seconds + tracer_seconds) << " frames/s"
+                  << "  field " << field_seconds / frames * 1e3 << " ms"
+                  << " (" << megapixels * frames / field_seconds << " Mpixel/s)"
+                  << "  tracers " << tracer_seconds / frames * 1e3 << " ms" << std::endl;
+    }
+    return 0;
+}
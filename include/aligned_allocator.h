@@ -0,0 +1,72 @@
+#ifndef ALIGNED_ALLOCATOR_H
+#define ALIGNED_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A minimal allocator for std::vector with over-aligned storage
+// (cache-line alignment by default), suitable for aligned SIMD loads
+template <typename T, size_t ALIGNMENT = 64>
+struct AlignedAllocator
+{
+    using value_type = T;
+
+    template <typename U>
+    struct rebind { using other = AlignedAllocator<U, ALIGNMENT>; };
+
+    AlignedAllocator() noexcept = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, ALIGNMENT>&) noexcept {}
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(ALIGNMENT)));
+    }
+
+    void deallocate(T* ptr, size_t) noexcept
+    {
+        ::operator delete(ptr, std::align_val_t(ALIGNMENT));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, ALIGNMENT>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, ALIGNMENT>&) const noexcept { return false; }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// An allocator for std::vector that default-initializes the elements on resize(n):
+// the trivial ones are left untouched, so the pages of a large array get placed
+// on the NUMA node of the thread that first writes them, not of the one that allocates them
+template <typename T>
+struct DefaultInitAllocator : std::allocator<T>
+{
+    using std::allocator<T>::allocator;
+
+    template <typename U>
+    struct rebind { using other = DefaultInitAllocator<U>; };
+
+    template <typename U>
+    void construct(U* ptr) noexcept(std::is_nothrow_default_constructible_v<U>)
+    {
+        ::new (static_cast<void*>(ptr)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* ptr, Args&&... args)
+    {
+        ::new (static_cast<void*>(ptr)) U(std::forward<Args>(args)...);
+    }
+};
+
+// The per-cell arrays of the lattices, filled in parallel after the allocation
+template <typename T>
+using FieldVector = std::vector<T, DefaultInitAllocator<T>>;
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <vector>
+#include <array>
+#include <string>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "d2q9.h"
+#include "mapped_file.h"
+
+// How the populations of a checkpoint are stored: as D2Q9<double>, D2Q9<float>
+// or D2Q9<MixedPrecision> keep them
+enum class PopulationEncoding : uint8_t {F64, F32, F32_DEVIATIONS};
+
+template <typename Precision>
+constexpr PopulationEncoding population_encoding()
+{
+    if constexpr (D2Q9Precision<Precision>::STORES_DEVIATIONS)
+        return PopulationEncoding::F32_DEVIATIONS;
+    else if constexpr (std::is_same_v<typename D2Q9Precision<Precision>::Storage, float>)
+        return PopulationEncoding::F32;
+    else
+        return PopulationEncoding::F64;
+}
+
+// A prescribed inflow/outflow condition
+struct CheckpointBoundary
+{
+    uint64_t idx;
+    double rho;
+    std::array<double, 2> u;
+};
+
+// The full solver state between two steps: the lattice parameters, the cell types,
+// the prescribed boundary conditions, the populations with the macroscopic fields
+// they were computed with, and the tracers. Headless runs only have tracers with --output;
+// their checkpoints otherwise hold none, and a restart seeds the tracers afresh.
+struct Checkpoint
+{
+    uint64_t step = 0;
+    std::array<uint64_t, 2> dimensions = {0, 0};
+    std::array<bool, 2> is_periodic = {false, false};
+    double tau = 1.0;
+    PopulationEncoding encoding = PopulationEncoding::F64;
+    bool post_collision = false; // see D2Q9::stores_post_collision()
+
+    std::vector<uint8_t> cell_type;
+    std::vector<double> rho;
+    std::vector<std::array<double, 2>> u;
+    std::vector<CheckpointBoundary> boundaries;
+    AlignedVector<char> populations; // 9 per cell, in the natural layout
+    std::vector<std::array<float, 2>> tracers;
+    std::vector<float> tracer_ages; // in lattice steps, as Tracers::get_age()
+};
+
+// The checkpoint file, version 2 (version 1 had no tracer ages): this header, then the sections at the offsets it gives,
+// each aligned to 64 bytes, so that a mapped file can be used in place.
+// The numbers are in the byte order of the machine that wrote the file.
+struct CheckpointHeader
+{
+    enum Section {CELL_TYPES, DENSITY, VELOCITY, BOUNDARIES, POPULATIONS, TRACERS, TRACER_AGES, SECTIONS};
+    struct Extent
+    {
+        uint64_t offset;
+        uint64_t bytes;
+    };
+
+    static constexpr char MAGIC[8] = {'L', 'B', 'M', 'C', 'K', 'P', 'T', '\0'};
+    static constexpr uint32_t VERSION = 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint64_t width;
+    uint64_t height;
+    uint8_t periodic_x;
+    uint8_t periodic_y;
+    uint8_t encoding;
+    uint8_t post_collision;
+    uint32_t reserved;
+    double tau;
+    uint64_t step;
+    uint64_t boundary_count;
+    uint64_t tracer_count;
+    Extent sections[SECTIONS];
+};
+
+// Takes a snapshot of a lattice after step steps, reusing the buffers of the snapshot
+template <typename Precision>
+void capture_checkpoint(const D2Q9<Precision>& lbm, uint64_t step,
+                        const std::vector<std::array<float, 2>>& tracers, const std::vector<float>& tracer_ages,
+                        Checkpoint& snapshot);
+
+// Writes to a temporary file first and renames it, so that an interrupted write
+// leaves the previous checkpoint of the same name intact
+void write_checkpoint(const Checkpoint& checkpoint, const std::string& filename);
+
+// Writes the checkpoints on a background thread, so that the solver only stalls for the snapshot
+class CheckpointWriter
+{
+public:
+    CheckpointWriter();
+    // Finishes the pending write
+    ~CheckpointWriter();
+
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    // Waits for the previous write, then swaps the snapshot with the writer's buffers:
+    // the snapshot gets those of the previous checkpoint back, to be refilled
+    void submit(Checkpoint& snapshot, const std::string& filename);
+    // Waits for the pending write. The error of a failed write is rethrown here or by submit().
+    void wait();
+
+private:
+    void writer_loop();
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    Checkpoint m_pending;
+    std::string m_filename;
+    bool m_busy = false;
+    bool m_stop = false;
+    std::exception_ptr m_error;
+    std::thread m_thread;
+};
+
+// A checkpoint file, mapped and validated
+class CheckpointFile
+{
+public:
+    explicit CheckpointFile(const std::string& filename);
+
+    uint64_t step() const { return m_header.step; }
+
+    // The parameters and the initial conditions of a lattice to restore the checkpoint into.
+    // The execution parameters are left at their defaults.
+    LBM<2>::LBMParams lbm_params() const;
+    D2Q9InitialConditions initial_conditions() const;
+    std::vector<std::array<float, 2>> tracers() const;
+    std::vector<float> tracer_ages() const;
+
+    // Restores the populations and the macroscopic fields into a lattice built from the above.
+    // Populations stored in another precision are converted.
+    template <typename Precision>
+    void restore(D2Q9<Precision>& lbm) const;
+
+private:
+    MappedFile m_file;
+    CheckpointHeader m_header;
+
+    template <typename T>
+    const T* section(CheckpointHeader::Section section) const
+    {
+        return reinterpret_cast<const T*>(m_file.data() + m_header.sections[section].offset);
+    }
+};
+
+#endif
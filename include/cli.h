@@ -0,0 +1,98 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <optional>
+#include <string>
+#include <vector>
+#include <memory>
+#include "d2q9.h"
+#include "d2q9_setup.h"
+#include "checkpoint.h"
+#include "field_output.h"
+#include "frame_writer.h"
+
+// Command line arguments shared by the interactive and the solver-only executables
+struct Args
+{
+    std::optional<std::string> input_file;
+    std::optional<std::string> output_file; 
+    // The queue of the frames on their way to the --output file, and what to do when it is full
+    FrameWriterParams recording;
+    D2Q9Kernel kernel = D2Q9Kernel::FOUR_PASS;
+    D2Q9Tiling tiling;  // tiled kernel only
+    std::string precision = "double";
+    // Override the execution params of the input file
+    std::optional<size_t> threads;
+    std::optional<ThreadBinding> binding;
+    // The texel format of the rendered field in the window, how it is pooled down to the
+    // window, and whether the window computes the quantities on the GPU
+    std::optional<FieldTexture> field_texture;
+    std::optional<FieldPooling> field_pooling;
+    bool gpu_observables = false;
+    // Override the number of random tracers of the input file, and how the tracers move
+    std::optional<size_t> tracers;
+    std::optional<TracerIntegrator> tracer_integrator;
+    std::optional<float> tracer_time_step;
+    std::optional<size_t> tracer_substeps;
+    // The attribute to color the tracers by, and the value at the top of the colormap
+    std::optional<TracerColoring> tracer_coloring;
+    std::optional<float> tracer_coloring_range;
+    // Batch mode: split the grid into row slabs over this many ranks (fused kernel),
+    // threads of this process ("local") or the processes of an MPI job ("mpi")
+    size_t ranks = 1;
+    std::string transport = "local";
+
+    // Batch mode: step the solver without a window or a GL context
+    bool headless = false;
+    size_t steps = 1000;
+    size_t diagnostics_every = 0; // 0 == no diagnostics
+    size_t dump_every = 0;        // 0 == no field dumps
+    std::string dump_prefix = "fields";
+    // Checkpoints of the full solver state every checkpoint_every steps, as <prefix>_<step>.ckpt,
+    // and the checkpoint to resume from
+    size_t checkpoint_every = 0;  // 0 == no checkpoints
+    std::string checkpoint_prefix = "checkpoint";
+    std::optional<std::string> restart_file;
+    // A time series of the fields for post-processing, every fields.every steps
+    FieldOutputParams fields;
+
+    // Instrumentation: a min/mean/p99 summary of the timed sections at exit
+    // or every profile_every frames, and an optional Chrome trace file
+    bool profile = false;
+    size_t profile_every = 0;
+    std::optional<std::string> profile_trace;
+};
+
+// Everything needed to set up a simulation
+struct SimulationSetup
+{
+    LBM<2>::LBMParams lbm_params;
+    D2Q9InitialConditions initials;
+    // A mapped input file of version 2, which the initial conditions are used from in place
+    std::shared_ptr<const MappedFile> mapped_input;
+    D2Q9InitialView mapped_initials;
+    VisualizationParams visual_params;
+    std::vector<QuantityParams> quants_params;  
+    TracersParams tracers_params;
+    // The checkpoint to resume from, which the lattice params and the initial conditions come from
+    std::shared_ptr<const CheckpointFile> restart;
+
+    // What to build the lattice from
+    D2Q9InitialView initial_view() const { return mapped_input ? mapped_initials : D2Q9InitialView(initials); }
+};
+
+Args parse_args(int argc, char** argv);
+
+// Enables the profiler if any of the profiling options was given
+void setup_profiler(const Args& args);
+
+// Reports when the lattice runs another kernel than the one given in the arguments
+void report_kernel_fallback(const Args& args, D2Q9Kernel kernel);
+
+// Loads the input file given in the arguments, or falls back to a sample setup
+SimulationSetup load_setup(const Args& args);
+
+// The checkpoint file written after step steps
+std::string checkpoint_filename(const Args& args, size_t step);
+
+#endif
@@ -3,30 +3,139 @@
 
 #include <vector>
 #include <array>
-#include <map>
 #include <cmath>
 #include <algorithm>
+#include <type_traits>
+#include <cstdint>
 #include "lbm.h"
+#include "aligned_allocator.h"
 
-class D2Q9: public LBM<2>
+// The precision of a D2Q9 lattice: Scalar is the arithmetic and macroscopic variables type,
+// Storage is the type the populations are kept in. 
+template <typename Precision>
+struct D2Q9Precision
 {
-    public:
-        using CellState = std::array<double, 9>;
-        using VelocityVec = std::array<double, 2>;
+    using Scalar = Precision;
+    using Storage = Precision;
+    static constexpr bool STORES_DEVIATIONS = false;
+};
 
-        struct InitialConditions 
-        {
-            std::vector<CellType> cell_type;
-            std::vector<double> initial_rho;
-            std::vector<VelocityVec> initial_u;
-        };
+// Mixed precision: the populations are stored in single precision as the deviations
+// from the lattice weights (the rest equilibrium) and processed in double precision
+struct MixedPrecision {};
+
+template <>
+struct D2Q9Precision<MixedPrecision>
+{
+    using Scalar = double;
+    using Storage = float;
+    static constexpr bool STORES_DEVIATIONS = true;
+};
+
+// The update kernel: either the four separate phases of LBM::step(),
+// a single fused pull-stream/moments/collide sweep over the grid,
+// the four phases over a structure-of-arrays layout with SIMD collision and moments,
+// the four phases over the non-solid cells only, with indirect addressing,
+// the fused sweep streaming in place within a single population array (the AA pattern),
+// or the fused sweep over cache-sized tiles, optionally several steps per tile
+enum class D2Q9Kernel {FOUR_PASS, FUSED, SOA, SPARSE, IN_PLACE, TILED};
+
+// The tile geometry of D2Q9Kernel::TILED. With time_steps > 1, advance() runs
+// up to time_steps steps on a tile before moving on to the next one.
+struct D2Q9Tiling
+{
+    size_t width = 64;
+    size_t height = 32;
+    size_t time_steps = 1;
+};
+
+// The initial state is always given in double precision
+struct D2Q9InitialConditions 
+{
+    std::vector<CellType> cell_type;
+    std::vector<double> initial_rho;
+    std::vector<std::array<double, 2>> initial_u;
+    // If both directions are non-periodic, mark the corners of the grid solid. The sub-lattices
+    // of a decomposed grid turn it off and carry the corners of the whole grid instead.
+    bool solid_corners = true;
+};
+
+// What the lattice is built from: views of the initial conditions, either of a
+// D2Q9InitialConditions or of the sections of a mapped input file (see d2q9_setup.h)
+struct D2Q9InitialView
+{
+    size_t size = 0;
+    const CellType* cell_type = nullptr;
+    const double* initial_rho = nullptr;
+    const std::array<double, 2>* initial_u = nullptr;
+    bool solid_corners = true;
+
+    D2Q9InitialView() = default;
+    D2Q9InitialView(const D2Q9InitialConditions& initials);
+};
+
+template <typename Precision = double>
+class D2Q9: public LBM<2, typename D2Q9Precision<Precision>::Scalar>
+{
+    public:
+        using Scalar = typename D2Q9Precision<Precision>::Scalar;
+        using Storage = typename D2Q9Precision<Precision>::Storage;
+        using Base = LBM<2, Scalar>;
+        using LBMParams = typename Base::LBMParams;
+        using CellState = std::array<Scalar, 9>;
+        using StoredState = std::array<Storage, 9>;
+        using VelocityVec = std::array<Scalar, 2>;
+        using Kernel = D2Q9Kernel;
+        using InitialConditions = D2Q9InitialView;
     
         D2Q9(size_t width, size_t height, double tau);
         D2Q9(const LBMParams& lbm_params, 
-             const InitialConditions& initials);
+             const InitialConditions& initials,
+             Kernel kernel = Kernel::FOUR_PASS,
+             const D2Q9Tiling& tiling = {});
+
+        void step() override;
+        void advance(size_t steps) override;
+        void step_timed(typename Base::PhaseTimes& times) override;
+        // The kernel that runs: the fused one instead of the in-place one on a single row or column
+        Kernel get_kernel() const { return m_kernel; }
+        // The memory taken by the population arrays, in bytes
+        size_t get_population_bytes() const;
+
+        // The fused step in parts, for the sub-lattices of a decomposed grid (fused kernel only):
+        // sweep_rows() over disjoint row ranges, then end_sweep(). Rows left out are not updated.
+        void sweep_rows(size_t row_begin, size_t row_end);
+        void end_sweep();
+        // The 3 populations per cell of a row that stream out of it along dir_y (+1 or -1),
+        // copied to or from a buffer of 3 * width entries, for the halo exchange
+        void pack_row(size_t row, int dir_y, Storage* buffer) const;
+        void unpack_row(size_t row, int dir_y, const Storage* buffer);
+
+        // The full state between two steps, for checkpoints: the populations of every grid cell
+        // in the natural layout and the storage precision. With the fused, in-place and tiled kernels
+        // they are the post-collision states, with the others the streamed ones.
+        bool stores_post_collision() const;
+        void get_populations(StoredState* f) const;
+        // Restores the state of a lattice with the same cells. Streamed populations are relaxed
+        // on the way into a post-collision kernel; the reverse cannot be done and throws.
+        void set_state(const StoredState* f, bool post_collision,
+                       const double* rho, const std::array<double, 2>* u);
+
+        // The prescribed density and velocity of an inflow/outflow cell
+        struct BoundaryCondition
+        {
+            size_t idx;
+            Scalar rho;
+            VelocityVec u;
+        };
+        std::vector<BoundaryCondition> get_boundary_conditions() const;
+
+        // Conversions between the storage and the arithmetic precision
+        static CellState load_state(const StoredState& f_stored);
+        static StoredState store_state(const CellState& f);
         
-        const std::vector<double>& get_density() const override;
-        const std::vector<VelocityVec>& get_velocity() const override;
+        const FieldVector<Scalar>& get_density() const override;
+        const FieldVector<VelocityVec>& get_velocity() const override;
         const std::vector<float>& get_obstacle_mask() const { return m_obstacle_mask; }
         const std::vector<size_t>& get_fluid_cells() const { return m_fluid_cells; }
         const std::vector<size_t>& get_inflow_cells() const { return m_inflow_cells; }
@@ -42,7 +151,7 @@ class D2Q9: public LBM<2>
             return static_cast<size_t>(y * m_dimensions[0] + x); 
         }
 
-        static size_t coords_to_index(int x, int y, const LBM<2>::LBMParams& params) 
+        static size_t coords_to_index(int x, int y, const LBMParams& params) 
         { 
             x = params.is_periodic[0] ? (x + params.dimensions[0]) % params.dimensions[0] 
                                  : std::clamp(x, 0, static_cast<int>(params.dimensions[0]) - 1);
@@ -84,9 +193,68 @@ class D2Q9: public LBM<2>
         }
 
     private:
-        // D2Q9 cell states
-        std::vector<CellState> m_f;
-        std::vector<CellState> m_f_new;
+        using Base::m_tau;
+        using Base::m_inv_tau;
+        using Base::m_dimensions;
+        using Base::m_is_periodic;
+        using Base::m_total_size;
+        using Base::m_cell_type;
+        using Base::m_rho;
+        using Base::m_u;
+        using Base::m_pool;
+
+        static constexpr bool STORES_DEVIATIONS = D2Q9Precision<Precision>::STORES_DEVIATIONS;
+        // The SIMD kernels of the structure-of-arrays layout are double precision only
+        static constexpr bool SOA_SUPPORTED = std::is_same_v<Precision, double>;
+
+        Kernel m_kernel = Kernel::FOUR_PASS;
+
+        // D2Q9 cell states in the storage precision. 
+        // With the fused kernel, m_f holds the post-collision states of the fluid cells.
+        FieldVector<StoredState> m_f;
+        FieldVector<StoredState> m_f_new;
+
+        // The streaming geometry, built once at construction.
+        // Bulk cells (interior, no solid neighbors) pull along fixed linear offsets;
+        // the remaining non-solid cells pull through precomputed links.
+        struct BulkSpan 
+        {
+            size_t begin;
+            size_t end;
+        };
+        struct LinkedCell
+        {
+            size_t idx;
+            // Flat offsets of the source populations in m_f, with bounce-back resolved.
+            // Opposite directions share the weight, so stored deviations bounce back as they are.
+            std::array<size_t, 9> src;
+        };
+        std::array<ptrdiff_t, 9> m_stream_offsets;
+        std::vector<BulkSpan> m_bulk_spans;
+        std::vector<LinkedCell> m_linked_cells;
+
+        // The structure-of-arrays storage for Kernel::SOA (m_f, m_f_new and m_u are left empty):
+        // nine aligned population planes and the velocity component planes
+        std::array<AlignedVector<Storage>, 9> m_f_planes;
+        std::array<AlignedVector<Storage>, 9> m_f_planes_new;
+        AlignedVector<Scalar> m_ux, m_uy;
+        // 1.0 for the fluid cells, 0.0 otherwise, for branch-free masking in the SIMD kernels
+        AlignedVector<Scalar> m_fluid_mask;
+        // The (destination cell, direction) pairs whose source is a solid cell
+        std::vector<std::pair<size_t, size_t>> m_bounce_back_links;
+        std::vector<size_t> m_rows;
+        std::vector<size_t> m_blocks;
+        // get_velocity() packs the velocity planes on demand
+        mutable FieldVector<VelocityVec> m_u_packed;
+        mutable bool m_u_packed_stale = true;
+
+        // The compact storage for Kernel::SPARSE: m_f and m_f_new hold the non-solid cells only,
+        // the fluid cells first and then the inflow/outflow cells, each group in grid order
+        std::vector<size_t> m_sparse_cells; // the grid index of each compact cell
+        size_t m_sparse_fluid_count = 0;
+        // Flat offsets of the source populations in the compact m_f, with bounce-back resolved
+        std::vector<std::array<uint32_t, 9>> m_sparse_links;
+        std::vector<size_t> m_sparse_blocks;
 
         // Lists of special cells for boundary conditions
         std::vector<size_t> m_fluid_cells;
@@ -94,41 +262,189 @@ class D2Q9: public LBM<2>
         std::vector<size_t> m_inflow_cells;
         std::vector<size_t> m_outflow_cells;
         
-        // The velocity and density for the inflow cells
-        std::map<size_t, std::pair<VelocityVec, double>> m_inflow_conditions;   
+        // The inflow/outflow cells, classified once at construction.
+        // Each side of the domain gets a contiguous batch of cells sharing the Zou-He variant;
+        // INTERIOR holds the inner (or periodic) cells that are renewed to the equilibrium.
+        // The outflow cells prescribe the density with a zero velocity.
+        enum BoundarySide {WEST, EAST, SOUTH, NORTH, INTERIOR, BOUNDARY_SIDES};
+        struct BoundaryCell
+        {
+            size_t idx; // the storage index: the grid index, or the compact one with Kernel::SPARSE
+            Scalar rho;
+            VelocityVec u;
+        };
+        std::array<std::vector<BoundaryCell>, BOUNDARY_SIDES> m_boundary_batches;
 
-        // The density for the outflow cells
-        std::map<size_t, double> m_outflow_conditions;
+        // The single population array of Kernel::IN_PLACE (m_f_new is left empty).
+        // The steps alternate between two layouts of the post-collision states:
+        // natural, with F_i(x) in slot i of cell x, and swapped, with F_i(x) in slot opp(i)
+        // of the cell x + e_i, where its next destination pulls it from its own cell.
+        // The neighbor step reads and writes the same slots of the neighbor cells,
+        // and the local step reads and writes the cell's own slots, so no two cells touch
+        // the same slot within a step. With bounce-back the slot is the opposite one of the cell.
+        struct InPlaceCell
+        {
+            size_t idx;
+            std::array<size_t, 9> neighbor_addr; // flat offsets in m_f for the neighbor step
+            std::array<size_t, 9> local_addr;    // flat offsets in m_f to read in the local step
+        };
+        // A population streaming in across a non-periodic edge, which the pull scheme takes
+        // from the clamped source cell. The slot is shared with another cell's stream, so it is
+        // copied to a ghost slot past the grid cells of m_f before each step.
+        struct GhostLink
+        {
+            size_t ghost;
+            size_t natural_src;
+            size_t swapped_src;
+        };
+        std::vector<InPlaceCell> m_in_place_cells; // the fluid cells not in m_bulk_spans
+        std::array<std::vector<InPlaceCell>, BOUNDARY_SIDES> m_in_place_boundary; // aligned with m_boundary_batches
+        std::vector<GhostLink> m_ghost_links;
+        bool m_in_place_swapped = false;
+
+        // The tiles of Kernel::TILED, in row-major order. A single step runs the fused sweep
+        // tile by tile over the global arrays. A temporal block copies each tile with a halo
+        // of m_tiling.time_steps cells to a scratch grid, advances it there over a region shrinking
+        // by a cell per step and copies the tile back, so that the tiles stay independent.
+        // Scratch coordinates are not wrapped: a periodic seam inside a halo holds copies.
+        struct ScratchRun
+        {
+            uint32_t local;
+            size_t idx;
+            uint32_t length;
+        };
+        struct ScratchSpan
+        {
+            uint32_t row;
+            uint32_t begin;
+            uint32_t end;
+            size_t idx; // the grid index of the first cell
+        };
+        struct ScratchCell
+        {
+            uint32_t local;
+            size_t idx;
+            bool fluid;
+            // Flat offsets of the source populations in the scratch grid, 
+            // with bounce-back and the clamping at non-periodic edges resolved
+            std::array<uint32_t, 9> src;
+        };
+        struct ScratchBoundary
+        {
+            uint32_t local;
+            BoundarySide side;
+            BoundaryCell cell;
+        };
+        struct Tile
+        {
+            size_t x0, y0, width, height;
+            // Single steps over the global arrays
+            std::vector<BulkSpan> bulk_spans;
+            std::vector<LinkedCell> linked_cells;
+            // Temporal blocks over the scratch grid
+            std::vector<ScratchRun> scratch_runs; // the in-domain cells, for the copy-in
+            std::vector<ScratchSpan> scratch_spans;
+            std::vector<ScratchCell> scratch_cells;
+            std::vector<ScratchBoundary> scratch_boundary;
+        };
+        D2Q9Tiling m_tiling;
+        std::vector<Tile> m_tiles;
         
         // The obstacle bitmask for rendering
         std::vector<float> m_obstacle_mask;
 
-        // The (x,y)-coordinates are to be flattened to indices
-        std::vector<size_t> m_indices;
-
         void collide() override;
         void stream() override;
         void compute_macroscopic() override;
         void apply_cell_conditions() override;
-        
+
+        // Collision, streaming, boundary conditions and macroscopic variables in one sweep
+        void fused_step();
+
+        // The same sweep, streaming in place
+        void init_in_place();
+        void in_place_step();
+
+        // The same sweep, tile by tile
+        void init_tiled();
+        void init_scratch(Tile& tile);
+        void tiled_step();
+        void tiled_block(size_t steps);
+        void advance_tile(const Tile& tile, size_t steps, std::vector<StoredState>& scratch, std::vector<StoredState>& scratch_new);
+
+        // The phases over the structure-of-arrays layout
+        void init_soa();
+        void collide_soa();
+        void stream_soa();
+        void apply_cell_conditions_soa();
+        void compute_macroscopic_soa();
+
+        // The phases over the compact storage of the non-solid cells
+        void init_sparse();
+        void collide_sparse();
+        void stream_sparse();
+        void compute_macroscopic_sparse();
+
+        void init_streaming();
+        void init_boundaries();
+
+        // Per-cell building blocks shared by the four-pass and the fused kernels
+        void pull_bulk_cell(size_t dest_idx, StoredState& f_out) const;
+        void pull_linked_cell(const LinkedCell& cell, const Storage* f_flat, StoredState& f_out) const;
+        void finish_fused_cell(size_t idx, const StoredState& f_stored);
+        void update_fluid_cell(size_t idx, StoredState& f_stored);
+        void update_fluid_state(StoredState& f_stored, Scalar& rho, VelocityVec& u) const;
+        void relax_cell(CellState& f, Scalar rho, const VelocityVec& u) const;
+        void compute_moments(const CellState& f, Scalar& rho, VelocityVec& u) const;
+        void apply_boundary(const BoundaryCell& cell, BoundarySide side, CellState& f) const;
+        // Calls func(cell, side) for every boundary cell, one parallel batch per side
+        template <typename Func>
+        void for_each_boundary_cell(Func func) const;
+
+        // The parallel loops. On the thread pool, a worker takes the items of its band of
+        // grid rows (items sorted by the grid cell returned by cell_of) or, without cell_of,
+        // its share of the items; otherwise the items go to the parallel algorithms.
+        template <typename Items, typename Func, typename CellOf>
+        void parallel_for_each(Items& items, Func func, CellOf cell_of) const;
+        template <typename Items, typename Func>
+        void parallel_for_each(Items& items, Func func) const;
+        // The items of a sorted list whose cells lie in the rows [row_begin, row_end)
+        template <typename It>
+        struct ItemRange
+        {
+            It first, last;
+            It begin() const { return first; }
+            It end() const { return last; }
+            size_t size() const { return last - first; }
+        };
+        template <typename Items, typename CellOf>
+        auto rows_of(Items& items, size_t row_begin, size_t row_end, CellOf cell_of) const
+            -> ItemRange<decltype(items.begin())>;
+        // func(begin, end) on the grid cells of every row band, on the workers that own them;
+        // on the whole grid at once without a pool
+        template <typename Func>
+        void for_each_row_band(Func func) const;
+
         // The equilibrium state for a single cell given macroscopic variables
-        CellState compute_equilibrium(double rho, const VelocityVec& u);
+        CellState compute_equilibrium(Scalar rho, const VelocityVec& u) const;
 
         // Constant parameters for D2Q9
         // The order: the center, 4 cardinals, 4 diagonals 
         static constexpr std::array<std::array<int, 2>, 9> m_directions 
             = {{{0, 0}, {1, 0}, {0, 1}, {-1, 0}, {0, -1}, {1, 1}, {-1, 1}, {-1, -1}, {1, -1}}};    
-        static constexpr CellState m_weights 
+        static constexpr std::array<double, 9> m_weights 
             = {4.0/9.0, 1.0/9.0, 1.0/9.0, 1.0/9.0, 1.0/9.0, 1.0/36.0, 1.0/36.0, 1.0/36.0, 1.0/36.0};
         static constexpr std::array<size_t, 9> m_bounce_back_indices 
             = {0, 3, 4, 1, 2, 7, 8, 5, 6}; 
-        static constexpr double m_csq = 1.0 / 3.0;
-        static constexpr double m_inv_csq = 3.0; // The inverse of the speed of sound squared
+        static constexpr Scalar m_csq = static_cast<Scalar>(1.0 / 3.0);
+        static constexpr Scalar m_inv_csq = 3.0; // The inverse of the speed of sound squared
 
         static constexpr double MIN_DENSITY_THRESHOLD = 1e-7;
+        static constexpr size_t SOA_BLOCK_SIZE = 4096;
+        static constexpr size_t SPARSE_BLOCK_SIZE = 1024;
 };
 
-D2Q9::InitialConditions sample_d2q9(const LBM<2>::LBMParams& params);
+D2Q9InitialConditions sample_d2q9(const LBM<2>::LBMParams& params);
 
 #endif
 
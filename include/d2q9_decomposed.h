@@ -0,0 +1,64 @@
+#ifndef D2Q9_DECOMPOSED_H
+#define D2Q9_DECOMPOSED_H
+
+#include <vector>
+#include <array>
+#include <memory>
+#include "d2q9.h"
+#include "halo_transport.h"
+
+// A D2Q9 grid split into slabs of rows, one per rank of the transport.
+// Each rank keeps its rows in a fused sub-lattice with a ghost row next to every neighbouring slab.
+// A step sends the populations that stream out of the border rows to the neighbours,
+// updates the interior rows while they are in flight, and the border rows once they have arrived.
+// The states are those of the whole grid stepped by the fused kernel.
+template <typename Precision = double>
+class D2Q9Decomposed
+{
+    public:
+        using Lattice = D2Q9<Precision>;
+        using Scalar = typename Lattice::Scalar;
+        using Storage = typename Lattice::Storage;
+        using VelocityVec = typename Lattice::VelocityVec;
+        using LBMParams = typename Lattice::LBMParams;
+
+        // All the ranks pass the parameters and the initial conditions of the whole grid
+        D2Q9Decomposed(const LBMParams& lbm_params,
+                       const D2Q9InitialView& initials,
+                       HaloTransport& transport);
+
+        void step();
+        void advance(size_t steps);
+
+        // The total mass and the maximum speed over the non-solid cells of the whole grid, on all ranks
+        void reduce_diagnostics(double& mass, double& max_speed);
+        // The density and the velocity of the whole grid, on rank 0; the other ranks get empty vectors
+        void gather_fields(std::vector<Scalar>& rho, std::vector<VelocityVec>& u);
+
+        const std::vector<size_t>& get_dimensions() const { return m_dimensions; }
+        size_t get_total_size() const { return m_dimensions[0] * m_dimensions[1]; }
+        // The rows [row_begin, row_end) of the whole grid owned by this rank
+        size_t get_row_begin() const { return m_row_begin; }
+        size_t get_row_end() const { return m_row_end; }
+        const Lattice& get_lattice() const { return *m_lattice; }
+
+    private:
+        enum Tag {TAG_UP, TAG_DOWN, TAG_DIAGNOSTICS, TAG_FIELDS};
+
+        HaloTransport& m_transport;
+        std::vector<size_t> m_dimensions;
+        size_t m_row_begin, m_row_end;
+        // The neighbouring ranks, if any
+        bool m_has_below = false, m_has_above = false;
+        size_t m_below = 0, m_above = 0;
+        // The first owned row of the sub-lattice, after the bottom ghost row if there is one
+        size_t m_first_row = 0;
+
+        std::unique_ptr<Lattice> m_lattice;
+
+        // The halo messages, 3 populations per cell of a row
+        std::vector<Storage> m_send_up, m_send_down;
+        std::vector<Storage> m_recv_below, m_recv_above;
+};
+
+#endif
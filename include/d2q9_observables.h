@@ -2,6 +2,7 @@
 #define D2Q9_OBSERVABLE_H  
 
 #include "d2q9.h"
+#include <array>
 #include <vector>
 #include <cmath>
 #include <map>
@@ -15,30 +16,60 @@
 // For normalization, zero_ref == where the zero value of f gets mapped to in [0,1]
 // amplitude == the expected amplitude of |f|
 
-void D2Q9_compute_speed(const D2Q9& lbm, 
+template <typename Precision>
+void D2Q9_compute_speed(const D2Q9<Precision>& lbm, 
                         std::vector<float>& out_field,
                         const float zero_ref,
                         const float amplitude);
 
-void D2Q9_compute_density(const D2Q9& lbm, 
+template <typename Precision>
+void D2Q9_compute_density(const D2Q9<Precision>& lbm, 
                           std::vector<float>& out_field,
                           const float zero_ref,
                           const float amplitude);
 
-void D2Q9_compute_vorticity(const D2Q9& lbm, 
+template <typename Precision>
+void D2Q9_compute_vorticity(const D2Q9<Precision>& lbm, 
                             std::vector<float>& out_field,
                             const float zero_ref,
                             const float amplitude);
 
-void D2Q9_compute_zero(const D2Q9& lbm, 
+template <typename Precision>
+void D2Q9_compute_divergence(const D2Q9<Precision>& lbm, 
+                             std::vector<float>& out_field,
+                             const float zero_ref,
+                             const float amplitude);
+
+template <typename Precision>
+void D2Q9_compute_q_criterion(const D2Q9<Precision>& lbm, 
+                              std::vector<float>& out_field,
+                              const float zero_ref,
+                              const float amplitude);
+
+template <typename Precision>
+void D2Q9_compute_strain_rate(const D2Q9<Precision>& lbm, 
+                              std::vector<float>& out_field,
+                              const float zero_ref,
+                              const float amplitude);
+
+template <typename Precision>
+void D2Q9_compute_zero(const D2Q9<Precision>& lbm, 
                             std::vector<float>& out_field,
                             const float zero_ref,
                             const float amplitude);
 
 
-using ComputeFunc = std::function<void(const D2Q9&, std::vector<float>&, const float, const float)>;
+// The raw moments for the renderer to compute the observables from, per cell: rho - 1,
+// which keeps its precision in half floats, and the velocity
+template <typename Precision>
+void D2Q9_pack_moments(const D2Q9<Precision>& lbm, 
+                       std::vector<std::array<float, 3>>& out_moments);
+
+
+template <typename Precision>
+using ComputeFunc = std::function<void(const D2Q9<Precision>&, std::vector<float>&, const float, const float)>;
 
-extern const std::map<std::string, ComputeFunc> compute_functions;
-const std::map<std::string, ComputeFunc>& get_compute_functions();
+template <typename Precision>
+const std::map<std::string, ComputeFunc<Precision>>& get_compute_functions();
 
 #endif
\ No newline at end of file
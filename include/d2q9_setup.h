@@ -1,15 +1,39 @@
 #ifndef D2Q9_SETUP_H
 #define D2Q9_SETUP_H
 
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
 #include "d2q9.h"       
 #include "lbm.h"       
-#include "tracers_collection.h" 
+#include "mapped_file.h"
+
+// The texel format the window uploads the rendered field in: 4, 2 or 1 bytes per cell.
+// The field is in [0, 1] once offset and scaled, so 8 bits lose little but the gradations.
+enum class FieldTexture {FLOAT32, FLOAT16, UNORM8};
+
+// Throws for an unknown name: float32, float16, unorm8
+FieldTexture parse_field_texture(const std::string& name);
+
+// How the window reduces a grid larger than itself: the mean, the minimum or the maximum
+// of the blocks of cells behind every texel, or not at all, leaving it to the GPU
+enum class FieldPooling {NONE, MEAN, MIN, MAX};
+
+// Throws for an unknown name: none, mean, min, max
+FieldPooling parse_field_pooling(const std::string& name);
 
 struct VisualizationParams
 {
     size_t width;
     size_t height;
     size_t steps_per_frame;
+    // Not in the input file: the format of the field texture, how a large grid is reduced
+    // to it, and whether the window computes the quantities on the GPU from the raw moments
+    FieldTexture field_texture = FieldTexture::FLOAT32;
+    FieldPooling field_pooling = FieldPooling::MEAN;
+    bool gpu_observables = false;
 };
 
 struct QuantityParams
@@ -19,17 +43,94 @@ struct QuantityParams
     float amplitude;
 };
 
+// How the tracers are moved through the interpolated velocity field
+enum class TracerIntegrator {EULER, RK2, RK4};
+// What the color of a tracer shows: nothing (the color of the input file), the time since
+// it was seeded, or the flow speed where it is
+enum class TracerColoring {NONE, AGE, SPEED};
+
+struct TracersParams
+{
+    std::array<float, 4> color;
+    float size;
+    float emission_rate;
+    size_t random_initial;
+    std::vector<size_t> initial_tracers;
+    // Not in the input file: every update advances the tracers by time_step lattice
+    // steps, in substeps of the integrator
+    TracerIntegrator integrator = TracerIntegrator::RK2;
+    float time_step = 5.0f;
+    size_t substeps = 1;
+    // Not in the input file either: the attribute the tracers are colored by, through the
+    // jet colormap from 0 to coloring_range (0 for the default range of the attribute)
+    TracerColoring coloring = TracerColoring::NONE;
+    float coloring_range = 0.0f;
+};
+
+// The input file, version 2: this header, then the sections at the offsets it gives,
+// each aligned to 64 bytes, so that the initial conditions can be used in place from
+// the mapped file. Little-endian, as written by scripts/prepare_simulation.py.
+// Version 1 files have no header and are read field by field by load_from_binary().
+struct InputFileHeader
+{
+    // QUANTITIES holds a record per quantity: u8 name length, the name, f32 offset, f32 amplitude.
+    // CELL_TYPES is a byte per cell, DENSITY a double per cell, VELOCITY two interleaved doubles
+    // per cell and TRACERS the u64 indices of the cells with an initial tracer.
+    enum Section {QUANTITIES, CELL_TYPES, DENSITY, VELOCITY, TRACERS, SECTIONS};
+    struct Extent
+    {
+        uint64_t offset;
+        uint64_t bytes;
+    };
+
+    static constexpr char MAGIC[8] = {'L', 'B', 'M', 'I', 'N', 'P', 'U', 'T'};
+    static constexpr uint32_t VERSION = 2;
 
-// Loads simulation data from a binary file and populates existing structs
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint64_t width;
+    uint64_t height;
+    uint8_t periodic_x;
+    uint8_t periodic_y;
+    uint8_t binding;
+    uint8_t reserved;
+    uint32_t quantity_count;
+    double tau;
+    uint64_t threads;
+    uint64_t window_width;
+    uint64_t window_height;
+    uint64_t steps_per_frame;
+    float tracers_color[4];
+    float tracers_size;
+    float tracers_emission_rate;
+    uint64_t tracers_random_initial;
+    uint64_t tracer_count;
+    Extent sections[SECTIONS];
+};
+
+// The version of the input file format: 2 for the files starting with InputFileHeader::MAGIC, 1 otherwise
+uint32_t input_file_version(const std::string& filename);
+
+// Loads simulation data from a binary file of version 1 and populates existing structs
 void load_from_binary(const std::string& filename, 
                       LBM<2>::LBMParams& lbm_params, 
-                      D2Q9::InitialConditions& initials, 
+                      D2Q9InitialConditions& initials, 
                       VisualizationParams& visual_params,
                       std::vector<QuantityParams>& render_quant_params,
                       TracersParams& tracers_params);
 
+// Maps an input file of version 2, validates it and populates existing structs. The initial
+// conditions are views into the returned file, which has to outlive them.
+std::shared_ptr<const MappedFile> map_from_binary(const std::string& filename,
+                                                  LBM<2>::LBMParams& lbm_params,
+                                                  D2Q9InitialView& initials,
+                                                  VisualizationParams& visual_params,
+                                                  std::vector<QuantityParams>& render_quant_params,
+                                                  TracersParams& tracers_params);
+
 void sample_d2q9(LBM<2>::LBMParams& lbm_params, 
-                 D2Q9::InitialConditions& initials, 
+                 D2Q9InitialConditions& initials, 
                  VisualizationParams& visual_params,
                  std::vector<QuantityParams>& quant_params,
                  TracersParams& tracers_params);
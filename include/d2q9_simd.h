@@ -0,0 +1,32 @@
+#ifndef D2Q9_SIMD_H
+#define D2Q9_SIMD_H
+
+#include <cstddef>
+
+// Structure-of-arrays D2Q9 kernels over the cell range [begin, end).
+// f points to the nine population planes (the D2Q9 direction order).
+// Only the cells with a non-zero fluid_mask value are updated.
+// The instruction set (AVX-512, AVX2 or scalar) is chosen at compile time.
+
+// BGK relaxation towards the equilibrium given by rho, ux, uy
+void D2Q9_soa_collide(double* const* f,
+                      const double* rho,
+                      const double* ux,
+                      const double* uy,
+                      const double* fluid_mask,
+                      const double inv_tau,
+                      size_t begin, size_t end);
+
+// Density and velocity moments of the populations
+void D2Q9_soa_moments(const double* const* f,
+                      double* rho,
+                      double* ux,
+                      double* uy,
+                      const double* fluid_mask,
+                      const double min_density,
+                      size_t begin, size_t end);
+
+// The name of the instruction set the kernels were compiled for
+const char* D2Q9_simd_isa();
+
+#endif
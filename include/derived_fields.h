@@ -0,0 +1,28 @@
+#ifndef DERIVED_FIELDS_H
+#define DERIVED_FIELDS_H
+
+#include <array>
+#include <string>
+#include "lbm.h"
+
+// Scalar fields of the velocity gradient, with du_i/dx_j taken by central differences
+// over the neighbors as the lattice sees them: across the periodic edges, and the edge
+// cell itself across the other edges.
+//  VORTICITY    du_x/dy - du_y/dx, as the window has always shown it (positive clockwise)
+//  DIVERGENCE   du_x/dx + du_y/dy
+//  Q_CRITERION  (|Omega|^2 - |S|^2) / 2, positive where rotation dominates strain
+//  STRAIN_RATE  sqrt(2 S:S), the magnitude of the strain rate tensor S
+enum class DerivedField {VORTICITY, DIVERGENCE, Q_CRITERION, STRAIN_RATE};
+
+// Throws for an unknown name: vorticity, divergence, q_criterion, strain_rate
+DerivedField parse_derived_field(const std::string& name);
+
+// Writes scale * f + offset for every cell of the grid of params to out, from the cell
+// velocities u. Bands of rows run in parallel; the rows and columns away from the edges
+// take their neighbors at fixed offsets, without wrapping or clamping.
+template <typename Scalar, typename Out>
+void compute_derived_field(DerivedField field, const LBM<2>::LBMParams& params,
+                           const std::array<Scalar, 2>* u, Out* out,
+                           Out scale = 1, Out offset = 0);
+
+#endif
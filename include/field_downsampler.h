@@ -0,0 +1,28 @@
+#ifndef FIELD_DOWNSAMPLER_H
+#define FIELD_DOWNSAMPLER_H
+
+#include <cstddef>
+#include <vector>
+#include "d2q9_setup.h"
+
+// A rectangle of cells of the grid
+struct GridRect
+{
+    size_t x = 0;
+    size_t y = 0;
+    size_t width = 0;
+    size_t height = 0;
+};
+
+// The smallest factor the rect has to be pooled by to fit in max_width x max_height: 1 if it fits
+size_t pooling_factor(const GridRect& rect, size_t max_width, size_t max_height);
+
+// Writes the rect of a field of grid_width cells per row to out, every value pooled over a
+// block of factor x factor cells: (rect.width + factor - 1) / factor values per row, in the
+// order of the field. The blocks of the last column and row may be partial; the pooling
+// is ignored for a factor of 1, and NONE pools as MEAN. Bands of rows run in parallel, and every task reads its rows
+// of the field once, in order.
+void downsample_field(const float* field, size_t grid_width, const GridRect& rect, size_t factor,
+                      FieldPooling pooling, std::vector<float>& out);
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef FIELD_OUTPUT_H
+#define FIELD_OUTPUT_H
+
+#include <vector>
+#include <array>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "lbm.h"
+#include "derived_fields.h"
+
+// The number type the fields are written as
+enum class FieldType : uint8_t {FLOAT64, FLOAT32, FLOAT16};
+
+FieldType parse_field_type(const std::string& name);
+
+// A rectangle of the grid, in cells. A zero width or height stands for the whole grid.
+struct FieldRegion
+{
+    size_t x = 0;
+    size_t y = 0;
+    size_t width = 0;
+    size_t height = 0;
+};
+
+// Which fields to write every `every` steps, and how
+struct FieldOutputParams
+{
+    size_t every = 0;  // 0 == no field output
+    std::string prefix = "series";
+    // density, velocity (2 components), speed, vorticity
+    std::vector<std::string> quantities = {"density", "velocity"};
+    FieldType type = FieldType::FLOAT32;
+    FieldRegion region;
+};
+
+// The fields of a step, cropped and converted to the output type: a buffer per quantity
+struct FieldFrame
+{
+    uint64_t step = 0;
+    std::vector<std::vector<char>> quantities;
+};
+
+// A time series of fields: every quantity is appended frame by frame to a raw file,
+// <prefix>_<quantity>.raw, of (height, width[, components]) frames in C order, the bottom
+// row first. The <prefix>.json index and, unless the fields are written as float16, a
+// <prefix>.xmf XDMF description for ParaView list the frames once they are in the files:
+// both end with a fixed tail, which every frame overwrites with its own entry and the tail,
+// so the cost of a frame does not grow with the series. The files are written on a background thread.
+class FieldSeries
+{
+public:
+    // With first_step > 0, a restart: the frames of an existing series with the same settings
+    // up to first_step are kept and the new ones appended after them
+    FieldSeries(const FieldOutputParams& params, const LBM<2>::LBMParams& lbm_params, uint64_t first_step = 0);
+    // Throws what the constructor would for these params, without opening any file
+    static void validate(const FieldOutputParams& params, const LBM<2>::LBMParams& lbm_params);
+    // Finishes the pending write
+    ~FieldSeries();
+
+    FieldSeries(const FieldSeries&) = delete;
+    FieldSeries& operator=(const FieldSeries&) = delete;
+
+    // Fills in a frame from the density and the velocity of the whole grid, reusing its buffers
+    template <typename Scalar>
+    void capture(uint64_t step, const Scalar* rho, const std::array<Scalar, 2>* u, FieldFrame& frame) const;
+
+    // Waits for the previous write, then swaps the frame with the writer's buffers:
+    // the frame gets those of the previous one back, to be refilled
+    void submit(FieldFrame& frame);
+    // Waits for the pending write. The error of a failed write is rethrown here or by submit().
+    void wait();
+
+private:
+    enum class Quantity {DENSITY, VELOCITY, SPEED, VORTICITY, DIVERGENCE, Q_CRITERION, STRAIN_RATE};
+    static Quantity parse_quantity(const std::string& name);
+    static FieldRegion clip_region(const FieldRegion& region, const LBM<2>::LBMParams& lbm_params);
+
+    struct Output
+    {
+        std::string name;
+        Quantity quantity;
+        DerivedField derived; // for the fields of the velocity gradient
+        size_t components;
+        std::string filename;
+        std::ofstream file;
+    };
+
+    void writer_loop();
+    void write_frame();
+    // The frames of the existing series up to first_step, to m_steps; false if there is none
+    bool resume(uint64_t first_step);
+    // The index up to its list of steps, and the entry of a frame in the XDMF collection
+    std::string index_head() const;
+    std::string xdmf_head() const;
+    std::string xdmf_frame(size_t frame) const;
+    // Replaces the index and the XDMF description with ones listing m_steps
+    void write_metadata();
+    // Lists the last frame of m_steps in place of the tail of the files
+    void append_metadata();
+    size_t frame_bytes(const Output& output) const;
+
+    LBM<2>::LBMParams m_lbm_params;
+    FieldType m_type;
+    FieldRegion m_region;
+    std::string m_prefix;
+    std::vector<Output> m_outputs;
+    mutable std::vector<double> m_derived; // the derived field being captured, over the whole grid
+    std::vector<uint64_t> m_steps; // of the frames written
+    std::fstream m_index, m_xdmf;
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    FieldFrame m_pending;
+    bool m_busy = false;
+    bool m_stop = false;
+    std::exception_ptr m_error;
+    std::thread m_thread;
+};
+
+#endif
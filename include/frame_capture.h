@@ -0,0 +1,41 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <array>
+#include <GL/glew.h>
+#include "frame_writer.h"
+
+// Reads the rendered frames back as RGB pixels through a ring of pixel-buffer objects:
+// the readback of a frame runs asynchronously and the frame is only mapped RING_SIZE
+// captures later, when the next capture needs its buffer, and handed to the writer. flush()
+// maps the frames still in flight. Needs the GL context
+// of the frames to be current and to outlive it.
+class FrameCapture
+{
+public:
+    static constexpr size_t RING_SIZE = 3;
+
+    FrameCapture(size_t width, size_t height, FrameWriter& writer);
+    ~FrameCapture();
+
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+
+    // Starts the readback of the frame in the back buffer; call before swapping the buffers.
+    // Hands the oldest frame of a full ring to the writer first.
+    void capture();
+    // Hands the frames still in the ring to the writer, oldest first
+    void flush();
+
+private:
+    void retrieve(size_t slot);
+
+    size_t m_width, m_height;
+    FrameWriter& m_writer;
+    std::array<GLuint, RING_SIZE> m_buffers;
+    std::array<GLsync, RING_SIZE> m_fences;
+    size_t m_next = 0;      // the slot of the next readback
+    size_t m_in_flight = 0; // readbacks not handed to the writer yet
+};
+
+#endif
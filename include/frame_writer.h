@@ -0,0 +1,80 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <cstdio>
+#include <deque>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+// What to do with a frame when the queue is full: wait for the writer, or drop the frame
+enum class FramePolicy {BLOCK, DROP};
+
+FramePolicy parse_frame_policy(const std::string& name);
+
+// Starts ffmpeg encoding the width x height RGB frames written to the returned pipe, bottom row
+// first, into filename. Returns nullptr if the pipe cannot be opened; close it with pclose().
+FILE* open_video_pipe(const std::string& filename, size_t width, size_t height);
+
+struct FrameWriterParams
+{
+    size_t queue_frames = 8;
+    FramePolicy policy = FramePolicy::BLOCK;
+};
+
+struct FrameWriterStats
+{
+    size_t queued = 0;
+    size_t written = 0;
+    size_t dropped = 0;
+    size_t max_queue_depth = 0;
+    double mean_queue_depth = 0.0; // as seen by the queued frames
+};
+
+// Writes fixed-size frames to a stream (the ffmpeg pipe) on a dedicated thread, through a
+// bounded queue, so that the frame loop does not stall on the stream unless the policy says so
+class FrameWriter
+{
+public:
+    FrameWriter(FILE* sink, size_t frame_bytes, const FrameWriterParams& params);
+    // Writes out the queued frames
+    ~FrameWriter();
+
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    size_t frame_bytes() const { return m_frame_bytes; }
+
+    // Queues a copy of a frame, unless the queue is full and the policy is to drop it.
+    // Returns whether the frame was queued. A failed write is rethrown here or by drain().
+    bool push(const unsigned char* frame);
+    // Waits until the queued frames are written
+    void drain();
+
+    FrameWriterStats get_stats() const;
+    void print_stats(std::ostream& out) const;
+
+private:
+    void writer_loop();
+
+    FILE* m_sink;
+    size_t m_frame_bytes;
+    FrameWriterParams m_params;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::deque<std::vector<unsigned char>> m_queue;
+    std::vector<std::vector<unsigned char>> m_free; // written frames, to be reused
+    bool m_writing = false;
+    bool m_stop = false;
+    std::exception_ptr m_error;
+    FrameWriterStats m_stats;
+    double m_queue_depth_sum = 0.0;
+    std::thread m_thread;
+};
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef HALF_FLOAT_H
+#define HALF_FLOAT_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// IEEE half precision, rounded to the nearest even
+inline uint16_t to_half(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(float));
+    const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    const uint32_t magnitude = bits & 0x7fffffff;
+
+    // Infinity and NaN
+    if (magnitude >= 0x7f800000)
+        return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+    // Rounds past the largest half, 65504
+    if (magnitude >= 0x477ff000)
+        return sign | 0x7c00;
+    // Below the smallest normal half, 2^-14: a multiple of 2^-24
+    if (magnitude < 0x38800000)
+        return sign | static_cast<uint16_t>(std::nearbyint(std::fabs(value) * 16777216.0f));
+
+    // Rebias the exponent and drop 13 bits of the mantissa; a carry into the exponent is right
+    uint32_t half = (magnitude - 0x38000000) >> 13;
+    const uint32_t rest = magnitude & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | static_cast<uint16_t>(half);
+}
+
+#endif
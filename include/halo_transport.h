@@ -0,0 +1,121 @@
+#ifndef HALO_TRANSPORT_H
+#define HALO_TRANSPORT_H
+
+#include <vector>
+#include <map>
+#include <deque>
+#include <tuple>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string>
+
+// Point-to-point messages between the ranks of a decomposed lattice.
+// Sends and receives are posted without blocking and completed together by wait_all(),
+// so that the ranks can compute while their messages are in flight. The messages
+// between two ranks with the same tag arrive in the order they were sent.
+class HaloTransport
+{
+public:
+    virtual ~HaloTransport() = default;
+
+    virtual size_t rank() const = 0;
+    virtual size_t size() const = 0;
+
+    // The buffers must stay valid and untouched until wait_all()
+    virtual void post_send(size_t to, int tag, const void* data, size_t bytes) = 0;
+    virtual void post_recv(size_t from, int tag, void* data, size_t bytes) = 0;
+    virtual void wait_all() = 0;
+
+    virtual void barrier() = 0;
+};
+
+// The mailboxes shared by the ranks of a LocalTransport
+class LocalExchange
+{
+public:
+    explicit LocalExchange(size_t ranks) : m_ranks(ranks) {}
+
+    size_t size() const { return m_ranks; }
+
+    void send(size_t from, size_t to, int tag, const void* data, size_t bytes);
+    // Blocks until the message has arrived
+    void recv(size_t from, size_t to, int tag, void* data, size_t bytes);
+    void barrier();
+
+private:
+    const size_t m_ranks;
+
+    std::mutex m_mutex;
+    std::condition_variable m_arrived;
+    std::map<std::tuple<size_t, size_t, int>, std::deque<std::vector<char>>> m_mailboxes;
+
+    size_t m_barrier_count = 0;
+    size_t m_barrier_generation = 0;
+};
+
+// The ranks as threads of a single process, a stand-in for MPI on one machine.
+// Sends are copied to the receiver's mailbox at once; receives complete in wait_all().
+class LocalTransport : public HaloTransport
+{
+public:
+    LocalTransport(LocalExchange& exchange, size_t rank) : m_exchange(exchange), m_rank(rank) {}
+
+    size_t rank() const override { return m_rank; }
+    size_t size() const override { return m_exchange.size(); }
+
+    void post_send(size_t to, int tag, const void* data, size_t bytes) override;
+    void post_recv(size_t from, int tag, void* data, size_t bytes) override;
+    void wait_all() override;
+    void barrier() override { m_exchange.barrier(); }
+
+private:
+    struct PendingRecv
+    {
+        size_t from;
+        int tag;
+        void* data;
+        size_t bytes;
+    };
+
+    LocalExchange& m_exchange;
+    const size_t m_rank;
+    std::vector<PendingRecv> m_pending;
+};
+
+// Runs body on ranks threads, each with its own LocalTransport, and rethrows
+// the first exception of a rank. A rank that throws should leave its peers nothing
+// to wait for, or they block: the bodies are expected to fail on all ranks alike.
+void run_local_ranks(size_t ranks, const std::function<void(HaloTransport&)>& body);
+
+#ifdef LBM_WITH_MPI
+#include <mpi.h>
+
+// The ranks of MPI_COMM_WORLD. MPI is initialized here unless the program did it already,
+// and then finalized with the transport.
+class MpiTransport : public HaloTransport
+{
+public:
+    MpiTransport();
+    ~MpiTransport() override;
+
+    MpiTransport(const MpiTransport&) = delete;
+    MpiTransport& operator=(const MpiTransport&) = delete;
+
+    size_t rank() const override { return m_rank; }
+    size_t size() const override { return m_size; }
+
+    void post_send(size_t to, int tag, const void* data, size_t bytes) override;
+    void post_recv(size_t from, int tag, void* data, size_t bytes) override;
+    void wait_all() override;
+    void barrier() override;
+
+private:
+    bool m_owns_mpi = false;
+    size_t m_rank = 0;
+    size_t m_size = 1;
+    std::vector<MPI_Request> m_requests;
+};
+#endif
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include "cli.h"
+
+// Batch mode: runs args.steps solver steps without a window or a GL context,
+// with optional periodic diagnostics, field dumps, field series, checkpoints and a video
+// rendered in software
+int run_headless(const Args& args, const SimulationSetup& setup);
+
+// Writes the density and the velocity components as a (3, height, width) float32 .npy array
+template <typename Precision>
+void dump_fields_npy(const D2Q9<Precision>& lbm, const std::string& filename);
+
+#endif
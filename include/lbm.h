@@ -6,57 +6,114 @@
 #include <functional>
 #include <numeric>
 #include <stdexcept>
+#include <chrono>
+#include <memory>
+#include <cstdint>
+#include "profiler.h"
+#include "thread_pool.h"
+#include "aligned_allocator.h"
 
-enum CellType {FLUID, SOLID, INFLOW, OUTFLOW};
+// One byte per cell, as in the input files
+enum CellType : uint8_t {FLUID, SOLID, INFLOW, OUTFLOW};
 
-// An abstract class for an N_DIM-ensional LBM automaton 
 template <size_t N_DIM>
+struct LBMParameters
+{
+    std::vector<size_t> dimensions;
+    std::array<bool, N_DIM> is_periodic; 
+    double tau;
+    ExecutionParams execution = {};
+};
+
+// An abstract class for an N_DIM-ensional LBM automaton. 
+// Real is the floating point type of the macroscopic variables.
+template <size_t N_DIM, typename Real = double>
 class LBM
 {
 public:
-    using VelocityVec = std::array<double, N_DIM>;   
+    using VelocityVec = std::array<Real, N_DIM>;   
 
-    struct LBMParams 
-    {
-        std::vector<size_t> dimensions;
-        std::array<bool, N_DIM> is_periodic; 
-        double tau;
-    };
+    // The parameters do not depend on the precision of the lattice
+    using LBMParams = LBMParameters<N_DIM>;
 
     LBM(const LBMParams& params) : m_dimensions(params.dimensions), 
                                    m_is_periodic(params.is_periodic), 
                                    m_tau(params.tau),
-                                   m_inv_tau(1.0 / m_tau)
+                                   m_inv_tau(static_cast<Real>(1.0 / params.tau))
     {
         if (m_dimensions.size() != N_DIM)
             throw std::runtime_error("Dimension count mismatch in LBMParams.");
 
         m_total_size = std::accumulate(m_dimensions.begin(), m_dimensions.end(), 1, std::multiplies<size_t>());
+
+        if (params.execution.threads)
+            m_pool = std::make_unique<ThreadPool>(params.execution.threads, params.execution.binding,
+                                                  params.execution.pool, params.execution.pools);
     }   
 
     virtual ~LBM() = default;
 
-    // A single LBM evolution step
-    void step()
+    // Wall-clock seconds spent in each phase, accumulated by step_timed()
+    struct PhaseTimes
+    {
+        double collide = 0.0;
+        double stream = 0.0;
+        double boundary = 0.0;
+        double macroscopic = 0.0;
+        double fused = 0.0; // the phases of a fused kernel cannot be told apart
+    };
+
+    // A single LBM evolution step. Concrete lattices may override this 
+    // with a fused kernel that performs all the phases in a single sweep.
+    virtual void step()
     {   
         // The pull scheme order
+        { PROFILE_SCOPE("lbm.collide"); collide(); }
+        { PROFILE_SCOPE("lbm.stream"); stream(); }
+        { PROFILE_SCOPE("lbm.boundary"); apply_cell_conditions(); }
+        { PROFILE_SCOPE("lbm.macroscopic"); compute_macroscopic(); }
+    }
+
+    // Several steps at once. Lattices that block several steps together in time override this;
+    // the state after advance(n) is that after n calls to step().
+    virtual void advance(size_t steps)
+    {
+        for (size_t step_cnt = 0; step_cnt < steps; step_cnt++)
+            step();
+    }
+
+    // The same step, with the time spent in each phase added to times
+    virtual void step_timed(PhaseTimes& times)
+    {
+        using Clock = std::chrono::steady_clock;
+        auto t0 = Clock::now();
         collide();
-        stream();  
+        auto t1 = Clock::now();
+        stream();
+        auto t2 = Clock::now();
         apply_cell_conditions();
-        compute_macroscopic(); 
+        auto t3 = Clock::now();
+        compute_macroscopic();
+        auto t4 = Clock::now();
+
+        times.collide += std::chrono::duration<double>(t1 - t0).count();
+        times.stream += std::chrono::duration<double>(t2 - t1).count();
+        times.boundary += std::chrono::duration<double>(t3 - t2).count();
+        times.macroscopic += std::chrono::duration<double>(t4 - t3).count();
     }
 
-    virtual const std::vector<double>& get_density() const = 0;
-    virtual const std::vector<VelocityVec>& get_velocity() const = 0;
+    virtual const FieldVector<Real>& get_density() const = 0;
+    virtual const FieldVector<VelocityVec>& get_velocity() const = 0;
     size_t get_total_size() const { return m_total_size; }
     const std::vector<size_t>& get_dimensions() const { return m_dimensions; }
+    double get_tau() const { return m_tau; }
     bool is_periodic(size_t dim) const { return (dim < N_DIM)? m_is_periodic[dim]: false; }
     CellType get_cell_type(size_t idx) const { return m_cell_type[idx]; }
 
 protected:
-    // The relaxation time and its inverse
+    // The relaxation time as given in the parameters, and its inverse in the lattice precision
     const double m_tau;
-    const double m_inv_tau;
+    const Real m_inv_tau;
 
     // Domain geometry and cell types distribution
     const std::vector<size_t> m_dimensions;
@@ -65,8 +122,11 @@ protected:
     std::vector<CellType> m_cell_type;
 
     // Macroscopic variables
-    std::vector<double> m_rho; // density
-    std::vector<VelocityVec> m_u; // velocity    
+    FieldVector<Real> m_rho; // density
+    FieldVector<VelocityVec> m_u; // velocity    
+
+    // The workers of ExecutionParams::threads; null with the parallel algorithms of the standard library
+    std::unique_ptr<ThreadPool> m_pool;
     
     virtual void collide() = 0;
     virtual void stream() = 0;
@@ -0,0 +1,32 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// A read-only view of a whole file. On POSIX systems the file is memory-mapped, so its pages
+// are read on first access and shared with the page cache; elsewhere it is read into memory.
+// The data is aligned to at least 64 bytes, so aligned sections of the file can be used in place.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    const std::string& filename() const { return m_filename; }
+
+private:
+    std::string m_filename;
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::vector<char> m_buffer; // the fallback without mmap
+};
+
+#endif
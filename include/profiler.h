@@ -0,0 +1,142 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <random>
+#include <ostream>
+
+// Low-overhead wall-clock instrumentation of the hot paths.
+// PROFILE_SCOPE(name) times the enclosing scope as the section `name`. The timers are
+// idle until Profiler::enable() is called; defining LBM_DISABLE_PROFILING compiles them out.
+
+using ProfileClock = std::chrono::steady_clock;
+
+// The durations recorded for a single named section: the count, total and minimum of all of
+// them, and a uniform random sample of at most MAX_SAMPLES of them for the p99
+class ProfileSection
+{
+public:
+    explicit ProfileSection(std::string name) : m_name(std::move(name)) {}
+
+    void record(ProfileClock::time_point start, ProfileClock::time_point end);
+
+    const std::string& get_name() const { return m_name; }
+
+private:
+    friend class Profiler;
+
+    // The sample is bounded, to keep long runs from exhausting the memory
+    static constexpr size_t MAX_SAMPLES = 1 << 16;
+
+    // Seconds, since the last summary
+    struct Durations
+    {
+        size_t calls = 0;
+        double total = 0.0;
+        double min = 0.0;
+        std::vector<double> samples;
+    };
+
+    std::string m_name;
+    std::mutex m_mutex;
+    Durations m_durations;
+    std::minstd_rand m_rng;
+};
+
+class Profiler
+{
+public:
+    static Profiler& instance();
+
+    // Starts recording. Summaries are printed every summary_every frames (0 == at exit only);
+    // a non-empty trace_file collects the Chrome trace events written by finish().
+    void enable(size_t summary_every, const std::string& trace_file = "");
+    bool is_enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    // The section registered under name; its address is stable for the lifetime of the program
+    ProfileSection& section(const std::string& name);
+
+    // Marks the end of a frame, records its duration as the "frame" section
+    // and prints the summary when it is due
+    void end_frame();
+
+    // min/mean/p99 of every section since the last summary
+    void print_summary(std::ostream& out);
+
+    // Prints the remaining summary and writes the trace file, if any
+    void finish();
+
+private:
+    friend class ProfileSection;
+
+    Profiler();
+    void add_trace_event(const ProfileSection& section, ProfileClock::time_point start, ProfileClock::time_point end);
+    void write_chrome_trace(const std::string& filename) const;
+
+    struct TraceEvent
+    {
+        const ProfileSection* section;
+        double start_us;
+        double duration_us;
+        size_t thread;
+    };
+
+    // The trace is bounded, to keep long runs from exhausting the memory
+    static constexpr size_t MAX_TRACE_EVENTS = 1 << 22;
+
+    std::atomic<bool> m_enabled{false};
+    size_t m_summary_every = 0;
+    size_t m_frame = 0;
+    size_t m_summary_start_frame = 0;
+    std::string m_trace_file;
+    ProfileClock::time_point m_origin;
+    ProfileClock::time_point m_frame_start;
+    ProfileSection* m_frame_section = nullptr;
+
+    std::mutex m_mutex;
+    std::map<std::string, std::unique_ptr<ProfileSection>> m_sections;
+    std::vector<TraceEvent> m_trace;
+};
+
+// Records the lifetime of the object into a section
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(ProfileSection& section)
+        : m_section(section), m_active(Profiler::instance().is_enabled())
+    {
+        if (m_active) m_start = ProfileClock::now();
+    }
+
+    ~ScopedTimer()
+    {
+        if (m_active) m_section.record(m_start, ProfileClock::now());
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    ProfileSection& m_section;
+    bool m_active;
+    ProfileClock::time_point m_start;
+};
+
+#ifndef LBM_DISABLE_PROFILING
+#define PROFILE_CONCAT_IMPL(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_IMPL(a, b)
+// The section lookup is done once per call site
+#define PROFILE_SCOPE(name) \
+    static ProfileSection& PROFILE_CONCAT(profile_section_, __LINE__) = Profiler::instance().section(name); \
+    ScopedTimer PROFILE_CONCAT(profile_timer_, __LINE__)(PROFILE_CONCAT(profile_section_, __LINE__))
+#else
+#define PROFILE_SCOPE(name) do {} while (0)
+#endif
+
+#endif
@@ -1,32 +1,97 @@
 #ifndef RENDERER_H
 #define RENDERER_H  
 
+#include <array>
+#include <string>
 #include <vector>
+#include <cstdint>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <iostream>
+#include "d2q9_setup.h"
+#include "field_downsampler.h"
 
+// Draws the scalar field through the jet colormap, with the obstacles over it. The field
+// is uploaded at every new snapshot, in the texel format asked for: converted on the CPU to
+// half floats or 8-bit normalized values, it takes 2 or 4 times less bandwidth than in floats.
+// Only the view, the part of the grid panned and zoomed to, is uploaded, pooled down to the
+// window size if it has more cells than the window has pixels.
+// The obstacle mask is uploaded once, then only the rows that change, if ever.
+// Alternatively, render_moments() uploads the raw density and velocity, and the fragment
+// shader computes the quantity from them: the CPU computes no observable at all, and
+// switching quantities only changes a uniform.
 class Renderer 
 {  
 public:
-    Renderer (size_t width, size_t height, size_t grid_width, size_t grid_height);
+    // The window size and the texture params of visual_params; periodic: along x and y,
+    // for the gradients of render_moments()
+    Renderer (const VisualizationParams& visual_params, size_t grid_width, size_t grid_height,
+              std::array<bool, 2> periodic = {false, false});
     ~Renderer();
     
-    void render(const std::vector<float>& scalar_field, 
-                const std::vector<float>& obstacle_mask);
+    // Uploads the rows where the mask differs from the last one at the next render()
+    void set_obstacle_mask(const std::vector<float>& obstacle_mask);
+    // Uploads the field if it changed since the last call, or if the view did
+    void render(const std::vector<float>& scalar_field, bool field_changed = true);
+    // From rho - 1, ux and uy per cell (see D2Q9_pack_moments()), in float32 or, for the
+    // compact texel formats, in half floats. Throws for a quantity the shader cannot compute.
+    void render_moments(const std::vector<std::array<float, 3>>& moments, const QuantityParams& quantity);
+    // Whether render_moments() can compute the quantity
+    static bool is_moment_quantity(const std::string& quant_id);
 
     const bool should_close() const { return glfwWindowShouldClose(m_window); }
     void poll_events() { glfwPollEvents(); }
     void wait_events() { glfwWaitEvents(); }
     GLFWwindow* get_window() { return m_window; }
 
+    // Pan and zoom. The view is the whole grid at zoom 1, and otherwise the rectangle of
+    // whole cells around 1/zoom of the grid about its center, kept inside the grid.
+    void zoom(double factor);
+    // By fractions of the view
+    void pan(double dx, double dy);
+    void reset_view();
+    const GridRect& get_view() const { return m_view; }
+
 private:
     size_t m_width, m_height, m_grid_width, m_grid_height;
+    FieldTexture m_field_texture;
+    FieldPooling m_field_pooling;
+    std::array<bool, 2> m_periodic;
     GLFWwindow* m_window;
     GLuint m_shader_program, m_fieldTex, m_obstacleTex;
     GLuint m_vao, m_ebo, m_vbo;
+    // render_moments() only, set up at its first call: the program and its uniforms
+    GLuint m_moments_program = 0, m_momentsTex = 0;
+    GLint m_quantity_loc, m_scale_loc, m_offset_loc, m_moments_view_loc;
+    GLint m_field_scale_loc, m_view_loc;
+
+    double m_zoom = 1.0, m_center_x, m_center_y;
+    GridRect m_view;
+    // The size of the field texture, and whether it holds the field of another view
+    size_t m_field_width = 0, m_field_height = 0;
+    bool m_field_stale = true;
+    std::vector<float> m_pooled;
+
+    // The field in the texel format of FLOAT16 and UNORM8, converted in parallel bands of
+    // the rows of the field texture
+    std::vector<unsigned char> m_texels;
+    std::vector<size_t> m_bands;
+    // The mask last set, and the rows [begin, end) of it not uploaded yet
+    std::vector<float> m_obstacle_mask;
+    size_t m_obstacle_dirty_begin = 0, m_obstacle_dirty_end = 0;
 
     void init();
+    void init_moments();
+    void upload_obstacle_rows();
+    void update_view();
+    // The view, in the texture coordinates of the grid, to the uniforms of the programs
+    void set_view_uniforms();
+    void resize_field_texture(size_t width, size_t height);
+    void upload_field(const std::vector<float>& scalar_field);
+    // Packs the rows of width cells to half floats in m_texels, a band of rows per task
+    void pack_half_bands(const float* values, size_t width, size_t height, size_t floats_per_cell);
+    // The obstacles and the quad, with the program and the field texture bound
+    void draw();
 };
 
 // Helper functions
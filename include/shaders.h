@@ -1,26 +1,7 @@
-// A simple vertex shader
-static const char* vertex_shader_src = R"(
-#version 330 core
-layout (location = 0) in vec2 aPos;
-layout (location = 1) in vec2 aTexCoord;
-out vec2 TexCoord;
-void main() 
-{
-    gl_Position = vec4(aPos, 0.0, 1.0);
-    TexCoord = aTexCoord;
-}
-)";
+#include <string>
 
-// A texture shader for a scalar field and obstacles
-static const char* fragment_shader_src = R"(
-#version 330 core
-in vec2 TexCoord;
-out vec4 FragColor;
-
-uniform sampler2D scalarTex;   // a scalar field
-uniform sampler2D obstacleTex; // obstacle mask
-
-// Jet colormap
+// The jet colormap, pasted into the fragment shaders that map a value to a color
+static const std::string jet_colormap_glsl = R"(
 vec3 jet(float t) 
 {
     t = clamp(t, 0.0, 1.0);
@@ -46,11 +27,133 @@ vec3 jet(float t)
         return mix(c4, c5, (t - 0.875) / 0.125);
     }
 }
+)";
+
+// A simple vertex shader
+static const char* vertex_shader_src = R"(
+#version 330 core
+layout (location = 0) in vec2 aPos;
+layout (location = 1) in vec2 aTexCoord;
+out vec2 TexCoord;
+void main() 
+{
+    gl_Position = vec4(aPos, 0.0, 1.0);
+    TexCoord = aTexCoord;
+}
+)";
+
+// A texture shader for a scalar field and obstacles
+static const std::string fragment_shader_src = R"(
+#version 330 core
+in vec2 TexCoord;
+out vec4 FragColor;
+
+uniform sampler2D scalarTex;   // a scalar field, over the view only
+uniform sampler2D obstacleTex; // obstacle mask
+uniform vec4 uView;            // the view in the grid: offset, size, in texture coordinates
+uniform vec2 uFieldScale;      // the part of scalarTex over the view: less than 1 past a partial last block
+
+)" + jet_colormap_glsl + R"(
+void main()
+{
+    float scalar = texture(scalarTex, TexCoord * uFieldScale).r;   
+    float mask   = texture(obstacleTex, uView.xy + TexCoord * uView.zw).r; // 0 == fluid, 1 == obstacle
+
+    float smoothedMask = smoothstep(0.2, 0.3, mask);
+
+    if (smoothedMask > 0.5) {
+        // Obstacle: render dark gray
+        FragColor = vec4(0.2, 0.2, 0.2, 1.0);
+    } else {
+        // Fluid: jet colormap
+        vec3 col = jet(scalar);
+        FragColor = vec4(col, 1.0);
+    }
+}
+)";
+
+// The observables computed from the raw moments, rho - 1, ux and uy, of every cell, as
+// D2Q9_compute_* and the derived-field kernels do on the CPU: uQuantity indexes the
+// MOMENT_QUANTITIES of renderer.cpp, and the gradients are central differences across the
+// periodic edges, clamped at the others. The value is interpolated between the four
+// nearest cells as GL_LINEAR does the CPU field, wrapping around the periodic edges and
+// clamped at the others as GL_REPEAT and GL_CLAMP_TO_EDGE do.
+static const std::string moments_fragment_shader_src = R"(
+#version 330 core
+in vec2 TexCoord;
+out vec4 FragColor;
+
+uniform sampler2D momentsTex;  // rho - 1, ux, uy
+uniform sampler2D obstacleTex; // obstacle mask
+uniform ivec2 uGridSize;
+uniform vec4 uView;            // the view in the grid: offset, size, in texture coordinates
+uniform bvec2 uPeriodic;
+uniform int uQuantity;
+uniform float uScale;
+uniform float uOffset;
+
+)" + jet_colormap_glsl + R"(
+vec3 moments_at(ivec2 cell)
+{
+    return texelFetch(momentsTex, cell, 0).rgb;
+}
+
+// The velocity of the neighbor of a cell as the lattice sees it
+vec2 velocity_at(ivec2 cell, ivec2 offset)
+{
+    ivec2 neighbor = cell + offset;
+    ivec2 wrapped = (neighbor + uGridSize) % uGridSize;
+    ivec2 clamped = clamp(neighbor, ivec2(0), uGridSize - 1);
+    return moments_at(ivec2(uPeriodic.x ? wrapped.x : clamped.x, uPeriodic.y ? wrapped.y : clamped.y)).gb;
+}
+
+float quantity_at(ivec2 cell)
+{
+    vec3 m = moments_at(cell);
+    if (uQuantity == 0)             // density
+        return 1.0 + m.r;
+    if (uQuantity == 1)             // speed
+        return length(m.gb);
+    if (uQuantity == 6)             // zero
+        return 0.0;
+
+    vec2 left = velocity_at(cell, ivec2(-1, 0));
+    vec2 right = velocity_at(cell, ivec2(1, 0));
+    vec2 below = velocity_at(cell, ivec2(0, -1));
+    vec2 above = velocity_at(cell, ivec2(0, 1));
+    float dux_dx = 0.5 * (right.x - left.x);
+    float duy_dx = 0.5 * (right.y - left.y);
+    float dux_dy = 0.5 * (above.x - below.x);
+    float duy_dy = 0.5 * (above.y - below.y);
+    if (uQuantity == 2)             // vorticity
+        return dux_dy - duy_dx;
+    if (uQuantity == 3)             // divergence
+        return dux_dx + duy_dy;
+    if (uQuantity == 4)             // q_criterion
+        return -0.5 * (dux_dx * dux_dx + duy_dy * duy_dy) - dux_dy * duy_dx;
+    float shear = dux_dy + duy_dx;  // strain_rate
+    return sqrt(2.0 * (dux_dx * dux_dx + duy_dy * duy_dy) + shear * shear);
+}
 
 void main()
 {
-    float scalar = texture(scalarTex, TexCoord).r;   
-    float mask   = texture(obstacleTex, TexCoord).r; // 0 == fluid, 1 == obstacle
+    // Between the centers of the four nearest cells, wrapping around the periodic edges
+    // and clamped to the edge cells of the others
+    vec2 grid_coord = uView.xy + TexCoord * uView.zw;
+    vec2 position = grid_coord * vec2(uGridSize) - 0.5;
+    vec2 t = fract(position);
+    ivec2 below = ivec2(floor(position));
+    ivec2 above = below + 1;
+    ivec2 wrapped_below = (below + uGridSize) % uGridSize;
+    ivec2 wrapped_above = (wrapped_below + 1) % uGridSize;
+    ivec2 clamped_below = clamp(below, ivec2(0), uGridSize - 1);
+    ivec2 clamped_above = clamp(above, ivec2(0), uGridSize - 1);
+    ivec2 first = ivec2(uPeriodic.x ? wrapped_below.x : clamped_below.x, uPeriodic.y ? wrapped_below.y : clamped_below.y);
+    ivec2 second = ivec2(uPeriodic.x ? wrapped_above.x : clamped_above.x, uPeriodic.y ? wrapped_above.y : clamped_above.y);
+    float value = mix(mix(quantity_at(first), quantity_at(ivec2(second.x, first.y)), t.x),
+                      mix(quantity_at(ivec2(first.x, second.y)), quantity_at(second), t.x), t.y);
+    float scalar = uScale * value + uOffset;
+    float mask   = texture(obstacleTex, grid_coord).r; // 0 == fluid, 1 == obstacle
 
     float smoothedMask = smoothstep(0.2, 0.3, mask);
 
@@ -69,27 +172,34 @@ void main()
 static const char* tracer_vertex_shader_src = R"(
 #version 330 core
 layout (location = 0) in vec2 aPos;
+layout (location = 1) in float aValue; // the attribute to color by, if any
+out float vValue;
 
-uniform vec2 uGridSize;  
+uniform vec4 uView;        // the view in the grid: offset, size, in cells
 uniform float uPointSize;   
+uniform float uValueScale; // 1 / the value at the top of the colormap
 
 void main() 
 {
     // Grid coords to NDC
-    float x = (aPos.x / uGridSize.x) * 2.0 - 1.0;
-    float y = (aPos.y / uGridSize.y) * 2.0 - 1.0;
+    float x = ((aPos.x - uView.x) / uView.z) * 2.0 - 1.0;
+    float y = ((aPos.y - uView.y) / uView.w) * 2.0 - 1.0;
     gl_Position = vec4(x, y, 0.0, 1.0);
 
     gl_PointSize = uPointSize;
+    vValue = aValue * uValueScale;
 }
 )";
 
-static const char* tracer_fragment_shader_src = R"(
+static const std::string tracer_fragment_shader_src = R"(
 #version 330 core
 
+in float vValue;
 out vec4 FragColor;
 uniform vec4 uTracerColor;
+uniform bool uColored; // through the jet colormap, with the alpha of uTracerColor
 
+)" + jet_colormap_glsl + R"(
 void main() 
 {
     // Distance from center
@@ -99,7 +209,7 @@ void main()
     if (dist > 0.5)
         discard;
 
-    FragColor = uTracerColor;
+    FragColor = uColored ? vec4(jet(vValue), uTracerColor.a) : uTracerColor;
 
     // // Tail fade (still left → right for now)
     // float tail = 1.0 - gl_PointCoord.x;
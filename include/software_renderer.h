@@ -0,0 +1,52 @@
+#ifndef SOFTWARE_RENDERER_H
+#define SOFTWARE_RENDERER_H
+
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+// Renders the frames of Renderer and TracersCollection on the CPU, without a window or
+// a GL context: the scalar field through the jet colormap of the fragment shader, the
+// obstacles in dark gray, both sampled bilinearly as the GL textures are, and the tracers
+// as round point splats. The frames are RGB rows from the bottom up, as glReadPixels gives them.
+class SoftwareRenderer
+{
+public:
+    // The field and the obstacles wrap around the periodic axes and are clamped to the edges of the others
+    SoftwareRenderer(size_t width, size_t height, size_t grid_width, size_t grid_height,
+                     const std::array<bool, 2>& periodic);
+
+    void render(const std::vector<float>& scalar_field,
+                const std::vector<float>& obstacle_mask);
+    // Draws over the frame, as the tracer shaders do: positions in grid coordinates,
+    // size in pixels, the alpha of the color ignored. Given a value per tracer, the
+    // tracers take the colormap at value * value_scale instead of the color.
+    void render_tracers(const std::vector<std::array<float, 2>>& positions,
+                        const std::array<float, 4>& color, float size,
+                        const std::vector<float>& values = {}, float value_scale = 1.0f);
+
+    const std::vector<unsigned char>& get_pixels() const { return m_pixels; }
+
+    // The name of the instruction set the colormap was compiled for
+    static const char* simd_isa();
+
+private:
+    // The two texels a pixel center falls between along an axis, wrapping around as
+    // GL_REPEAT does on a periodic axis or clamped as GL_CLAMP_TO_EDGE, and the weight of the second one
+    struct Sample
+    {
+        uint32_t first, second;
+        float weight;
+    };
+
+    static std::vector<Sample> samples(size_t pixels, size_t texels, bool periodic);
+    void render_rows(const float* scalar_field, const float* obstacle_mask, size_t begin, size_t end);
+
+    size_t m_width, m_height, m_grid_width, m_grid_height;
+    std::vector<Sample> m_columns, m_rows;
+    std::vector<size_t> m_bands; // the first rows of the bands rendered in parallel
+    std::vector<unsigned char> m_pixels;
+};
+
+#endif
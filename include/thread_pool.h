@@ -0,0 +1,73 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <string>
+#include <utility>
+
+// How the workers of a pool are pinned to the CPUs the process may run on:
+// not at all, worker i on the i-th CPU, or evenly spread over all of them
+// (across the sockets, with the usual socket-major CPU numbering)
+enum class ThreadBinding {NONE, COMPACT, SPREAD};
+
+ThreadBinding parse_thread_binding(const std::string& name);
+const char* thread_binding_name(ThreadBinding binding);
+
+// The execution backend of a lattice. With threads == 0 the sweeps run on the
+// parallel algorithms of the standard library; otherwise on a pool of that many
+// persistent workers, each owning a fixed band of grid rows.
+struct ExecutionParams
+{
+    size_t threads = 0;
+    ThreadBinding binding = ThreadBinding::NONE;
+    // The pools of the ranks that share the process: this is pool `pool` of `pools`, and its
+    // workers are pinned after those of the pools before it, so that the pools get disjoint CPUs
+    size_t pool = 0;
+    size_t pools = 1;
+};
+
+// A fixed set of workers that all run the same task, each on its own static part of the work.
+// A worker keeps its part from one task to the next, so the data it first touched
+// stays on its NUMA node and in its caches.
+class ThreadPool
+{
+public:
+    ThreadPool(size_t threads, ThreadBinding binding = ThreadBinding::NONE, size_t pool = 0, size_t pools = 1);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return m_workers.size(); }
+
+    // Runs task(worker) on every worker and waits for all of them.
+    // The first exception thrown by a worker is rethrown here. Tasks must not call run().
+    void run(const std::function<void(size_t worker)>& task);
+
+    // The part [begin, end) of count items that falls to the worker
+    std::pair<size_t, size_t> partition(size_t count, size_t worker) const
+    {
+        return {count * worker / size(), count * (worker + 1) / size()};
+    }
+
+private:
+    void worker_loop(size_t worker, int cpu);
+
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_task_ready;
+    std::condition_variable m_task_done;
+    const std::function<void(size_t)>* m_task = nullptr;
+    size_t m_generation = 0; // counts the tasks, so that a worker runs each one once
+    size_t m_running = 0;
+    bool m_stop = false;
+    std::exception_ptr m_error;
+};
+
+#endif
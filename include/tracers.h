@@ -0,0 +1,86 @@
+#ifndef TRACERS_H
+#define TRACERS_H
+
+#include <algorithm>
+#include <random>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <array>
+#include <vector>
+#include "d2q9.h"
+#include "d2q9_setup.h"
+
+TracerIntegrator parse_tracer_integrator(const std::string& name);
+const char* tracer_integrator_name(TracerIntegrator integrator);
+// Throws for an unknown name: none, age, speed
+TracerColoring parse_tracer_coloring(const std::string& name);
+// The value at the top of the colormap: the coloring_range of the params, or a default
+// for the attribute if it is 0
+float tracer_coloring_range(const TracersParams& tracers_params);
+
+// The tracer particles, without any rendering: seeded at random in the fluid cells and
+// at the cells given in the input, and emitted at the inflow cells. Every update carries
+// them through the velocity field, interpolated bilinearly between the cell centers,
+// and drops those that left the grid or reached an outflow cell.
+// The positions are kept as separate x and y arrays, in grid coordinates, and updated
+// in parallel blocks with a branch-free inner loop; the dropped tracers are compacted out.
+// Every tracer also carries its age, in the lattice steps of the updates since it was
+// seeded, and the flow speed at its last substep, for coloring.
+template <typename Precision = double>
+class Tracers
+{
+    public:
+        Tracers(const D2Q9<Precision>& lbm, const TracersParams& tracers_params);
+
+        void update_positions();
+        void emit_tracers();
+
+        size_t size() const { return m_x.size(); }
+        const std::vector<float>& get_x() const { return m_x; }
+        const std::vector<float>& get_y() const { return m_y; }
+        const std::vector<float>& get_age() const { return m_age; }
+        const std::vector<float>& get_speed() const { return m_speed; }
+        // The attribute to color by, in the order of the positions; empty for NONE
+        void get_attribute(TracerColoring coloring, std::vector<float>& values) const;
+
+        // The positions as (x, y) pairs, for rendering and checkpoints
+        void get_positions(std::vector<std::array<float, 2>>& positions) const;
+        std::vector<std::array<float, 2>> get_positions() const;
+        // Replaces the tracers, as restored from a checkpoint
+        void set_positions(const std::vector<std::array<float, 2>>& positions, const std::vector<float>& ages);
+
+    private:
+        // The tracers of a block are advanced by one task
+        static constexpr size_t BLOCK_SIZE = 16384;
+
+        void add_tracer(size_t cell_idx, float jitter_x, float jitter_y);
+        void sample_velocity();
+        template <TracerIntegrator INTEGRATOR>
+        void advance_block(size_t begin, size_t end);
+
+        const D2Q9<Precision>* m_lbm;
+        size_t m_grid_width, m_grid_height;
+        std::array<bool, 2> m_periodic;
+        float m_emission_rate;
+        TracerIntegrator m_integrator;
+        float m_time_step;
+        size_t m_substeps;
+
+        std::vector<float> m_x, m_y;
+        std::vector<float> m_age, m_speed;
+        // The velocity of the cells with a ring of ghost cells around the grid, copied from
+        // the lattice at every update: the ghosts hold the cells across the periodic edges
+        // or repeat the edge cells, so the interpolation never wraps or clamps an index
+        std::vector<float> m_ux, m_uy;
+        std::vector<size_t> m_padded_rows;
+        std::vector<uint8_t> m_drops; // 1 at the outflow cells
+        // Scratch for the compaction
+        std::vector<uint8_t> m_keep;
+        std::vector<size_t> m_block_offsets;
+        std::vector<size_t> m_blocks;
+        std::vector<float> m_next_x, m_next_y, m_next_age, m_next_speed;
+        std::mt19937 m_rng;
+};
+
+#endif
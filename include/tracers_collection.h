@@ -1,44 +1,59 @@
 #ifndef TRACERS_COLLECTION_H
 #define TRACERS_COLLECTION_H
 
-#include <algorithm>
-#include <random>
-#include <cstdlib>
 #include <array>
 #include <vector>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
-#include "d2q9.h"
-
-struct TracersParams
-{
-    std::array<float, 4> color;
-    float size;
-    float emission_rate;
-    size_t random_initial;
-    std::vector<size_t> initial_tracers;
-};
+#include "d2q9_setup.h"
+#include "field_downsampler.h"
 
+// Renders the positions of the tracers, in grid coordinates, as point sprites, colored
+// by a per-tracer attribute (age, speed) through the jet colormap if the params ask for it.
+// The vertices stream through buffers allocated once for a ring of REGIONS frames and
+// grown by doubling: each frame writes the next region while the GPU may still draw from
+// the previous ones. With GL_ARB_buffer_storage the buffers stay mapped and every region
+// is fenced until the GPU is done with it; otherwise the regions are written with
+// glBufferSubData. Either way no frame reallocates the buffers, as glBufferData would.
 class TracersCollection
 {
     public:
-        TracersCollection(const D2Q9& lbm, const TracersParams& tracers_params);
+        TracersCollection(size_t grid_width, size_t grid_height, const TracersParams& tracers_params);
         ~TracersCollection();
 
-        void update_positions();
-        void emit_tracers();
-        void render_tracers();    
-    
+        // The values of the attribute, in the order of the positions, if the tracers are colored
+        void render_tracers(const std::vector<std::array<float, 2>>& positions,
+                            const std::vector<float>& values = {});
+        // The region of the grid the window shows, the whole grid until set
+        void set_view(const GridRect& view);
+
     private:
-        GLuint m_vao, m_vbo, m_shader_program;
-        size_t m_num_tracers;
-        const D2Q9* m_lbm;
+        static constexpr size_t REGIONS = 3;
+        // The smallest capacity allocated, in tracers per region
+        static constexpr size_t MIN_CAPACITY = 4096;
+
         size_t m_grid_width, m_grid_height;
-        float m_emission_rate;
-        std::vector<std::array<float, 2>> m_positions;
-        std::mt19937 m_rng;
+        GLuint m_vao, m_shader_program;
+        GLint m_colored_loc, m_view_loc;
+        GridRect m_view;
+        bool m_coloring;        // whether the params color the tracers
+        bool m_colored = false; // whether the attribute array is enabled
+
+        bool m_persistent;
+        size_t m_capacity = 0;  // in tracers per region
+        size_t m_region = 0;    // the next one to write
+        GLuint m_position_vbo = 0, m_value_vbo = 0;
+        // Persistent mapping only: the mapped buffers, and the fence of the last draw from every region
+        std::array<float, 2>* m_mapped_positions = nullptr;
+        float* m_mapped_values = nullptr;
+        std::array<GLsync, REGIONS> m_fences{};
 
         void init(const TracersParams& tracers_params);
+        // Makes room for count tracers per region; the contents are lost on growth
+        void reserve(size_t count);
+        void release_buffers();
+        // Waits until the GPU no longer draws from the region, persistent mapping only
+        void wait_for_region(size_t region);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,55 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Hands the latest of a stream of values from one producer thread to one consumer thread,
+// without locks and without either side ever waiting for the other. The producer fills the
+// back buffer and publishes it by swapping it with the middle one; the consumer takes the
+// middle one in exchange for its front buffer when a newer value is there. Values the
+// consumer is too slow to take are overwritten, so it always gets the latest.
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() = default;
+    // Every buffer starts as a copy of value, e.g. to size them once and for all
+    explicit TripleBuffer(const T& value) : m_buffers{value, value, value} {}
+
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    // Producer side: the buffer to fill, then publish it. The next back buffer
+    // holds an older value, to be overwritten.
+    T& back() { return m_buffers[m_back]; }
+    void publish()
+    {
+        m_back = m_middle.exchange(m_back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+    // Whether the last value published has not been taken yet
+    bool pending() const { return m_middle.load(std::memory_order_acquire) & FRESH; }
+
+    // Consumer side: takes the latest value published, if newer than the front buffer.
+    // Returns whether it did; the front buffer stays the consumer's until the next update.
+    bool update()
+    {
+        if (!(m_middle.load(std::memory_order_relaxed) & FRESH))
+            return false;
+        m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    const T& front() const { return m_buffers[m_front]; }
+
+private:
+    static constexpr uint8_t INDEX = 0x3;
+    static constexpr uint8_t FRESH = 0x4;
+
+    std::array<T, 3> m_buffers;
+    uint8_t m_back = 0;                     // the producer's
+    std::atomic<uint8_t> m_middle{1};       // shared, with the FRESH bit set once published
+    uint8_t m_front = 2;                    // the consumer's
+};
+
+#endif
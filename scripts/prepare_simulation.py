@@ -9,7 +9,50 @@ def hex_to_rgb(hex_color):
     hex_color = hex_color.lstrip('#')
     return tuple(bytes.fromhex(hex_color))
 
-def main(config_file):
+def align(offset, alignment=64):
+    return (offset + alignment - 1) // alignment * alignment
+
+def write_v2(f, width, height, is_periodic_x, is_periodic_y, tau, threads, binding,
+             render, render_window_size, steps_per_frame, tracers_params,
+             cell_type, initial_rho, initial_u_x, initial_u_y, tracers):
+    """The mapped format: a header, then the sections at 64-byte aligned offsets (InputFileHeader in d2q9_setup.h)"""
+    total_size = width * height
+    quantities = b''
+    for quant in render['render_quantities']:
+        quant_id = quant['quantity'].encode('utf-8')
+        quantities += struct.pack('<B', len(quant_id)) + quant_id
+        quantities += struct.pack('<ff', float(quant['offset']), float(quant['amplitude']))
+
+    initial_u = [0.0] * (2 * total_size)
+    initial_u[0::2] = initial_u_x
+    initial_u[1::2] = initial_u_y
+    sections = [quantities,
+                struct.pack(f'<{total_size}B', *cell_type),
+                struct.pack(f'<{total_size}d', *initial_rho),
+                struct.pack(f'<{2 * total_size}d', *initial_u),
+                struct.pack(f'<{len(tracers)}Q', *tracers)]
+
+    header_format = '<8sII QQ BBBBI d Q QQQ 4f ff QQ' + 'QQ' * len(sections)
+    header_bytes = struct.calcsize(header_format)
+    extents = []
+    offset = align(header_bytes)
+    for section in sections:
+        extents += [offset, len(section)]
+        offset = align(offset + len(section))
+
+    tracers_color = [float(val) / 255 for val in hex_to_rgb(tracers_params.get('color', '#FF00FF').lstrip('#'))]
+    tracers_color.append(1.0) # The alpha channel
+    f.write(struct.pack(header_format, b'LBMINPUT', 2, header_bytes, width, height,
+                        is_periodic_x, is_periodic_y, binding, 0, len(render['render_quantities']),
+                        tau, threads, *render_window_size, steps_per_frame,
+                        *tracers_color, float(tracers_params.get('size', 3.0)),
+                        float(tracers_params.get('emission_rate', 0)), tracers_params.get('random_initial', 0),
+                        len(tracers), *extents))
+    for section, section_offset in zip(sections, extents[0::2]):
+        f.write(b'\0' * (section_offset - f.tell()))
+        f.write(section)
+
+def main(config_file, file_format='v2'):
     try:
         config_dir = Path(config_file).parent
         with open(config_file, 'r') as f:
@@ -23,12 +66,18 @@ def main(config_file):
     color_map = config['color_map']
     render = config['render']
     tracers_params = config['tracers']
+    execution = config.get('execution', {})
     
     viscosity = sim_params['viscosity']
     is_periodic_x = periodicity['x']
     is_periodic_y = periodicity['y']
 
     steps_per_frame = render['steps_per_frame']
+
+    # 0 threads: the parallel algorithms of the standard library, no pool
+    threads = execution.get('threads', 0)
+    binding_map = {'none': 0, 'compact': 1, 'spread': 2}
+    binding = binding_map[execution.get('binding', 'none')]
     render_window_size = render['render_window_size']
 
     # The relaxation parameter
@@ -85,6 +134,14 @@ def main(config_file):
 
     # Make sure the format matches the one used in d2q9_setup.cpp
     with open(output_file, 'wb') as f:
+        if file_format == 'v2':
+            write_v2(f, width, height, is_periodic_x, is_periodic_y, tau, threads, binding,
+                     render, render_window_size, steps_per_frame, tracers_params,
+                     cell_type, initial_rho, initial_u_x, initial_u_y, tracers)
+            print(f"Simulation setup data saved as {output_file}.")
+            return
+
+        # The legacy format, read field by field
         # LBM parameters (grid dimensions, periodicity, tau) 
         f.write(struct.pack('<QQ', width, height))
         f.write(struct.pack('<bb', is_periodic_x, is_periodic_y))
@@ -121,11 +178,16 @@ def main(config_file):
         f.write(struct.pack('<Q', len(tracers)))
         f.write(struct.pack(f'<{len(tracers)}Q', *tracers))        
 
+        # Execution
+        f.write(struct.pack('<QB', threads, binding))
+
         
     print(f"Simulation setup data saved as {output_file}.")
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="Prepare LBM simulation data from a YAML config file.")
     parser.add_argument('config_file', type=str, help='Path to the YAML configuration file.')
+    parser.add_argument('--format', choices=['v1', 'v2'], default='v2',
+                        help='v2 (default): a header with aligned sections, memory-mapped by the solver; v1: the legacy layout.')
     args = parser.parse_args()
-    main(args.config_file)
+    main(args.config_file, args.format)
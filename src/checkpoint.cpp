@@ -0,0 +1,336 @@
+#include "checkpoint.h"
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+static constexpr size_t SECTION_ALIGNMENT = 64;
+
+static uint64_t align_section(uint64_t offset)
+{
+    return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+static size_t storage_bytes(PopulationEncoding encoding)
+{
+    return encoding == PopulationEncoding::F64 ? sizeof(double) : sizeof(float);
+}
+
+template <typename Precision>
+void capture_checkpoint(const D2Q9<Precision>& lbm, uint64_t step,
+                        const std::vector<std::array<float, 2>>& tracers, const std::vector<float>& tracer_ages,
+                        Checkpoint& snapshot)
+{
+    using StoredState = typename D2Q9<Precision>::StoredState;
+    const size_t total_size = lbm.get_total_size();
+
+    snapshot.step = step;
+    snapshot.dimensions = {lbm.get_dimensions()[0], lbm.get_dimensions()[1]};
+    snapshot.is_periodic = {lbm.is_periodic(0), lbm.is_periodic(1)};
+    snapshot.tau = lbm.get_tau();
+    snapshot.encoding = population_encoding<Precision>();
+    snapshot.post_collision = lbm.stores_post_collision();
+
+    const auto& rho = lbm.get_density();
+    const auto& u = lbm.get_velocity();
+    snapshot.cell_type.resize(total_size);
+    snapshot.rho.resize(total_size);
+    snapshot.u.resize(total_size);
+    for (size_t idx = 0; idx < total_size; idx++)
+    {
+        snapshot.cell_type[idx] = static_cast<uint8_t>(lbm.get_cell_type(idx));
+        snapshot.rho[idx] = rho[idx];
+        snapshot.u[idx] = {u[idx][0], u[idx][1]};
+    }
+
+    snapshot.boundaries.clear();
+    for (const auto& condition : lbm.get_boundary_conditions())
+        snapshot.boundaries.push_back({condition.idx, condition.rho, {condition.u[0], condition.u[1]}});
+
+    snapshot.populations.resize(total_size * sizeof(StoredState));
+    lbm.get_populations(reinterpret_cast<StoredState*>(snapshot.populations.data()));
+
+    snapshot.tracers = tracers;
+    snapshot.tracer_ages = tracer_ages;
+}
+
+void write_checkpoint(const Checkpoint& checkpoint, const std::string& filename)
+{
+    const size_t total_size = checkpoint.dimensions[0] * checkpoint.dimensions[1];
+    if (checkpoint.cell_type.size() != total_size || checkpoint.rho.size() != total_size
+        || checkpoint.u.size() != total_size
+        || checkpoint.populations.size() != 9 * total_size * storage_bytes(checkpoint.encoding)
+        || checkpoint.tracer_ages.size() != checkpoint.tracers.size())
+        throw std::runtime_error("Inconsistent checkpoint data");
+
+    CheckpointHeader header{};
+    std::memcpy(header.magic, CheckpointHeader::MAGIC, sizeof(header.magic));
+    header.version = CheckpointHeader::VERSION;
+    header.header_bytes = sizeof(CheckpointHeader);
+    header.width = checkpoint.dimensions[0];
+    header.height = checkpoint.dimensions[1];
+    header.periodic_x = checkpoint.is_periodic[0];
+    header.periodic_y = checkpoint.is_periodic[1];
+    header.encoding = static_cast<uint8_t>(checkpoint.encoding);
+    header.post_collision = checkpoint.post_collision;
+    header.tau = checkpoint.tau;
+    header.step = checkpoint.step;
+    header.boundary_count = checkpoint.boundaries.size();
+    header.tracer_count = checkpoint.tracers.size();
+
+    const std::array<const void*, CheckpointHeader::SECTIONS> data = {
+        checkpoint.cell_type.data(), checkpoint.rho.data(), checkpoint.u.data(),
+        checkpoint.boundaries.data(), checkpoint.populations.data(), checkpoint.tracers.data(),
+        checkpoint.tracer_ages.data()};
+    const std::array<size_t, CheckpointHeader::SECTIONS> bytes = {
+        checkpoint.cell_type.size(), checkpoint.rho.size() * sizeof(double),
+        checkpoint.u.size() * sizeof(std::array<double, 2>),
+        checkpoint.boundaries.size() * sizeof(CheckpointBoundary),
+        checkpoint.populations.size(), checkpoint.tracers.size() * sizeof(std::array<float, 2>),
+        checkpoint.tracer_ages.size() * sizeof(float)};
+
+    uint64_t offset = align_section(sizeof(CheckpointHeader));
+    for (size_t section = 0; section < CheckpointHeader::SECTIONS; section++)
+    {
+        header.sections[section] = {offset, bytes[section]};
+        offset = align_section(offset + bytes[section]);
+    }
+
+    const std::string temporary = filename + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file.is_open())
+            throw std::runtime_error("Failed to open checkpoint file " + temporary);
+
+        const char padding[SECTION_ALIGNMENT] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        uint64_t position = sizeof(header);
+        for (size_t section = 0; section < CheckpointHeader::SECTIONS; section++)
+        {
+            file.write(padding, header.sections[section].offset - position);
+            file.write(static_cast<const char*>(data[section]), bytes[section]);
+            position = header.sections[section].offset + bytes[section];
+        }
+
+        if (!file)
+            throw std::runtime_error("Failed to write checkpoint file " + temporary);
+    }
+
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("Failed to rename " + temporary + " to " + filename);
+}
+
+CheckpointWriter::CheckpointWriter() : m_thread(&CheckpointWriter::writer_loop, this) {}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this] { return !m_busy; });
+        m_stop = true;
+    }
+    m_changed.notify_all();
+    m_thread.join();
+
+    if (m_error)
+    {
+        try
+        {
+            std::rethrow_exception(m_error);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "The last checkpoint was not written: " << e.what() << std::endl;
+        }
+    }
+}
+
+void CheckpointWriter::submit(Checkpoint& snapshot, const std::string& filename)
+{
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::swap(m_pending, snapshot);
+        m_filename = filename;
+        m_busy = true;
+    }
+    m_changed.notify_all();
+}
+
+void CheckpointWriter::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this] { return !m_busy; });
+    if (m_error)
+        std::rethrow_exception(std::exchange(m_error, nullptr));
+}
+
+void CheckpointWriter::writer_loop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_changed.wait(lock, [this] { return m_stop || m_busy; });
+        if (m_stop) return;
+
+        // The snapshot is left alone by submit() until the write is done
+        lock.unlock();
+        std::exception_ptr error;
+        try
+        {
+            write_checkpoint(m_pending, m_filename);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        m_error = error;
+        m_busy = false;
+        m_changed.notify_all();
+    }
+}
+
+CheckpointFile::CheckpointFile(const std::string& filename) : m_file(filename)
+{
+    if (m_file.size() < sizeof(CheckpointHeader))
+        throw std::runtime_error(filename + " is not a checkpoint file");
+    std::memcpy(&m_header, m_file.data(), sizeof(CheckpointHeader));
+
+    if (std::memcmp(m_header.magic, CheckpointHeader::MAGIC, sizeof(m_header.magic)) != 0)
+        throw std::runtime_error(filename + " is not a checkpoint file");
+    if (m_header.version != CheckpointHeader::VERSION || m_header.header_bytes != sizeof(CheckpointHeader))
+        throw std::runtime_error("Unsupported checkpoint version " + std::to_string(m_header.version)
+                                 + " in " + filename);
+    if (m_header.encoding > static_cast<uint8_t>(PopulationEncoding::F32_DEVIATIONS))
+        throw std::runtime_error("Unknown population encoding in " + filename);
+
+    const uint64_t total_size = m_header.width * m_header.height;
+    const std::array<uint64_t, CheckpointHeader::SECTIONS> bytes = {
+        total_size, total_size * sizeof(double), total_size * sizeof(std::array<double, 2>),
+        m_header.boundary_count * sizeof(CheckpointBoundary),
+        9 * total_size * storage_bytes(static_cast<PopulationEncoding>(m_header.encoding)),
+        m_header.tracer_count * sizeof(std::array<float, 2>), m_header.tracer_count * sizeof(float)};
+
+    for (size_t section = 0; section < CheckpointHeader::SECTIONS; section++)
+    {
+        const CheckpointHeader::Extent& extent = m_header.sections[section];
+        if (extent.bytes != bytes[section] || extent.offset % SECTION_ALIGNMENT != 0
+            || extent.offset > m_file.size() || extent.bytes > m_file.size() - extent.offset)
+            throw std::runtime_error("Corrupt or truncated checkpoint file " + filename);
+    }
+}
+
+LBM<2>::LBMParams CheckpointFile::lbm_params() const
+{
+    LBM<2>::LBMParams params;
+    params.dimensions = {m_header.width, m_header.height};
+    params.is_periodic = {m_header.periodic_x != 0, m_header.periodic_y != 0};
+    params.tau = m_header.tau;
+    return params;
+}
+
+D2Q9InitialConditions CheckpointFile::initial_conditions() const
+{
+    const size_t total_size = m_header.width * m_header.height;
+    const uint8_t* cell_type = section<uint8_t>(CheckpointHeader::CELL_TYPES);
+    const double* rho = section<double>(CheckpointHeader::DENSITY);
+    const auto* u = section<std::array<double, 2>>(CheckpointHeader::VELOCITY);
+
+    D2Q9InitialConditions initials;
+    initials.cell_type.resize(total_size);
+    for (size_t idx = 0; idx < total_size; idx++)
+    {
+        if (cell_type[idx] > CellType::OUTFLOW)
+            throw std::runtime_error("Corrupt cell types in checkpoint file " + m_file.filename());
+        initials.cell_type[idx] = static_cast<CellType>(cell_type[idx]);
+    }
+    initials.initial_rho.assign(rho, rho + total_size);
+    initials.initial_u.assign(u, u + total_size);
+
+    // The lattice takes the prescribed conditions from the initial fields
+    const CheckpointBoundary* boundaries = section<CheckpointBoundary>(CheckpointHeader::BOUNDARIES);
+    for (size_t i = 0; i < m_header.boundary_count; i++)
+    {
+        if (boundaries[i].idx >= total_size)
+            throw std::runtime_error("Corrupt boundary conditions in checkpoint file " + m_file.filename());
+        initials.initial_rho[boundaries[i].idx] = boundaries[i].rho;
+        initials.initial_u[boundaries[i].idx] = boundaries[i].u;
+    }
+    return initials;
+}
+
+std::vector<std::array<float, 2>> CheckpointFile::tracers() const
+{
+    const auto* tracers = section<std::array<float, 2>>(CheckpointHeader::TRACERS);
+    return {tracers, tracers + m_header.tracer_count};
+}
+
+std::vector<float> CheckpointFile::tracer_ages() const
+{
+    const float* ages = section<float>(CheckpointHeader::TRACER_AGES);
+    return {ages, ages + m_header.tracer_count};
+}
+
+// The populations as another precision stores them
+template <typename From, typename To>
+static void convert_populations(const char* data, size_t total_size,
+                                std::vector<typename D2Q9<To>::StoredState>& converted)
+{
+    using ToScalar = typename D2Q9<To>::Scalar;
+    const auto* f = reinterpret_cast<const typename D2Q9<From>::StoredState*>(data);
+
+    converted.resize(total_size);
+    for (size_t idx = 0; idx < total_size; idx++)
+    {
+        const auto state = D2Q9<From>::load_state(f[idx]);
+        typename D2Q9<To>::CellState cell;
+        for (size_t dir = 0; dir < 9; dir++)
+            cell[dir] = static_cast<ToScalar>(state[dir]);
+        converted[idx] = D2Q9<To>::store_state(cell);
+    }
+}
+
+template <typename Precision>
+void CheckpointFile::restore(D2Q9<Precision>& lbm) const
+{
+    using StoredState = typename D2Q9<Precision>::StoredState;
+    const auto& dims = lbm.get_dimensions();
+    if (dims[0] != m_header.width || dims[1] != m_header.height)
+        throw std::runtime_error("The checkpoint is for a " + std::to_string(m_header.width) + "x"
+                                 + std::to_string(m_header.height) + " grid");
+
+    const size_t total_size = lbm.get_total_size();
+    const char* data = section<char>(CheckpointHeader::POPULATIONS);
+    const auto encoding = static_cast<PopulationEncoding>(m_header.encoding);
+
+    std::vector<StoredState> converted;
+    const StoredState* f = reinterpret_cast<const StoredState*>(data);
+    if (encoding != population_encoding<Precision>())
+    {
+        if (encoding == PopulationEncoding::F64)
+            convert_populations<double, Precision>(data, total_size, converted);
+        else if (encoding == PopulationEncoding::F32)
+            convert_populations<float, Precision>(data, total_size, converted);
+        else
+            convert_populations<MixedPrecision, Precision>(data, total_size, converted);
+        f = converted.data();
+    }
+
+    lbm.set_state(f, m_header.post_collision != 0,
+                  section<double>(CheckpointHeader::DENSITY),
+                  section<std::array<double, 2>>(CheckpointHeader::VELOCITY));
+}
+
+template void capture_checkpoint<double>(const D2Q9<double>&, uint64_t,
+                                         const std::vector<std::array<float, 2>>&, const std::vector<float>&, Checkpoint&);
+template void capture_checkpoint<float>(const D2Q9<float>&, uint64_t,
+                                        const std::vector<std::array<float, 2>>&, const std::vector<float>&, Checkpoint&);
+template void capture_checkpoint<MixedPrecision>(const D2Q9<MixedPrecision>&, uint64_t,
+                                                 const std::vector<std::array<float, 2>>&, const std::vector<float>&, Checkpoint&);
+template void CheckpointFile::restore<double>(D2Q9<double>&) const;
+template void CheckpointFile::restore<float>(D2Q9<float>&) const;
+template void CheckpointFile::restore<MixedPrecision>(D2Q9<MixedPrecision>&) const;
@@ -0,0 +1,301 @@
+#include "cli.h"
+#include "tracers.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+Args parse_args(int argc, char** argv)
+{
+    Args args;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        std::cout << arg << std::endl;
+        if (arg == "--input" && i + 1 < argc)
+            args.input_file = argv[++i];
+        else if (arg == "--output" && i + 1 < argc)
+            args.output_file = argv[++i];
+        else if (arg == "--record-queue" && i + 1 < argc)
+            args.recording.queue_frames = std::stoul(argv[++i]);
+        else if (arg == "--record-policy" && i + 1 < argc)
+        {
+            try
+            {
+                args.recording.policy = parse_frame_policy(argv[++i]);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << ". Blocking on a full queue." << std::endl;
+            }
+        }
+        else if (arg == "--kernel" && i + 1 < argc)
+        {
+            std::string kernel = argv[++i];
+            if (kernel == "fused")
+                args.kernel = D2Q9Kernel::FUSED;
+            else if (kernel == "soa")
+                args.kernel = D2Q9Kernel::SOA;
+            else if (kernel == "sparse")
+                args.kernel = D2Q9Kernel::SPARSE;
+            else if (kernel == "in-place")
+                args.kernel = D2Q9Kernel::IN_PLACE;
+            else if (kernel == "tiled")
+                args.kernel = D2Q9Kernel::TILED;
+            else if (kernel == "four-pass")
+                args.kernel = D2Q9Kernel::FOUR_PASS;
+            else
+                std::cerr << "Unknown kernel: " << kernel << ". Using the four-pass kernel." << std::endl;
+        }
+        else if (arg == "--tile" && i + 1 < argc)
+        {
+            std::string tile = argv[++i];
+            const size_t x_pos = tile.find('x');
+            if (x_pos == std::string::npos)
+                std::cerr << "The tile size should read WxH, got " << tile << std::endl;
+            else
+            {
+                args.tiling.width = std::stoul(tile.substr(0, x_pos));
+                args.tiling.height = std::stoul(tile.substr(x_pos + 1));
+            }
+        }
+        else if (arg == "--tile-steps" && i + 1 < argc)
+            args.tiling.time_steps = std::stoul(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            args.threads = std::stoul(argv[++i]);
+        else if (arg == "--bind" && i + 1 < argc)
+        {
+            try
+            {
+                args.binding = parse_thread_binding(argv[++i]);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << ". The workers are not pinned." << std::endl;
+            }
+        }
+        else if (arg == "--field-texture" && i + 1 < argc)
+        {
+            try
+            {
+                args.field_texture = parse_field_texture(argv[++i]);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << ". Uploading the field as float32." << std::endl;
+            }
+        }
+        else if (arg == "--field-pooling" && i + 1 < argc)
+        {
+            try
+            {
+                args.field_pooling = parse_field_pooling(argv[++i]);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << ". Pooling the field by the mean." << std::endl;
+            }
+        }
+        else if (arg == "--gpu-observables")
+            args.gpu_observables = true;
+        else if (arg == "--tracers" && i + 1 < argc)
+            args.tracers = std::stoul(argv[++i]);
+        else if (arg == "--tracers-integrator" && i + 1 < argc)
+        {
+            try
+            {
+                args.tracer_integrator = parse_tracer_integrator(argv[++i]);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << ". Using rk2." << std::endl;
+            }
+        }
+        else if (arg == "--tracers-dt" && i + 1 < argc)
+            args.tracer_time_step = std::stof(argv[++i]);
+        else if (arg == "--tracers-substeps" && i + 1 < argc)
+            args.tracer_substeps = std::max<size_t>(std::stoul(argv[++i]), 1);
+        else if (arg == "--tracers-color-by" && i + 1 < argc)
+        {
+            try
+            {
+                args.tracer_coloring = parse_tracer_coloring(argv[++i]);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << ". Using the color of the input file." << std::endl;
+            }
+        }
+        else if (arg == "--tracers-color-range" && i + 1 < argc)
+            args.tracer_coloring_range = std::stof(argv[++i]);
+        else if (arg == "--ranks" && i + 1 < argc)
+            args.ranks = std::stoul(argv[++i]);
+        else if (arg == "--transport" && i + 1 < argc)
+        {
+            std::string transport = argv[++i];
+            if (transport == "local" || transport == "mpi")
+                args.transport = transport;
+            else
+                std::cerr << "Unknown transport: " << transport << ". Using the local transport." << std::endl;
+        }
+        else if (arg == "--precision" && i + 1 < argc)
+            args.precision = argv[++i];
+        else if (arg == "--headless")
+            args.headless = true;
+        else if (arg == "--steps" && i + 1 < argc)
+            args.steps = std::stoul(argv[++i]);
+        else if (arg == "--diagnostics-every" && i + 1 < argc)
+            args.diagnostics_every = std::stoul(argv[++i]);
+        else if (arg == "--dump-every" && i + 1 < argc)
+            args.dump_every = std::stoul(argv[++i]);
+        else if (arg == "--dump-prefix" && i + 1 < argc)
+            args.dump_prefix = argv[++i];
+        else if (arg == "--checkpoint-every" && i + 1 < argc)
+            args.checkpoint_every = std::stoul(argv[++i]);
+        else if (arg == "--checkpoint-prefix" && i + 1 < argc)
+            args.checkpoint_prefix = argv[++i];
+        else if (arg == "--restart" && i + 1 < argc)
+            args.restart_file = argv[++i];
+        else if (arg == "--fields-every" && i + 1 < argc)
+            args.fields.every = std::stoul(argv[++i]);
+        else if (arg == "--fields-prefix" && i + 1 < argc)
+            args.fields.prefix = argv[++i];
+        else if (arg == "--fields" && i + 1 < argc)
+        {
+            std::istringstream quantities(argv[++i]);
+            args.fields.quantities.clear();
+            for (std::string quantity; std::getline(quantities, quantity, ','); )
+                args.fields.quantities.push_back(quantity);
+        }
+        else if (arg == "--fields-type" && i + 1 < argc)
+        {
+            try
+            {
+                args.fields.type = parse_field_type(argv[++i]);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << e.what() << ". Writing float32 fields." << std::endl;
+            }
+        }
+        else if (arg == "--fields-region" && i + 1 < argc)
+        {
+            std::string region = argv[++i];
+            FieldRegion& field_region = args.fields.region;
+            char comma[3];
+            std::istringstream values(region);
+            if (!(values >> field_region.x >> comma[0] >> field_region.y >> comma[1] >> field_region.width >> comma[2] >> field_region.height)
+                || comma[0] != ',' || comma[1] != ',' || comma[2] != ',')
+            {
+                std::cerr << "The field output region should read X,Y,W,H, got " << region << std::endl;
+                field_region = {};
+            }
+        }
+        else if (arg == "--profile")
+            args.profile = true;
+        else if (arg == "--profile-every" && i + 1 < argc)
+        {
+            args.profile = true;
+            args.profile_every = std::stoul(argv[++i]);
+        }
+        else if (arg == "--profile-trace" && i + 1 < argc)
+        {
+            args.profile = true;
+            args.profile_trace = argv[++i];
+        }
+        else
+            std::cerr << "Unsupported command line argument: " << arg << std::endl; 
+    }
+    return args;
+}
+
+void setup_profiler(const Args& args)
+{
+    if (!args.profile) return;
+#ifdef LBM_DISABLE_PROFILING
+    std::cerr << "Profiling was compiled out (LBM_DISABLE_PROFILING); no timings will be collected." << std::endl;
+#endif
+    Profiler::instance().enable(args.profile_every, args.profile_trace.value_or(""));
+}
+
+void report_kernel_fallback(const Args& args, D2Q9Kernel kernel)
+{
+    if (args.kernel == D2Q9Kernel::IN_PLACE && kernel == D2Q9Kernel::FUSED)
+        std::cerr << "The in-place kernel needs at least 2 cells along each axis. Using the fused kernel." << std::endl;
+}
+
+SimulationSetup load_setup(const Args& args)
+{
+    SimulationSetup setup{};
+
+    if (args.input_file)
+    {
+        std::cout << "Loading setup from " << *args.input_file << std::endl;
+        if (input_file_version(*args.input_file) == 1)
+            load_from_binary(*args.input_file, 
+                              setup.lbm_params, 
+                              setup.initials, 
+                              setup.visual_params, 
+                              setup.quants_params, 
+                              setup.tracers_params);
+        else
+            setup.mapped_input = map_from_binary(*args.input_file,
+                                                 setup.lbm_params,
+                                                 setup.mapped_initials,
+                                                 setup.visual_params,
+                                                 setup.quants_params,
+                                                 setup.tracers_params);
+    }
+    else
+    {
+        std::cout << "No input file provided. Using a sample setup." << std::endl;
+
+        setup.lbm_params = {{200, 80}, {false, true}, 0.6}; // Grid dimensions, periodicity, tau
+        setup.initials = sample_d2q9(setup.lbm_params);
+        setup.visual_params = {800, 320, 1};
+        setup.quants_params = { {"speed", 0.0f, 0.2f}, {"vorticity", 0.5f, 0.05f} };
+    }
+
+    if (args.restart_file)
+    {
+        std::cout << "Restarting from " << *args.restart_file << std::endl;
+        setup.restart = std::make_shared<const CheckpointFile>(*args.restart_file);
+        const ExecutionParams execution = setup.lbm_params.execution;
+        setup.lbm_params = setup.restart->lbm_params();
+        setup.lbm_params.execution = execution;
+        setup.initials = setup.restart->initial_conditions();
+        setup.mapped_input.reset();
+    }
+
+    if (args.threads)
+        setup.lbm_params.execution.threads = *args.threads;
+    if (args.binding)
+        setup.lbm_params.execution.binding = *args.binding;
+    if (args.field_texture)
+        setup.visual_params.field_texture = *args.field_texture;
+    if (args.field_pooling)
+        setup.visual_params.field_pooling = *args.field_pooling;
+    if (args.gpu_observables)
+        setup.visual_params.gpu_observables = true;
+    if (args.tracers)
+        setup.tracers_params.random_initial = *args.tracers;
+    if (args.tracer_integrator)
+        setup.tracers_params.integrator = *args.tracer_integrator;
+    if (args.tracer_time_step)
+        setup.tracers_params.time_step = *args.tracer_time_step;
+    if (args.tracer_substeps)
+        setup.tracers_params.substeps = *args.tracer_substeps;
+    if (args.tracer_coloring)
+        setup.tracers_params.coloring = *args.tracer_coloring;
+    if (args.tracer_coloring_range)
+        setup.tracers_params.coloring_range = *args.tracer_coloring_range;
+    return setup;
+}
+
+std::string checkpoint_filename(const Args& args, size_t step)
+{
+    std::ostringstream filename;
+    filename << args.checkpoint_prefix << "_" << std::setw(8) << std::setfill('0') << step << ".ckpt";
+    return filename.str();
+}
@@ -1,17 +1,39 @@
 #include "d2q9.h"
+#include "d2q9_simd.h"
 #include <stdexcept>
 #include <numeric>
 #include <execution>
 #include <iterator>
 #include <utility>
 #include <iostream>
+#include <limits>
+#include <unordered_map>
 
-D2Q9::D2Q9(size_t width, size_t height, double tau): 
-    LBM<2>(LBMParams{ {width, height}, {false, false}, tau })
-{    
+D2Q9InitialView::D2Q9InitialView(const D2Q9InitialConditions& initials):
+    size(initials.cell_type.size()),
+    cell_type(initials.cell_type.data()),
+    initial_rho(initials.initial_rho.data()),
+    initial_u(initials.initial_u.data()),
+    solid_corners(initials.solid_corners)
+{
+    if (initials.initial_rho.size() != size)
+    {
+        throw std::runtime_error("Wrong size of the initial conditions data: density");
+    }
+
+    if (initials.initial_u.size() != size)
+    {
+        throw std::runtime_error("Wrong size of the initial conditions data: velocity");
+    }
+}
+
+template <typename Precision>
+D2Q9<Precision>::D2Q9(size_t width, size_t height, double tau):
+    Base(LBMParams{ {width, height}, {false, false}, tau })
+{
     // Create a static, uniform density state for testing purposes
     m_f.resize(m_total_size);
-    m_f_new.resize(m_total_size);
+    m_f_new.assign(m_total_size, StoredState{});
 
     m_cell_type.resize(m_total_size);
     std::fill(m_cell_type.begin(), m_cell_type.end(), CellType::FLUID);
@@ -23,42 +45,60 @@ D2Q9::D2Q9(size_t width, size_t height, double tau):
     std::fill(m_u.begin(), m_u.end(), VelocityVec{0.0, 0.0});
 
     for (size_t idx = 0; idx < m_total_size; idx++)
-        m_f[idx] = compute_equilibrium(m_rho[idx], m_u[idx]);
+        m_f[idx] = store_state(compute_equilibrium(m_rho[idx], m_u[idx]));
 }
 
-D2Q9::D2Q9(const LBMParams& lbm_params, 
-           const InitialConditions& initials): LBM<2>(lbm_params)
-{  
-    if (m_total_size != initials.cell_type.size())
+template <typename Precision>
+D2Q9<Precision>::D2Q9(const LBMParams& lbm_params,
+                      const InitialConditions& initials,
+                      Kernel kernel,
+                      const D2Q9Tiling& tiling): Base(lbm_params), m_kernel(kernel), m_tiling(tiling)
+{
+    if (m_total_size != initials.size)
     {
-        throw std::runtime_error("Wrong size of the initial conditions data: cell type");
+        throw std::runtime_error("Wrong size of the initial conditions data");
     }
 
-    if (m_total_size != initials.initial_rho.size())
+    if (m_kernel == Kernel::SOA && !SOA_SUPPORTED)
     {
-        throw std::runtime_error("Wrong size of the initial conditions data: density");
+        throw std::runtime_error("The SoA kernel is only available in double precision");
     }
 
-    if (m_total_size != initials.initial_u.size())
+    if (m_kernel == Kernel::TILED && (!m_tiling.width || !m_tiling.height || !m_tiling.time_steps))
     {
-        throw std::runtime_error("Wrong size of the initial conditions data: velocity");
+        throw std::runtime_error("The tile size and the number of steps per tile must be positive");
     }
 
-    m_cell_type = initials.cell_type;
-    m_rho = initials.initial_rho;
-    m_u = initials.initial_u;
+    // On a single row or column, a cell is its own neighbor along the other axis: the slots of
+    // its neighbor step and of its ghost links alias each other within a step.
+    // The caller tells from get_kernel() that the fused kernel runs instead
+    if (m_kernel == Kernel::IN_PLACE && (m_dimensions[0] < 2 || m_dimensions[1] < 2))
+        m_kernel = Kernel::FUSED;
 
+    m_cell_type.assign(initials.cell_type, initials.cell_type + m_total_size);
+    m_rho.resize(m_total_size);
+    m_u.resize(m_total_size);
     m_f.resize(m_total_size);
     m_f_new.resize(m_total_size);
 
-    m_obstacle_mask.resize(m_total_size, 0.0f);
+    // The first touch of the per-cell arrays, by the workers that will sweep them
+    for_each_row_band([this, &initials](size_t begin, size_t end)
+                      {
+                            for (size_t idx = begin; idx < end; idx++)
+                            {
+                                m_rho[idx] = static_cast<Scalar>(initials.initial_rho[idx]);
+                                m_u[idx] = {static_cast<Scalar>(initials.initial_u[idx][0]),
+                                            static_cast<Scalar>(initials.initial_u[idx][1])};
+                                m_f[idx] = StoredState{};
+                                m_f_new[idx] = StoredState{};
+                            }
+                      });
 
-    m_indices.resize(m_total_size);
-    std::iota(m_indices.begin(), m_indices.end(), 0);
+    m_obstacle_mask.resize(m_total_size, 0.0f);
 
     // A simplification that helps to handle boundaries: 
     // if both directions are non-periodic, mark the corners as solid.
-    if (!m_is_periodic[0] && !m_is_periodic[1])
+    if (initials.solid_corners && !m_is_periodic[0] && !m_is_periodic[1])
     {
         m_cell_type[coords_to_index(0, 0)] = CellType::SOLID;
         m_cell_type[coords_to_index(m_dimensions[0] - 1, 0)] = CellType::SOLID;
@@ -66,211 +106,1409 @@ D2Q9::D2Q9(const LBMParams& lbm_params,
         m_cell_type[coords_to_index(m_dimensions[0] - 1, m_dimensions[1] - 1)] = CellType::SOLID;
     }
 
-    std::for_each(m_indices.begin(), m_indices.end(),
-                  [this](size_t idx)
-                  {
-                        switch(m_cell_type[idx])
-                        {
-                            case CellType::FLUID:
-                                m_fluid_cells.push_back(idx);
-                                m_f[idx] = compute_equilibrium(m_rho[idx], m_u[idx]);
-                                break;
-                            case CellType::SOLID:
-                                m_solid_cells.push_back(idx);
-                                m_rho[idx] = 1.0; // A reference density value
-                                m_u[idx] = {0.0, 0.0};
-                                m_obstacle_mask[idx] = 1.0f;
-                                break;
-                            case CellType::INFLOW:
-                                m_inflow_cells.push_back(idx);
-                                m_inflow_conditions[idx] = {m_u[idx], m_rho[idx]};
-                                m_f[idx] = compute_equilibrium(m_rho[idx], m_u[idx]);
-                                break;
-                            case CellType::OUTFLOW:
-                                m_outflow_cells.push_back(idx);
-                                m_outflow_conditions[idx] = m_rho[idx];
-                                m_f[idx] = compute_equilibrium(m_rho[idx], m_u[idx]);
-                        }
-                  });
-    
-}
-
-D2Q9::CellState D2Q9::compute_equilibrium(double rho, const VelocityVec& u)
+    for (size_t idx = 0; idx < m_total_size; idx++)
+    {
+        switch(m_cell_type[idx])
+        {
+            case CellType::FLUID:
+                m_fluid_cells.push_back(idx);
+                m_f[idx] = store_state(compute_equilibrium(m_rho[idx], m_u[idx]));
+                break;
+            case CellType::SOLID:
+                m_solid_cells.push_back(idx);
+                m_rho[idx] = 1.0; // A reference density value
+                m_u[idx] = {0.0, 0.0};
+                m_obstacle_mask[idx] = 1.0f;
+                break;
+            case CellType::INFLOW:
+                m_inflow_cells.push_back(idx);
+                m_f[idx] = store_state(compute_equilibrium(m_rho[idx], m_u[idx]));
+                break;
+            case CellType::OUTFLOW:
+                m_outflow_cells.push_back(idx);
+                m_f[idx] = store_state(compute_equilibrium(m_rho[idx], m_u[idx]));
+        }
+    }
+
+    init_boundaries();
+
+    if (m_kernel == Kernel::SOA)
+        init_soa();
+    else if (m_kernel == Kernel::SPARSE)
+        init_sparse();
+    else if (m_kernel == Kernel::IN_PLACE)
+        init_in_place();
+    else
+        init_streaming();
+
+    if (m_kernel == Kernel::TILED)
+        init_tiled();
+}
+
+template <typename Precision>
+void D2Q9<Precision>::init_streaming()
+{
+    const size_t nx = m_dimensions[0];
+    const size_t ny = m_dimensions[1];
+
+    for (size_t dir = 0; dir < 9; dir++)
+        m_stream_offsets[dir] = m_directions[dir][0] + m_directions[dir][1] * static_cast<ptrdiff_t>(nx);
+
+    auto is_bulk = [&](size_t x, size_t y)
+    {
+        if (x == 0 || y == 0 || x == nx - 1 || y == ny - 1) return false;
+        const size_t idx = y * nx + x;
+        for (size_t dir = 0; dir < 9; dir++)
+            if (m_cell_type[idx - m_stream_offsets[dir]] == CellType::SOLID) return false;
+        return true;
+    };
+
+    for (size_t y = 0; y < ny; y++)
+    {
+        for (size_t x = 0; x < nx; x++)
+        {
+            const size_t idx = y * nx + x;
+            if (m_cell_type[idx] == CellType::SOLID) continue;
+
+            if (is_bulk(x, y))
+            {
+                // Extend the current span or open a new one
+                if (!m_bulk_spans.empty() && m_bulk_spans.back().end == idx)
+                    m_bulk_spans.back().end++;
+                else
+                    m_bulk_spans.push_back({idx, idx + 1});
+                continue;
+            }
+
+            LinkedCell cell{idx, {}};
+            for (size_t dir = 0; dir < 9; dir++)
+            {
+                const size_t src_idx = get_neighbor_index(idx, m_directions[dir]);
+                //Bounce off solid cells
+                if (m_cell_type[src_idx] == CellType::SOLID)
+                    cell.src[dir] = idx * 9 + m_bounce_back_indices[dir];
+                else
+                    cell.src[dir] = src_idx * 9 + dir;
+            }
+            m_linked_cells.push_back(cell);
+        }
+    }
+}
+
+// Sort the inflow/outflow cells into the per-side batches with their prescribed rho/u,
+// so that the boundary pass needs neither lookups nor coordinate checks
+template <typename Precision>
+void D2Q9<Precision>::init_boundaries()
+{
+    auto side_of = [this](size_t idx)
+    {
+        auto [x, y] = index_to_coords(idx);
+        if (!m_is_periodic[0] && x == 0) return WEST;
+        if (!m_is_periodic[0] && x == m_dimensions[0] - 1) return EAST;
+        if (!m_is_periodic[1] && y == 0) return SOUTH;
+        if (!m_is_periodic[1] && y == m_dimensions[1] - 1) return NORTH;
+        return INTERIOR;
+    };
+
+    for (size_t idx : m_inflow_cells)
+        m_boundary_batches[side_of(idx)].push_back({idx, m_rho[idx], m_u[idx]});
+    for (size_t idx : m_outflow_cells)
+        m_boundary_batches[side_of(idx)].push_back({idx, m_rho[idx], VelocityVec{0.0, 0.0}});
+}
+
+// Move the initial cell states and velocities to the structure-of-arrays layout
+template <typename Precision>
+void D2Q9<Precision>::init_soa()
+{
+    for (size_t dir = 0; dir < 9; dir++)
+    {
+        m_f_planes[dir].resize(m_total_size);
+        m_f_planes_new[dir].resize(m_total_size);
+        for (size_t idx = 0; idx < m_total_size; idx++)
+            m_f_planes[dir][idx] = m_f[idx][dir];
+    }
+
+    m_ux.resize(m_total_size);
+    m_uy.resize(m_total_size);
+    m_fluid_mask.resize(m_total_size);
+    for (size_t idx = 0; idx < m_total_size; idx++)
+    {
+        m_ux[idx] = m_u[idx][0];
+        m_uy[idx] = m_u[idx][1];
+        m_fluid_mask[idx] = (m_cell_type[idx] == CellType::FLUID) ? 1.0 : 0.0;
+    }
+
+    for (size_t idx = 0; idx < m_total_size; idx++)
+    {
+        if (m_cell_type[idx] == CellType::SOLID) continue;
+        for (size_t dir = 0; dir < 9; dir++)
+            if (m_cell_type[get_neighbor_index(idx, m_directions[dir])] == CellType::SOLID)
+                m_bounce_back_links.push_back({idx, dir});
+    }
+
+    m_rows.resize(m_dimensions[1]);
+    std::iota(m_rows.begin(), m_rows.end(), 0);
+
+    for (size_t begin = 0; begin < m_total_size; begin += SOA_BLOCK_SIZE)
+        m_blocks.push_back(begin);
+
+    // Release the array-of-structures storage
+    m_f = FieldVector<StoredState>();
+    m_f_new = FieldVector<StoredState>();
+    m_u = FieldVector<VelocityVec>();
+}
+
+template <typename Precision>
+typename D2Q9<Precision>::CellState D2Q9<Precision>::load_state(const StoredState& f_stored)
+{
+    CellState f;
+    for (size_t dir = 0; dir < 9; dir++)
+    {
+        if constexpr (STORES_DEVIATIONS)
+            f[dir] = static_cast<Scalar>(f_stored[dir]) + static_cast<Scalar>(m_weights[dir]);
+        else
+            f[dir] = f_stored[dir];
+    }
+    return f;
+}
+
+template <typename Precision>
+typename D2Q9<Precision>::StoredState D2Q9<Precision>::store_state(const CellState& f)
+{
+    StoredState f_stored;
+    for (size_t dir = 0; dir < 9; dir++)
+    {
+        if constexpr (STORES_DEVIATIONS)
+            f_stored[dir] = static_cast<Storage>(f[dir] - static_cast<Scalar>(m_weights[dir]));
+        else
+            f_stored[dir] = f[dir];
+    }
+    return f_stored;
+}
+
+template <typename Precision>
+typename D2Q9<Precision>::CellState D2Q9<Precision>::compute_equilibrium(Scalar rho, const VelocityVec& u) const
 {
     CellState f_eq;
-    const double usq = u[0] * u[0] + u[1] * u[1];
+    const Scalar usq = u[0] * u[0] + u[1] * u[1];
 
     for (size_t dir = 0; dir < 9; dir++)
     {
-        const double eu = m_directions[dir][0] * u[0] + m_directions[dir][1] * u[1];
-        f_eq[dir] = m_weights[dir] * rho * (1.0 + eu * m_inv_csq 
-                                                + (m_inv_csq * m_inv_csq * (eu * eu) / 2.0) 
-                                                - (m_inv_csq * usq / 2.0));
+        const Scalar eu = m_directions[dir][0] * u[0] + m_directions[dir][1] * u[1];
+        f_eq[dir] = static_cast<Scalar>(m_weights[dir]) * rho * (Scalar(1.0) + eu * m_inv_csq
+                                                + (m_inv_csq * m_inv_csq * (eu * eu) / Scalar(2.0))
+                                                - (m_inv_csq * usq / Scalar(2.0)));
     }
     return f_eq; 
 }
 
-void D2Q9::collide()
+template <typename Precision>
+void D2Q9<Precision>::step()
 {
-    std::for_each(std::execution::par,
-                  m_fluid_cells.begin(), m_fluid_cells.end(),
-                  [this](size_t idx)
-                  {
-                        CellState f_eq = compute_equilibrium(m_rho[idx], m_u[idx]);
-                        for (size_t dir = 0; dir < 9; dir++) 
-                             m_f[idx][dir] -= m_inv_tau * (m_f[idx][dir] - f_eq[dir]);
-                  });
+    if (m_kernel == Kernel::FUSED)
+    {
+        PROFILE_SCOPE("lbm.fused");
+        fused_step();
+    }
+    else if (m_kernel == Kernel::IN_PLACE)
+    {
+        PROFILE_SCOPE("lbm.in_place");
+        in_place_step();
+    }
+    else if (m_kernel == Kernel::TILED)
+    {
+        PROFILE_SCOPE("lbm.tiled");
+        tiled_step();
+    }
+    else
+        Base::step();
 }
 
-void D2Q9::stream()
+// Temporal blocks of m_tiling.time_steps steps, then the remainder
+template <typename Precision>
+void D2Q9<Precision>::advance(size_t steps)
 {
-    auto process_cell = [this](size_t dest_idx) 
+    if (m_kernel != Kernel::TILED || m_tiling.time_steps == 1)
+        return Base::advance(steps);
+
+    while (steps >= 2)
     {
-        if (m_cell_type[dest_idx] == CellType::SOLID) return;
-        size_t src_idx, opposite_dir;
+        PROFILE_SCOPE("lbm.tiled_block");
+        const size_t block = std::min(steps, m_tiling.time_steps);
+        tiled_block(block);
+        steps -= block;
+    }
+    if (steps)
+        step();
+}
 
-        for (size_t dir = 0; dir < 9; dir++) 
+template <typename Precision>
+void D2Q9<Precision>::step_timed(typename Base::PhaseTimes& times)
+{
+    if (m_kernel == Kernel::FUSED || m_kernel == Kernel::IN_PLACE || m_kernel == Kernel::TILED)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (m_kernel == Kernel::FUSED)
+            fused_step();
+        else if (m_kernel == Kernel::IN_PLACE)
+            in_place_step();
+        else
+            tiled_step();
+        times.fused += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    else
+        Base::step_timed(times);
+}
+
+// Compact the non-solid cells and link each of them to its streaming sources
+template <typename Precision>
+void D2Q9<Precision>::init_sparse()
+{
+    m_sparse_cells = m_fluid_cells;
+    m_sparse_fluid_count = m_fluid_cells.size();
+    m_sparse_cells.insert(m_sparse_cells.end(), m_inflow_cells.begin(), m_inflow_cells.end());
+    m_sparse_cells.insert(m_sparse_cells.end(), m_outflow_cells.begin(), m_outflow_cells.end());
+    std::sort(m_sparse_cells.begin() + m_sparse_fluid_count, m_sparse_cells.end());
+
+    if (9 * m_sparse_cells.size() > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Too many non-solid cells for the sparse kernel");
+
+    // The compact index of every grid cell, only needed while linking
+    std::vector<uint32_t> compact_index(m_total_size, 0);
+    for (size_t c = 0; c < m_sparse_cells.size(); c++)
+        compact_index[m_sparse_cells[c]] = static_cast<uint32_t>(c);
+
+    m_sparse_links.resize(m_sparse_cells.size());
+    for (size_t c = 0; c < m_sparse_cells.size(); c++)
+    {
+        const size_t idx = m_sparse_cells[c];
+        for (size_t dir = 0; dir < 9; dir++)
         {
-            src_idx = get_neighbor_index(dest_idx, m_directions[dir]);
+            const size_t src_idx = get_neighbor_index(idx, m_directions[dir]);
             //Bounce off solid cells
-            if (m_cell_type[src_idx] == CellType::SOLID)                                        
-            {
-                opposite_dir = m_bounce_back_indices[dir];
-                m_f_new[dest_idx][dir] = m_f[dest_idx][opposite_dir];
-            }
-            else                    
+            if (m_cell_type[src_idx] == CellType::SOLID)
+                m_sparse_links[c][dir] = static_cast<uint32_t>(c * 9 + m_bounce_back_indices[dir]);
+            else
+                m_sparse_links[c][dir] = compact_index[src_idx] * 9 + static_cast<uint32_t>(dir);
+        }
+    }
+
+    for (auto& batch : m_boundary_batches)
+        for (BoundaryCell& cell : batch)
+            cell.idx = compact_index[cell.idx];
+
+    for (size_t begin = 0; begin < m_sparse_cells.size(); begin += SPARSE_BLOCK_SIZE)
+        m_sparse_blocks.push_back(begin);
+
+    // The workers first touch the compact arrays in the blocks they sweep
+    FieldVector<StoredState> f_compact(m_sparse_cells.size());
+    m_f_new = FieldVector<StoredState>(m_sparse_cells.size());
+    parallel_for_each(m_sparse_blocks,
+                      [this, &f_compact](size_t begin)
+                      {
+                            const size_t end = std::min(begin + SPARSE_BLOCK_SIZE, m_sparse_cells.size());
+                            for (size_t c = begin; c < end; c++)
+                            {
+                                f_compact[c] = m_f[m_sparse_cells[c]];
+                                m_f_new[c] = StoredState{};
+                            }
+                      });
+    m_f = std::move(f_compact);
+}
+
+template <typename Precision>
+void D2Q9<Precision>::init_in_place()
+{
+    const size_t nx = m_dimensions[0];
+    const size_t ny = m_dimensions[1];
+
+    for (size_t dir = 0; dir < 9; dir++)
+        m_stream_offsets[dir] = m_directions[dir][0] + m_directions[dir][1] * static_cast<ptrdiff_t>(nx);
+
+    auto crosses_edge = [&](size_t idx, size_t dir)
+    {
+        const auto [x, y] = index_to_coords(idx);
+        const ptrdiff_t src_x = static_cast<ptrdiff_t>(x) - m_directions[dir][0];
+        const ptrdiff_t src_y = static_cast<ptrdiff_t>(y) - m_directions[dir][1];
+        return (!m_is_periodic[0] && (src_x < 0 || src_x >= static_cast<ptrdiff_t>(nx)))
+            || (!m_is_periodic[1] && (src_y < 0 || src_y >= static_cast<ptrdiff_t>(ny)));
+    };
+
+    // Number the ghost slots, which follow the grid cells in m_f
+    std::unordered_map<size_t, size_t> ghosts; // cell * 9 + dir -> flat offset
+    size_t ghost = 9 * m_total_size;
+    for (size_t idx = 0; idx < m_total_size; idx++)
+    {
+        if (m_cell_type[idx] == CellType::SOLID) continue;
+        for (size_t dir = 0; dir < 9; dir++)
+        {
+            const size_t src_idx = get_neighbor_index(idx, m_directions[dir]);
+            if (m_cell_type[src_idx] != CellType::SOLID && crosses_edge(idx, dir))
             {
-                m_f_new[dest_idx][dir] = m_f[src_idx][dir];
+                m_ghost_links.push_back({ghost, src_idx * 9 + dir, 0});
+                ghosts[idx * 9 + dir] = ghost++;
             }
         }
-       // std::cout << m_f_new[dest_idx][2] << std::endl;
+    }
+
+    // The slot the neighbor step pulls F_i(x - e_i) from and pushes F'_opp(i)(x) to
+    auto neighbor_addr = [&](size_t idx, size_t dir)
+    {
+        const size_t src_idx = get_neighbor_index(idx, m_directions[dir]);
+        //Bounce off solid cells
+        if (m_cell_type[src_idx] == CellType::SOLID)
+            return idx * 9 + m_bounce_back_indices[dir];
+        auto it = ghosts.find(idx * 9 + dir);
+        return (it != ghosts.end()) ? it->second : src_idx * 9 + dir;
     };
 
-    std::for_each(std::execution::par,
-                  m_indices.begin(), m_indices.end(),
-                  process_cell);
+    auto make_cell = [&](size_t idx)
+    {
+        InPlaceCell cell{idx, {}, {}};
+        for (size_t dir = 0; dir < 9; dir++)
+        {
+            auto it = ghosts.find(idx * 9 + dir);
+            cell.neighbor_addr[dir] = neighbor_addr(idx, dir);
+            cell.local_addr[dir] = (it != ghosts.end()) ? it->second : idx * 9 + m_bounce_back_indices[dir];
+        }
+        return cell;
+    };
 
-    std::swap(m_f, m_f_new);
+    // In the swapped layout, F_i of the clamped source cell is where that cell pushed it
+    for (GhostLink& link : m_ghost_links)
+    {
+        const size_t src_idx = link.natural_src / 9;
+        const size_t dir = link.natural_src % 9;
+        link.swapped_src = neighbor_addr(src_idx, m_bounce_back_indices[dir]);
+    }
+
+    auto is_bulk = [&](size_t x, size_t y)
+    {
+        if (x == 0 || y == 0 || x == nx - 1 || y == ny - 1) return false;
+        const size_t idx = y * nx + x;
+        for (size_t dir = 0; dir < 9; dir++)
+            if (m_cell_type[idx - m_stream_offsets[dir]] == CellType::SOLID) return false;
+        return true;
+    };
+
+    for (size_t y = 0; y < ny; y++)
+    {
+        for (size_t x = 0; x < nx; x++)
+        {
+            const size_t idx = y * nx + x;
+            if (m_cell_type[idx] != CellType::FLUID) continue;
+
+            if (!is_bulk(x, y))
+                m_in_place_cells.push_back(make_cell(idx));
+            else if (!m_bulk_spans.empty() && m_bulk_spans.back().end == idx)
+                m_bulk_spans.back().end++;
+            else
+                m_bulk_spans.push_back({idx, idx + 1});
+        }
+    }
+
+    for (size_t side = 0; side < BOUNDARY_SIDES; side++)
+        for (const BoundaryCell& cell : m_boundary_batches[side])
+            m_in_place_boundary[side].push_back(make_cell(cell.idx));
+
+    // Append the ghost slots without growing past the final size
+    m_f_new = FieldVector<StoredState>();
+    FieldVector<StoredState> f;
+    f.reserve(m_total_size + (m_ghost_links.size() + 8) / 9);
+    f.resize(f.capacity());
+    for_each_row_band([this, &f](size_t begin, size_t end)
+                      {
+                            std::copy(m_f.begin() + begin, m_f.begin() + end, f.begin() + begin);
+                      });
+    std::fill(f.begin() + m_total_size, f.end(), StoredState{});
+    m_f = std::move(f);
 }
 
+// Split the fused sweep's streaming geometry between the tiles
+template <typename Precision>
+void D2Q9<Precision>::init_tiled()
+{
+    const size_t nx = m_dimensions[0];
+    const size_t ny = m_dimensions[1];
+    const size_t tiles_x = (nx + m_tiling.width - 1) / m_tiling.width;
+
+    for (size_t y0 = 0; y0 < ny; y0 += m_tiling.height)
+        for (size_t x0 = 0; x0 < nx; x0 += m_tiling.width)
+            m_tiles.push_back({x0, y0, std::min(m_tiling.width, nx - x0), std::min(m_tiling.height, ny - y0),
+                               {}, {}, {}, {}, {}, {}});
 
-void D2Q9::compute_macroscopic()
+    auto tile_of = [&](size_t idx)
+    {
+        return (idx / nx / m_tiling.height) * tiles_x + (idx % nx) / m_tiling.width;
+    };
+
+    // A bulk span is cut where it crosses into the next tile
+    for (const BulkSpan& span : m_bulk_spans)
+    {
+        for (size_t begin = span.begin; begin < span.end; )
+        {
+            Tile& tile = m_tiles[tile_of(begin)];
+            const size_t end = std::min(span.end, (begin / nx) * nx + tile.x0 + tile.width);
+            tile.bulk_spans.push_back({begin, end});
+            begin = end;
+        }
+    }
+    for (const LinkedCell& cell : m_linked_cells)
+        m_tiles[tile_of(cell.idx)].linked_cells.push_back(cell);
+
+    m_bulk_spans.clear();
+    m_linked_cells.clear();
+
+    if (m_tiling.time_steps > 1)
+        parallel_for_each(m_tiles, [this](Tile& tile) { init_scratch(tile); });
+}
+
+// The scratch grid of a tile covers the tile and its halo, in unwrapped coordinates
+template <typename Precision>
+void D2Q9<Precision>::init_scratch(Tile& tile)
 {
-    auto process_cell = [this](size_t idx)
+    const ptrdiff_t nx = m_dimensions[0];
+    const ptrdiff_t ny = m_dimensions[1];
+    const size_t halo = m_tiling.time_steps;
+    const size_t sw = tile.width + 2 * halo;
+    const size_t sh = tile.height + 2 * halo;
+
+    if (sw * sh * 9 > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("The tile is too large");
+
+    // Wrap a coordinate in a periodic direction; -1 if it is outside a non-periodic domain
+    auto wrap = [this](ptrdiff_t coord, size_t dim)
     {
-        if (m_cell_type[idx] == CellType::FLUID) 
+        const ptrdiff_t n = m_dimensions[dim];
+        if (m_is_periodic[dim]) return ((coord % n) + n) % n;
+        return (coord < 0 || coord >= n) ? ptrdiff_t(-1) : coord;
+    };
+    auto global_x = [&](size_t lx) { return static_cast<ptrdiff_t>(tile.x0 + lx) - static_cast<ptrdiff_t>(halo); };
+    auto global_y = [&](size_t ly) { return static_cast<ptrdiff_t>(tile.y0 + ly) - static_cast<ptrdiff_t>(halo); };
+
+    std::unordered_map<size_t, std::pair<BoundarySide, BoundaryCell>> boundary;
+    for (size_t side = 0; side < BOUNDARY_SIDES; side++)
+        for (const BoundaryCell& cell : m_boundary_batches[side])
+            boundary[cell.idx] = {static_cast<BoundarySide>(side), cell};
+
+    for (size_t ly = 0; ly < sh; ly++)
+    {
+        const ptrdiff_t gy = wrap(global_y(ly), 1);
+        if (gy < 0) continue;
+
+        for (size_t lx = 0; lx < sw; lx++)
         {
-            m_rho[idx] = std::accumulate(m_f[idx].begin(), m_f[idx].end(), 0.0);
+            const ptrdiff_t gx = wrap(global_x(lx), 0);
+            if (gx < 0) continue;
+
+            const size_t idx = gy * nx + gx;
+            const uint32_t local = static_cast<uint32_t>(ly * sw + lx);
 
-            m_u[idx] = {0.0, 0.0};
+            // Runs of cells consecutive in both grids
+            ScratchRun* run = tile.scratch_runs.empty() ? nullptr : &tile.scratch_runs.back();
+            if (run && run->local + run->length == local && run->idx + run->length == idx)
+                run->length++;
+            else
+                tile.scratch_runs.push_back({local, idx, 1});
+
+            // The outermost ring of the halo is only read from
+            if (m_cell_type[idx] == CellType::SOLID || lx == 0 || ly == 0 || lx == sw - 1 || ly == sh - 1)
+                continue;
+
+            ScratchCell cell{local, idx, m_cell_type[idx] == CellType::FLUID, {}};
+            bool is_bulk = cell.fluid;
             for (size_t dir = 0; dir < 9; dir++)
             {
-                m_u[idx][0] += m_f[idx][dir] * m_directions[dir][0];
-                m_u[idx][1] += m_f[idx][dir] * m_directions[dir][1];
+                // Clamp the source at the non-periodic edges, like get_neighbor_index()
+                ptrdiff_t src_x = global_x(lx) - m_directions[dir][0];
+                ptrdiff_t src_y = global_y(ly) - m_directions[dir][1];
+                if (!m_is_periodic[0]) src_x = std::clamp<ptrdiff_t>(src_x, 0, nx - 1);
+                if (!m_is_periodic[1]) src_y = std::clamp<ptrdiff_t>(src_y, 0, ny - 1);
+                const uint32_t src_local = static_cast<uint32_t>((src_y - global_y(0)) * sw + (src_x - global_x(0)));
+                const size_t src_idx = wrap(src_y, 1) * nx + wrap(src_x, 0);
+
+                //Bounce off solid cells
+                if (m_cell_type[src_idx] == CellType::SOLID)
+                {
+                    cell.src[dir] = local * 9 + static_cast<uint32_t>(m_bounce_back_indices[dir]);
+                    is_bulk = false;
+                }
+                else
+                {
+                    cell.src[dir] = src_local * 9 + static_cast<uint32_t>(dir);
+                    is_bulk = is_bulk && (src_local + m_directions[dir][0] + m_directions[dir][1] * sw == local);
+                }
             }
 
-            if (m_rho[idx] > MIN_DENSITY_THRESHOLD)
+            if (!is_bulk)
             {
-                m_u[idx][0] /= m_rho[idx];
-                m_u[idx][1] /= m_rho[idx];
+                tile.scratch_cells.push_back(cell);
+                auto it = boundary.find(idx);
+                if (it != boundary.end())
+                    tile.scratch_boundary.push_back({local, it->second.first, it->second.second});
             }
+            else if (!tile.scratch_spans.empty() && tile.scratch_spans.back().row == ly
+                     && tile.scratch_spans.back().end == lx && tile.scratch_spans.back().idx + (lx - tile.scratch_spans.back().begin) == idx)
+                tile.scratch_spans.back().end++;
+            else
+                tile.scratch_spans.push_back({static_cast<uint32_t>(ly), static_cast<uint32_t>(lx), static_cast<uint32_t>(lx + 1), idx});
         }
-    };
+    }
+}
 
-    std::for_each(std::execution::par, 
-                  m_indices.begin(), m_indices.end(), 
-                  process_cell);
+// BGK relaxation of a single cell towards the equilibrium
+template <typename Precision>
+void D2Q9<Precision>::relax_cell(CellState& f, Scalar rho, const VelocityVec& u) const
+{
+    CellState f_eq = compute_equilibrium(rho, u);
+    for (size_t dir = 0; dir < 9; dir++) 
+         f[dir] -= m_inv_tau * (f[dir] - f_eq[dir]);
 }
 
-void D2Q9::apply_cell_conditions()
+// Pull the populations streaming into a bulk cell
+template <typename Precision>
+void D2Q9<Precision>::pull_bulk_cell(size_t dest_idx, StoredState& f_out) const
 {
-    // Use Zou-He conditions for the inflow/outflow cells on edges.
-    // For inner inflow/outflow cells in the domain, renew the cell state to the equilibrium.
+    const StoredState* dest = m_f.data() + dest_idx;
+    for (size_t dir = 0; dir < 9; dir++)
+        f_out[dir] = dest[-m_stream_offsets[dir]][dir];
+}
 
-    // Handling inflow cells
-    for (size_t idx : m_inflow_cells)
+// Pull the populations streaming into a cell near a wall or on the domain edge
+template <typename Precision>
+void D2Q9<Precision>::pull_linked_cell(const LinkedCell& cell, const Storage* f_flat, StoredState& f_out) const
+{
+    for (size_t dir = 0; dir < 9; dir++) 
+        f_out[dir] = f_flat[cell.src[dir]];
+}
+
+template <typename Precision>
+void D2Q9<Precision>::compute_moments(const CellState& f, Scalar& rho, VelocityVec& u) const
+{
+    rho = std::accumulate(f.begin(), f.end(), Scalar(0.0));
+
+    u = {0.0, 0.0};
+    for (size_t dir = 0; dir < 9; dir++)
     {
-        auto [x, y] = index_to_coords(idx);
-        auto [u_in, rho_in] = m_inflow_conditions[idx];
+        u[0] += f[dir] * m_directions[dir][0];
+        u[1] += f[dir] * m_directions[dir][1];
+    }
 
-        if (!m_is_periodic[0] && x == 0) 
-        {
-            // West boundary
-            m_f[idx][1] = m_f[idx][3] + (2.0/3.0) * rho_in * u_in[0];
-            m_f[idx][5] = m_f[idx][7] + (1.0/6.0) * rho_in * u_in[0] + 0.5 * rho_in * u_in[1];
-            m_f[idx][8] = m_f[idx][6] + (1.0/6.0) * rho_in * u_in[0] - 0.5 * rho_in * u_in[1];
-        }
-        else if (!m_is_periodic[0] && x == m_dimensions[0] - 1) 
-        {
-            // East boundary
-            m_f[idx][3] = m_f[idx][1] - (2.0/3.0) * rho_in * u_in[0];
-            m_f[idx][6] = m_f[idx][8] - (1.0/6.0) * rho_in * u_in[0] + 0.5 * rho_in * u_in[1];
-            m_f[idx][7] = m_f[idx][5] - (1.0/6.0) * rho_in * u_in[0] - 0.5 * rho_in * u_in[1];
-        }
-        else if (!m_is_periodic[1] && y == 0) 
-        {
-            // South boundary
-            m_f[idx][2] = m_f[idx][4] + (2.0/3.0) * rho_in * u_in[1];
-            m_f[idx][5] = m_f[idx][7] + 0.5 * rho_in * u_in[0] + (1.0/6.0) * rho_in * u_in[1];
-            m_f[idx][6] = m_f[idx][8] - 0.5 * rho_in * u_in[0] + (1.0/6.0) * rho_in * u_in[1];
-        }
-        else if (!m_is_periodic[1] && y == m_dimensions[1] - 1) 
-        {
-            // North boundary
-            m_f[idx][4] = m_f[idx][2] - (2.0/3.0) * rho_in * u_in[1];
-            m_f[idx][7] = m_f[idx][5] - 0.5 * rho_in * u_in[0] - (1.0/6.0) * rho_in * u_in[1];
-            m_f[idx][8] = m_f[idx][6] + 0.5 * rho_in * u_in[0] - (1.0/6.0) * rho_in * u_in[1];
-        }
-        else
-        {
-            // Internal or periodic inflow
-            m_f[idx] = compute_equilibrium(rho_in, u_in);
-        }
+    if (rho > MIN_DENSITY_THRESHOLD)
+    {
+        u[0] /= rho;
+        u[1] /= rho;
+    }
+}
+
+template <typename Precision>
+void D2Q9<Precision>::collide()
+{
+    if (m_kernel == Kernel::SOA)
+        return collide_soa();
+    if (m_kernel == Kernel::SPARSE)
+        return collide_sparse();
+
+    parallel_for_each(m_fluid_cells,
+                      [this](size_t idx)
+                      {
+                            CellState f = load_state(m_f[idx]);
+                            relax_cell(f, m_rho[idx], m_u[idx]);
+                            m_f[idx] = store_state(f);
+                      },
+                      [](size_t idx) { return idx; });
+}
+
+// Streaming only moves the stored populations, so it stays in the storage precision
+template <typename Precision>
+void D2Q9<Precision>::stream()
+{
+    if (m_kernel == Kernel::SOA)
+        return stream_soa();
+    if (m_kernel == Kernel::SPARSE)
+        return stream_sparse();
+
+    const Storage* f_flat = reinterpret_cast<const Storage*>(m_f.data());
+
+    parallel_for_each(m_bulk_spans,
+                      [this](const BulkSpan& span)
+                      {
+                            for (size_t idx = span.begin; idx < span.end; idx++)
+                                pull_bulk_cell(idx, m_f_new[idx]);
+                      },
+                      [](const BulkSpan& span) { return span.begin; });
+
+    parallel_for_each(m_linked_cells,
+                      [this, f_flat](const LinkedCell& cell)
+                      {
+                            pull_linked_cell(cell, f_flat, m_f_new[cell.idx]);
+                      },
+                      [](const LinkedCell& cell) { return cell.idx; });
+
+    std::swap(m_f, m_f_new);
+}
+
+
+template <typename Precision>
+void D2Q9<Precision>::compute_macroscopic()
+{
+    if (m_kernel == Kernel::SOA)
+        return compute_macroscopic_soa();
+    if (m_kernel == Kernel::SPARSE)
+        return compute_macroscopic_sparse();
+
+    parallel_for_each(m_fluid_cells,
+                      [this](size_t idx)
+                      {
+                            compute_moments(load_state(m_f[idx]), m_rho[idx], m_u[idx]);
+                      },
+                      [](size_t idx) { return idx; });
+}
+
+// The fused kernel keeps the post-collision states in m_f. A destination fluid cell pulls
+// its populations, has its macroscopic variables updated and is relaxed, all while
+// the populations are still in registers. The inflow/outflow cells get their conditions
+// in the boundary pass after the sweep.
+// The arithmetic is that of the four-pass kernel, so the results are identical.
+template <typename Precision>
+void D2Q9<Precision>::fused_step()
+{
+    sweep_rows(0, m_dimensions[1]);
+    end_sweep();
+}
+
+template <typename Precision>
+void D2Q9<Precision>::sweep_rows(size_t row_begin, size_t row_end)
+{
+    if (m_kernel != Kernel::FUSED)
+        throw std::runtime_error("Partial sweeps need the fused kernel");
+
+    const Storage* f_flat = reinterpret_cast<const Storage*>(m_f.data());
+    auto bulk_spans = rows_of(m_bulk_spans, row_begin, row_end, [](const BulkSpan& span) { return span.begin; });
+    auto linked_cells = rows_of(m_linked_cells, row_begin, row_end, [](const LinkedCell& cell) { return cell.idx; });
+
+    parallel_for_each(bulk_spans,
+                      [this](const BulkSpan& span)
+                      {
+                            StoredState f;
+                            for (size_t idx = span.begin; idx < span.end; idx++)
+                            {
+                                pull_bulk_cell(idx, f);
+                                finish_fused_cell(idx, f);
+                            }
+                      },
+                      [](const BulkSpan& span) { return span.begin; });
+
+    parallel_for_each(linked_cells,
+                      [this, f_flat](const LinkedCell& cell)
+                      {
+                            StoredState f;
+                            pull_linked_cell(cell, f_flat, f);
+                            finish_fused_cell(cell.idx, f);
+                      },
+                      [](const LinkedCell& cell) { return cell.idx; });
+}
+
+template <typename Precision>
+void D2Q9<Precision>::end_sweep()
+{
+    std::swap(m_f, m_f_new);
+    apply_cell_conditions();
+}
+
+template <typename Precision>
+void D2Q9<Precision>::pack_row(size_t row, int dir_y, Storage* buffer) const
+{
+    const size_t nx = m_dimensions[0];
+    for (size_t x = 0; x < nx; x++)
+        for (size_t dir = 0; dir < 9; dir++)
+            if (m_directions[dir][1] == dir_y)
+                *buffer++ = m_f[row * nx + x][dir];
+}
+
+template <typename Precision>
+void D2Q9<Precision>::unpack_row(size_t row, int dir_y, const Storage* buffer)
+{
+    const size_t nx = m_dimensions[0];
+    for (size_t x = 0; x < nx; x++)
+        for (size_t dir = 0; dir < 9; dir++)
+            if (m_directions[dir][1] == dir_y)
+                m_f[row * nx + x][dir] = *buffer++;
+}
+
+template <typename Precision>
+bool D2Q9<Precision>::stores_post_collision() const
+{
+    return m_kernel == Kernel::FUSED || m_kernel == Kernel::IN_PLACE || m_kernel == Kernel::TILED;
+}
+
+template <typename Precision>
+void D2Q9<Precision>::get_populations(StoredState* f) const
+{
+    if (m_kernel == Kernel::SOA)
+    {
+        for_each_row_band([this, f](size_t begin, size_t end)
+                          {
+                                for (size_t idx = begin; idx < end; idx++)
+                                    for (size_t dir = 0; dir < 9; dir++)
+                                        f[idx][dir] = m_f_planes[dir][idx];
+                          });
+        return;
     }
 
-    // Handling outflow cells
-    for (size_t idx : m_outflow_cells)
+    if (m_kernel == Kernel::SPARSE)
     {
-        auto [x, y] = index_to_coords(idx);
-        double rho_out = m_outflow_conditions[idx];
-        VelocityVec u_out = {0.0, 0.0};
+        std::fill(f, f + m_total_size, StoredState{});
+        for (size_t c = 0; c < m_sparse_cells.size(); c++)
+            f[m_sparse_cells[c]] = m_f[c];
+        return;
+    }
+
+    for_each_row_band([this, f](size_t begin, size_t end)
+                      {
+                            std::copy(m_f.begin() + begin, m_f.begin() + end, f + begin);
+                      });
+    if (m_kernel != Kernel::IN_PLACE || !m_in_place_swapped)
+        return;
+
+    // In the swapped layout, F_i(x) is in the slot the neighbor step of x pushed it to,
+    // the one it pulls F_opp(i) from
+    const Storage* f_flat = reinterpret_cast<const Storage*>(m_f.data());
+    for (const BulkSpan& span : m_bulk_spans)
+        for (size_t idx = span.begin; idx < span.end; idx++)
+            for (size_t dir = 0; dir < 9; dir++)
+            {
+                const size_t opp = m_bounce_back_indices[dir];
+                f[idx][dir] = f_flat[9 * (idx - m_stream_offsets[opp]) + opp];
+            }
 
-        if (!m_is_periodic[0] && x == 0) 
+    auto gather = [this, f, f_flat](const InPlaceCell& cell)
+    {
+        for (size_t dir = 0; dir < 9; dir++)
+            f[cell.idx][dir] = f_flat[cell.neighbor_addr[m_bounce_back_indices[dir]]];
+    };
+    std::for_each(m_in_place_cells.begin(), m_in_place_cells.end(), gather);
+    for (const auto& cells : m_in_place_boundary)
+        std::for_each(cells.begin(), cells.end(), gather);
+}
+
+template <typename Precision>
+void D2Q9<Precision>::set_state(const StoredState* f, bool post_collision,
+                                const double* rho, const std::array<double, 2>* u)
+{
+    if (post_collision && !stores_post_collision())
+        throw std::runtime_error("Post-collision populations can only be restored into "
+                                 "the fused, in-place or tiled kernels");
+
+    // The collision that would start the next step of a four-phase kernel
+    const bool relax = !post_collision && stores_post_collision();
+    auto state_of = [this, f, relax](size_t idx)
+    {
+        StoredState state = f[idx];
+        if (relax && m_cell_type[idx] == CellType::FLUID)
         {
-            // West boundary
-            m_f[idx][1] = m_f[idx][3] + (2.0/3.0) * rho_out * u_out[0];
-            m_f[idx][5] = m_f[idx][7] + (1.0/6.0) * rho_out * u_out[0] + 0.5 * rho_out * u_out[1];
-            m_f[idx][8] = m_f[idx][6] + (1.0/6.0) * rho_out * u_out[0] - 0.5 * rho_out * u_out[1];
+            CellState cell = load_state(state);
+            relax_cell(cell, m_rho[idx], m_u[idx]);
+            state = store_state(cell);
         }
-        else if (!m_is_periodic[0] && x == m_dimensions[0] - 1) 
+        return state;
+    };
+
+    for_each_row_band([&](size_t begin, size_t end)
+                      {
+                            for (size_t idx = begin; idx < end; idx++)
+                            {
+                                const VelocityVec u_idx = {static_cast<Scalar>(u[idx][0]), static_cast<Scalar>(u[idx][1])};
+                                m_rho[idx] = static_cast<Scalar>(rho[idx]);
+                                if (m_kernel == Kernel::SOA)
+                                {
+                                    m_ux[idx] = u_idx[0];
+                                    m_uy[idx] = u_idx[1];
+                                    for (size_t dir = 0; dir < 9; dir++)
+                                        m_f_planes[dir][idx] = f[idx][dir];
+                                    continue;
+                                }
+
+                                m_u[idx] = u_idx;
+                                if (m_kernel != Kernel::SPARSE)
+                                    m_f[idx] = state_of(idx);
+                            }
+                      });
+
+    if (m_kernel == Kernel::SOA)
+        m_u_packed_stale = true;
+    if (m_kernel == Kernel::SPARSE)
+        for (size_t c = 0; c < m_sparse_cells.size(); c++)
+            m_f[c] = f[m_sparse_cells[c]];
+    // The natural layout
+    m_in_place_swapped = false;
+}
+
+template <typename Precision>
+std::vector<typename D2Q9<Precision>::BoundaryCondition> D2Q9<Precision>::get_boundary_conditions() const
+{
+    std::vector<BoundaryCondition> conditions;
+    for (const auto& batch : m_boundary_batches)
+        for (const BoundaryCell& cell : batch)
         {
-            // East boundary
-            m_f[idx][3] = m_f[idx][1] - (2.0/3.0) * rho_out * u_out[0];
-            m_f[idx][6] = m_f[idx][8] - (1.0/6.0) * rho_out * u_out[0] + 0.5 * rho_out * u_out[1];
-            m_f[idx][7] = m_f[idx][5] - (1.0/6.0) * rho_out * u_out[0] - 0.5 * rho_out * u_out[1];
+            const size_t idx = m_kernel == Kernel::SPARSE ? m_sparse_cells[cell.idx] : cell.idx;
+            conditions.push_back({idx, cell.rho, cell.u});
         }
-        else if (!m_is_periodic[1] && y == 0) 
+    std::sort(conditions.begin(), conditions.end(),
+              [](const BoundaryCondition& a, const BoundaryCondition& b) { return a.idx < b.idx; });
+    return conditions;
+}
+
+template <typename Precision>
+void D2Q9<Precision>::finish_fused_cell(size_t idx, const StoredState& f_stored)
+{
+    m_f_new[idx] = f_stored;
+    // The inflow/outflow cells are only streamed here; their conditions are applied after the sweep
+    if (m_cell_type[idx] == CellType::FLUID)
+        update_fluid_cell(idx, m_f_new[idx]);
+}
+
+// The moments and the relaxation of a fluid cell with its streamed populations
+template <typename Precision>
+void D2Q9<Precision>::update_fluid_cell(size_t idx, StoredState& f_stored)
+{
+    update_fluid_state(f_stored, m_rho[idx], m_u[idx]);
+}
+
+template <typename Precision>
+void D2Q9<Precision>::update_fluid_state(StoredState& f_stored, Scalar& rho, VelocityVec& u) const
+{
+    CellState f = load_state(f_stored);
+    compute_moments(f, rho, u);
+    relax_cell(f, rho, u);
+    f_stored = store_state(f);
+}
+
+// The fused sweep, one tile after the other within a task
+template <typename Precision>
+void D2Q9<Precision>::tiled_step()
+{
+    const Storage* f_flat = reinterpret_cast<const Storage*>(m_f.data());
+
+    parallel_for_each(m_tiles,
+                      [this, f_flat](const Tile& tile)
+                      {
+                            StoredState f;
+                            for (const BulkSpan& span : tile.bulk_spans)
+                            {
+                                for (size_t idx = span.begin; idx < span.end; idx++)
+                                {
+                                    pull_bulk_cell(idx, f);
+                                    finish_fused_cell(idx, f);
+                                }
+                            }
+                            for (const LinkedCell& cell : tile.linked_cells)
+                            {
+                                pull_linked_cell(cell, f_flat, f);
+                                finish_fused_cell(cell.idx, f);
+                            }
+                      },
+                      [nx = m_dimensions[0]](const Tile& tile) { return tile.y0 * nx + tile.x0; });
+
+    std::swap(m_f, m_f_new);
+    apply_cell_conditions();
+}
+
+// A temporal block of up to m_tiling.time_steps steps
+template <typename Precision>
+void D2Q9<Precision>::tiled_block(size_t steps)
+{
+    parallel_for_each(m_tiles,
+                      [this, steps](const Tile& tile)
+                      {
+                            thread_local std::vector<StoredState> scratch, scratch_new;
+                            advance_tile(tile, steps, scratch, scratch_new);
+                      },
+                      [nx = m_dimensions[0]](const Tile& tile) { return tile.y0 * nx + tile.x0; });
+
+    std::swap(m_f, m_f_new);
+}
+
+// Step k of a block updates the cells at least halo - (steps - k) cells away from the scratch
+// border: after the last step the tile itself is up to date. The arithmetic per cell is that
+// of the fused sweep.
+template <typename Precision>
+void D2Q9<Precision>::advance_tile(const Tile& tile, size_t steps,
+                                   std::vector<StoredState>& scratch, std::vector<StoredState>& scratch_new)
+{
+    const size_t halo = m_tiling.time_steps;
+    const size_t sw = tile.width + 2 * halo;
+    const size_t sh = tile.height + 2 * halo;
+    scratch.resize(sw * sh);
+    scratch_new.resize(sw * sh);
+
+    for (const ScratchRun& run : tile.scratch_runs)
+        std::copy(m_f.begin() + run.idx, m_f.begin() + run.idx + run.length, scratch.begin() + run.local);
+
+    std::array<ptrdiff_t, 9> offsets;
+    for (size_t dir = 0; dir < 9; dir++)
+        offsets[dir] = m_directions[dir][0] + m_directions[dir][1] * static_cast<ptrdiff_t>(sw);
+
+    for (size_t k = 1; k <= steps; k++)
+    {
+        const size_t margin = halo - (steps - k);
+        const bool last = (k == steps);
+        auto inside = [&](uint32_t local)
+        {
+            const size_t lx = local % sw, ly = local / sw;
+            return lx >= margin && ly >= margin && lx < sw - margin && ly < sh - margin;
+        };
+
+        Scalar rho;
+        VelocityVec u;
+        StoredState f;
+        for (const ScratchSpan& span : tile.scratch_spans)
         {
-            // South boundary
-            m_f[idx][2] = m_f[idx][4] + (2.0/3.0) * rho_out * u_out[1];
-            m_f[idx][5] = m_f[idx][7] + 0.5 * rho_out * u_out[0] + (1.0/6.0) * rho_out * u_out[1];
-            m_f[idx][6] = m_f[idx][8] - 0.5 * rho_out * u_out[0] + (1.0/6.0) * rho_out * u_out[1];
+            if (span.row < margin || span.row >= sh - margin) continue;
+            const size_t begin = std::max<size_t>(span.begin, margin);
+            const size_t end = std::min<size_t>(span.end, sw - margin);
+            for (size_t lx = begin; lx < end; lx++)
+            {
+                const size_t local = span.row * sw + lx;
+                for (size_t dir = 0; dir < 9; dir++)
+                    f[dir] = scratch[local - offsets[dir]][dir];
+                if (last)
+                    update_fluid_cell(span.idx + (lx - span.begin), f);
+                else
+                    update_fluid_state(f, rho, u);
+                scratch_new[local] = f;
+            }
         }
-        else if (!m_is_periodic[1] && y == m_dimensions[1] - 1)
+
+        const Storage* f_flat = reinterpret_cast<const Storage*>(scratch.data());
+        for (const ScratchCell& cell : tile.scratch_cells)
         {
-            // North boundary
-            m_f[idx][4] = m_f[idx][2] - (2.0/3.0) * rho_out * u_out[1];
-            m_f[idx][7] = m_f[idx][5] - 0.5 * rho_out * u_out[0] - (1.0/6.0) * rho_out * u_out[1];
-            m_f[idx][8] = m_f[idx][6] + 0.5 * rho_out * u_out[0] - (1.0/6.0) * rho_out * u_out[1];
+            if (!inside(cell.local)) continue;
+            for (size_t dir = 0; dir < 9; dir++)
+                f[dir] = f_flat[cell.src[dir]];
+            if (cell.fluid)
+            {
+                if (last)
+                    update_fluid_cell(cell.idx, f);
+                else
+                    update_fluid_state(f, rho, u);
+            }
+            scratch_new[cell.local] = f;
         }
-        else 
+
+        for (const ScratchBoundary& boundary : tile.scratch_boundary)
         {
-            // Internal or periodic inflow
-            m_f[idx] = compute_equilibrium(rho_out, u_out);
+            if (!inside(boundary.local)) continue;
+            CellState f_cell = load_state(scratch_new[boundary.local]);
+            apply_boundary(boundary.cell, boundary.side, f_cell);
+            scratch_new[boundary.local] = store_state(f_cell);
         }
+
+        std::swap(scratch, scratch_new);
+    }
+
+    const size_t nx = m_dimensions[0];
+    for (size_t y = 0; y < tile.height; y++)
+        std::copy(scratch.begin() + (y + halo) * sw + halo,
+                  scratch.begin() + (y + halo) * sw + halo + tile.width,
+                  m_f_new.begin() + (tile.y0 + y) * nx + tile.x0);
+}
+
+// The fused sweep over the single population array, see InPlaceCell for the layouts.
+// The cells only touch their own slots, so the fluid and the boundary cells are
+// processed in separate passes.
+template <typename Precision>
+void D2Q9<Precision>::in_place_step()
+{
+    Storage* f_flat = reinterpret_cast<Storage*>(m_f.data());
+    const bool swapped = m_in_place_swapped;
+
+    parallel_for_each(m_ghost_links,
+                      [f_flat, swapped](const GhostLink& link)
+                      {
+                            f_flat[link.ghost] = f_flat[swapped ? link.swapped_src : link.natural_src];
+                      });
+
+    parallel_for_each(m_bulk_spans,
+                      [this, f_flat, swapped](const BulkSpan& span)
+                      {
+                            StoredState f;
+                            for (size_t idx = span.begin; idx < span.end; idx++)
+                            {
+                                if (swapped)
+                                {
+                                    for (size_t dir = 0; dir < 9; dir++)
+                                        f[dir] = m_f[idx][m_bounce_back_indices[dir]];
+                                    update_fluid_cell(idx, f);
+                                    m_f[idx] = f;
+                                }
+                                else
+                                {
+                                    const ptrdiff_t base = 9 * static_cast<ptrdiff_t>(idx);
+                                    for (size_t dir = 0; dir < 9; dir++)
+                                        f[dir] = f_flat[base - 9 * m_stream_offsets[dir] + dir];
+                                    update_fluid_cell(idx, f);
+                                    for (size_t dir = 0; dir < 9; dir++)
+                                        f_flat[base - 9 * m_stream_offsets[dir] + dir] = f[m_bounce_back_indices[dir]];
+                                }
+                            }
+                      },
+                      [](const BulkSpan& span) { return span.begin; });
+
+    auto process_cell = [this, f_flat, swapped](const InPlaceCell& cell, auto update)
+    {
+        StoredState f;
+        const auto& src = swapped ? cell.local_addr : cell.neighbor_addr;
+        for (size_t dir = 0; dir < 9; dir++)
+            f[dir] = f_flat[src[dir]];
+        update(f);
+        if (swapped)
+            m_f[cell.idx] = f;
+        else
+            for (size_t dir = 0; dir < 9; dir++)
+                f_flat[cell.neighbor_addr[dir]] = f[m_bounce_back_indices[dir]];
+    };
+
+    parallel_for_each(m_in_place_cells,
+                      [this, &process_cell](const InPlaceCell& cell)
+                      {
+                            process_cell(cell, [this, &cell](StoredState& f) { update_fluid_cell(cell.idx, f); });
+                      },
+                      [](const InPlaceCell& cell) { return cell.idx; });
+
+    for (size_t side = 0; side < BOUNDARY_SIDES; side++)
+    {
+        const std::vector<BoundaryCell>& batch = m_boundary_batches[side];
+        const std::vector<InPlaceCell>& cells = m_in_place_boundary[side];
+        parallel_for_each(cells,
+                          [this, &process_cell, &batch, &cells, side](const InPlaceCell& cell)
+                          {
+                                const BoundaryCell& boundary = batch[&cell - cells.data()];
+                                process_cell(cell, [this, &boundary, side](StoredState& f_stored)
+                                                   {
+                                                        CellState f = load_state(f_stored);
+                                                        apply_boundary(boundary, static_cast<BoundarySide>(side), f);
+                                                        f_stored = store_state(f);
+                                                   });
+                          });
+    }
+
+    m_in_place_swapped = !swapped;
+}
+
+// Zou-He conditions for a cell on a non-periodic edge with the prescribed density and velocity.
+// For inner (or periodic) inflow/outflow cells, renew the cell state to the equilibrium.
+template <typename Precision>
+void D2Q9<Precision>::apply_boundary(const BoundaryCell& cell, BoundarySide side, CellState& f) const
+{
+    constexpr Scalar two_thirds = 2.0/3.0;
+    constexpr Scalar one_sixth = 1.0/6.0;
+    constexpr Scalar half = 0.5;
+    const Scalar rho = cell.rho;
+    const VelocityVec& u = cell.u;
+
+    switch (side)
+    {
+        case WEST:
+            f[1] = f[3] + two_thirds * rho * u[0];
+            f[5] = f[7] + one_sixth * rho * u[0] + half * rho * u[1];
+            f[8] = f[6] + one_sixth * rho * u[0] - half * rho * u[1];
+            break;
+        case EAST:
+            f[3] = f[1] - two_thirds * rho * u[0];
+            f[6] = f[8] - one_sixth * rho * u[0] + half * rho * u[1];
+            f[7] = f[5] - one_sixth * rho * u[0] - half * rho * u[1];
+            break;
+        case SOUTH:
+            f[2] = f[4] + two_thirds * rho * u[1];
+            f[5] = f[7] + half * rho * u[0] + one_sixth * rho * u[1];
+            f[6] = f[8] - half * rho * u[0] + one_sixth * rho * u[1];
+            break;
+        case NORTH:
+            f[4] = f[2] - two_thirds * rho * u[1];
+            f[7] = f[5] - half * rho * u[0] - one_sixth * rho * u[1];
+            f[8] = f[6] + half * rho * u[0] - one_sixth * rho * u[1];
+            break;
+        default:
+            // Internal or periodic inflow/outflow
+            f = compute_equilibrium(rho, u);
+    }
+}
+
+// The cells of a batch are independent, and the side is the same for the whole batch
+template <typename Precision>
+template <typename Func>
+void D2Q9<Precision>::for_each_boundary_cell(Func func) const
+{
+    for (size_t side = 0; side < BOUNDARY_SIDES; side++)
+    {
+        parallel_for_each(m_boundary_batches[side],
+                          [&func, side](const BoundaryCell& cell)
+                          {
+                                func(cell, static_cast<BoundarySide>(side));
+                          });
+    }
+}
+
+template <typename Precision>
+template <typename Items, typename Func, typename CellOf>
+void D2Q9<Precision>::parallel_for_each(Items& items, Func func, CellOf cell_of) const
+{
+    if (!m_pool)
+    {
+        std::for_each(std::execution::par, items.begin(), items.end(), func);
+        return;
+    }
+
+    m_pool->run([&](size_t worker)
+                {
+                    const auto [row_begin, row_end] = m_pool->partition(m_dimensions[1], worker);
+                    const auto band = rows_of(items, row_begin, row_end, cell_of);
+                    std::for_each(band.begin(), band.end(), func);
+                });
+}
+
+template <typename Precision>
+template <typename Items, typename Func>
+void D2Q9<Precision>::parallel_for_each(Items& items, Func func) const
+{
+    if (!m_pool)
+    {
+        std::for_each(std::execution::par, items.begin(), items.end(), func);
+        return;
+    }
+
+    m_pool->run([&](size_t worker)
+                {
+                    const auto [begin, end] = m_pool->partition(items.size(), worker);
+                    std::for_each(items.begin() + begin, items.begin() + end, func);
+                });
+}
+
+template <typename Precision>
+template <typename Items, typename CellOf>
+auto D2Q9<Precision>::rows_of(Items& items, size_t row_begin, size_t row_end, CellOf cell_of) const
+    -> ItemRange<decltype(items.begin())>
+{
+    const size_t nx = m_dimensions[0];
+    auto precedes = [&cell_of](const auto& item, size_t cell) { return cell_of(item) < cell; };
+    auto first = std::lower_bound(items.begin(), items.end(), row_begin * nx, precedes);
+    auto last = std::lower_bound(first, items.end(), row_end * nx, precedes);
+    return {first, last};
+}
+
+template <typename Precision>
+template <typename Func>
+void D2Q9<Precision>::for_each_row_band(Func func) const
+{
+    if (!m_pool)
+        return func(0, m_total_size);
+
+    const size_t nx = m_dimensions[0];
+    m_pool->run([&](size_t worker)
+                {
+                    const auto [row_begin, row_end] = m_pool->partition(m_dimensions[1], worker);
+                    func(row_begin * nx, row_end * nx);
+                });
+}
+
+template <typename Precision>
+void D2Q9<Precision>::apply_cell_conditions()
+{
+    if (m_kernel == Kernel::SOA)
+        return apply_cell_conditions_soa();
+
+    for_each_boundary_cell([this](const BoundaryCell& cell, BoundarySide side)
+                           {
+                                CellState f = load_state(m_f[cell.idx]);
+                                apply_boundary(cell, side, f);
+                                m_f[cell.idx] = store_state(f);
+                           });
+}
+
+
+template <typename Precision>
+void D2Q9<Precision>::collide_soa()
+{
+    if constexpr (SOA_SUPPORTED)
+    {
+        std::array<double*, 9> f;
+        for (size_t dir = 0; dir < 9; dir++)
+            f[dir] = m_f_planes[dir].data();
+
+        parallel_for_each(m_blocks,
+                          [&](size_t begin)
+                          {
+                                const size_t end = std::min(begin + SOA_BLOCK_SIZE, m_total_size);
+                                D2Q9_soa_collide(f.data(), m_rho.data(), m_ux.data(), m_uy.data(),
+                                                 m_fluid_mask.data(), m_inv_tau, begin, end);
+                          },
+                          [](size_t begin) { return begin; });
+    }
+}
+
+// Streaming a plane is a shifted copy of the source row, except for the two edge cells,
+// which may wrap around. The bounce-back links then overwrite the entries with solid sources.
+template <typename Precision>
+void D2Q9<Precision>::stream_soa()
+{
+    const size_t nx = m_dimensions[0];
+
+    parallel_for_each(m_rows,
+                      [this, nx](size_t y)
+                      {
+                            const size_t row = y * nx;
+                            for (size_t dir = 0; dir < 9; dir++)
+                            {
+                                const Storage* src = m_f_planes[dir].data();
+                                Storage* dest = m_f_planes_new[dir].data();
+
+                                const size_t src_row = get_neighbor_index(row, {0, m_directions[dir][1]});
+                                if (nx > 2)
+                                    std::copy(src + src_row + 1 - m_directions[dir][0],
+                                              src + src_row + nx - 1 - m_directions[dir][0],
+                                              dest + row + 1);
+
+                                dest[row] = src[get_neighbor_index(row, m_directions[dir])];
+                                dest[row + nx - 1] = src[get_neighbor_index(row + nx - 1, m_directions[dir])];
+                            }
+                      },
+                      [nx](size_t y) { return y * nx; });
+
+    parallel_for_each(m_bounce_back_links,
+                      [this](const std::pair<size_t, size_t>& link)
+                      {
+                            const auto [idx, dir] = link;
+                            m_f_planes_new[dir][idx] = m_f_planes[m_bounce_back_indices[dir]][idx];
+                      },
+                      [](const std::pair<size_t, size_t>& link) { return link.first; });
+
+    std::swap(m_f_planes, m_f_planes_new);
+}
+
+template <typename Precision>
+void D2Q9<Precision>::apply_cell_conditions_soa()
+{
+    for_each_boundary_cell([this](const BoundaryCell& cell, BoundarySide side)
+                           {
+                                StoredState f_stored;
+                                for (size_t dir = 0; dir < 9; dir++)
+                                    f_stored[dir] = m_f_planes[dir][cell.idx];
+                                CellState f = load_state(f_stored);
+                                apply_boundary(cell, side, f);
+                                f_stored = store_state(f);
+                                for (size_t dir = 0; dir < 9; dir++)
+                                    m_f_planes[dir][cell.idx] = f_stored[dir];
+                           });
+}
+
+template <typename Precision>
+void D2Q9<Precision>::compute_macroscopic_soa()
+{
+    if constexpr (SOA_SUPPORTED)
+    {
+        std::array<const double*, 9> f;
+        for (size_t dir = 0; dir < 9; dir++)
+            f[dir] = m_f_planes[dir].data();
+
+        parallel_for_each(m_blocks,
+                          [&](size_t begin)
+                          {
+                                const size_t end = std::min(begin + SOA_BLOCK_SIZE, m_total_size);
+                                D2Q9_soa_moments(f.data(), m_rho.data(), m_ux.data(), m_uy.data(),
+                                                 m_fluid_mask.data(), MIN_DENSITY_THRESHOLD, begin, end);
+                          },
+                          [](size_t begin) { return begin; });
     }
+
+    m_u_packed_stale = true;
 }
 
 
-const std::vector<double>& D2Q9::get_density() const { return m_rho; }
-const std::vector<D2Q9::VelocityVec>& D2Q9::get_velocity() const { return m_u; }
\ No newline at end of file
+// The fluid cells lead the compact storage, so the collision and the moments
+// run over the range [0, m_sparse_fluid_count) without cell type checks
+template <typename Precision>
+void D2Q9<Precision>::collide_sparse()
+{
+    parallel_for_each(m_sparse_blocks,
+                      [this](size_t begin)
+                      {
+                            const size_t end = std::min(begin + SPARSE_BLOCK_SIZE, m_sparse_fluid_count);
+                            for (size_t c = begin; c < end; c++)
+                            {
+                                const size_t idx = m_sparse_cells[c];
+                                CellState f = load_state(m_f[c]);
+                                relax_cell(f, m_rho[idx], m_u[idx]);
+                                m_f[c] = store_state(f);
+                            }
+                      });
+}
+
+template <typename Precision>
+void D2Q9<Precision>::stream_sparse()
+{
+    const Storage* f_flat = reinterpret_cast<const Storage*>(m_f.data());
+
+    parallel_for_each(m_sparse_blocks,
+                      [this, f_flat](size_t begin)
+                      {
+                            const size_t end = std::min(begin + SPARSE_BLOCK_SIZE, m_sparse_cells.size());
+                            for (size_t c = begin; c < end; c++)
+                            {
+                                const auto& links = m_sparse_links[c];
+                                for (size_t dir = 0; dir < 9; dir++)
+                                    m_f_new[c][dir] = f_flat[links[dir]];
+                            }
+                      });
+
+    std::swap(m_f, m_f_new);
+}
+
+template <typename Precision>
+void D2Q9<Precision>::compute_macroscopic_sparse()
+{
+    parallel_for_each(m_sparse_blocks,
+                      [this](size_t begin)
+                      {
+                            const size_t end = std::min(begin + SPARSE_BLOCK_SIZE, m_sparse_fluid_count);
+                            for (size_t c = begin; c < end; c++)
+                            {
+                                const size_t idx = m_sparse_cells[c];
+                                compute_moments(load_state(m_f[c]), m_rho[idx], m_u[idx]);
+                            }
+                      });
+}
+
+template <typename Precision>
+size_t D2Q9<Precision>::get_population_bytes() const
+{
+    size_t bytes = (m_f.capacity() + m_f_new.capacity()) * sizeof(StoredState);
+    for (size_t dir = 0; dir < 9; dir++)
+        bytes += (m_f_planes[dir].capacity() + m_f_planes_new[dir].capacity()) * sizeof(Storage);
+    return bytes;
+}
+
+template <typename Precision>
+const FieldVector<typename D2Q9<Precision>::Scalar>& D2Q9<Precision>::get_density() const { return m_rho; }
+
+template <typename Precision>
+const FieldVector<typename D2Q9<Precision>::VelocityVec>& D2Q9<Precision>::get_velocity() const
+{
+    if (m_kernel != Kernel::SOA)
+        return m_u; 
+
+    // An adapter for the structure-of-arrays layout
+    if (m_u_packed_stale)
+    {
+        m_u_packed.resize(m_total_size);
+        std::transform(std::execution::par,
+                       m_ux.begin(), m_ux.end(), m_uy.begin(), m_u_packed.begin(),
+                       [](Scalar ux, Scalar uy) { return VelocityVec{ux, uy}; });
+        m_u_packed_stale = false;
+    }
+    return m_u_packed;
+}
+
+template class D2Q9<double>;
+template class D2Q9<float>;
+template class D2Q9<MixedPrecision>;
@@ -0,0 +1,216 @@
+#include "d2q9_decomposed.h"
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+template <typename Precision>
+D2Q9Decomposed<Precision>::D2Q9Decomposed(const LBMParams& lbm_params,
+                                          const D2Q9InitialView& initials,
+                                          HaloTransport& transport): m_transport(transport),
+                                                                     m_dimensions(lbm_params.dimensions)
+{
+    if (m_dimensions.size() != 2)
+        throw std::runtime_error("Dimension count mismatch in LBMParams.");
+
+    const size_t nx = m_dimensions[0];
+    const size_t ny = m_dimensions[1];
+    const size_t ranks = m_transport.size();
+    const size_t rank = m_transport.rank();
+
+    if (initials.size != nx * ny)
+        throw std::runtime_error("Wrong size of the initial conditions data");
+    if (ny < ranks)
+        throw std::runtime_error("The grid has fewer rows than there are ranks");
+
+    m_row_begin = ny * rank / ranks;
+    m_row_end = ny * (rank + 1) / ranks;
+
+    // Across a periodic edge, the first and the last slabs are neighbours
+    const bool periodic_y = lbm_params.is_periodic[1];
+    if (rank > 0 || (periodic_y && ranks > 1))
+    {
+        m_has_below = true;
+        m_below = rank > 0 ? rank - 1 : ranks - 1;
+    }
+    if (rank + 1 < ranks || (periodic_y && ranks > 1))
+    {
+        m_has_above = true;
+        m_above = rank + 1 < ranks ? rank + 1 : 0;
+    }
+    m_first_row = m_has_below ? 1 : 0;
+
+    // The sub-lattice: the owned rows between the ghost rows. The slabs stream
+    // across their borders through the ghost rows, never periodically on their own.
+    const size_t local_ny = (m_row_end - m_row_begin) + m_has_below + m_has_above;
+    LBMParams local_params = lbm_params;
+    local_params.dimensions = {nx, local_ny};
+    local_params.is_periodic = {lbm_params.is_periodic[0], ranks == 1 && periodic_y};
+
+    // The corners of the whole grid are solid if it is periodic in neither direction,
+    // those of the sub-lattice are not
+    const bool solid_corners = !lbm_params.is_periodic[0] && !periodic_y;
+
+    D2Q9InitialConditions local_initials;
+    local_initials.solid_corners = false;
+    local_initials.cell_type.reserve(nx * local_ny);
+    local_initials.initial_rho.reserve(nx * local_ny);
+    local_initials.initial_u.reserve(nx * local_ny);
+    for (size_t local_y = 0; local_y < local_ny; local_y++)
+    {
+        const size_t y = (m_row_begin + ny + local_y - m_first_row) % ny;
+        for (size_t x = 0; x < nx; x++)
+        {
+            const size_t idx = y * nx + x;
+            const bool corner = (x == 0 || x == nx - 1) && (y == 0 || y == ny - 1);
+            local_initials.cell_type.push_back(solid_corners && corner ? CellType::SOLID : initials.cell_type[idx]);
+            local_initials.initial_rho.push_back(initials.initial_rho[idx]);
+            local_initials.initial_u.push_back(initials.initial_u[idx]);
+        }
+    }
+
+    m_lattice = std::make_unique<Lattice>(local_params, local_initials, D2Q9Kernel::FUSED);
+
+    m_send_up.resize(3 * nx);
+    m_send_down.resize(3 * nx);
+    m_recv_below.resize(3 * nx);
+    m_recv_above.resize(3 * nx);
+}
+
+template <typename Precision>
+void D2Q9Decomposed<Precision>::step()
+{
+    const size_t rows = m_row_end - m_row_begin;
+    const size_t last_row = m_first_row + rows - 1;
+    const size_t message_bytes = m_send_up.size() * sizeof(Storage);
+
+    // The populations leaving the border rows, then the ones entering the ghost rows
+    if (m_has_above)
+    {
+        m_lattice->pack_row(last_row, 1, m_send_up.data());
+        m_transport.post_send(m_above, TAG_UP, m_send_up.data(), message_bytes);
+    }
+    if (m_has_below)
+    {
+        m_lattice->pack_row(m_first_row, -1, m_send_down.data());
+        m_transport.post_send(m_below, TAG_DOWN, m_send_down.data(), message_bytes);
+    }
+    if (m_has_below)
+        m_transport.post_recv(m_below, TAG_UP, m_recv_below.data(), message_bytes);
+    if (m_has_above)
+        m_transport.post_recv(m_above, TAG_DOWN, m_recv_above.data(), message_bytes);
+
+    // The interior rows do not pull from the ghost rows
+    const size_t interior_begin = m_first_row + m_has_below;
+    const size_t interior_end = std::max(interior_begin, m_first_row + rows - m_has_above);
+    {
+        PROFILE_SCOPE("decomposed.interior");
+        m_lattice->sweep_rows(interior_begin, interior_end);
+    }
+
+    {
+        PROFILE_SCOPE("decomposed.halo_wait");
+        m_transport.wait_all();
+    }
+
+    PROFILE_SCOPE("decomposed.border");
+    if (m_has_below)
+        m_lattice->unpack_row(0, 1, m_recv_below.data());
+    if (m_has_above)
+        m_lattice->unpack_row(last_row + 1, -1, m_recv_above.data());
+    m_lattice->sweep_rows(m_first_row, interior_begin);
+    m_lattice->sweep_rows(interior_end, m_first_row + rows);
+    m_lattice->end_sweep();
+}
+
+template <typename Precision>
+void D2Q9Decomposed<Precision>::advance(size_t steps)
+{
+    for (size_t step_cnt = 0; step_cnt < steps; step_cnt++)
+        step();
+}
+
+template <typename Precision>
+void D2Q9Decomposed<Precision>::reduce_diagnostics(double& mass, double& max_speed)
+{
+    const size_t nx = m_dimensions[0];
+    const auto& rho = m_lattice->get_density();
+    const auto& u = m_lattice->get_velocity();
+
+    std::array<double, 2> partial = {0.0, 0.0};
+    for (size_t idx = m_first_row * nx; idx < (m_first_row + m_row_end - m_row_begin) * nx; idx++)
+    {
+        if (m_lattice->get_cell_type(idx) == CellType::SOLID) continue;
+        partial[0] += rho[idx];
+        partial[1] = std::max(partial[1], static_cast<double>(std::hypot(u[idx][0], u[idx][1])));
+    }
+
+    // Rank 0 combines the partial results in the order of the ranks and hands the totals back
+    const size_t ranks = m_transport.size();
+    const size_t message_bytes = sizeof(partial);
+    std::array<double, 2> total = partial;
+    if (m_transport.rank() == 0)
+    {
+        std::vector<std::array<double, 2>> partials(ranks);
+        for (size_t rank = 1; rank < ranks; rank++)
+            m_transport.post_recv(rank, TAG_DIAGNOSTICS, partials[rank].data(), message_bytes);
+        m_transport.wait_all();
+
+        for (size_t rank = 1; rank < ranks; rank++)
+        {
+            total[0] += partials[rank][0];
+            total[1] = std::max(total[1], partials[rank][1]);
+        }
+        for (size_t rank = 1; rank < ranks; rank++)
+            m_transport.post_send(rank, TAG_DIAGNOSTICS, total.data(), message_bytes);
+        m_transport.wait_all();
+    }
+    else
+    {
+        m_transport.post_send(0, TAG_DIAGNOSTICS, partial.data(), message_bytes);
+        m_transport.post_recv(0, TAG_DIAGNOSTICS, total.data(), message_bytes);
+        m_transport.wait_all();
+    }
+
+    mass = total[0];
+    max_speed = total[1];
+}
+
+template <typename Precision>
+void D2Q9Decomposed<Precision>::gather_fields(std::vector<Scalar>& rho, std::vector<VelocityVec>& u)
+{
+    const size_t nx = m_dimensions[0];
+    const size_t ny = m_dimensions[1];
+    const size_t owned_begin = m_first_row * nx;
+    const size_t owned_size = (m_row_end - m_row_begin) * nx;
+    const Scalar* local_rho = m_lattice->get_density().data() + owned_begin;
+    const VelocityVec* local_u = m_lattice->get_velocity().data() + owned_begin;
+
+    if (m_transport.rank() != 0)
+    {
+        rho.clear();
+        u.clear();
+        m_transport.post_send(0, TAG_FIELDS, local_rho, owned_size * sizeof(Scalar));
+        m_transport.post_send(0, TAG_FIELDS, local_u, owned_size * sizeof(VelocityVec));
+        m_transport.wait_all();
+        return;
+    }
+
+    rho.resize(nx * ny);
+    u.resize(nx * ny);
+    std::copy(local_rho, local_rho + owned_size, rho.begin() + m_row_begin * nx);
+    std::copy(local_u, local_u + owned_size, u.begin() + m_row_begin * nx);
+
+    const size_t ranks = m_transport.size();
+    for (size_t rank = 1; rank < ranks; rank++)
+    {
+        const size_t begin = ny * rank / ranks * nx;
+        const size_t size = ny * (rank + 1) / ranks * nx - begin;
+        m_transport.post_recv(rank, TAG_FIELDS, rho.data() + begin, size * sizeof(Scalar));
+        m_transport.post_recv(rank, TAG_FIELDS, u.data() + begin, size * sizeof(VelocityVec));
+    }
+    m_transport.wait_all();
+}
+
+template class D2Q9Decomposed<double>;
+template class D2Q9Decomposed<float>;
+template class D2Q9Decomposed<MixedPrecision>;
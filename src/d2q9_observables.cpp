@@ -1,20 +1,25 @@
 #include "d2q9_observables.h"
+#include "derived_fields.h"
 
-const std::map<std::string, ComputeFunc> compute_functions = 
-{
-    {"speed", D2Q9_compute_speed},
-    {"vorticity", D2Q9_compute_vorticity},
-    {"density", D2Q9_compute_density},
-    {"zero", D2Q9_compute_zero}
-};
-
-const std::map<std::string, ComputeFunc>& get_compute_functions() 
+template <typename Precision>
+const std::map<std::string, ComputeFunc<Precision>>& get_compute_functions() 
 {
+    static const std::map<std::string, ComputeFunc<Precision>> compute_functions = 
+    {
+        {"speed", D2Q9_compute_speed<Precision>},
+        {"vorticity", D2Q9_compute_vorticity<Precision>},
+        {"divergence", D2Q9_compute_divergence<Precision>},
+        {"q_criterion", D2Q9_compute_q_criterion<Precision>},
+        {"strain_rate", D2Q9_compute_strain_rate<Precision>},
+        {"density", D2Q9_compute_density<Precision>},
+        {"zero", D2Q9_compute_zero<Precision>}
+    };
     return compute_functions;
 }
 
 // Observable computation functions
-void D2Q9_compute_speed(const D2Q9& lbm, 
+template <typename Precision>
+void D2Q9_compute_speed(const D2Q9<Precision>& lbm, 
                         std::vector<float>& out_field,
                         const float zero_ref,
                         const float amplitude)
@@ -24,14 +29,15 @@ void D2Q9_compute_speed(const D2Q9& lbm,
                    lbm.get_velocity().begin(), 
                    lbm.get_velocity().end(), 
                    out_field.begin(), 
-                   [scale, zero_ref](D2Q9::VelocityVec val)
+                   [scale, zero_ref](const typename D2Q9<Precision>::VelocityVec& val)
                    {
                         float value = static_cast<float>(hypot(val[0], val[1]));
                         return scale * value + zero_ref;
                    });
 }
 
-void D2Q9_compute_density(const D2Q9& lbm, 
+template <typename Precision>
+void D2Q9_compute_density(const D2Q9<Precision>& lbm, 
                           std::vector<float>& out_field,
                           const float zero_ref,
                           const float amplitude)
@@ -41,43 +47,94 @@ void D2Q9_compute_density(const D2Q9& lbm,
                    lbm.get_density().begin(), 
                    lbm.get_density().end(), 
                    out_field.begin(), 
-                   [scale, zero_ref](double val)
+                   [scale, zero_ref](typename D2Q9<Precision>::Scalar val)
                    {
                         float value = static_cast<float>(val);
                         return scale * value + zero_ref;
                    });
 }
 
-void D2Q9_compute_vorticity(const D2Q9& lbm, 
+// The fields of the velocity gradient, on the derived-field kernels
+template <typename Precision>
+static void D2Q9_compute_derived(DerivedField field,
+                                 const D2Q9<Precision>& lbm, 
+                                 std::vector<float>& out_field,
+                                 const float zero_ref,
+                                 const float amplitude)
+{
+    LBM<2>::LBMParams params;
+    params.dimensions = lbm.get_dimensions();
+    params.is_periodic = {lbm.is_periodic(0), lbm.is_periodic(1)};
+    const float scale = std::max(1 - zero_ref, zero_ref) / amplitude;
+    compute_derived_field(field, params, lbm.get_velocity().data(), out_field.data(), scale, zero_ref);
+}
+
+template <typename Precision>
+void D2Q9_compute_vorticity(const D2Q9<Precision>& lbm, 
                             std::vector<float>& out_field,
                             const float zero_ref,
                             const float amplitude)
 {
-    const auto& u = lbm.get_velocity();
-    const auto& dims = lbm.get_dimensions();
-    const float scale = std::max(1 - zero_ref, zero_ref) / amplitude;
+    D2Q9_compute_derived(DerivedField::VORTICITY, lbm, out_field, zero_ref, amplitude);
+}
 
-    size_t width = dims[0];
-    size_t height = dims[1];
-    double dudy, dudx, curl;
+template <typename Precision>
+void D2Q9_compute_divergence(const D2Q9<Precision>& lbm, 
+                             std::vector<float>& out_field,
+                             const float zero_ref,
+                             const float amplitude)
+{
+    D2Q9_compute_derived(DerivedField::DIVERGENCE, lbm, out_field, zero_ref, amplitude);
+}
 
-    for (int y=0; y < height; ++y) 
-    {
-        for (int x=0; x < width; ++x)         
-        {
-            dudy = (u[lbm.coords_to_index(x+1, y)][1] - u[lbm.coords_to_index(x-1, y)][1]) * 0.5;
-            dudx = (u[lbm.coords_to_index(x, y+1)][0] - u[lbm.coords_to_index(x, y-1)][0]) * 0.5;
-            curl = dudx - dudy;
+template <typename Precision>
+void D2Q9_compute_q_criterion(const D2Q9<Precision>& lbm, 
+                              std::vector<float>& out_field,
+                              const float zero_ref,
+                              const float amplitude)
+{
+    D2Q9_compute_derived(DerivedField::Q_CRITERION, lbm, out_field, zero_ref, amplitude);
+}
 
-            out_field[lbm.coords_to_index(x,y)] = scale * static_cast<float>(curl) + zero_ref;
-        }
-    }
+template <typename Precision>
+void D2Q9_compute_strain_rate(const D2Q9<Precision>& lbm, 
+                              std::vector<float>& out_field,
+                              const float zero_ref,
+                              const float amplitude)
+{
+    D2Q9_compute_derived(DerivedField::STRAIN_RATE, lbm, out_field, zero_ref, amplitude);
 }
 
-void D2Q9_compute_zero(const D2Q9& lbm, 
+template <typename Precision>
+void D2Q9_compute_zero(const D2Q9<Precision>& lbm, 
                             std::vector<float>& out_field,
                             const float zero_ref,
                             const float amplitude)
 {
     std::fill(out_field.begin(), out_field.end(), zero_ref);
-}
\ No newline at end of file
+}
+
+template <typename Precision>
+void D2Q9_pack_moments(const D2Q9<Precision>& lbm, 
+                       std::vector<std::array<float, 3>>& out_moments)
+{
+    out_moments.resize(lbm.get_density().size());
+    std::transform(std::execution::par,
+                   lbm.get_density().begin(), 
+                   lbm.get_density().end(), 
+                   lbm.get_velocity().begin(), 
+                   out_moments.begin(), 
+                   [](typename D2Q9<Precision>::Scalar rho, const typename D2Q9<Precision>::VelocityVec& u)
+                   {
+                        return std::array<float, 3>{static_cast<float>(rho - 1), 
+                                                    static_cast<float>(u[0]), static_cast<float>(u[1])};
+                   });
+}
+
+template void D2Q9_pack_moments<double>(const D2Q9<double>&, std::vector<std::array<float, 3>>&);
+template void D2Q9_pack_moments<float>(const D2Q9<float>&, std::vector<std::array<float, 3>>&);
+template void D2Q9_pack_moments<MixedPrecision>(const D2Q9<MixedPrecision>&, std::vector<std::array<float, 3>>&);
+
+template const std::map<std::string, ComputeFunc<double>>& get_compute_functions<double>();
+template const std::map<std::string, ComputeFunc<float>>& get_compute_functions<float>();
+template const std::map<std::string, ComputeFunc<MixedPrecision>>& get_compute_functions<MixedPrecision>();
@@ -7,12 +7,59 @@
 #include <array>
 #include <numeric>
 #include <algorithm>
+#include <cstring>
+#include <limits>
 
 
+static constexpr size_t SECTION_ALIGNMENT = 64;
+// The layout packed by scripts/prepare_simulation.py
+static_assert(sizeof(InputFileHeader) == 200, "Unexpected padding in InputFileHeader");
+
+FieldTexture parse_field_texture(const std::string& name)
+{
+    if (name == "float32")
+        return FieldTexture::FLOAT32;
+    if (name == "float16")
+        return FieldTexture::FLOAT16;
+    if (name == "unorm8")
+        return FieldTexture::UNORM8;
+    throw std::runtime_error("Unknown field texture format: " + name);
+}
+
+FieldPooling parse_field_pooling(const std::string& name)
+{
+    if (name == "none")
+        return FieldPooling::NONE;
+    if (name == "mean")
+        return FieldPooling::MEAN;
+    if (name == "min")
+        return FieldPooling::MIN;
+    if (name == "max")
+        return FieldPooling::MAX;
+    throw std::runtime_error("Unknown field pooling: " + name);
+}
+
+uint32_t input_file_version(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) 
+        throw std::runtime_error("Failed to open input file " + filename);
+
+    char magic[sizeof(InputFileHeader::MAGIC)];
+    uint32_t version;
+    if (file.read(magic, sizeof(magic)) && std::memcmp(magic, InputFileHeader::MAGIC, sizeof(magic)) == 0)
+    {
+        if (!file.read(reinterpret_cast<char*>(&version), sizeof(uint32_t)))
+            throw std::runtime_error("Truncated input file " + filename);
+        return version;
+    }
+    return 1;
+}
+
 // Load domain geometry and simulation parameters
 void load_from_binary(const std::string& filename, 
                       LBM<2>::LBMParams& lbm_params, 
-                      D2Q9::InitialConditions& initials, 
+                      D2Q9InitialConditions& initials, 
                       VisualizationParams& visual_params,
                       std::vector<QuantityParams>& render_quant_params,
                       TracersParams& tracers_params) 
@@ -66,6 +113,8 @@ void load_from_binary(const std::string& filename,
     file.read(reinterpret_cast<char*>(&tracers_params.size), sizeof(float));
     file.read(reinterpret_cast<char*>(&tracers_params.emission_rate), sizeof(float));
     file.read(reinterpret_cast<char*>(&tracers_params.random_initial), sizeof(uint64_t));
+    if (!file)
+        throw std::runtime_error("Truncated input file " + filename);
 
     // Load the initial conditions
     size_t total_size = lbm_params.dimensions[0] * lbm_params.dimensions[1];
@@ -98,14 +147,130 @@ void load_from_binary(const std::string& filename,
 
     tracers_params.initial_tracers.resize(num_initial_tracers);
     file.read(reinterpret_cast<char*>(tracers_params.initial_tracers.data()), sizeof(uint64_t) * num_initial_tracers);
+    if (!file)
+        throw std::runtime_error("Truncated input file " + filename);
+
+    // Execution params, optional: older files end with the tracers
+    uint64_t threads;
+    uint8_t binding;
+    if (file.read(reinterpret_cast<char*>(&threads), sizeof(uint64_t))
+        && file.read(reinterpret_cast<char*>(&binding), sizeof(uint8_t)))
+    {
+        if (binding > static_cast<uint8_t>(ThreadBinding::SPREAD))
+            throw std::runtime_error("Unknown thread binding in " + filename);
+        lbm_params.execution = {static_cast<size_t>(threads), static_cast<ThreadBinding>(binding)};
+    }
+}
+
+
+// Map domain geometry and read simulation parameters
+std::shared_ptr<const MappedFile> map_from_binary(const std::string& filename,
+                                                  LBM<2>::LBMParams& lbm_params,
+                                                  D2Q9InitialView& initials,
+                                                  VisualizationParams& visual_params,
+                                                  std::vector<QuantityParams>& render_quant_params,
+                                                  TracersParams& tracers_params)
+{
+    auto file = std::make_shared<const MappedFile>(filename);
+
+    InputFileHeader header;
+    if (file->size() < sizeof(InputFileHeader))
+        throw std::runtime_error("Truncated input file " + filename);
+    std::memcpy(&header, file->data(), sizeof(InputFileHeader));
+
+    if (std::memcmp(header.magic, InputFileHeader::MAGIC, sizeof(header.magic)) != 0)
+        throw std::runtime_error(filename + " is not an input file of version 2");
+    if (header.version != InputFileHeader::VERSION || header.header_bytes != sizeof(InputFileHeader))
+        throw std::runtime_error("Unsupported input file version " + std::to_string(header.version)
+                                 + " in " + filename);
+    if (!header.width || !header.height
+        || header.width > std::numeric_limits<uint64_t>::max() / sizeof(std::array<double, 2>) / header.height)
+        throw std::runtime_error("Invalid grid dimensions in " + filename);
+    if (header.binding > static_cast<uint8_t>(ThreadBinding::SPREAD))
+        throw std::runtime_error("Unknown thread binding in " + filename);
+
+    const uint64_t total_size = header.width * header.height;
+    if (header.tracer_count > total_size)
+        throw std::runtime_error("Corrupt input file " + filename);
+    const std::array<uint64_t, InputFileHeader::SECTIONS> bytes = {
+        header.sections[InputFileHeader::QUANTITIES].bytes, total_size, total_size * sizeof(double),
+        total_size * sizeof(std::array<double, 2>), header.tracer_count * sizeof(uint64_t)};
+
+    for (size_t section = 0; section < InputFileHeader::SECTIONS; section++)
+    {
+        const InputFileHeader::Extent& extent = header.sections[section];
+        if (extent.bytes != bytes[section] || extent.offset % SECTION_ALIGNMENT != 0
+            || extent.offset > file->size() || extent.bytes > file->size() - extent.offset)
+            throw std::runtime_error("Corrupt or truncated input file " + filename);
+    }
+    auto section = [&](InputFileHeader::Section section)
+    {
+        return file->data() + header.sections[section].offset;
+    };
+
+    // LBM params
+    lbm_params.dimensions = {static_cast<size_t>(header.width), static_cast<size_t>(header.height)};
+    lbm_params.is_periodic = {header.periodic_x != 0, header.periodic_y != 0};
+    lbm_params.tau = header.tau;
+    lbm_params.execution = {static_cast<size_t>(header.threads), static_cast<ThreadBinding>(header.binding)};
+
+    // Visualization params
+    visual_params.width = static_cast<size_t>(header.window_width);
+    visual_params.height = static_cast<size_t>(header.window_height);
+    visual_params.steps_per_frame = static_cast<size_t>(header.steps_per_frame);
+
+    // Quantities rendering params: packed records, read with memcpy
+    const char* record = section(InputFileHeader::QUANTITIES);
+    const char* records_end = record + header.sections[InputFileHeader::QUANTITIES].bytes;
+    for (uint32_t i = 0; i < header.quantity_count; i++)
+    {
+        if (records_end - record < 1)
+            throw std::runtime_error("Corrupt input file " + filename);
+        const uint8_t quant_len = static_cast<uint8_t>(*record++);
+        if (static_cast<size_t>(records_end - record) < quant_len + 2 * sizeof(float))
+            throw std::runtime_error("Corrupt input file " + filename);
+        std::string quant_id(record, quant_len);
+        record += quant_len;
+
+        float offset, amplitude;
+        std::memcpy(&offset, record, sizeof(float));
+        std::memcpy(&amplitude, record + sizeof(float), sizeof(float));
+        record += 2 * sizeof(float);
+
+        render_quant_params.push_back({quant_id, offset, amplitude});
+    }
+    if (record != records_end)
+        throw std::runtime_error("Corrupt input file " + filename);
+
+    // Tracers params
+    std::copy(header.tracers_color, header.tracers_color + 4, tracers_params.color.begin());
+    tracers_params.size = header.tracers_size;
+    tracers_params.emission_rate = header.tracers_emission_rate;
+    tracers_params.random_initial = static_cast<size_t>(header.tracers_random_initial);
+    const uint64_t* tracers = reinterpret_cast<const uint64_t*>(section(InputFileHeader::TRACERS));
+    tracers_params.initial_tracers.assign(tracers, tracers + header.tracer_count);
+
+    // The initial conditions, in place. The cell types are checked here, so that a corrupt
+    // file fails now instead of leaving unknown cells in the lattice.
+    const uint8_t* cell_type = reinterpret_cast<const uint8_t*>(section(InputFileHeader::CELL_TYPES));
+    if (std::any_of(cell_type, cell_type + total_size, [](uint8_t type) { return type > CellType::OUTFLOW; }))
+        throw std::runtime_error("Unknown cell type in " + filename);
+
+    initials.size = static_cast<size_t>(total_size);
+    initials.cell_type = reinterpret_cast<const CellType*>(cell_type);
+    initials.initial_rho = reinterpret_cast<const double*>(section(InputFileHeader::DENSITY));
+    initials.initial_u = reinterpret_cast<const std::array<double, 2>*>(section(InputFileHeader::VELOCITY));
+    initials.solid_corners = true;
+
+    return file;
 }
 
 
 // Sample initial conditions
-D2Q9::InitialConditions sample_d2q9(const LBM<2>::LBMParams& params)
+D2Q9InitialConditions sample_d2q9(const LBM<2>::LBMParams& params)
 {
-    const D2Q9::VelocityVec u0 = {0.1, 0.0}; // Inflow velocity    
-    D2Q9::InitialConditions initials;
+    const std::array<double, 2> u0 = {0.1, 0.0}; // Inflow velocity    
+    D2Q9InitialConditions initials;
 
     size_t total_cells = params.dimensions[0] * params.dimensions[1];
 
@@ -115,11 +280,11 @@ D2Q9::InitialConditions sample_d2q9(const LBM<2>::LBMParams& params)
 
     //Inflow on the left boundary
     for (size_t y = 0; y < params.dimensions[1]; y++) 
-        initials.cell_type[D2Q9::coords_to_index(0, y, params)] = CellType::INFLOW;
+        initials.cell_type[D2Q9<>::coords_to_index(0, y, params)] = CellType::INFLOW;
 
     // An obstacle
     for(size_t x = 35; x < 55; x++) 
-        initials.cell_type[D2Q9::coords_to_index(x, 85-x, params)] = CellType::SOLID;    
+        initials.cell_type[D2Q9<>::coords_to_index(x, 85-x, params)] = CellType::SOLID;    
 
     return initials;
 }
\ No newline at end of file
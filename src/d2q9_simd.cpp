@@ -0,0 +1,188 @@
+#include "d2q9_simd.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Thin wrappers over the vector instruction sets, so that the kernels are written once.
+// select(m, a, b) picks a where the mask m is set and b elsewhere.
+
+struct ScalarOps
+{
+    using Vec = double;
+    using Mask = bool;
+    static constexpr size_t WIDTH = 1;
+
+    static Vec load(const double* ptr) { return *ptr; }
+    static void store(double* ptr, Vec v) { *ptr = v; }
+    static Vec set1(double val) { return val; }
+    static Vec add(Vec a, Vec b) { return a + b; }
+    static Vec sub(Vec a, Vec b) { return a - b; }
+    static Vec mul(Vec a, Vec b) { return a * b; }
+    static Vec div(Vec a, Vec b) { return a / b; }
+    static Mask nonzero(Vec a) { return a != 0.0; }
+    static Mask greater(Vec a, Vec b) { return a > b; }
+    static Vec select(Mask m, Vec a, Vec b) { return m ? a : b; }
+};
+
+#if defined(__AVX2__)
+struct Avx2Ops
+{
+    using Vec = __m256d;
+    using Mask = __m256d;
+    static constexpr size_t WIDTH = 4;
+
+    static Vec load(const double* ptr) { return _mm256_loadu_pd(ptr); }
+    static void store(double* ptr, Vec v) { _mm256_storeu_pd(ptr, v); }
+    static Vec set1(double val) { return _mm256_set1_pd(val); }
+    static Vec add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+    static Vec sub(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+    static Vec mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+    static Vec div(Vec a, Vec b) { return _mm256_div_pd(a, b); }
+    static Mask nonzero(Vec a) { return _mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_NEQ_OQ); }
+    static Mask greater(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    static Vec select(Mask m, Vec a, Vec b) { return _mm256_blendv_pd(b, a, m); }
+};
+#endif
+
+#if defined(__AVX512F__)
+struct Avx512Ops
+{
+    using Vec = __m512d;
+    using Mask = __mmask8;
+    static constexpr size_t WIDTH = 8;
+
+    static Vec load(const double* ptr) { return _mm512_loadu_pd(ptr); }
+    static void store(double* ptr, Vec v) { _mm512_storeu_pd(ptr, v); }
+    static Vec set1(double val) { return _mm512_set1_pd(val); }
+    static Vec add(Vec a, Vec b) { return _mm512_add_pd(a, b); }
+    static Vec sub(Vec a, Vec b) { return _mm512_sub_pd(a, b); }
+    static Vec mul(Vec a, Vec b) { return _mm512_mul_pd(a, b); }
+    static Vec div(Vec a, Vec b) { return _mm512_div_pd(a, b); }
+    static Mask nonzero(Vec a) { return _mm512_cmp_pd_mask(a, _mm512_setzero_pd(), _CMP_NEQ_OQ); }
+    static Mask greater(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+    static Vec select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_pd(m, b, a); }
+};
+#endif
+
+#if defined(__AVX512F__)
+using WideOps = Avx512Ops;
+#elif defined(__AVX2__)
+using WideOps = Avx2Ops;
+#else
+using WideOps = ScalarOps;
+#endif
+
+// The D2Q9 lattice constants, in the same order as in D2Q9
+static constexpr int EX[9] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+static constexpr int EY[9] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+static constexpr double W[9] = {4.0/9.0, 1.0/9.0, 1.0/9.0, 1.0/9.0, 1.0/9.0,
+                                1.0/36.0, 1.0/36.0, 1.0/36.0, 1.0/36.0};
+
+template <typename Ops>
+static size_t collide_range(double* const* f, const double* rho, const double* ux, const double* uy,
+                            const double* fluid_mask, const double inv_tau, size_t begin, size_t end)
+{
+    using Vec = typename Ops::Vec;
+    const Vec one = Ops::set1(1.0);
+    const Vec c1 = Ops::set1(3.0);
+    const Vec c2 = Ops::set1(4.5);
+    const Vec c3 = Ops::set1(1.5);
+    const Vec omega = Ops::set1(inv_tau);
+
+    size_t idx = begin;
+    for (; idx + Ops::WIDTH <= end; idx += Ops::WIDTH)
+    {
+        const auto mask = Ops::nonzero(Ops::load(fluid_mask + idx));
+        const Vec r = Ops::load(rho + idx);
+        const Vec u = Ops::load(ux + idx);
+        const Vec v = Ops::load(uy + idx);
+        const Vec usq_term = Ops::mul(c3, Ops::add(Ops::mul(u, u), Ops::mul(v, v)));
+
+        for (size_t dir = 0; dir < 9; dir++)
+        {
+            // e.u is a signed sum of the velocity components
+            Vec eu = Ops::set1(0.0);
+            if (EX[dir] > 0) eu = Ops::add(eu, u); else if (EX[dir] < 0) eu = Ops::sub(eu, u);
+            if (EY[dir] > 0) eu = Ops::add(eu, v); else if (EY[dir] < 0) eu = Ops::sub(eu, v);
+
+            const Vec poly = Ops::sub(Ops::add(Ops::add(one, Ops::mul(c1, eu)),
+                                               Ops::mul(c2, Ops::mul(eu, eu))),
+                                      usq_term);
+            const Vec f_eq = Ops::mul(Ops::mul(Ops::set1(W[dir]), r), poly);
+            const Vec f_old = Ops::load(f[dir] + idx);
+            const Vec f_new = Ops::sub(f_old, Ops::mul(omega, Ops::sub(f_old, f_eq)));
+            Ops::store(f[dir] + idx, Ops::select(mask, f_new, f_old));
+        }
+    }
+    return idx;
+}
+
+template <typename Ops>
+static size_t moments_range(const double* const* f, double* rho, double* ux, double* uy,
+                            const double* fluid_mask, const double min_density, size_t begin, size_t end)
+{
+    using Vec = typename Ops::Vec;
+    const Vec threshold = Ops::set1(min_density);
+
+    size_t idx = begin;
+    for (; idx + Ops::WIDTH <= end; idx += Ops::WIDTH)
+    {
+        const auto mask = Ops::nonzero(Ops::load(fluid_mask + idx));
+        Vec fd[9];
+        for (size_t dir = 0; dir < 9; dir++)
+            fd[dir] = Ops::load(f[dir] + idx);
+
+        Vec r = fd[0];
+        for (size_t dir = 1; dir < 9; dir++)
+            r = Ops::add(r, fd[dir]);
+
+        // Momentum: e_x = +1 for 1, 5, 8 and -1 for 3, 6, 7; e_y = +1 for 2, 5, 6 and -1 for 4, 7, 8
+        Vec mx = Ops::sub(Ops::add(Ops::add(fd[1], fd[5]), fd[8]), Ops::add(Ops::add(fd[3], fd[6]), fd[7]));
+        Vec my = Ops::sub(Ops::add(Ops::add(fd[2], fd[5]), fd[6]), Ops::add(Ops::add(fd[4], fd[7]), fd[8]));
+
+        const auto dense = Ops::greater(r, threshold);
+        mx = Ops::select(dense, Ops::div(mx, r), mx);
+        my = Ops::select(dense, Ops::div(my, r), my);
+
+        Ops::store(rho + idx, Ops::select(mask, r, Ops::load(rho + idx)));
+        Ops::store(ux + idx, Ops::select(mask, mx, Ops::load(ux + idx)));
+        Ops::store(uy + idx, Ops::select(mask, my, Ops::load(uy + idx)));
+    }
+    return idx;
+}
+
+void D2Q9_soa_collide(double* const* f,
+                      const double* rho,
+                      const double* ux,
+                      const double* uy,
+                      const double* fluid_mask,
+                      const double inv_tau,
+                      size_t begin, size_t end)
+{
+    size_t tail = collide_range<WideOps>(f, rho, ux, uy, fluid_mask, inv_tau, begin, end);
+    collide_range<ScalarOps>(f, rho, ux, uy, fluid_mask, inv_tau, tail, end);
+}
+
+void D2Q9_soa_moments(const double* const* f,
+                      double* rho,
+                      double* ux,
+                      double* uy,
+                      const double* fluid_mask,
+                      const double min_density,
+                      size_t begin, size_t end)
+{
+    size_t tail = moments_range<WideOps>(f, rho, ux, uy, fluid_mask, min_density, begin, end);
+    moments_range<ScalarOps>(f, rho, ux, uy, fluid_mask, min_density, tail, end);
+}
+
+const char* D2Q9_simd_isa()
+{
+#if defined(__AVX512F__)
+    return "avx512";
+#elif defined(__AVX2__)
+    return "avx2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,91 @@
+#include "field_downsampler.h"
+#include <algorithm>
+#include <execution>
+#include <limits>
+
+// The rows of the output pooled by a task
+static constexpr size_t BAND_ROWS = 16;
+
+size_t pooling_factor(const GridRect& rect, size_t max_width, size_t max_height)
+{
+    const size_t along_x = (rect.width + max_width - 1) / std::max<size_t>(max_width, 1);
+    const size_t along_y = (rect.height + max_height - 1) / std::max<size_t>(max_height, 1);
+    return std::max({along_x, along_y, size_t{1}});
+}
+
+// A row of the output, from the rows of the field behind it: every row of the field is
+// folded into the row of the output in turn
+template <FieldPooling POOLING>
+static void pool_row(const float* field, size_t grid_width, const GridRect& rect, size_t factor,
+                     size_t out_row, float* out, size_t out_width)
+{
+    const size_t y_begin = rect.y + out_row * factor;
+    const size_t y_end = std::min(y_begin + factor, rect.y + rect.height);
+
+    float initial = 0.0f;
+    if constexpr (POOLING == FieldPooling::MIN)
+        initial = std::numeric_limits<float>::infinity();
+    else if constexpr (POOLING == FieldPooling::MAX)
+        initial = -std::numeric_limits<float>::infinity();
+    std::fill(out, out + out_width, initial);
+
+    for (size_t y = y_begin; y < y_end; y++)
+    {
+        const float* row = field + y * grid_width + rect.x;
+        for (size_t i = 0; i < out_width; i++)
+        {
+            const size_t x_end = std::min((i + 1) * factor, rect.width);
+            float value = out[i];
+            for (size_t x = i * factor; x < x_end; x++)
+            {
+                if constexpr (POOLING == FieldPooling::MIN)
+                    value = std::min(value, row[x]);
+                else if constexpr (POOLING == FieldPooling::MAX)
+                    value = std::max(value, row[x]);
+                else
+                    value += row[x];
+            }
+            out[i] = value;
+        }
+    }
+
+    if constexpr (POOLING == FieldPooling::MEAN)
+    {
+        const size_t rows = y_end - y_begin;
+        for (size_t i = 0; i < out_width; i++)
+            out[i] /= static_cast<float>(rows * (std::min((i + 1) * factor, rect.width) - i * factor));
+    }
+}
+
+void downsample_field(const float* field, size_t grid_width, const GridRect& rect, size_t factor,
+                      FieldPooling pooling, std::vector<float>& out)
+{
+    factor = std::max<size_t>(factor, 1);
+    const size_t out_width = (rect.width + factor - 1) / factor;
+    const size_t out_height = (rect.height + factor - 1) / factor;
+    out.resize(out_width * out_height);
+
+    std::vector<size_t> bands;
+    for (size_t row = 0; row < out_height; row += BAND_ROWS)
+        bands.push_back(row);
+    std::for_each(std::execution::par, bands.begin(), bands.end(),
+                  [&](size_t begin)
+                  {
+                      const size_t end = std::min(begin + BAND_ROWS, out_height);
+                      for (size_t row = begin; row < end; row++)
+                      {
+                          float* out_row = out.data() + row * out_width;
+                          if (factor == 1)
+                          {
+                              const float* source = field + (rect.y + row) * grid_width + rect.x;
+                              std::copy(source, source + out_width, out_row);
+                          }
+                          else if (pooling == FieldPooling::MIN)
+                              pool_row<FieldPooling::MIN>(field, grid_width, rect, factor, row, out_row, out_width);
+                          else if (pooling == FieldPooling::MAX)
+                              pool_row<FieldPooling::MAX>(field, grid_width, rect, factor, row, out_row, out_width);
+                          else
+                              pool_row<FieldPooling::MEAN>(field, grid_width, rect, factor, row, out_row, out_width);
+                      }
+                  });
+}
@@ -0,0 +1,450 @@
+#include "field_output.h"
+#include "half_float.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+FieldType parse_field_type(const std::string& name)
+{
+    if (name == "float64")
+        return FieldType::FLOAT64;
+    if (name == "float32")
+        return FieldType::FLOAT32;
+    if (name == "float16")
+        return FieldType::FLOAT16;
+    throw std::runtime_error("Unknown field type: " + name);
+}
+
+static size_t type_bytes(FieldType type)
+{
+    switch (type)
+    {
+        case FieldType::FLOAT64: return sizeof(double);
+        case FieldType::FLOAT32: return sizeof(float);
+        default: return sizeof(uint16_t);
+    }
+}
+
+static bool little_endian()
+{
+    const uint16_t probe = 1;
+    unsigned char first;
+    std::memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+// The numpy dtype of the values, in the byte order of this machine
+static std::string numpy_dtype(FieldType type)
+{
+    return std::string(little_endian() ? "<" : ">") + "f" + std::to_string(type_bytes(type));
+}
+
+static void store(double value, double& out) { out = value; }
+static void store(double value, float& out) { out = static_cast<float>(value); }
+static void store(double value, uint16_t& out) { out = to_half(static_cast<float>(value)); }
+
+// Writes value(x, y, component) over the region, row by row
+template <typename Out, typename Value>
+static void fill_region(const FieldRegion& region, size_t components, Value value, std::vector<char>& buffer)
+{
+    buffer.resize(region.width * region.height * components * sizeof(Out));
+    Out* out = reinterpret_cast<Out*>(buffer.data());
+    for (size_t y = region.y; y < region.y + region.height; y++)
+        for (size_t x = region.x; x < region.x + region.width; x++)
+            for (size_t component = 0; component < components; component++)
+                store(value(x, y, component), *out++);
+}
+
+template <typename Value>
+static void fill_region(FieldType type, const FieldRegion& region, size_t components, Value value,
+                        std::vector<char>& buffer)
+{
+    switch (type)
+    {
+        case FieldType::FLOAT64: fill_region<double>(region, components, value, buffer); break;
+        case FieldType::FLOAT32: fill_region<float>(region, components, value, buffer); break;
+        case FieldType::FLOAT16: fill_region<uint16_t>(region, components, value, buffer); break;
+    }
+}
+
+static std::string base_name(const std::string& path)
+{
+    const size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// The ends of the index and of the XDMF description, after the last frame
+static const std::string INDEX_TAIL = "]\n}\n";
+static const std::string XDMF_TAIL = "    </Grid>\n  </Domain>\n</Xdmf>\n";
+
+// Writes to a temporary file first and renames it, so that readers never see a partial file
+static void replace_file(const std::string& filename, const std::string& contents)
+{
+    const std::string temporary = filename + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file.is_open())
+            throw std::runtime_error("Failed to open output file " + temporary);
+        file << contents;
+        if (!file)
+            throw std::runtime_error("Failed to write output file " + temporary);
+    }
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("Failed to rename " + temporary + " to " + filename);
+}
+
+FieldSeries::Quantity FieldSeries::parse_quantity(const std::string& name)
+{
+    if (name == "density")
+        return Quantity::DENSITY;
+    if (name == "velocity")
+        return Quantity::VELOCITY;
+    if (name == "speed")
+        return Quantity::SPEED;
+    if (name == "vorticity")
+        return Quantity::VORTICITY;
+    if (name == "divergence")
+        return Quantity::DIVERGENCE;
+    if (name == "q_criterion")
+        return Quantity::Q_CRITERION;
+    if (name == "strain_rate")
+        return Quantity::STRAIN_RATE;
+    throw std::runtime_error("Unknown field quantity: " + name);
+}
+
+// The whole grid for an empty region
+FieldRegion FieldSeries::clip_region(const FieldRegion& region, const LBM<2>::LBMParams& lbm_params)
+{
+    const size_t nx = lbm_params.dimensions[0];
+    const size_t ny = lbm_params.dimensions[1];
+    if (!region.width || !region.height)
+        return {0, 0, nx, ny};
+    if (region.x >= nx || region.y >= ny || region.width > nx - region.x || region.height > ny - region.y)
+        throw std::runtime_error("The field output region lies outside the grid");
+    return region;
+}
+
+void FieldSeries::validate(const FieldOutputParams& params, const LBM<2>::LBMParams& lbm_params)
+{
+    clip_region(params.region, lbm_params);
+    for (const std::string& name : params.quantities)
+        parse_quantity(name);
+    if (params.quantities.empty())
+        throw std::runtime_error("No field quantities to write");
+}
+
+FieldSeries::FieldSeries(const FieldOutputParams& params, const LBM<2>::LBMParams& lbm_params, uint64_t first_step):
+    m_lbm_params(lbm_params), m_type(params.type), m_region(clip_region(params.region, lbm_params)),
+    m_prefix(params.prefix)
+{
+    validate(params, lbm_params);
+    for (const std::string& name : params.quantities)
+    {
+        Output output;
+        output.name = name;
+        output.quantity = parse_quantity(name);
+        output.components = output.quantity == Quantity::VELOCITY ? 2 : 1;
+        if (output.quantity != Quantity::DENSITY && output.quantity != Quantity::VELOCITY 
+            && output.quantity != Quantity::SPEED)
+            output.derived = parse_derived_field(name);
+        output.filename = m_prefix + "_" + name + ".raw";
+        m_outputs.push_back(std::move(output));
+    }
+
+    const bool resumed = first_step && resume(first_step);
+    for (Output& output : m_outputs)
+    {
+        output.file.open(output.filename, std::ios::binary | (resumed ? std::ios::app : std::ios::trunc));
+        if (!output.file.is_open())
+            throw std::runtime_error("Failed to open output file " + output.filename);
+    }
+    write_metadata();
+
+    m_thread = std::thread(&FieldSeries::writer_loop, this);
+}
+
+bool FieldSeries::resume(uint64_t first_step)
+{
+    std::ifstream file(m_prefix + ".json", std::ios::binary);
+    if (!file.is_open())
+        return false;
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    const std::string index = contents.str();
+    const std::string head = index_head();
+    if (index.compare(0, head.size(), head) != 0)
+        throw std::runtime_error("The field series " + m_prefix + " was written with other settings; "
+                                 "choose another --fields-prefix to restart");
+
+    // The steps, in increasing order, up to the tail
+    std::istringstream steps(index.substr(head.size()));
+    uint64_t step;
+    char separator = ',';
+    while (separator == ',' && steps >> step && step <= first_step)
+    {
+        m_steps.push_back(step);
+        steps >> separator;
+    }
+
+    // Drops the frames past the restart, and any not listed yet
+    for (const Output& output : m_outputs)
+    {
+        const uintmax_t bytes = m_steps.size() * frame_bytes(output);
+        std::error_code error;
+        if (std::filesystem::file_size(output.filename, error) < bytes || error)
+            throw std::runtime_error("The field series file " + output.filename + " is shorter than its index");
+        std::filesystem::resize_file(output.filename, bytes);
+    }
+    std::cout << "Appending to the field series " << m_prefix << " after " << m_steps.size() << " frames" << std::endl;
+    return true;
+}
+
+FieldSeries::~FieldSeries()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this] { return !m_busy; });
+        m_stop = true;
+    }
+    m_changed.notify_all();
+    m_thread.join();
+
+    if (m_error)
+    {
+        try
+        {
+            std::rethrow_exception(m_error);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "The last field frame was not written: " << e.what() << std::endl;
+        }
+    }
+}
+
+template <typename Scalar>
+void FieldSeries::capture(uint64_t step, const Scalar* rho, const std::array<Scalar, 2>* u, FieldFrame& frame) const
+{
+    const LBM<2>::LBMParams& params = m_lbm_params;
+    const size_t nx = params.dimensions[0];
+
+    frame.step = step;
+    frame.quantities.resize(m_outputs.size());
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        const Output& output = m_outputs[i];
+        switch (output.quantity)
+        {
+            case Quantity::DENSITY:
+                fill_region(m_type, m_region, 1, [=](size_t x, size_t y, size_t)
+                            {
+                                return static_cast<double>(rho[y * nx + x]);
+                            }, frame.quantities[i]);
+                break;
+            case Quantity::VELOCITY:
+                fill_region(m_type, m_region, 2, [=](size_t x, size_t y, size_t component)
+                            {
+                                return static_cast<double>(u[y * nx + x][component]);
+                            }, frame.quantities[i]);
+                break;
+            case Quantity::SPEED:
+                fill_region(m_type, m_region, 1, [=](size_t x, size_t y, size_t)
+                            {
+                                const auto& cell_u = u[y * nx + x];
+                                return std::hypot(static_cast<double>(cell_u[0]), static_cast<double>(cell_u[1]));
+                            }, frame.quantities[i]);
+                break;
+            case Quantity::VORTICITY:
+            case Quantity::DIVERGENCE:
+            case Quantity::Q_CRITERION:
+            case Quantity::STRAIN_RATE:
+            {
+                // As the rendered fields, over the whole grid for the neighbors of the region
+                std::vector<double>& derived = m_derived;
+                derived.resize(params.dimensions[0] * params.dimensions[1]);
+                compute_derived_field(output.derived, params, u, derived.data());
+                fill_region(m_type, m_region, 1, [&derived, nx](size_t x, size_t y, size_t)
+                            {
+                                return derived[y * nx + x];
+                            }, frame.quantities[i]);
+                break;
+            }
+        }
+    }
+}
+
+void FieldSeries::submit(FieldFrame& frame)
+{
+    wait();
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        std::swap(m_pending, frame);
+        m_busy = true;
+    }
+    m_changed.notify_all();
+}
+
+void FieldSeries::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this] { return !m_busy; });
+    if (m_error)
+        std::rethrow_exception(std::exchange(m_error, nullptr));
+}
+
+void FieldSeries::writer_loop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_changed.wait(lock, [this] { return m_stop || m_busy; });
+        if (m_stop) return;
+
+        // The frame is left alone by submit() until the write is done
+        lock.unlock();
+        std::exception_ptr error;
+        try
+        {
+            write_frame();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        m_error = error;
+        m_busy = false;
+        m_changed.notify_all();
+    }
+}
+
+size_t FieldSeries::frame_bytes(const Output& output) const
+{
+    return m_region.width * m_region.height * output.components * type_bytes(m_type);
+}
+
+void FieldSeries::write_frame()
+{
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        Output& output = m_outputs[i];
+        const std::vector<char>& data = m_pending.quantities[i];
+        if (data.size() != frame_bytes(output))
+            throw std::runtime_error("Inconsistent field frame");
+        output.file.write(data.data(), data.size());
+        output.file.flush();
+        if (!output.file)
+            throw std::runtime_error("Failed to write output file " + output.filename);
+    }
+
+    // The index only lists the frames once they are in the files
+    m_steps.push_back(m_pending.step);
+    append_metadata();
+}
+
+std::string FieldSeries::index_head() const
+{
+    std::ostringstream index;
+    index << "{\n"
+          << "  \"format\": \"lbm-field-series\",\n"
+          << "  \"version\": 1,\n"
+          << "  \"grid\": [" << m_lbm_params.dimensions[0] << ", " << m_lbm_params.dimensions[1] << "],\n"
+          << "  \"region\": {\"x\": " << m_region.x << ", \"y\": " << m_region.y
+          << ", \"width\": " << m_region.width << ", \"height\": " << m_region.height << "},\n"
+          << "  \"dtype\": \"" << numpy_dtype(m_type) << "\",\n"
+          << "  \"order\": \"C\",\n"
+          << "  \"quantities\": [\n";
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        const Output& output = m_outputs[i];
+        index << "    {\"name\": \"" << output.name << "\", \"file\": \"" << base_name(output.filename)
+              << "\", \"frame_shape\": [" << m_region.height << ", " << m_region.width;
+        if (output.components > 1)
+            index << ", " << output.components;
+        index << "], \"frame_bytes\": " << frame_bytes(output) << "}"
+              << (i + 1 < m_outputs.size() ? ",\n" : "\n");
+    }
+    index << "  ],\n"
+          << "  \"steps\": [";
+    return index.str();
+}
+
+std::string FieldSeries::xdmf_head() const
+{
+    return "<?xml version=\"1.0\" ?>\n"
+           "<Xdmf Version=\"3.0\">\n"
+           "  <Domain>\n"
+           "    <Grid Name=\"" + base_name(m_prefix) + "\" GridType=\"Collection\" CollectionType=\"Temporal\">\n";
+}
+
+std::string FieldSeries::xdmf_frame(size_t frame) const
+{
+    const std::string dimensions = std::to_string(m_region.height) + " " + std::to_string(m_region.width);
+    const char* endian = little_endian() ? "Little" : "Big";
+
+    std::ostringstream xdmf;
+    xdmf << "      <Grid Name=\"step_" << m_steps[frame] << "\" GridType=\"Uniform\">\n"
+         << "        <Time Value=\"" << m_steps[frame] << "\"/>\n"
+         << "        <Topology TopologyType=\"2DCoRectMesh\" Dimensions=\"" << dimensions << "\"/>\n"
+         << "        <Geometry GeometryType=\"ORIGIN_DXDY\">\n"
+         << "          <DataItem Dimensions=\"2\" Format=\"XML\">" << m_region.y << " " << m_region.x << "</DataItem>\n"
+         << "          <DataItem Dimensions=\"2\" Format=\"XML\">1 1</DataItem>\n"
+         << "        </Geometry>\n";
+    for (const Output& output : m_outputs)
+    {
+        xdmf << "        <Attribute Name=\"" << output.name << "\" AttributeType=\""
+             << (output.components > 1 ? "Vector" : "Scalar") << "\" Center=\"Node\">\n"
+             << "          <DataItem Dimensions=\"" << dimensions;
+        if (output.components > 1)
+            xdmf << " " << output.components;
+        xdmf << "\" NumberType=\"Float\" Precision=\"" << type_bytes(m_type)
+             << "\" Format=\"Binary\" Endian=\"" << endian << "\" Seek=\"" << frame * frame_bytes(output) << "\">"
+             << base_name(output.filename) << "</DataItem>\n"
+             << "        </Attribute>\n";
+    }
+    xdmf << "      </Grid>\n";
+    return xdmf.str();
+}
+
+void FieldSeries::write_metadata()
+{
+    std::ostringstream index;
+    index << index_head();
+    for (size_t frame = 0; frame < m_steps.size(); frame++)
+        index << (frame ? ", " : "") << m_steps[frame];
+    replace_file(m_prefix + ".json", index.str() + INDEX_TAIL);
+    m_index.open(m_prefix + ".json", std::ios::binary | std::ios::in | std::ios::out);
+
+    if (m_type == FieldType::FLOAT16)
+        return;
+    std::string xdmf = xdmf_head();
+    for (size_t frame = 0; frame < m_steps.size(); frame++)
+        xdmf += xdmf_frame(frame);
+    replace_file(m_prefix + ".xmf", xdmf + XDMF_TAIL);
+    m_xdmf.open(m_prefix + ".xmf", std::ios::binary | std::ios::in | std::ios::out);
+}
+
+void FieldSeries::append_metadata()
+{
+    const size_t frame = m_steps.size() - 1;
+    m_index.seekp(-static_cast<std::streamoff>(INDEX_TAIL.size()), std::ios::end);
+    m_index << (frame ? ", " : "") << m_steps[frame] << INDEX_TAIL << std::flush;
+    if (!m_index)
+        throw std::runtime_error("Failed to write output file " + m_prefix + ".json");
+
+    if (m_type == FieldType::FLOAT16)
+        return;
+    m_xdmf.seekp(-static_cast<std::streamoff>(XDMF_TAIL.size()), std::ios::end);
+    m_xdmf << xdmf_frame(frame) << XDMF_TAIL << std::flush;
+    if (!m_xdmf)
+        throw std::runtime_error("Failed to write output file " + m_prefix + ".xmf");
+}
+
+template void FieldSeries::capture<double>(uint64_t, const double*, const std::array<double, 2>*, FieldFrame&) const;
+template void FieldSeries::capture<float>(uint64_t, const float*, const std::array<float, 2>*, FieldFrame&) const;
@@ -0,0 +1,85 @@
+#include "frame_capture.h"
+#include "profiler.h"
+#include <stdexcept>
+
+FrameCapture::FrameCapture(size_t width, size_t height, FrameWriter& writer):
+    m_width(width), m_height(height), m_writer(writer)
+{
+    if (m_writer.frame_bytes() != 3 * m_width * m_height)
+        throw std::runtime_error("The frame size does not match the writer's");
+
+    m_fences.fill(nullptr);
+    glGenBuffers(RING_SIZE, m_buffers.data());
+    for (GLuint buffer : m_buffers)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, m_writer.frame_bytes(), nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+FrameCapture::~FrameCapture()
+{
+    for (GLsync fence : m_fences)
+        if (fence) glDeleteSync(fence);
+    glDeleteBuffers(RING_SIZE, m_buffers.data());
+}
+
+void FrameCapture::capture()
+{
+    if (m_in_flight == RING_SIZE)
+        retrieve(m_next);
+
+    // Tightly packed rows: the default alignment of 4 would pad the RGB rows of odd widths
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_buffers[m_next]);
+    glReadPixels(0, 0, m_width, m_height, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    m_fences[m_next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    m_next = (m_next + 1) % RING_SIZE;
+    m_in_flight++;
+}
+
+void FrameCapture::flush()
+{
+    while (m_in_flight)
+        retrieve((m_next + RING_SIZE - m_in_flight) % RING_SIZE);
+}
+
+void FrameCapture::retrieve(size_t slot)
+{
+    {
+        // Normally signaled long ago; a stall here means the GPU is RING_SIZE captures behind
+        PROFILE_SCOPE("capture.fence_wait");
+        GLenum status;
+        do
+            status = glClientWaitSync(m_fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+        while (status == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(m_fences[slot]);
+        m_fences[slot] = nullptr;
+        m_in_flight--;
+        if (status == GL_WAIT_FAILED)
+            throw std::runtime_error("Failed to wait for a frame readback");
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_buffers[slot]);
+    const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, m_writer.frame_bytes(), GL_MAP_READ_BIT);
+    if (!pixels)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        throw std::runtime_error("Failed to map a frame readback");
+    }
+    try
+    {
+        m_writer.push(static_cast<const unsigned char*>(pixels));
+    }
+    catch (...)
+    {
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        throw;
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
@@ -0,0 +1,162 @@
+#include "frame_writer.h"
+#include "profiler.h"
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+#include <algorithm>
+
+FramePolicy parse_frame_policy(const std::string& name)
+{
+    if (name == "block")
+        return FramePolicy::BLOCK;
+    if (name == "drop")
+        return FramePolicy::DROP;
+    throw std::runtime_error("Unknown frame policy: " + name);
+}
+
+FILE* open_video_pipe(const std::string& filename, size_t width, size_t height)
+{
+    std::string cmd =   "ffmpeg -y "
+                        "-f rawvideo -pix_fmt rgb24 "
+                        "-s " + std::to_string(width) + "x" + std::to_string(height) + " "
+                        "-r 60 "
+                        "-i - "
+                        "-vf vflip "
+                        "-an -c:v libx264 -pix_fmt yuv420p "
+                        + filename;
+
+    return popen(cmd.c_str(), "w");
+}
+
+FrameWriter::FrameWriter(FILE* sink, size_t frame_bytes, const FrameWriterParams& params):
+    m_sink(sink), m_frame_bytes(frame_bytes), m_params(params)
+{
+    m_params.queue_frames = std::max<size_t>(m_params.queue_frames, 1);
+    m_thread = std::thread(&FrameWriter::writer_loop, this);
+}
+
+FrameWriter::~FrameWriter()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this] { return (m_queue.empty() && !m_writing) || m_error; });
+        m_stop = true;
+    }
+    m_changed.notify_all();
+    m_thread.join();
+
+    if (m_error)
+    {
+        try
+        {
+            std::rethrow_exception(m_error);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Not all the frames were written: " << e.what() << std::endl;
+        }
+    }
+}
+
+bool FrameWriter::push(const unsigned char* frame)
+{
+    std::vector<unsigned char> buffer;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_params.policy == FramePolicy::BLOCK)
+        {
+            PROFILE_SCOPE("capture.queue_wait");
+            m_changed.wait(lock, [this] { return m_queue.size() < m_params.queue_frames || m_error; });
+        }
+        if (m_error)
+            std::rethrow_exception(std::exchange(m_error, nullptr));
+        if (m_queue.size() >= m_params.queue_frames)
+        {
+            m_stats.dropped++;
+            return false;
+        }
+        if (!m_free.empty())
+        {
+            buffer = std::move(m_free.back());
+            m_free.pop_back();
+        }
+    }
+
+    // Only this thread adds frames, so there is still room once the copy is done
+    buffer.resize(m_frame_bytes);
+    std::memcpy(buffer.data(), frame, m_frame_bytes);
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_queue.push_back(std::move(buffer));
+        m_stats.queued++;
+        m_stats.max_queue_depth = std::max(m_stats.max_queue_depth, m_queue.size());
+        m_queue_depth_sum += m_queue.size();
+    }
+    m_changed.notify_all();
+    return true;
+}
+
+void FrameWriter::drain()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this] { return (m_queue.empty() && !m_writing) || m_error; });
+    if (m_error)
+        std::rethrow_exception(std::exchange(m_error, nullptr));
+}
+
+FrameWriterStats FrameWriter::get_stats() const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    FrameWriterStats stats = m_stats;
+    stats.mean_queue_depth = stats.queued ? m_queue_depth_sum / stats.queued : 0.0;
+    return stats;
+}
+
+void FrameWriter::print_stats(std::ostream& out) const
+{
+    const FrameWriterStats stats = get_stats();
+    out << "Recorded " << stats.written << " frames, dropped " << stats.dropped
+        << "; queue depth mean " << stats.mean_queue_depth << ", max " << stats.max_queue_depth
+        << " of " << m_params.queue_frames << std::endl;
+}
+
+void FrameWriter::writer_loop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_changed.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+        if (m_queue.empty()) return;
+
+        // The front frame is left alone by push() until it is written
+        const std::vector<unsigned char>& frame = m_queue.front();
+        m_writing = true;
+        lock.unlock();
+        std::exception_ptr error;
+        {
+            PROFILE_SCOPE("capture.write");
+            if (std::fwrite(frame.data(), 1, frame.size(), m_sink) != frame.size())
+                error = std::make_exception_ptr(std::runtime_error("Failed to write a frame to the output stream"));
+        }
+        lock.lock();
+
+        m_free.push_back(std::move(m_queue.front()));
+        m_queue.pop_front();
+        m_writing = false;
+        if (error)
+        {
+            // Nothing more can be written; the remaining frames are discarded
+            m_error = error;
+            m_stats.dropped += m_queue.size();
+            while (!m_queue.empty())
+            {
+                m_free.push_back(std::move(m_queue.front()));
+                m_queue.pop_front();
+            }
+        }
+        else
+            m_stats.written++;
+        m_changed.notify_all();
+    }
+}
@@ -0,0 +1,150 @@
+#include "halo_transport.h"
+#include <cstring>
+#include <climits>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+
+void LocalExchange::send(size_t from, size_t to, int tag, const void* data, size_t bytes)
+{
+    const char* begin = static_cast<const char*>(data);
+    std::vector<char> message(begin, begin + bytes);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_mailboxes[{from, to, tag}].push_back(std::move(message));
+    }
+    m_arrived.notify_all();
+}
+
+void LocalExchange::recv(size_t from, size_t to, int tag, void* data, size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto& mailbox = m_mailboxes[{from, to, tag}];
+    m_arrived.wait(lock, [&mailbox] { return !mailbox.empty(); });
+
+    std::vector<char> message = std::move(mailbox.front());
+    mailbox.pop_front();
+    lock.unlock();
+
+    if (message.size() != bytes)
+        throw std::runtime_error("Message size mismatch between ranks " + std::to_string(from)
+                                 + " and " + std::to_string(to));
+    std::memcpy(data, message.data(), bytes);
+}
+
+void LocalExchange::barrier()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const size_t generation = m_barrier_generation;
+    if (++m_barrier_count == m_ranks)
+    {
+        m_barrier_count = 0;
+        m_barrier_generation++;
+        m_arrived.notify_all();
+    }
+    else
+        m_arrived.wait(lock, [&] { return m_barrier_generation != generation; });
+}
+
+void LocalTransport::post_send(size_t to, int tag, const void* data, size_t bytes)
+{
+    m_exchange.send(m_rank, to, tag, data, bytes);
+}
+
+void LocalTransport::post_recv(size_t from, int tag, void* data, size_t bytes)
+{
+    m_pending.push_back({from, tag, data, bytes});
+}
+
+void LocalTransport::wait_all()
+{
+    std::vector<PendingRecv> pending;
+    pending.swap(m_pending);
+    for (const PendingRecv& recv : pending)
+        m_exchange.recv(recv.from, m_rank, recv.tag, recv.data, recv.bytes);
+}
+
+void run_local_ranks(size_t ranks, const std::function<void(HaloTransport&)>& body)
+{
+    if (ranks == 0)
+        throw std::runtime_error("At least one rank is needed");
+
+    LocalExchange exchange(ranks);
+    std::vector<std::exception_ptr> errors(ranks);
+    std::vector<std::thread> threads;
+    for (size_t rank = 0; rank < ranks; rank++)
+    {
+        threads.emplace_back([&, rank]
+                             {
+                                LocalTransport transport(exchange, rank);
+                                try
+                                {
+                                    body(transport);
+                                }
+                                catch (...)
+                                {
+                                    errors[rank] = std::current_exception();
+                                }
+                             });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    for (const std::exception_ptr& error : errors)
+        if (error) std::rethrow_exception(error);
+}
+
+#ifdef LBM_WITH_MPI
+MpiTransport::MpiTransport()
+{
+    int initialized = 0;
+    MPI_Initialized(&initialized);
+    if (!initialized)
+    {
+        MPI_Init(nullptr, nullptr);
+        m_owns_mpi = true;
+    }
+
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    m_rank = static_cast<size_t>(rank);
+    m_size = static_cast<size_t>(size);
+}
+
+MpiTransport::~MpiTransport()
+{
+    if (m_owns_mpi)
+        MPI_Finalize();
+}
+
+static int message_count(size_t bytes)
+{
+    if (bytes > static_cast<size_t>(INT_MAX))
+        throw std::runtime_error("The message is too large for a single MPI call");
+    return static_cast<int>(bytes);
+}
+
+void MpiTransport::post_send(size_t to, int tag, const void* data, size_t bytes)
+{
+    m_requests.emplace_back();
+    MPI_Isend(data, message_count(bytes), MPI_BYTE, static_cast<int>(to), tag, MPI_COMM_WORLD, &m_requests.back());
+}
+
+void MpiTransport::post_recv(size_t from, int tag, void* data, size_t bytes)
+{
+    m_requests.emplace_back();
+    MPI_Irecv(data, message_count(bytes), MPI_BYTE, static_cast<int>(from), tag, MPI_COMM_WORLD, &m_requests.back());
+}
+
+void MpiTransport::wait_all()
+{
+    MPI_Waitall(static_cast<int>(m_requests.size()), m_requests.data(), MPI_STATUSES_IGNORE);
+    m_requests.clear();
+}
+
+void MpiTransport::barrier()
+{
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+#endif
@@ -0,0 +1,448 @@
+#include "headless.h"
+#include "d2q9_decomposed.h"
+#include "d2q9_observables.h"
+#include "tracers.h"
+#include "software_renderer.h"
+#include "frame_writer.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <memory>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+// The density and the velocity components of a width x height grid as a (3, height, width) float32 .npy array
+template <typename Density, typename Velocity>
+static void write_fields_npy(size_t width, size_t height, const Density& rho, const Velocity& u, 
+                             const std::string& filename)
+{
+    const size_t total_size = width * height;
+
+    std::vector<float> data(3 * total_size);
+    for (size_t idx = 0; idx < total_size; idx++)
+    {
+        data[idx] = static_cast<float>(rho[idx]);
+        data[total_size + idx] = static_cast<float>(u[idx][0]);
+        data[2 * total_size + idx] = static_cast<float>(u[idx][1]);
+    }
+
+    // The .npy v1.0 header, padded so that the data starts at a multiple of 64 bytes
+    std::string header = "{'descr': '<f4', 'fortran_order': False, 'shape': (3, " 
+                         + std::to_string(height) + ", " + std::to_string(width) + "), }";
+    const size_t preamble = 10;
+    header.append(64 - (preamble + header.size() + 1) % 64, ' ');
+    header.push_back('\n');
+    const uint16_t header_len = static_cast<uint16_t>(header.size());
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) 
+        throw std::runtime_error("Failed to open output file " + filename);
+
+    file.write("\x93NUMPY\x01\x00", 8);
+    file.write(reinterpret_cast<const char*>(&header_len), sizeof(uint16_t));
+    file.write(header.data(), header.size());
+    file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float));
+}
+
+template <typename Precision>
+void dump_fields_npy(const D2Q9<Precision>& lbm, const std::string& filename)
+{
+    const auto& dims = lbm.get_dimensions();
+    write_fields_npy(dims[0], dims[1], lbm.get_density(), lbm.get_velocity(), filename);
+}
+
+static std::string dump_filename(const Args& args, size_t step)
+{
+    std::ostringstream filename;
+    filename << args.dump_prefix << "_" << std::setw(8) << std::setfill('0') << step << ".npy";
+    return filename.str();
+}
+
+static void print_diagnostics(size_t step, double mass, double max_speed, double mlups)
+{
+    std::cout << "step " << step 
+              << "  mass " << std::setprecision(10) << mass
+              << "  max |u| " << std::setprecision(6) << max_speed
+              << "  MLUPS " << std::setprecision(4) << mlups << std::endl;
+}
+
+static void check_diverged(size_t step, double mass)
+{
+    if (!std::isfinite(mass))
+        throw std::runtime_error("The simulation diverged at step " + std::to_string(step));
+}
+
+// Total mass and the maximum speed over the non-solid cells
+template <typename Precision>
+static void print_diagnostics(const D2Q9<Precision>& lbm, size_t step, double mlups)
+{
+    double mass = 0.0, max_speed = 0.0;
+    for (size_t idx = 0; idx < lbm.get_total_size(); idx++)
+    {
+        if (lbm.get_cell_type(idx) == CellType::SOLID) continue;
+        const auto& u = lbm.get_velocity()[idx];
+        mass += lbm.get_density()[idx];
+        max_speed = std::max(max_speed, static_cast<double>(std::hypot(u[0], u[1])));
+    }
+
+    print_diagnostics(step, mass, max_speed, mlups);
+    check_diverged(step, mass);
+}
+
+// The number of steps up to the end of the run or the next diagnostics, dump, checkpoint, field frame
+// or video frame (every frame_every steps, if not zero), at most block
+static size_t steps_to_next_output(const Args& args, size_t step, size_t block, size_t frame_every = 0)
+{
+    size_t steps = std::min(block, args.steps - step);
+    if (args.diagnostics_every)
+        steps = std::min(steps, args.diagnostics_every - step % args.diagnostics_every);
+    if (args.dump_every)
+        steps = std::min(steps, args.dump_every - step % args.dump_every);
+    if (args.checkpoint_every)
+        steps = std::min(steps, args.checkpoint_every - step % args.checkpoint_every);
+    if (args.fields.every)
+        steps = std::min(steps, args.fields.every - step % args.fields.every);
+    if (frame_every)
+        steps = std::min(steps, frame_every - step % frame_every);
+    return steps;
+}
+
+// The headless run of a rank of a decomposed grid. All the ranks step, reduce the diagnostics
+// and gather the fields together; rank 0 prints them and writes the dumps and the field series.
+// The ranks that are threads of this process pin their workers to disjoint CPUs.
+template <typename Precision>
+static int run_decomposed_impl(const Args& args, const SimulationSetup& setup, HaloTransport& transport,
+                               bool shares_process)
+{
+    const bool root = transport.rank() == 0;
+    LBM<2>::LBMParams lbm_params = setup.lbm_params;
+    if (shares_process)
+    {
+        lbm_params.execution.pool = transport.rank();
+        lbm_params.execution.pools = transport.size();
+    }
+    else if (root && lbm_params.execution.threads && lbm_params.execution.binding != ThreadBinding::NONE && transport.size() > 1)
+        std::cerr << "Every process pins its workers within the CPUs it may run on; "
+                  << "bind the processes to disjoint CPUs in mpirun" << std::endl;
+
+    try 
+    {
+        D2Q9Decomposed<Precision> lbm(lbm_params, setup.initial_view(), transport);
+
+        // Every rank checks the field output params, so that they fail together
+        std::unique_ptr<FieldSeries> field_series;
+        FieldFrame field_frame;
+        if (args.fields.every)
+        {
+            FieldSeries::validate(args.fields, setup.lbm_params);
+            if (root)
+                field_series = std::make_unique<FieldSeries>(args.fields, setup.lbm_params);
+        }
+
+        if (root)
+            std::cout << "Running " << args.steps << " steps headless on a " 
+                      << setup.lbm_params.dimensions[0] << "x" << setup.lbm_params.dimensions[1] << " grid over " 
+                      << transport.size() << " ranks with the fused kernel" << std::endl;
+
+        using Clock = std::chrono::steady_clock;
+        const auto start = Clock::now();
+        auto report_start = start;
+        size_t report_step = 0;
+
+        std::vector<typename D2Q9Decomposed<Precision>::Scalar> rho;
+        std::vector<typename D2Q9Decomposed<Precision>::VelocityVec> u;
+        for (size_t step = 0; step < args.steps; )
+        {
+            const size_t steps = steps_to_next_output(args, step, args.steps);
+            lbm.advance(steps);
+            step += steps;
+            if (root)
+                Profiler::instance().end_frame();
+
+            if (args.diagnostics_every && step % args.diagnostics_every == 0)
+            {
+                double mass, max_speed;
+                lbm.reduce_diagnostics(mass, max_speed);
+                const double seconds = std::chrono::duration<double>(Clock::now() - report_start).count();
+                if (root)
+                    print_diagnostics(step, mass, max_speed, lbm.get_total_size() * (step - report_step) / seconds * 1e-6);
+                // On every rank, so that they stop together
+                check_diverged(step, mass);
+                report_start = Clock::now();
+                report_step = step;
+            }
+
+            if (args.dump_every && step % args.dump_every == 0)
+            {
+                PROFILE_SCOPE("output.dump");
+                lbm.gather_fields(rho, u);
+                if (root)
+                    write_fields_npy(lbm.get_dimensions()[0], lbm.get_dimensions()[1], rho, u, dump_filename(args, step));
+            }
+
+            if (args.fields.every && step % args.fields.every == 0)
+            {
+                PROFILE_SCOPE("output.fields");
+                lbm.gather_fields(rho, u);
+                if (root)
+                {
+                    field_series->capture(step, rho.data(), u.data(), field_frame);
+                    field_series->submit(field_frame);
+                }
+            }
+        }
+
+        if (root)
+        {
+            if (field_series)
+                field_series->wait();
+            Profiler::instance().finish();
+
+            const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            std::cout << "Simulation completed in " << seconds << " s, " 
+                      << lbm.get_total_size() * args.steps / seconds * 1e-6 << " MLUPS." << std::endl;
+        }
+    }
+    catch (const std::exception& e) 
+    {
+        std::cerr << "Exception occurred on rank " << transport.rank() << ": " << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+template <typename Precision>
+static int run_decomposed(const Args& args, const SimulationSetup& setup)
+{
+    if (setup.restart || args.checkpoint_every)
+    {
+        std::cerr << "Checkpoints are not supported with a decomposed grid" << std::endl;
+        return -1;
+    }
+    if (args.output_file)
+    {
+        std::cerr << "Video output is not supported with a decomposed grid" << std::endl;
+        return -1;
+    }
+    // The slabs always run the fused kernel, which also stands in for the default four-pass one
+    if (args.kernel != D2Q9Kernel::FUSED && args.kernel != D2Q9Kernel::FOUR_PASS)
+    {
+        std::cerr << "A decomposed grid only runs the fused kernel" << std::endl;
+        return -1;
+    }
+
+    if (args.transport == "mpi")
+    {
+#ifdef LBM_WITH_MPI
+        MpiTransport transport;
+        return run_decomposed_impl<Precision>(args, setup, transport, false);
+#else
+        std::cerr << "This build has no MPI support; rebuild with -DLBM_WITH_MPI or use the local transport" << std::endl;
+        return -1;
+#endif
+    }
+
+    std::vector<int> results(args.ranks);
+    run_local_ranks(args.ranks, [&](HaloTransport& transport)
+                                {
+                                    results[transport.rank()] = run_decomposed_impl<Precision>(args, setup, transport, true);
+                                });
+    return std::all_of(results.begin(), results.end(), [](int result) { return result == 0; }) ? 0 : -1;
+}
+
+template <typename Precision>
+static int run_headless_impl(const Args& args, const SimulationSetup& setup)
+{
+    if (args.ranks > 1 || args.transport == "mpi")
+        return run_decomposed<Precision>(args, setup);
+
+    D2Q9<Precision> lbm(setup.lbm_params, setup.initial_view(), args.kernel, args.tiling);
+    report_kernel_fallback(args, lbm.get_kernel());
+
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    size_t first_step = 0;
+
+    // The video, rendered on the CPU as the window would show it, a frame every steps_per_frame steps
+    const VisualizationParams& visual_params = setup.visual_params;
+    FILE* ffmpeg = nullptr;
+    std::unique_ptr<FrameWriter> frame_writer;
+    std::unique_ptr<SoftwareRenderer> software_renderer;
+    std::unique_ptr<Tracers<Precision>> tracers;
+    std::vector<std::array<float, 2>> tracer_positions;
+    std::vector<float> tracer_values;
+    std::vector<float> render_field;
+    size_t frame_every = 0;
+    if (args.output_file)
+    {
+        if (setup.quants_params.empty())
+        {
+            std::cerr << "No quantities to render to " << *args.output_file << std::endl;
+            return -1;
+        }
+        ffmpeg = open_video_pipe(*args.output_file, visual_params.width, visual_params.height);
+        if (!ffmpeg) 
+        {
+            std::cerr << "Failed to open ffmpeg pipe\n";
+            return -1;
+        }
+        frame_writer = std::make_unique<FrameWriter>(ffmpeg, 3 * visual_params.width * visual_params.height, args.recording);
+        software_renderer = std::make_unique<SoftwareRenderer>(visual_params.width, visual_params.height, 
+                                                               setup.lbm_params.dimensions[0], setup.lbm_params.dimensions[1],
+                                                               std::array<bool, 2>{lbm.is_periodic(0), lbm.is_periodic(1)});
+        tracers = std::make_unique<Tracers<Precision>>(lbm, setup.tracers_params);
+        render_field.resize(lbm.get_total_size());
+        frame_every = std::max<size_t>(visual_params.steps_per_frame, 1);
+    }
+
+    try 
+    {
+        if (setup.restart)
+        {
+            setup.restart->restore(lbm);
+            first_step = setup.restart->step();
+            // A run without --output saved no tracers: keep those just seeded
+            if (auto positions = setup.restart->tracers(); tracers && !positions.empty())
+                tracers->set_positions(positions, setup.restart->tracer_ages());
+        }
+
+        std::cout << "Running " << args.steps << " steps headless on a " 
+                  << setup.lbm_params.dimensions[0] << "x" << setup.lbm_params.dimensions[1] << " grid";
+        if (first_step)
+            std::cout << ", resuming at step " << first_step;
+        if (software_renderer)
+            std::cout << ", rendering " << setup.quants_params[0].quant_id << " to " << *args.output_file 
+                      << " (" << SoftwareRenderer::simd_isa() << ")";
+        std::cout << std::endl;
+
+        start = Clock::now();
+        auto report_start = start;
+        size_t report_step = first_step;
+
+        CheckpointWriter checkpoint_writer;
+        Checkpoint snapshot;
+        std::unique_ptr<FieldSeries> field_series;
+        FieldFrame field_frame;
+        if (args.fields.every)
+            field_series = std::make_unique<FieldSeries>(args.fields, setup.lbm_params, first_step);
+
+        // The tiled kernel advances a temporal block at a time, up to the next diagnostics or dump
+        const size_t block = args.kernel == D2Q9Kernel::TILED ? args.tiling.time_steps : 1;
+        for (size_t step = first_step; step < args.steps; )
+        {
+            const size_t steps = steps_to_next_output(args, step, block, frame_every);
+
+            lbm.advance(steps);
+            step += steps;
+            // Every block of steps is a frame of the profile
+            Profiler::instance().end_frame();
+
+            if (args.diagnostics_every && step % args.diagnostics_every == 0)
+            {
+                const auto now = Clock::now();
+                const double seconds = std::chrono::duration<double>(now - report_start).count();
+                print_diagnostics(lbm, step, lbm.get_total_size() * (step - report_step) / seconds * 1e-6);
+                report_start = Clock::now();
+                report_step = step;
+            }
+
+            if (args.dump_every && step % args.dump_every == 0)
+            {
+                PROFILE_SCOPE("output.dump");
+                dump_fields_npy(lbm, dump_filename(args, step));
+            }
+
+            // Only the snapshot stalls the solver; the file is written while it goes on
+            if (args.checkpoint_every && step % args.checkpoint_every == 0)
+            {
+                PROFILE_SCOPE("output.checkpoint");
+                // Without --output there are no tracers to save
+                if (tracers)
+                    capture_checkpoint(lbm, step, tracers->get_positions(), tracers->get_age(), snapshot);
+                else
+                    capture_checkpoint(lbm, step, {}, {}, snapshot);
+                checkpoint_writer.submit(snapshot, checkpoint_filename(args, step));
+            }
+
+            // As the checkpoints, the frame is written while the solver goes on
+            if (args.fields.every && step % args.fields.every == 0)
+            {
+                PROFILE_SCOPE("output.fields");
+                field_series->capture(step, lbm.get_density().data(), lbm.get_velocity().data(), field_frame);
+                field_series->submit(field_frame);
+            }
+
+            // The first quantity of the input, as the window shows it first
+            if (frame_every && step % frame_every == 0)
+            {
+                const QuantityParams& quant = setup.quants_params[0];
+                {
+                    PROFILE_SCOPE("output.observable");
+                    auto it = get_compute_functions<Precision>().find(quant.quant_id);
+                    if (it == get_compute_functions<Precision>().end())
+                        throw std::runtime_error("Unknown quantity '" + quant.quant_id + "' to render");
+                    it->second(lbm, render_field, quant.offset, quant.amplitude);
+                }
+                {
+                    PROFILE_SCOPE("output.tracers");
+                    tracers->update_positions();
+                    tracers->emit_tracers();
+                    tracers->get_positions(tracer_positions);
+                    tracers->get_attribute(setup.tracers_params.coloring, tracer_values);
+                }
+                {
+                    PROFILE_SCOPE("output.render");
+                    software_renderer->render(render_field, lbm.get_obstacle_mask());
+                    software_renderer->render_tracers(tracer_positions, setup.tracers_params.color, 
+                                                      setup.tracers_params.size, tracer_values,
+                                                      1.0f / tracer_coloring_range(setup.tracers_params));
+                }
+                frame_writer->push(software_renderer->get_pixels().data());
+            }
+        }
+        checkpoint_writer.wait();
+        if (field_series)
+            field_series->wait();
+        if (frame_writer)
+        {
+            frame_writer->drain();
+            frame_writer->print_stats(std::cout);
+        }
+    }
+    catch (const std::exception& e) 
+    {
+        std::cerr << "Exception occurred: " << e.what() << std::endl;
+        frame_writer.reset();
+        if (ffmpeg) pclose(ffmpeg);
+        return -1;
+    }
+    frame_writer.reset();
+    if (ffmpeg) pclose(ffmpeg);
+
+    Profiler::instance().finish();
+
+    const size_t steps_run = args.steps > first_step ? args.steps - first_step : 0;
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "Simulation completed in " << seconds << " s, " 
+              << lbm.get_total_size() * steps_run / seconds * 1e-6 << " MLUPS." << std::endl;
+    return 0;
+}
+
+int run_headless(const Args& args, const SimulationSetup& setup)
+{
+    if (args.precision == "float")
+        return run_headless_impl<float>(args, setup);
+    if (args.precision == "mixed")
+        return run_headless_impl<MixedPrecision>(args, setup);
+    if (args.precision != "double")
+        std::cerr << "Unknown precision: " << args.precision << ". Using double precision." << std::endl;
+    return run_headless_impl<double>(args, setup);
+}
+
+template void dump_fields_npy<double>(const D2Q9<double>&, const std::string&);
+template void dump_fields_npy<float>(const D2Q9<float>&, const std::string&);
+template void dump_fields_npy<MixedPrecision>(const D2Q9<MixedPrecision>&, const std::string&);
@@ -5,44 +5,33 @@
 #include <optional>
 #include <cstdlib>
 #include <cstdio>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 #include "renderer.h"
+#include "frame_capture.h"
 #include "d2q9.h"
 #include "d2q9_setup.h"
 #include "d2q9_observables.h"
+#include "tracers.h"
 #include "tracers_collection.h"
+#include "triple_buffer.h"
+#include "cli.h"
+#include "headless.h"
 
-struct Args
-{
-    std::optional<std::string> input_file;
-    std::optional<std::string> output_file; 
-};
-
+// Written by the key callback, read by the solver thread; the view of the renderer is
+// changed on the render thread, which polls the events
 struct QuantParamsStatus
 {
-    int current_quant;
+    std::atomic<size_t> current_quant;
     const std::vector<QuantityParams>* quants;
+    Renderer* renderer;
 };
 
-Args parse_args(int argc, char** argv)
-{
-    Args args;
-
-    for (int i = 1; i < argc; i++)
-    {
-        std::string arg = argv[i];
-
-        std::cout << arg << std::endl;
-        if (arg == "--input" && i + 1 < argc)
-            args.input_file = argv[++i];
-        else if (arg == "--output" && i + 1 < argc)
-            args.output_file = argv[++i];
-        else
-            std::cerr << "Unsupported command line argument: " << arg << std::endl; 
-    }
-    return args;
-}
-
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
@@ -52,90 +41,144 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     if (key == GLFW_KEY_SPACE && action == GLFW_PRESS) 
     {
         QuantParamsStatus* current_status = static_cast<QuantParamsStatus*>(glfwGetWindowUserPointer(window));
-        current_status->current_quant = (current_status->current_quant + 1) % (current_status->quants)->size(); 
+        current_status->current_quant = (current_status->current_quant + 1) % (current_status->quants)->size();
 
         std::cout << "Currently rendering: " << (*current_status->quants)[current_status->current_quant].quant_id << std::endl;
     }
+    // +/- to zoom in and out, the arrows to pan, R to show the whole grid again
+    if (action == GLFW_PRESS || action == GLFW_REPEAT)
+    {
+        Renderer* renderer = static_cast<QuantParamsStatus*>(glfwGetWindowUserPointer(window))->renderer;
+        switch (key)
+        {
+            case GLFW_KEY_EQUAL:
+            case GLFW_KEY_KP_ADD:
+                renderer->zoom(1.25);
+                break;
+            case GLFW_KEY_MINUS:
+            case GLFW_KEY_KP_SUBTRACT:
+                renderer->zoom(0.8);
+                break;
+            case GLFW_KEY_LEFT:
+                renderer->pan(-0.1, 0.0);
+                break;
+            case GLFW_KEY_RIGHT:
+                renderer->pan(0.1, 0.0);
+                break;
+            case GLFW_KEY_DOWN:
+                renderer->pan(0.0, -0.1);
+                break;
+            case GLFW_KEY_UP:
+                renderer->pan(0.0, 0.1);
+                break;
+            case GLFW_KEY_R:
+                renderer->reset_view();
+                break;
+        }
+    }
 }
 
-int main(int argc, char** argv)
+// What the solver thread hands to the render thread: the quantity to render, computed
+// on the solver thread, or the raw moments to compute it from on the GPU, and the tracer
+// positions and the attribute they are colored by (empty if they are not), after the given step
+struct FrameSnapshot
 {
-    LBM<2>::LBMParams lbm_params;
-    D2Q9::InitialConditions initials;
-    VisualizationParams visual_params;
-    std::vector<QuantityParams> quants_params;  
-    TracersParams tracers_params;
-
-    GLFWwindow* renderer_window;
+    size_t step = 0;
+    std::vector<float> render_field;
+    std::vector<std::array<float, 3>> moments;
+    std::vector<std::array<float, 2>> tracers;
+    std::vector<float> tracer_values;
+};
 
-    Args args = parse_args(argc, argv);
-    //Args args{ std::make_optional<std::string>("../examples/boltzmann.dat"), std::nullopt };
+// The recording: the ffmpeg pipe, the thread writing the frames to it and the asynchronous
+// readbacks of the window. However the simulation ends, the frames read back are written out
+// before the pipe is closed; the readbacks need the GL context, so this goes after the renderer.
+struct Recording
+{
+    FILE* ffmpeg = nullptr;
+    std::optional<FrameWriter> frame_writer;
+    std::optional<FrameCapture> frame_capture;
 
-    if (args.input_file)
+    Recording() = default;
+    Recording(const Recording&) = delete;
+    Recording& operator=(const Recording&) = delete;
+    ~Recording()
     {
-        std::cout << "Loading setup from " << *args.input_file << std::endl;
-        load_from_binary(*args.input_file, 
-                          lbm_params, 
-                          initials, 
-                          visual_params, 
-                          quants_params, 
-                          tracers_params);
+        if (frame_capture)
+        {
+            // A failed write has been reported already
+            try { frame_capture->flush(); } catch (const std::exception&) {}
+            frame_capture.reset();
+        }
+        frame_writer.reset();
+        if (ffmpeg) pclose(ffmpeg);
     }
-    else
-    {
-        std::cout << "No input file provided. Using a sample setup." << std::endl;
+};
 
-        lbm_params = {{200, 80}, {false, true}, 0.6}; // Grid dimensions, periodicity, tau
-        initials = sample_d2q9(lbm_params);
-        visual_params = {800, 320, 1};
-        quants_params = { {"speed", 0.0f, 0.2f}, {"vorticity", 0.5f, 0.05f} };
-    }
+template <typename Precision>
+int run_simulation(const Args& args, const SimulationSetup& setup)
+{
+    const LBM<2>::LBMParams& lbm_params = setup.lbm_params;
+    const VisualizationParams& visual_params = setup.visual_params;
+    const std::vector<QuantityParams>& quants_params = setup.quants_params;
+    GLFWwindow* renderer_window;
+
+    D2Q9<Precision> lbm(lbm_params, setup.initial_view(), args.kernel, args.tiling);
+    report_kernel_fallback(args, lbm.get_kernel());
+    Renderer renderer(visual_params, 
+                      lbm_params.dimensions[0], 
+                      lbm_params.dimensions[1],
+                      {lbm.is_periodic(0), lbm.is_periodic(1)});    
+    // The obstacles never change: their texture is uploaded once
+    renderer.set_obstacle_mask(lbm.get_obstacle_mask());
+    Tracers<Precision> tracers(lbm, setup.tracers_params);
+    TracersCollection tracers_collection(lbm_params.dimensions[0], lbm_params.dimensions[1], setup.tracers_params);
+
+    renderer_window = renderer.get_window();
 
     // Bring up an ffmpeg pipe if requested
-    FILE* ffmpeg = nullptr;
+    Recording recording;
     if (args.output_file) 
     { 
-        std::string cmd =   "ffmpeg -y "
-                            "-f rawvideo -pix_fmt rgb24 "
-                            "-s " + std::to_string(visual_params.width) + "x" + std::to_string(visual_params.height) + " "
-                            "-r 60 "
-                            "-i - "
-                            "-vf vflip "
-                            "-an -c:v libx264 -pix_fmt yuv420p "
-                            + *args.output_file;
-
-        ffmpeg = popen(cmd.c_str(), "w");
-        if (!ffmpeg) 
+        recording.ffmpeg = open_video_pipe(*args.output_file, visual_params.width, visual_params.height);
+        if (!recording.ffmpeg) 
         {
             std::cerr << "Failed to open ffmpeg pipe\n";
             return -1;
         }
     }
-    
-    D2Q9 lbm(lbm_params,  initials);
-    Renderer renderer(visual_params.width, 
-                      visual_params.height, 
-                      lbm_params.dimensions[0], 
-                      lbm_params.dimensions[1]);    
-    TracersCollection tracers(lbm, tracers_params);
 
-    renderer_window = renderer.get_window();
-
-    QuantParamsStatus quants_status = {0, &quants_params};
+    QuantParamsStatus quants_status = {0, &quants_params, &renderer};
     if (!quants_params.size())
     {
         std::cout << "No quantities to render. Exiting the simulation." << std::endl;
         return 0;
     } 
 
+    // The GPU computes the quantities from the raw moments, if it knows them all
+    bool gpu_observables = visual_params.gpu_observables;
+    for (const QuantityParams& quant : quants_params)
+    {
+        if (gpu_observables && !Renderer::is_moment_quantity(quant.quant_id))
+        {
+            std::cerr << "The GPU cannot compute '" << quant.quant_id << "'. Computing the quantities on the CPU." << std::endl;
+            gpu_observables = false;
+        }
+    }
+
     // Register the keyboard callback
     glfwSetKeyCallback(renderer_window, key_callback);
     
     glfwSetWindowUserPointer(renderer_window, &quants_status);    
 
-    std::vector<float> render_field(lbm.get_total_size()); 
-    std::vector<unsigned char> pixels(3 * visual_params.width * visual_params.height);
-    const auto& compute_functions = get_compute_functions();
+    // The recording: asynchronous readbacks, written to the ffmpeg pipe on a thread of their own
+    std::optional<FrameCapture>& frame_capture = recording.frame_capture;
+    if (recording.ffmpeg)
+    {
+        recording.frame_writer.emplace(recording.ffmpeg, 3 * visual_params.width * visual_params.height, args.recording);
+        frame_capture.emplace(visual_params.width, visual_params.height, *recording.frame_writer);
+    }
+    const auto& compute_functions = get_compute_functions<Precision>();
 
     std::cout << "Starting LBM simulation..." << std::endl;
     std::cout << "Press ESC or close window to exit." << std::endl;
@@ -144,41 +187,183 @@ int main(int argc, char** argv)
 
     try 
     {   
-        // Main loop
-        while (!renderer.should_close()) 
+        size_t step = 0;
+        if (setup.restart)
+        {
+            setup.restart->restore(lbm);
+            step = setup.restart->step();
+            // A headless run without --output saved no tracers: keep those just seeded
+            if (auto positions = setup.restart->tracers(); !positions.empty())
+                tracers.set_positions(positions, setup.restart->tracer_ages());
+        }
+
+        CheckpointWriter checkpoint_writer;
+        Checkpoint snapshot;
+        std::unique_ptr<FieldSeries> field_series;
+        FieldFrame field_frame;
+        if (args.fields.every)
+            field_series = std::make_unique<FieldSeries>(args.fields, lbm_params, step);
+
+        // The solver steps on a thread of its own, as fast as it can, and publishes a snapshot every
+        // steps_per_frame steps; the render thread draws the latest one at the display rate.
+        // The obstacle mask never changes: the renderer has it already.
+        const TracerColoring tracer_coloring = setup.tracers_params.coloring;
+        FrameSnapshot first_snapshot{step, {}, {}, tracers.get_positions(), {}};
+        if (gpu_observables)
+            D2Q9_pack_moments(lbm, first_snapshot.moments);
+        else
+            first_snapshot.render_field.resize(lbm.get_total_size());
+        tracers.get_attribute(tracer_coloring, first_snapshot.tracer_values);
+        TripleBuffer<FrameSnapshot> snapshots(first_snapshot);
+        std::atomic<bool> stop{false}, solver_done{false};
+        std::exception_ptr solver_error;
+        // Signaled when the render thread takes a snapshot, or stops
+        std::mutex taken_mutex;
+        std::condition_variable taken;
+        auto notify_taken = [&]()
+        {
+            { std::lock_guard<std::mutex> lock(taken_mutex); }
+            taken.notify_one();
+        };
+
+        auto simulate = [&]()
+        {
+            try
+            {
+                while (!stop.load(std::memory_order_relaxed))
+                {
+                    const size_t previous_step = step;
+                    {
+                        PROFILE_SCOPE("sim.lbm");
+                        lbm.advance(visual_params.steps_per_frame);
+                        step += visual_params.steps_per_frame;
+                    }
+
+                    // The observable to render, or what the GPU computes it from
+                    FrameSnapshot& frame = snapshots.back();
+                    const QuantityParams& current_quant = quants_params[quants_status.current_quant.load(std::memory_order_relaxed)];
+                    if (gpu_observables)
+                    {
+                        PROFILE_SCOPE("sim.moments");
+                        D2Q9_pack_moments(lbm, frame.moments);
+                    }
+                    else
+                    {
+                        PROFILE_SCOPE("sim.observable");
+                        auto it = compute_functions.find(current_quant.quant_id);
+                        if (it != compute_functions.end())
+                            it->second(lbm, frame.render_field, current_quant.offset, current_quant.amplitude);
+                        else
+                            std::cerr << "Error: unknown quantity '" << current_quant.quant_id << "' to render" << std::endl;
+                    }
+
+                    // Process tracers
+                    {
+                        PROFILE_SCOPE("sim.tracers");
+                        tracers.update_positions();
+                        tracers.emit_tracers();
+                        tracers.get_positions(frame.tracers);
+                        tracers.get_attribute(tracer_coloring, frame.tracer_values);
+                    }
+
+                    // At the first snapshot past every checkpoint_every steps
+                    if (args.checkpoint_every && step / args.checkpoint_every > previous_step / args.checkpoint_every)
+                    {
+                        PROFILE_SCOPE("sim.checkpoint");
+                        capture_checkpoint(lbm, step, tracers.get_positions(), tracers.get_age(), snapshot);
+                        checkpoint_writer.submit(snapshot, checkpoint_filename(args, step));
+                    }
+
+                    // Likewise for the field series
+                    if (args.fields.every && step / args.fields.every > previous_step / args.fields.every)
+                    {
+                        PROFILE_SCOPE("sim.fields");
+                        field_series->capture(step, lbm.get_density().data(), lbm.get_velocity().data(), field_frame);
+                        field_series->submit(field_frame);
+                    }
+
+                    // A recording has every snapshot as a frame: the solver only runs one snapshot ahead
+                    frame.step = step;
+                    if (frame_capture)
+                    {
+                        PROFILE_SCOPE("sim.record_wait");
+                        std::unique_lock<std::mutex> lock(taken_mutex);
+                        taken.wait(lock, [&] { return !snapshots.pending() || stop.load(std::memory_order_relaxed); });
+                    }
+                    snapshots.publish();
+                }
+            }
+            catch (...)
+            {
+                solver_error = std::current_exception();
+            }
+            solver_done = true;
+        };
+        std::thread solver_thread(simulate);
+
+        // Main loop: the solver thread must be stopped before leaving it, come what may
+        std::exception_ptr render_error;
+        try
         {
-            for (int step_cnt = 0; step_cnt < visual_params.steps_per_frame; step_cnt++)
-                lbm.step();       
-
-            // Render an observable
-            const QuantityParams& current_quant = quants_params[quants_status.current_quant];
-            
-            auto it = compute_functions.find(current_quant.quant_id);
-            if (it != compute_functions.end())
-                it->second(lbm, render_field, current_quant.offset, current_quant.amplitude);
-            else
-                std::cerr << "Error: unknown quantity '" << current_quant.quant_id << "' to render" << std::endl;
-            renderer.render(render_field, lbm.get_obstacle_mask());
-            
-            // Process tracers
-            tracers.update_positions();
-            tracers.emit_tracers();
-            tracers.render_tracers();
-            
-            renderer.poll_events();
-            glfwSwapBuffers(renderer_window);
-
-            if (ffmpeg)
+            while (!renderer.should_close() && !solver_done) 
             {
-                glReadPixels(0, 0, visual_params.width, visual_params.height,
-                             GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
-                fwrite(pixels.data(), 1, pixels.size(), ffmpeg);
+                // The back buffer is redrawn at every frame, with the latest snapshot
+                const bool fresh = snapshots.update();
+                if (fresh && frame_capture)
+                    notify_taken();
+                const FrameSnapshot& frame = snapshots.front();
+                {
+                    PROFILE_SCOPE("frame.render");
+                    if (gpu_observables)
+                        renderer.render_moments(frame.moments, quants_params[quants_status.current_quant.load(std::memory_order_relaxed)]);
+                    else
+                        renderer.render(frame.render_field, fresh);
+                }
+                {
+                    PROFILE_SCOPE("frame.tracers");
+                    tracers_collection.set_view(renderer.get_view());
+                    tracers_collection.render_tracers(frame.tracers, frame.tracer_values);
+                }
+                
+                // The back buffer, before the swap leaves its contents undefined; every snapshot once
+                if (frame_capture && fresh)
+                {
+                    PROFILE_SCOPE("frame.capture");
+                    frame_capture->capture();
+                }
+                
+                {
+                    PROFILE_SCOPE("frame.swap");
+                    renderer.poll_events();
+                    glfwSwapBuffers(renderer_window);
+                }
+                Profiler::instance().end_frame();
             }
         }
+        catch (...)
+        {
+            render_error = std::current_exception();
+        }
+        stop = true;
+        notify_taken();
+        solver_thread.join();
+        if (render_error)
+            std::rethrow_exception(render_error);
+        if (solver_error)
+            std::rethrow_exception(solver_error);
 
-        if (ffmpeg) pclose(ffmpeg);
+        if (frame_capture)
+        {
+            frame_capture->flush();
+            recording.frame_writer->drain();
+            recording.frame_writer->print_stats(std::cout);
+        }
+        checkpoint_writer.wait();
+        if (field_series)
+            field_series->wait();
+        Profiler::instance().finish();
 
-        std::cout << "Simulation completed." << std::endl;
+        std::cout << "Simulation completed at step " << step << "." << std::endl;
     } 
     catch (const std::exception& e) 
     {
@@ -188,3 +373,33 @@ int main(int argc, char** argv)
 
     return 0;
 }
+
+int main(int argc, char** argv)
+{
+    Args args = parse_args(argc, argv);
+    //Args args{ std::make_optional<std::string>("../examples/boltzmann.dat"), std::nullopt };
+
+    // A missing or malformed input or restart file
+    try
+    {
+        SimulationSetup setup = load_setup(args);
+        setup_profiler(args);
+
+        if (args.headless)
+            return run_headless(args, setup);
+
+        // The lattice precision
+        if (args.precision == "float")
+            return run_simulation<float>(args, setup);
+        if (args.precision == "mixed")
+            return run_simulation<MixedPrecision>(args, setup);
+        if (args.precision != "double")
+            std::cerr << "Unknown precision: " << args.precision << ". Using double precision." << std::endl;
+        return run_simulation<double>(args, setup);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Exception occurred: " << e.what() << std::endl;
+        return -1;
+    }
+}
@@ -0,0 +1,65 @@
+#include "mapped_file.h"
+#include <fstream>
+#include <cstdint>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LBM_HAS_MMAP
+#endif
+
+MappedFile::MappedFile(const std::string& filename) : m_filename(filename)
+{
+#ifdef LBM_HAS_MMAP
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open file " + filename);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Failed to read the size of " + filename);
+    }
+    m_size = static_cast<size_t>(info.st_size);
+
+    if (m_size)
+    {
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Failed to map file " + filename);
+        }
+        m_data = static_cast<const char*>(data);
+        m_mapped = true;
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+#else
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        throw std::runtime_error("Failed to open file " + filename);
+    m_size = static_cast<size_t>(file.tellg());
+    file.seekg(0);
+
+    // Over-allocate to align the data to 64 bytes
+    m_buffer.resize(m_size + 64);
+    char* data = m_buffer.data();
+    data += (64 - reinterpret_cast<uintptr_t>(data) % 64) % 64;
+    if (!file.read(data, m_size))
+        throw std::runtime_error("Failed to read file " + filename);
+    m_data = data;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef LBM_HAS_MMAP
+    if (m_mapped)
+        munmap(const_cast<char*>(m_data), m_size);
+#endif
+}
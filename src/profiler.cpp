@@ -0,0 +1,156 @@
+#include "profiler.h"
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+
+void ProfileSection::record(ProfileClock::time_point start, ProfileClock::time_point end)
+{
+    const double duration = std::chrono::duration<double>(end - start).count();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Durations& d = m_durations;
+        d.min = d.calls ? std::min(d.min, duration) : duration;
+        d.total += duration;
+        d.calls++;
+        // Reservoir sampling: the n-th duration replaces a random sample with probability MAX_SAMPLES / n
+        if (d.samples.size() < MAX_SAMPLES)
+            d.samples.push_back(duration);
+        else
+        {
+            const size_t slot = std::uniform_int_distribution<size_t>(0, d.calls - 1)(m_rng);
+            if (slot < MAX_SAMPLES)
+                d.samples[slot] = duration;
+        }
+    }
+    Profiler::instance().add_trace_event(*this, start, end);
+}
+
+Profiler::Profiler() : m_origin(ProfileClock::now()) {}
+
+Profiler& Profiler::instance()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+void Profiler::enable(size_t summary_every, const std::string& trace_file)
+{
+    m_summary_every = summary_every;
+    m_trace_file = trace_file;
+    m_frame_section = &section("frame");
+    m_origin = ProfileClock::now();
+    m_frame_start = m_origin;
+    m_enabled = true;
+}
+
+ProfileSection& Profiler::section(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& section = m_sections[name];
+    if (!section)
+        section = std::make_unique<ProfileSection>(name);
+    return *section;
+}
+
+void Profiler::add_trace_event(const ProfileSection& section, ProfileClock::time_point start, ProfileClock::time_point end)
+{
+    if (m_trace_file.empty()) return;
+
+    // Small consecutive thread ids read better in the trace viewers than the hashed native ones
+    static std::unordered_map<size_t, size_t> thread_ids;
+    const size_t native_id = std::hash<std::thread::id>{}(std::this_thread::get_id());
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_trace.size() >= MAX_TRACE_EVENTS) return;
+
+    auto it = thread_ids.emplace(native_id, thread_ids.size()).first;
+    m_trace.push_back({&section,
+                       std::chrono::duration<double, std::micro>(start - m_origin).count(),
+                       std::chrono::duration<double, std::micro>(end - start).count(),
+                       it->second});
+    if (m_trace.size() == MAX_TRACE_EVENTS)
+        std::cerr << "Profiler: the trace is full, later events are dropped" << std::endl;
+}
+
+void Profiler::end_frame()
+{
+    if (!is_enabled()) return;
+
+    const auto now = ProfileClock::now();
+    m_frame_section->record(m_frame_start, now);
+    m_frame_start = now;
+
+    m_frame++;
+    if (m_summary_every && m_frame % m_summary_every == 0)
+        print_summary(std::cout);
+}
+
+void Profiler::print_summary(std::ostream& out)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    out << "Profile of frames " << m_summary_start_frame + 1 << "-" << m_frame << " (ms):" << std::endl;
+    out << "  " << std::left << std::setw(24) << "section" << std::right
+        << std::setw(10) << "calls" << std::setw(12) << "min" << std::setw(12) << "mean"
+        << std::setw(12) << "p99" << std::setw(12) << "total" << std::endl;
+
+    for (auto& [name, section] : m_sections)
+    {
+        ProfileSection::Durations durations;
+        {
+            std::lock_guard<std::mutex> section_lock(section->m_mutex);
+            std::swap(durations, section->m_durations);
+        }
+        if (!durations.calls) continue;
+
+        std::vector<double>& samples = durations.samples;
+        const size_t p99_rank = (99 * samples.size() + 99) / 100 - 1;
+        std::nth_element(samples.begin(), samples.begin() + p99_rank, samples.end());
+
+        out << "  " << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << durations.calls
+            << std::setw(12) << 1e3 * durations.min
+            << std::setw(12) << 1e3 * durations.total / durations.calls
+            << std::setw(12) << 1e3 * samples[p99_rank]
+            << std::setw(12) << 1e3 * durations.total << std::endl;
+    }
+    out << std::defaultfloat;
+    m_summary_start_frame = m_frame;
+}
+
+void Profiler::finish()
+{
+    if (!is_enabled()) return;
+
+    if (m_frame > m_summary_start_frame || !m_summary_every)
+        print_summary(std::cout);
+    if (!m_trace_file.empty())
+        write_chrome_trace(m_trace_file);
+    m_enabled = false;
+}
+
+// The trace event format of chrome://tracing and Perfetto, with complete ("X") events
+void Profiler::write_chrome_trace(const std::string& filename) const
+{
+    std::ofstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open trace file " << filename << std::endl;
+        return;
+    }
+
+    file << "{\"traceEvents\": [\n" << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < m_trace.size(); i++)
+    {
+        const TraceEvent& event = m_trace[i];
+        file << "{\"name\": \"" << event.section->get_name() << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+             << event.thread << ", \"ts\": " << event.start_us << ", \"dur\": " << event.duration_us << "}"
+             << (i + 1 < m_trace.size() ? ",\n" : "\n");
+    }
+    file << "], \"displayTimeUnit\": \"ms\"}\n";
+    std::cout << "Wrote " << m_trace.size() << " trace events to " << filename << std::endl;
+}
@@ -1,10 +1,49 @@
 #include "renderer.h"
+#include <algorithm>
+#include <cmath>
+#include <execution>
 #include <iostream>
+#include <numeric>
 #include <stdexcept>
+#include <utility>
+#include "half_float.h"
 #include "shaders.h"
 
-Renderer::Renderer(size_t width, size_t height, size_t grid_width, size_t grid_height) 
-    : m_width(width), m_height(height), m_grid_width(grid_width), m_grid_height(grid_height)
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// The rows of the field converted by a task
+static constexpr size_t BAND_ROWS = 16;
+// The quantities of render_moments(), in the order of uQuantity in the moments shader
+static const std::array<const char*, 7> MOMENT_QUANTITIES =
+    {"density", "speed", "vorticity", "divergence", "q_criterion", "strain_rate", "zero"};
+
+static void pack_half(const float* field, uint16_t* out, size_t count)
+{
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= count; i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                         _mm256_cvtps_ph(_mm256_loadu_ps(field + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+    for (; i < count; i++)
+        out[i] = to_half(field[i]);
+}
+
+// Clamped to [0, 1] as the shader does, NaN to 0, and rounded as GL does
+static void pack_unorm8(const float* field, uint8_t* out, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        out[i] = static_cast<uint8_t>(std::min(std::max(0.0f, field[i]), 1.0f) * 255.0f + 0.5f);
+}
+
+Renderer::Renderer(const VisualizationParams& visual_params, size_t grid_width, size_t grid_height,
+                   std::array<bool, 2> periodic) 
+    : m_width(visual_params.width), m_height(visual_params.height), 
+      m_grid_width(grid_width), m_grid_height(grid_height),
+      m_field_texture(visual_params.field_texture), m_field_pooling(visual_params.field_pooling),
+      m_periodic(periodic)
 {
     if (!glfwInit()) { throw std::runtime_error("Failed to initialize GLFW"); }
 
@@ -27,6 +66,11 @@ Renderer::~Renderer()
     glDeleteTextures(1, &m_fieldTex);
     glDeleteTextures(1, &m_obstacleTex);
     glDeleteProgram(m_shader_program);
+    if (m_moments_program)
+    {
+        glDeleteTextures(1, &m_momentsTex);
+        glDeleteProgram(m_moments_program);
+    }
     glDeleteVertexArrays(1, &m_vao);
     glDeleteBuffers(1, &m_vbo);
     glDeleteBuffers(1, &m_ebo);
@@ -44,7 +88,7 @@ void Renderer::init()
     
     // Compile and link shaders
     GLuint vertex_shader = compile_shader(vertex_shader_src, GL_VERTEX_SHADER);
-    GLuint fragment_shader = compile_shader(fragment_shader_src, GL_FRAGMENT_SHADER);
+    GLuint fragment_shader = compile_shader(fragment_shader_src.c_str(), GL_FRAGMENT_SHADER);
     m_shader_program = create_program(vertex_shader, fragment_shader);
     glDeleteShader(vertex_shader);
     glDeleteShader(fragment_shader);
@@ -85,14 +129,19 @@ void Renderer::init()
     glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void*)(2 * sizeof(float)));
     glEnableVertexAttribArray(1);
 
+    // The rows of the 1- and 2-byte texels are not padded to 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
     // Scalar field texture
     glGenTextures(1, &m_fieldTex);
     glBindTexture(GL_TEXTURE_2D, m_fieldTex);
     // Minimization/magnification filters
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // Allocate texture memory; "GL_R32F" -- use a single float channel per pixel
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, m_grid_width, m_grid_height, 0, GL_RED, GL_FLOAT, nullptr);
+    // The texture memory is allocated at the first upload, at the size of the view; the
+    // bands cover the whole grid, and the smaller uploads skip the ones beyond their rows
+    for (size_t y = 0; y < m_grid_height; y += BAND_ROWS)
+        m_bands.push_back(y);
 
     // Obstacle mask texture
     glGenTextures(1, &m_obstacleTex);
@@ -100,13 +149,212 @@ void Renderer::init()
     // Minimization/magnification filters
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // Allocate texture memory; "GL_R32F" -- use a single float channel per pixel
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, m_grid_width, m_grid_height, 0, GL_RED, GL_FLOAT, nullptr);
-    
+    // The obstacles only wrap around the periodic axes, as the software renderer samples them
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, m_periodic[0] ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, m_periodic[1] ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+    // Allocate texture memory; "GL_R32F" -- use a single float channel per pixel.
+    // No obstacles until a mask is set.
+    m_obstacle_mask.assign(m_grid_width * m_grid_height, 0.0f);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, m_grid_width, m_grid_height, 0, GL_RED, GL_FLOAT, m_obstacle_mask.data());
+
+    // The texture units never change
+    glUseProgram(m_shader_program);
+    glUniform1i(glGetUniformLocation(m_shader_program, "scalarTex"), 0);
+    glUniform1i(glGetUniformLocation(m_shader_program, "obstacleTex"), 1);
+    m_field_scale_loc = glGetUniformLocation(m_shader_program, "uFieldScale");
+    glUniform2f(m_field_scale_loc, 1.0f, 1.0f);
+    m_view_loc = glGetUniformLocation(m_shader_program, "uView");
+    glUseProgram(0);
+
+    reset_view();
+}
+
+void Renderer::zoom(double factor)
+{
+    m_zoom *= factor;
+    update_view();
+}
+
+void Renderer::pan(double dx, double dy)
+{
+    m_center_x += dx * m_grid_width / m_zoom;
+    m_center_y += dy * m_grid_height / m_zoom;
+    update_view();
+}
+
+void Renderer::reset_view()
+{
+    m_zoom = 1.0;
+    m_center_x = 0.5 * m_grid_width;
+    m_center_y = 0.5 * m_grid_height;
+    update_view();
+}
+
+void Renderer::update_view()
+{
+    // Down to 8 cells across the narrower side of the grid
+    const double max_zoom = std::max(1.0, std::min(m_grid_width, m_grid_height) / 8.0);
+    m_zoom = std::clamp(m_zoom, 1.0, max_zoom);
+    const double width = m_grid_width / m_zoom;
+    const double height = m_grid_height / m_zoom;
+    m_center_x = std::clamp(m_center_x, 0.5 * width, m_grid_width - 0.5 * width);
+    m_center_y = std::clamp(m_center_y, 0.5 * height, m_grid_height - 0.5 * height);
+
+    const double x = m_center_x - 0.5 * width;
+    const double y = m_center_y - 0.5 * height;
+    m_view.x = static_cast<size_t>(std::floor(x));
+    m_view.y = static_cast<size_t>(std::floor(y));
+    m_view.width = std::min(static_cast<size_t>(std::ceil(x + width)), m_grid_width) - m_view.x;
+    m_view.height = std::min(static_cast<size_t>(std::ceil(y + height)), m_grid_height) - m_view.y;
+    m_field_stale = true;
+    set_view_uniforms();
+}
+
+void Renderer::set_view_uniforms()
+{
+    const float x = static_cast<float>(m_view.x) / m_grid_width;
+    const float y = static_cast<float>(m_view.y) / m_grid_height;
+    const float width = static_cast<float>(m_view.width) / m_grid_width;
+    const float height = static_cast<float>(m_view.height) / m_grid_height;
+    const std::pair<GLuint, GLint> programs[] = {{m_shader_program, m_view_loc}, {m_moments_program, m_moments_view_loc}};
+    for (const auto& [program, view_loc] : programs)
+    {
+        if (!program)
+            continue;
+        glUseProgram(program);
+        glUniform4f(view_loc, x, y, width, height);
+    }
+    glUseProgram(0);
+}
+
+void Renderer::set_obstacle_mask(const std::vector<float>& obstacle_mask)
+{
+    if (obstacle_mask.size() != m_obstacle_mask.size()) 
+        throw std::runtime_error("Grid dimensions do not match the obstacle mask size");
+
+    // The first and the last rows that differ, added to those still to upload
+    const size_t width = m_grid_width;
+    auto row_differs = [&](size_t y)
+    {
+        return !std::equal(obstacle_mask.begin() + y * width, obstacle_mask.begin() + (y + 1) * width,
+                           m_obstacle_mask.begin() + y * width);
+    };
+    size_t begin = 0, end = m_grid_height;
+    while (begin < end && !row_differs(begin))
+        begin++;
+    while (end > begin && !row_differs(end - 1))
+        end--;
+    if (begin == end)
+        return;
+
+    std::copy(obstacle_mask.begin() + begin * width, obstacle_mask.begin() + end * width,
+              m_obstacle_mask.begin() + begin * width);
+    if (m_obstacle_dirty_begin == m_obstacle_dirty_end)
+    {
+        m_obstacle_dirty_begin = begin;
+        m_obstacle_dirty_end = end;
+    }
+    else
+    {
+        m_obstacle_dirty_begin = std::min(m_obstacle_dirty_begin, begin);
+        m_obstacle_dirty_end = std::max(m_obstacle_dirty_end, end);
+    }
+}
+
+void Renderer::upload_obstacle_rows()
+{
+    const size_t rows = m_obstacle_dirty_end - m_obstacle_dirty_begin;
+    glBindTexture(GL_TEXTURE_2D, m_obstacleTex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, m_obstacle_dirty_begin, m_grid_width, rows,
+                    GL_RED, GL_FLOAT, m_obstacle_mask.data() + m_obstacle_dirty_begin * m_grid_width);
+    m_obstacle_dirty_begin = m_obstacle_dirty_end = 0;
 }
 
-void Renderer::render(const std::vector<float>& scalar_field, 
-                      const std::vector<float>& obstacle_mask)
+void Renderer::pack_half_bands(const float* values, size_t width, size_t height, size_t floats_per_cell)
+{
+    uint16_t* texels = reinterpret_cast<uint16_t*>(m_texels.data());
+    const size_t floats_per_row = width * floats_per_cell;
+    std::for_each(std::execution::par, m_bands.begin(), m_bands.end(),
+                  [&](size_t begin)
+                  {
+                      if (begin >= height)
+                          return;
+                      const size_t end = std::min(begin + BAND_ROWS, height);
+                      pack_half(values + begin * floats_per_row, texels + begin * floats_per_row,
+                                (end - begin) * floats_per_row);
+                  });
+}
+
+void Renderer::resize_field_texture(size_t width, size_t height)
+{
+    m_field_width = width;
+    m_field_height = height;
+    // A single channel per pixel in the texel format asked for
+    switch (m_field_texture)
+    {
+        case FieldTexture::FLOAT32:
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, nullptr);
+            break;
+        case FieldTexture::FLOAT16:
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, width, height, 0, GL_RED, GL_HALF_FLOAT, nullptr);
+            m_texels.resize(std::max(m_texels.size(), width * height * sizeof(uint16_t)));
+            break;
+        case FieldTexture::UNORM8:
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+            m_texels.resize(std::max(m_texels.size(), width * height));
+            break;
+    }
+}
+
+void Renderer::upload_field(const std::vector<float>& scalar_field)
+{
+    // The view, pooled down to the window size unless the GPU is left to minify it
+    const float* values = scalar_field.data();
+    size_t width = m_grid_width, height = m_grid_height;
+    const size_t factor = m_field_pooling == FieldPooling::NONE ? 1 : pooling_factor(m_view, m_width, m_height);
+    if (factor > 1 || m_view.width != m_grid_width || m_view.height != m_grid_height)
+    {
+        downsample_field(values, m_grid_width, m_view, factor, m_field_pooling, m_pooled);
+        values = m_pooled.data();
+        width = (m_view.width + factor - 1) / factor;
+        height = (m_view.height + factor - 1) / factor;
+    }
+    if (width != m_field_width || height != m_field_height)
+        resize_field_texture(width, height);
+    // The texels span whole blocks of factor cells, the partial last ones too: the view ends
+    // inside the last texel. Only a periodic axis seen whole wraps around at the edges.
+    glUniform2f(m_field_scale_loc, static_cast<float>(m_view.width) / (width * factor),
+                static_cast<float>(m_view.height) / (height * factor));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+                    m_periodic[0] && m_view.width == m_grid_width ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+                    m_periodic[1] && m_view.height == m_grid_height ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+
+    // Converted to the texel format first
+    if (m_field_texture == FieldTexture::FLOAT32)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_FLOAT, values);
+    else if (m_field_texture == FieldTexture::FLOAT16)
+    {
+        pack_half_bands(values, width, height, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_HALF_FLOAT, m_texels.data());
+    }
+    else
+    {
+        std::for_each(std::execution::par, m_bands.begin(), m_bands.end(),
+                      [&](size_t begin)
+                      {
+                          if (begin >= height)
+                              return;
+                          const size_t first = begin * width;
+                          const size_t count = (std::min(begin + BAND_ROWS, height) - begin) * width;
+                          pack_unorm8(values + first, m_texels.data() + first, count);
+                      });
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, m_texels.data());
+    }
+    m_field_stale = false;
+}
+
+void Renderer::render(const std::vector<float>& scalar_field, bool field_changed)
 {
     if (scalar_field.size() != m_grid_width * m_grid_height) 
         throw std::runtime_error("Grid dimensions do not match the scalar field size");
@@ -118,16 +366,94 @@ void Renderer::render(const std::vector<float>& scalar_field,
     // Update scalar field texture
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, m_fieldTex);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_grid_width, m_grid_height,
-                    GL_RED, GL_FLOAT, scalar_field.data());
-    glUniform1i(glGetUniformLocation(m_shader_program, "scalarTex"), 0);
+    if (field_changed || m_field_stale)
+        upload_field(scalar_field);
 
-    // Update obstacle mask texture
+    draw();
+}
+
+bool Renderer::is_moment_quantity(const std::string& quant_id)
+{
+    return std::find(MOMENT_QUANTITIES.begin(), MOMENT_QUANTITIES.end(), quant_id) != MOMENT_QUANTITIES.end();
+}
+
+void Renderer::init_moments()
+{
+    GLuint vertex_shader = compile_shader(vertex_shader_src, GL_VERTEX_SHADER);
+    GLuint fragment_shader = compile_shader(moments_fragment_shader_src.c_str(), GL_FRAGMENT_SHADER);
+    m_moments_program = create_program(vertex_shader, fragment_shader);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    // The shader fetches the cells themselves; 8 bits are too coarse for the moments
+    glGenTextures(1, &m_momentsTex);
+    glBindTexture(GL_TEXTURE_2D, m_momentsTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    if (m_field_texture == FieldTexture::FLOAT32)
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, m_grid_width, m_grid_height, 0, GL_RGB, GL_FLOAT, nullptr);
+    else
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, m_grid_width, m_grid_height, 0, GL_RGB, GL_HALF_FLOAT, nullptr);
+        m_texels.resize(std::max(m_texels.size(), 3 * m_grid_width * m_grid_height * sizeof(uint16_t)));
+    }
+
+    glUseProgram(m_moments_program);
+    glUniform1i(glGetUniformLocation(m_moments_program, "momentsTex"), 0);
+    glUniform1i(glGetUniformLocation(m_moments_program, "obstacleTex"), 1);
+    glUniform2i(glGetUniformLocation(m_moments_program, "uGridSize"), m_grid_width, m_grid_height);
+    glUniform2i(glGetUniformLocation(m_moments_program, "uPeriodic"), m_periodic[0], m_periodic[1]);
+    m_quantity_loc = glGetUniformLocation(m_moments_program, "uQuantity");
+    m_scale_loc = glGetUniformLocation(m_moments_program, "uScale");
+    m_offset_loc = glGetUniformLocation(m_moments_program, "uOffset");
+    m_moments_view_loc = glGetUniformLocation(m_moments_program, "uView");
+    set_view_uniforms();
+}
+
+// The moments are uploaded as they are, three floats per cell
+static_assert(sizeof(std::array<float, 3>) == 3 * sizeof(float), "Unexpected padding in the moments");
+
+void Renderer::render_moments(const std::vector<std::array<float, 3>>& moments, const QuantityParams& quantity)
+{
+    if (moments.size() != m_grid_width * m_grid_height) 
+        throw std::runtime_error("Grid dimensions do not match the moments size");
+    const auto it = std::find(MOMENT_QUANTITIES.begin(), MOMENT_QUANTITIES.end(), quantity.quant_id);
+    if (it == MOMENT_QUANTITIES.end())
+        throw std::runtime_error("Unknown quantity '" + quantity.quant_id + "' to render");
+
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    if (!m_moments_program)
+        init_moments();
+    glUseProgram(m_moments_program);
+    // As D2Q9_compute_* normalize the field
+    glUniform1i(m_quantity_loc, static_cast<GLint>(it - MOMENT_QUANTITIES.begin()));
+    glUniform1f(m_scale_loc, std::max(1 - quantity.offset, quantity.offset) / quantity.amplitude);
+    glUniform1f(m_offset_loc, quantity.offset);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_momentsTex);
+    if (m_field_texture == FieldTexture::FLOAT32)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_grid_width, m_grid_height,
+                        GL_RGB, GL_FLOAT, moments.data());
+    else
+    {
+        pack_half_bands(moments.data()->data(), m_grid_width, m_grid_height, 3);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_grid_width, m_grid_height,
+                        GL_RGB, GL_HALF_FLOAT, m_texels.data());
+    }
+
+    draw();
+}
+
+void Renderer::draw()
+{
+    // The obstacle mask texture, where it changed
     glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, m_obstacleTex);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_grid_width, m_grid_height,
-                    GL_RED, GL_FLOAT, obstacle_mask.data());
-    glUniform1i(glGetUniformLocation(m_shader_program, "obstacleTex"), 1);
+    if (m_obstacle_dirty_begin != m_obstacle_dirty_end)
+        upload_obstacle_rows();
+    else
+        glBindTexture(GL_TEXTURE_2D, m_obstacleTex);
 
     glBindVertexArray(m_vao);
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
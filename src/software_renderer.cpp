@@ -0,0 +1,288 @@
+#include "software_renderer.h"
+#include <cmath>
+#include <algorithm>
+#include <execution>
+#include <stdexcept>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Thin wrappers over the vector instruction sets, as in d2q9_simd.cpp, in single precision
+// (named apart from those, which are defined in another translation unit).
+// select(m, a, b) picks a where the mask m is set and b elsewhere; store_int truncates.
+
+struct ScalarFloatOps
+{
+    using Vec = float;
+    using Mask = bool;
+    static constexpr size_t WIDTH = 1;
+
+    static Vec load(const float* ptr) { return *ptr; }
+    static void store_int(int32_t* ptr, Vec v) { *ptr = static_cast<int32_t>(v); }
+    static Vec set1(float val) { return val; }
+    static Vec add(Vec a, Vec b) { return a + b; }
+    static Vec sub(Vec a, Vec b) { return a - b; }
+    static Vec mul(Vec a, Vec b) { return a * b; }
+    static Vec min(Vec a, Vec b) { return std::min(a, b); }
+    static Vec max(Vec a, Vec b) { return std::max(a, b); }
+    static Mask greater(Vec a, Vec b) { return a > b; }
+    static Vec select(Mask m, Vec a, Vec b) { return m ? a : b; }
+};
+
+#if defined(__AVX2__)
+struct Avx2FloatOps
+{
+    using Vec = __m256;
+    using Mask = __m256;
+    static constexpr size_t WIDTH = 8;
+
+    static Vec load(const float* ptr) { return _mm256_loadu_ps(ptr); }
+    static void store_int(int32_t* ptr, Vec v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(ptr), _mm256_cvttps_epi32(v)); }
+    static Vec set1(float val) { return _mm256_set1_ps(val); }
+    static Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+    static Vec sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+    static Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+    static Vec min(Vec a, Vec b) { return _mm256_min_ps(a, b); }
+    static Vec max(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+    static Mask greater(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static Vec select(Mask m, Vec a, Vec b) { return _mm256_blendv_ps(b, a, m); }
+};
+#endif
+
+#if defined(__AVX512F__)
+struct Avx512FloatOps
+{
+    using Vec = __m512;
+    using Mask = __mmask16;
+    static constexpr size_t WIDTH = 16;
+
+    static Vec load(const float* ptr) { return _mm512_loadu_ps(ptr); }
+    static void store_int(int32_t* ptr, Vec v) { _mm512_storeu_si512(ptr, _mm512_cvttps_epi32(v)); }
+    static Vec set1(float val) { return _mm512_set1_ps(val); }
+    static Vec add(Vec a, Vec b) { return _mm512_add_ps(a, b); }
+    static Vec sub(Vec a, Vec b) { return _mm512_sub_ps(a, b); }
+    static Vec mul(Vec a, Vec b) { return _mm512_mul_ps(a, b); }
+    static Vec min(Vec a, Vec b) { return _mm512_min_ps(a, b); }
+    static Vec max(Vec a, Vec b) { return _mm512_max_ps(a, b); }
+    static Mask greater(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    static Vec select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_ps(m, b, a); }
+};
+#endif
+
+#if defined(__AVX512F__)
+using WideFloatOps = Avx512FloatOps;
+#elif defined(__AVX2__)
+using WideFloatOps = Avx2FloatOps;
+#else
+using WideFloatOps = ScalarFloatOps;
+#endif
+
+// The obstacle color, dark gray
+static constexpr float OBSTACLE = 0.2f;
+// smoothstep(0.2, 0.3, mask) > 0.5 in the shader
+static constexpr float OBSTACLE_THRESHOLD = 0.25f;
+// The rows rendered by a task
+static constexpr size_t BAND_ROWS = 16;
+
+// The jet colormap of the fragment shader, as the piecewise linear ramps it interpolates:
+// blue rises from 0.5 to 1 over [0, 1/8] and falls over [3/8, 5/8], green rises over
+// [1/8, 3/8] and falls over [5/8, 7/8], red rises over [3/8, 5/8] and falls to 0.5 over [7/8, 1].
+// The channels of cells [begin, end) are written as 0-255 values, rounded as GL does.
+template <typename Ops>
+static size_t colormap_range(const float* scalar, const float* mask,
+                             int32_t* red, int32_t* green, int32_t* blue, size_t begin, size_t end)
+{
+    using Vec = typename Ops::Vec;
+    const Vec zero = Ops::set1(0.0f);
+    const Vec one = Ops::set1(1.0f);
+    const Vec four = Ops::set1(4.0f);
+    const Vec scale = Ops::set1(255.0f);
+    const Vec half = Ops::set1(0.5f);
+    const Vec obstacle = Ops::set1(OBSTACLE);
+    const Vec threshold = Ops::set1(OBSTACLE_THRESHOLD);
+
+    auto ramp = [&](Vec t4, float rise, float fall)
+    {
+        // clamp(min(4t - rise, fall - 4t), 0, 1)
+        const Vec value = Ops::min(Ops::sub(t4, Ops::set1(rise)), Ops::sub(Ops::set1(fall), t4));
+        return Ops::min(Ops::max(value, zero), one);
+    };
+    auto store = [&](int32_t* out, Vec value, typename Ops::Mask solid)
+    {
+        Ops::store_int(out, Ops::add(Ops::mul(Ops::select(solid, obstacle, value), scale), half));
+    };
+
+    size_t idx = begin;
+    for (; idx + Ops::WIDTH <= end; idx += Ops::WIDTH)
+    {
+        const Vec t = Ops::min(Ops::max(Ops::load(scalar + idx), zero), one);
+        const Vec t4 = Ops::mul(four, t);
+        const auto solid = Ops::greater(Ops::load(mask + idx), threshold);
+
+        store(red + idx, ramp(t4, 1.5f, 4.5f), solid);
+        store(green + idx, ramp(t4, 0.5f, 3.5f), solid);
+        store(blue + idx, ramp(t4, -0.5f, 2.5f), solid);
+    }
+    return idx;
+}
+
+static void colormap_row(const float* scalar, const float* mask,
+                         int32_t* red, int32_t* green, int32_t* blue, size_t size)
+{
+    const size_t tail = colormap_range<WideFloatOps>(scalar, mask, red, green, blue, 0, size);
+    colormap_range<ScalarFloatOps>(scalar, mask, red, green, blue, tail, size);
+}
+
+const char* SoftwareRenderer::simd_isa()
+{
+#if defined(__AVX512F__)
+    return "avx512";
+#elif defined(__AVX2__)
+    return "avx2";
+#else
+    return "scalar";
+#endif
+}
+
+std::vector<SoftwareRenderer::Sample> SoftwareRenderer::samples(size_t pixels, size_t texels, bool periodic)
+{
+    std::vector<Sample> samples(pixels);
+    const long last = static_cast<long>(texels) - 1;
+    for (size_t pixel = 0; pixel < pixels; pixel++)
+    {
+        // The pixel center in texel units, the texel centers at half-integers
+        const double position = (pixel + 0.5) * texels / pixels - 0.5;
+        const double first = std::floor(position);
+        const float weight = static_cast<float>(position - first);
+        if (periodic)
+        {
+            const long wrapped = static_cast<long>(first) % static_cast<long>(texels);
+            const size_t index = static_cast<size_t>(wrapped < 0 ? wrapped + static_cast<long>(texels) : wrapped);
+            samples[pixel] = {static_cast<uint32_t>(index), static_cast<uint32_t>((index + 1) % texels), weight};
+        }
+        else
+        {
+            // Past the outer texel centers, both texels are the edge one
+            const long index = static_cast<long>(first);
+            samples[pixel] = {static_cast<uint32_t>(std::clamp(index, 0L, last)),
+                              static_cast<uint32_t>(std::clamp(index + 1, 0L, last)), weight};
+        }
+    }
+    return samples;
+}
+
+SoftwareRenderer::SoftwareRenderer(size_t width, size_t height, size_t grid_width, size_t grid_height,
+                                   const std::array<bool, 2>& periodic)
+    : m_width(width), m_height(height), m_grid_width(grid_width), m_grid_height(grid_height)
+{
+    if (!m_width || !m_height || !m_grid_width || !m_grid_height)
+        throw std::runtime_error("The frame and the grid must not be empty");
+
+    m_columns = samples(m_width, m_grid_width, periodic[0]);
+    m_rows = samples(m_height, m_grid_height, periodic[1]);
+    for (size_t row = 0; row < m_height; row += BAND_ROWS)
+        m_bands.push_back(row);
+    m_pixels.resize(3 * m_width * m_height);
+}
+
+void SoftwareRenderer::render(const std::vector<float>& scalar_field,
+                              const std::vector<float>& obstacle_mask)
+{
+    if (scalar_field.size() != m_grid_width * m_grid_height || obstacle_mask.size() != scalar_field.size())
+        throw std::runtime_error("Grid dimensions do not match the scalar field size");
+
+    std::for_each(std::execution::par, m_bands.begin(), m_bands.end(),
+                  [this, &scalar_field, &obstacle_mask](size_t begin)
+                  {
+                      render_rows(scalar_field.data(), obstacle_mask.data(),
+                                  begin, std::min(begin + BAND_ROWS, m_height));
+                  });
+}
+
+void SoftwareRenderer::render_rows(const float* scalar_field, const float* obstacle_mask, size_t begin, size_t end)
+{
+    std::vector<float> scalar(m_width), mask(m_width);
+    std::vector<int32_t> red(m_width), green(m_width), blue(m_width);
+
+    for (size_t row = begin; row < end; row++)
+    {
+        const Sample& y = m_rows[row];
+        const float* scalar_below = scalar_field + y.first * m_grid_width;
+        const float* scalar_above = scalar_field + y.second * m_grid_width;
+        const float* mask_below = obstacle_mask + y.first * m_grid_width;
+        const float* mask_above = obstacle_mask + y.second * m_grid_width;
+
+        // Bilinear sampling of both textures
+        for (size_t column = 0; column < m_width; column++)
+        {
+            const Sample& x = m_columns[column];
+            const float scalar_low = scalar_below[x.first] + x.weight * (scalar_below[x.second] - scalar_below[x.first]);
+            const float scalar_high = scalar_above[x.first] + x.weight * (scalar_above[x.second] - scalar_above[x.first]);
+            const float mask_low = mask_below[x.first] + x.weight * (mask_below[x.second] - mask_below[x.first]);
+            const float mask_high = mask_above[x.first] + x.weight * (mask_above[x.second] - mask_above[x.first]);
+            scalar[column] = scalar_low + y.weight * (scalar_high - scalar_low);
+            mask[column] = mask_low + y.weight * (mask_high - mask_low);
+        }
+
+        colormap_row(scalar.data(), mask.data(), red.data(), green.data(), blue.data(), m_width);
+
+        unsigned char* out = m_pixels.data() + 3 * row * m_width;
+        for (size_t column = 0; column < m_width; column++)
+        {
+            out[3 * column] = static_cast<unsigned char>(red[column]);
+            out[3 * column + 1] = static_cast<unsigned char>(green[column]);
+            out[3 * column + 2] = static_cast<unsigned char>(blue[column]);
+        }
+    }
+}
+
+void SoftwareRenderer::render_tracers(const std::vector<std::array<float, 2>>& positions,
+                                      const std::array<float, 4>& color, float size,
+                                      const std::vector<float>& values, float value_scale)
+{
+    unsigned char rgb[3];
+    for (size_t channel = 0; channel < 3; channel++)
+        rgb[channel] = static_cast<unsigned char>(std::clamp(color[channel], 0.0f, 1.0f) * 255.0f + 0.5f);
+    const bool colored = values.size() == positions.size();
+
+    const float radius = 0.5f * size;
+    const float scale_x = static_cast<float>(m_width) / m_grid_width;
+    const float scale_y = static_cast<float>(m_height) / m_grid_height;
+    const long width = static_cast<long>(m_width);
+    const long height = static_cast<long>(m_height);
+
+    // The pixels whose centers are within the point sprite's disc
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        const auto& position = positions[i];
+        if (colored)
+        {
+            const float t = values[i] * value_scale, fluid = 0.0f;
+            int32_t channels[3];
+            colormap_range<ScalarFloatOps>(&t, &fluid, channels, channels + 1, channels + 2, 0, 1);
+            for (size_t channel = 0; channel < 3; channel++)
+                rgb[channel] = static_cast<unsigned char>(channels[channel]);
+        }
+        const float center_x = position[0] * scale_x;
+        const float center_y = position[1] * scale_y;
+        const long x_begin = std::max(0L, static_cast<long>(std::ceil(center_x - radius - 0.5f)));
+        const long x_end = std::min(width, static_cast<long>(std::floor(center_x + radius - 0.5f)) + 1);
+        const long y_begin = std::max(0L, static_cast<long>(std::ceil(center_y - radius - 0.5f)));
+        const long y_end = std::min(height, static_cast<long>(std::floor(center_y + radius - 0.5f)) + 1);
+
+        for (long y = y_begin; y < y_end; y++)
+        {
+            const float dy = y + 0.5f - center_y;
+            for (long x = x_begin; x < x_end; x++)
+            {
+                const float dx = x + 0.5f - center_x;
+                if (dx * dx + dy * dy > radius * radius) continue;
+                unsigned char* pixel = m_pixels.data() + 3 * (y * m_width + x);
+                pixel[0] = rgb[0];
+                pixel[1] = rgb[1];
+                pixel[2] = rgb[2];
+            }
+        }
+    }
+}
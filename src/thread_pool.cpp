@@ -0,0 +1,138 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+ThreadBinding parse_thread_binding(const std::string& name)
+{
+    if (name == "none") return ThreadBinding::NONE;
+    if (name == "compact") return ThreadBinding::COMPACT;
+    if (name == "spread") return ThreadBinding::SPREAD;
+    throw std::runtime_error("Unknown thread binding: " + name);
+}
+
+const char* thread_binding_name(ThreadBinding binding)
+{
+    switch (binding)
+    {
+        case ThreadBinding::COMPACT: return "compact";
+        case ThreadBinding::SPREAD: return "spread";
+        default: return "none";
+    }
+}
+
+// The CPUs the process may run on, in increasing order
+static std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+#endif
+    return cpus;
+}
+
+ThreadPool::ThreadPool(size_t threads, ThreadBinding binding, size_t pool, size_t pools)
+{
+    if (threads == 0)
+        throw std::runtime_error("A thread pool needs at least one thread");
+
+    const std::vector<int> cpus = binding == ThreadBinding::NONE ? std::vector<int>() : allowed_cpus();
+    if (binding != ThreadBinding::NONE && cpus.empty())
+        std::cerr << "Thread binding is not supported on this system; the workers are not pinned" << std::endl;
+    // The workers of all the pools, numbered pool by pool
+    const size_t total = std::max<size_t>(pools, 1) * threads;
+    if (!cpus.empty() && total > cpus.size() && pool == 0)
+        std::cerr << "Pinning " << total << " workers to " << cpus.size() << " CPUs; some CPUs run several" << std::endl;
+
+    m_workers.reserve(threads);
+    for (size_t worker = 0; worker < threads; worker++)
+    {
+        const size_t global = pool * threads + worker;
+        int cpu = -1;
+        if (!cpus.empty())
+            cpu = binding == ThreadBinding::COMPACT ? cpus[global % cpus.size()]
+                                                    : cpus[(global * cpus.size() / total) % cpus.size()];
+        m_workers.emplace_back(&ThreadPool::worker_loop, this, worker, cpu);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_task_ready.notify_all();
+    for (std::thread& worker : m_workers)
+        worker.join();
+}
+
+void ThreadPool::run(const std::function<void(size_t)>& task)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_task = &task;
+    m_running = m_workers.size();
+    m_error = nullptr;
+    m_generation++;
+    m_task_ready.notify_all();
+
+    m_task_done.wait(lock, [this] { return m_running == 0; });
+    m_task = nullptr;
+    if (m_error)
+        std::rethrow_exception(m_error);
+}
+
+void ThreadPool::worker_loop(size_t worker, int cpu)
+{
+    // Pin the thread before it touches any data
+#ifdef __linux__
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            std::cerr << "Failed to pin worker " << worker << " to CPU " << cpu << std::endl;
+    }
+#else
+    (void)cpu;
+#endif
+
+    size_t generation = 0;
+    while (true)
+    {
+        const std::function<void(size_t)>* task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_task_ready.wait(lock, [&] { return m_stop || m_generation != generation; });
+            if (m_stop) return;
+            generation = m_generation;
+            task = m_task;
+        }
+
+        std::exception_ptr error;
+        try
+        {
+            (*task)(worker);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (error && !m_error)
+            m_error = error;
+        if (--m_running == 0)
+            m_task_done.notify_one();
+    }
+}
@@ -0,0 +1,491 @@
+#include "tracers.h"
+#include <cmath>
+#include <numeric>
+#include <execution>
+#include <stdexcept>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Thin wrappers over the vector instruction sets, as in d2q9_simd.cpp, in single precision
+// with the gathers the interpolation needs (named apart from those of the other translation units).
+// select(m, a, b) picks a where the mask m is set and b elsewhere; to_int truncates.
+struct ScalarTracerOps
+{
+    using Vec = float;
+    using IVec = int32_t;
+    using Mask = bool;
+    static constexpr size_t WIDTH = 1;
+
+    static Vec load(const float* ptr) { return *ptr; }
+    static void store(float* ptr, Vec v) { *ptr = v; }
+    static Vec set1(float val) { return val; }
+    static Vec add(Vec a, Vec b) { return a + b; }
+    static Vec sub(Vec a, Vec b) { return a - b; }
+    static Vec mul(Vec a, Vec b) { return a * b; }
+    static Vec min(Vec a, Vec b) { return std::min(a, b); }
+    static Vec max(Vec a, Vec b) { return std::max(a, b); }
+    static Vec floor(Vec a) { return std::floor(a); }
+    static Vec sqrt(Vec a) { return std::sqrt(a); }
+    static Mask less(Vec a, Vec b) { return a < b; }
+    static Vec select(Mask m, Vec a, Vec b) { return m ? a : b; }
+    static IVec to_int(Vec a) { return static_cast<int32_t>(a); }
+    static Vec to_float(IVec a) { return static_cast<float>(a); }
+    static IVec add_int(IVec a, int32_t b) { return a + b; }
+    static IVec mul_add_int(IVec a, int32_t b, IVec c) { return a * b + c; }
+    static Vec gather(const float* base, IVec idx) { return base[idx]; }
+};
+
+#if defined(__AVX2__)
+struct Avx2TracerOps
+{
+    using Vec = __m256;
+    using IVec = __m256i;
+    using Mask = __m256;
+    static constexpr size_t WIDTH = 8;
+
+    static Vec load(const float* ptr) { return _mm256_loadu_ps(ptr); }
+    static void store(float* ptr, Vec v) { _mm256_storeu_ps(ptr, v); }
+    static Vec set1(float val) { return _mm256_set1_ps(val); }
+    static Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+    static Vec sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+    static Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+    static Vec min(Vec a, Vec b) { return _mm256_min_ps(a, b); }
+    static Vec max(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+    static Vec floor(Vec a) { return _mm256_floor_ps(a); }
+    static Vec sqrt(Vec a) { return _mm256_sqrt_ps(a); }
+    static Mask less(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static Vec select(Mask m, Vec a, Vec b) { return _mm256_blendv_ps(b, a, m); }
+    static IVec to_int(Vec a) { return _mm256_cvttps_epi32(a); }
+    static Vec to_float(IVec a) { return _mm256_cvtepi32_ps(a); }
+    static IVec add_int(IVec a, int32_t b) { return _mm256_add_epi32(a, _mm256_set1_epi32(b)); }
+    static IVec mul_add_int(IVec a, int32_t b, IVec c) { return _mm256_add_epi32(_mm256_mullo_epi32(a, _mm256_set1_epi32(b)), c); }
+    static Vec gather(const float* base, IVec idx) { return _mm256_i32gather_ps(base, idx, 4); }
+};
+#endif
+
+#if defined(__AVX512F__)
+struct Avx512TracerOps
+{
+    using Vec = __m512;
+    using IVec = __m512i;
+    using Mask = __mmask16;
+    static constexpr size_t WIDTH = 16;
+
+    static Vec load(const float* ptr) { return _mm512_loadu_ps(ptr); }
+    static void store(float* ptr, Vec v) { _mm512_storeu_ps(ptr, v); }
+    static Vec set1(float val) { return _mm512_set1_ps(val); }
+    static Vec add(Vec a, Vec b) { return _mm512_add_ps(a, b); }
+    static Vec sub(Vec a, Vec b) { return _mm512_sub_ps(a, b); }
+    static Vec mul(Vec a, Vec b) { return _mm512_mul_ps(a, b); }
+    static Vec min(Vec a, Vec b) { return _mm512_min_ps(a, b); }
+    static Vec max(Vec a, Vec b) { return _mm512_max_ps(a, b); }
+    static Vec floor(Vec a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+    static Vec sqrt(Vec a) { return _mm512_sqrt_ps(a); }
+    static Mask less(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    static Vec select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_ps(m, b, a); }
+    static IVec to_int(Vec a) { return _mm512_cvttps_epi32(a); }
+    static Vec to_float(IVec a) { return _mm512_cvtepi32_ps(a); }
+    static IVec add_int(IVec a, int32_t b) { return _mm512_add_epi32(a, _mm512_set1_epi32(b)); }
+    static IVec mul_add_int(IVec a, int32_t b, IVec c) { return _mm512_add_epi32(_mm512_mullo_epi32(a, _mm512_set1_epi32(b)), c); }
+    static Vec gather(const float* base, IVec idx) { return _mm512_i32gather_ps(idx, base, 4); }
+};
+#endif
+
+#if defined(__AVX512F__)
+using WideTracerOps = Avx512TracerOps;
+#elif defined(__AVX2__)
+using WideTracerOps = Avx2TracerOps;
+#else
+using WideTracerOps = ScalarTracerOps;
+#endif
+
+TracerIntegrator parse_tracer_integrator(const std::string& name)
+{
+    if (name == "euler")
+        return TracerIntegrator::EULER;
+    if (name == "rk2")
+        return TracerIntegrator::RK2;
+    if (name == "rk4")
+        return TracerIntegrator::RK4;
+    throw std::runtime_error("Unknown tracer integrator: " + name);
+}
+
+const char* tracer_integrator_name(TracerIntegrator integrator)
+{
+    switch (integrator)
+    {
+        case TracerIntegrator::EULER: return "euler";
+        case TracerIntegrator::RK2: return "rk2";
+        case TracerIntegrator::RK4: return "rk4";
+    }
+    return "unknown";
+}
+
+TracerColoring parse_tracer_coloring(const std::string& name)
+{
+    if (name == "none")
+        return TracerColoring::NONE;
+    if (name == "age")
+        return TracerColoring::AGE;
+    if (name == "speed")
+        return TracerColoring::SPEED;
+    throw std::runtime_error("Unknown tracer coloring: " + name);
+}
+
+float tracer_coloring_range(const TracersParams& tracers_params)
+{
+    if (tracers_params.coloring_range > 0.0f)
+        return tracers_params.coloring_range;
+    // The amplitude the example setups render the speed with, and a thousand lattice steps
+    return tracers_params.coloring == TracerColoring::SPEED ? 0.2f : 1000.0f;
+}
+
+template <typename Precision>
+Tracers<Precision>::Tracers(const D2Q9<Precision>& lbm, const TracersParams& tracers_params)
+    : m_lbm(&lbm),
+      m_grid_width(lbm.get_dimensions()[0]),
+      m_grid_height(lbm.get_dimensions()[1]),
+      m_periodic{lbm.is_periodic(0), lbm.is_periodic(1)},
+      m_emission_rate(tracers_params.emission_rate),
+      m_integrator(tracers_params.integrator),
+      m_time_step(tracers_params.time_step),
+      m_substeps(std::max<size_t>(tracers_params.substeps, 1)),
+      m_rng(std::random_device{}())
+{
+    m_drops.resize(m_lbm -> get_total_size());
+    for (size_t idx = 0; idx < m_drops.size(); idx++)
+        m_drops[idx] = m_lbm -> get_cell_type(idx) == CellType::OUTFLOW;
+
+    std::vector<size_t> fluid_cell_indices = m_lbm -> get_fluid_cells();
+    std::shuffle(fluid_cell_indices.begin(), fluid_cell_indices.end(), m_rng);
+
+    // Add randomly placed tracers, more than one per cell if there are more tracers than fluid cells
+    std::uniform_real_distribution<float> jitter(0.0f, 1.0f);
+    if (!fluid_cell_indices.empty())
+    {
+        m_x.reserve(tracers_params.random_initial + tracers_params.initial_tracers.size());
+        m_y.reserve(m_x.capacity());
+        m_age.reserve(m_x.capacity());
+        m_speed.reserve(m_x.capacity());
+        for (size_t i = 0; i < tracers_params.random_initial; i++)
+            add_tracer(fluid_cell_indices[i % fluid_cell_indices.size()], jitter(m_rng), jitter(m_rng));
+    }
+    // Add custom tracers from the initial data, at the cell centers
+    for (size_t idx: tracers_params.initial_tracers)
+        add_tracer(idx, 0.5f, 0.5f);
+}
+
+template <typename Precision>
+void Tracers<Precision>::add_tracer(size_t cell_idx, float jitter_x, float jitter_y)
+{
+    auto coords = m_lbm -> index_to_coords(cell_idx);
+    m_x.push_back(static_cast<float>(coords[0]) + jitter_x);
+    m_y.push_back(static_cast<float>(coords[1]) + jitter_y);
+    m_age.push_back(0.0f);
+    m_speed.push_back(0.0f);
+}
+
+// The cell whose velocity a ghost at index i (-1 or n) along an axis of n cells holds
+static size_t ghost_source(long i, size_t n, bool periodic)
+{
+    if (i < 0)
+        return periodic ? n - 1 : 0;
+    if (i >= static_cast<long>(n))
+        return periodic ? 0 : n - 1;
+    return static_cast<size_t>(i);
+}
+
+template <typename Precision>
+void Tracers<Precision>::sample_velocity()
+{
+    const size_t padded_width = m_grid_width + 2;
+    const size_t padded_height = m_grid_height + 2;
+    m_ux.resize(padded_width * padded_height);
+    m_uy.resize(padded_width * padded_height);
+
+    m_padded_rows.resize(padded_height);
+    std::iota(m_padded_rows.begin(), m_padded_rows.end(), 0);
+    const auto& u = m_lbm -> get_velocity();
+    std::for_each(std::execution::par, m_padded_rows.begin(), m_padded_rows.end(),
+                  [&](size_t padded_row)
+                  {
+                      const size_t y = ghost_source(static_cast<long>(padded_row) - 1, m_grid_height, m_periodic[1]);
+                      const auto* source = u.data() + y * m_grid_width;
+                      float* ux = m_ux.data() + padded_row * padded_width;
+                      float* uy = m_uy.data() + padded_row * padded_width;
+                      for (size_t x = 0; x < m_grid_width; x++)
+                      {
+                          ux[x + 1] = static_cast<float>(source[x][0]);
+                          uy[x + 1] = static_cast<float>(source[x][1]);
+                      }
+                      const size_t before = ghost_source(-1, m_grid_width, m_periodic[0]);
+                      const size_t after = ghost_source(m_grid_width, m_grid_width, m_periodic[0]);
+                      ux[0] = ux[before + 1];
+                      uy[0] = uy[before + 1];
+                      ux[padded_width - 1] = ux[after + 1];
+                      uy[padded_width - 1] = uy[after + 1];
+                  });
+}
+
+// The padded velocity grid of an update, sampled WIDTH tracers at a time without branches:
+// a periodic axis wraps the position around, the others clamp it onto the edges, and the
+// ghost ring holds the neighbors across the edges
+template <typename Ops>
+struct VelocitySampler
+{
+    using Vec = typename Ops::Vec;
+    using IVec = typename Ops::IVec;
+
+    const float* ux;
+    const float* uy;
+    int32_t padded_width;
+    Vec width, height;
+    Vec inv_width, inv_height;
+    Vec wrap_x, wrap_y;     // the size along a periodic axis, 0 along the others
+
+    // Around the periodic axis into [0, size), without changing the other positions.
+    // The rounding of p / size may leave p a hair outside; the selects bring it back.
+    static Vec wrap(Vec p, Vec size, Vec inv_size, Vec wrap_size)
+    {
+        p = Ops::sub(p, Ops::mul(wrap_size, Ops::floor(Ops::mul(p, inv_size))));
+        p = Ops::select(Ops::less(p, Ops::set1(0.0f)), Ops::add(p, wrap_size), p);
+        return Ops::select(Ops::less(p, size), p, Ops::sub(p, wrap_size));
+    }
+
+    // Bilinear between the centers of the four nearest cells. The cell centers are
+    // at half-integers, and the ghost ring shifts the indices by one.
+    void operator()(Vec x, Vec y, Vec& vx, Vec& vy) const
+    {
+        const Vec zero = Ops::set1(0.0f), half = Ops::set1(0.5f);
+        x = Ops::min(Ops::max(wrap(x, width, inv_width, wrap_x), zero), width);
+        y = Ops::min(Ops::max(wrap(y, height, inv_height, wrap_y), zero), height);
+        const Vec gx = Ops::add(x, half);
+        const Vec gy = Ops::add(y, half);
+        const IVec ix = Ops::to_int(gx);
+        const IVec iy = Ops::to_int(gy);
+        const Vec tx = Ops::sub(gx, Ops::to_float(ix));
+        const Vec ty = Ops::sub(gy, Ops::to_float(iy));
+        const IVec below = Ops::mul_add_int(iy, padded_width, ix);
+        const IVec above = Ops::add_int(below, padded_width);
+
+        auto bilinear = [&](const float* u)
+        {
+            const Vec u00 = Ops::gather(u, below), u10 = Ops::gather(u, Ops::add_int(below, 1));
+            const Vec u01 = Ops::gather(u, above), u11 = Ops::gather(u, Ops::add_int(above, 1));
+            const Vec u_below = Ops::add(u00, Ops::mul(tx, Ops::sub(u10, u00)));
+            const Vec u_above = Ops::add(u01, Ops::mul(tx, Ops::sub(u11, u01)));
+            return Ops::add(u_below, Ops::mul(ty, Ops::sub(u_above, u_below)));
+        };
+        vx = bilinear(ux);
+        vy = bilinear(uy);
+    }
+};
+
+// Advances the tracers [begin, end) by one substep of length h, WIDTH at a time, and writes
+// the flow speed at their starting points to speeds unless it is null.
+// Returns where it stopped, the start of a tail shorter than WIDTH.
+template <typename Ops, TracerIntegrator INTEGRATOR>
+static size_t advance_range(const VelocitySampler<Ops>& velocity, float* xs, float* ys, float* speeds,
+                            size_t begin, size_t end, float h)
+{
+    using Vec = typename Ops::Vec;
+    const Vec step = Ops::set1(h), half_step = Ops::set1(0.5f * h);
+
+    size_t i = begin;
+    for (; i + Ops::WIDTH <= end; i += Ops::WIDTH)
+    {
+        const Vec x = Ops::load(xs + i), y = Ops::load(ys + i);
+        Vec vx, vy;
+        velocity(x, y, vx, vy);
+        if (speeds)
+            Ops::store(speeds + i, Ops::sqrt(Ops::add(Ops::mul(vx, vx), Ops::mul(vy, vy))));
+        if constexpr (INTEGRATOR == TracerIntegrator::RK2)
+        {
+            // The midpoint method
+            velocity(Ops::add(x, Ops::mul(half_step, vx)), Ops::add(y, Ops::mul(half_step, vy)), vx, vy);
+        }
+        else if constexpr (INTEGRATOR == TracerIntegrator::RK4)
+        {
+            Vec vx2, vy2, vx3, vy3, vx4, vy4;
+            velocity(Ops::add(x, Ops::mul(half_step, vx)), Ops::add(y, Ops::mul(half_step, vy)), vx2, vy2);
+            velocity(Ops::add(x, Ops::mul(half_step, vx2)), Ops::add(y, Ops::mul(half_step, vy2)), vx3, vy3);
+            velocity(Ops::add(x, Ops::mul(step, vx3)), Ops::add(y, Ops::mul(step, vy3)), vx4, vy4);
+            const Vec two = Ops::set1(2.0f), sixth = Ops::set1(1.0f / 6.0f);
+            vx = Ops::mul(Ops::add(Ops::add(vx, Ops::mul(two, Ops::add(vx2, vx3))), vx4), sixth);
+            vy = Ops::mul(Ops::add(Ops::add(vy, Ops::mul(two, Ops::add(vy2, vy3))), vy4), sixth);
+        }
+
+        const Vec next_x = Ops::add(x, Ops::mul(step, vx));
+        const Vec next_y = Ops::add(y, Ops::mul(step, vy));
+        Ops::store(xs + i, VelocitySampler<Ops>::wrap(next_x, velocity.width, velocity.inv_width, velocity.wrap_x));
+        Ops::store(ys + i, VelocitySampler<Ops>::wrap(next_y, velocity.height, velocity.inv_height, velocity.wrap_y));
+    }
+    return i;
+}
+
+template <typename Ops>
+VelocitySampler<Ops> velocity_sampler(const std::vector<float>& ux, const std::vector<float>& uy,
+                                      size_t width, size_t height, const std::array<bool, 2>& periodic)
+{
+    const float w = static_cast<float>(width), h = static_cast<float>(height);
+    return {ux.data(), uy.data(), static_cast<int32_t>(width + 2),
+            Ops::set1(w), Ops::set1(h), Ops::set1(1.0f / w), Ops::set1(1.0f / h),
+            Ops::set1(periodic[0] ? w : 0.0f), Ops::set1(periodic[1] ? h : 0.0f)};
+}
+
+template <typename Precision>
+template <TracerIntegrator INTEGRATOR>
+void Tracers<Precision>::advance_block(size_t begin, size_t end)
+{
+    const auto wide = velocity_sampler<WideTracerOps>(m_ux, m_uy, m_grid_width, m_grid_height, m_periodic);
+    const auto scalar = velocity_sampler<ScalarTracerOps>(m_ux, m_uy, m_grid_width, m_grid_height, m_periodic);
+
+    const float h = m_time_step / m_substeps;
+    float* xs = m_x.data();
+    float* ys = m_y.data();
+    for (size_t substep = 0; substep < m_substeps; substep++)
+    {
+        // The speed is the one of the last substep
+        float* speeds = substep + 1 == m_substeps ? m_speed.data() : nullptr;
+        const size_t tail = advance_range<WideTracerOps, INTEGRATOR>(wide, xs, ys, speeds, begin, end, h);
+        advance_range<ScalarTracerOps, INTEGRATOR>(scalar, xs, ys, speeds, tail, end, h);
+    }
+    float* ages = m_age.data();
+    for (size_t i = begin; i < end; i++)
+        ages[i] += m_time_step;
+
+    // Keep the tracers inside the grid and off the outflow cells
+    const float width = static_cast<float>(m_grid_width), height = static_cast<float>(m_grid_height);
+    const uint8_t* drops = m_drops.data();
+    uint8_t* keep = m_keep.data();
+    for (size_t i = begin; i < end; i++)
+    {
+        const float x = xs[i], y = ys[i];
+        const bool inside = (0.0f <= x) & (x < width) & (0.0f <= y) & (y < height);
+        const size_t cell = static_cast<size_t>(std::min(std::max(y, 0.0f), height - 1.0f)) * m_grid_width
+                            + static_cast<size_t>(std::min(std::max(x, 0.0f), width - 1.0f));
+        keep[i] = inside & !drops[cell];
+    }
+}
+
+template <typename Precision>
+void Tracers<Precision>::update_positions()
+{
+    const size_t count = m_x.size();
+    if (!count)
+        return;
+
+    sample_velocity();
+
+    // Advance every block and count the tracers it keeps
+    const size_t num_blocks = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    m_keep.resize(count);
+    m_block_offsets.resize(num_blocks);
+    m_blocks.resize(num_blocks);
+    std::iota(m_blocks.begin(), m_blocks.end(), 0);
+    std::for_each(std::execution::par, m_blocks.begin(), m_blocks.end(),
+                  [this, count](size_t block)
+                  {
+                      const size_t begin = block * BLOCK_SIZE;
+                      const size_t end = std::min(begin + BLOCK_SIZE, count);
+                      switch (m_integrator)
+                      {
+                          case TracerIntegrator::EULER: advance_block<TracerIntegrator::EULER>(begin, end); break;
+                          case TracerIntegrator::RK2: advance_block<TracerIntegrator::RK2>(begin, end); break;
+                          case TracerIntegrator::RK4: advance_block<TracerIntegrator::RK4>(begin, end); break;
+                      }
+                      m_block_offsets[block] = std::count(m_keep.begin() + begin, m_keep.begin() + end, 1);
+                  });
+
+    // The stream compaction: every block moves its kept tracers to its offset, in the order they were
+    const size_t kept = std::accumulate(m_block_offsets.begin(), m_block_offsets.end(), size_t{0});
+    if (kept == count)
+        return;
+    std::exclusive_scan(m_block_offsets.begin(), m_block_offsets.end(), m_block_offsets.begin(), size_t{0});
+    m_next_x.resize(kept);
+    m_next_y.resize(kept);
+    m_next_age.resize(kept);
+    m_next_speed.resize(kept);
+    std::for_each(std::execution::par, m_blocks.begin(), m_blocks.end(),
+                  [this, count](size_t block)
+                  {
+                      const size_t begin = block * BLOCK_SIZE;
+                      const size_t end = std::min(begin + BLOCK_SIZE, count);
+                      size_t out = m_block_offsets[block];
+                      for (size_t i = begin; i < end; i++)
+                      {
+                          if (!m_keep[i]) continue;
+                          m_next_x[out] = m_x[i];
+                          m_next_y[out] = m_y[i];
+                          m_next_age[out] = m_age[i];
+                          m_next_speed[out] = m_speed[i];
+                          out++;
+                      }
+                  });
+    m_x.swap(m_next_x);
+    m_y.swap(m_next_y);
+    m_age.swap(m_next_age);
+    m_speed.swap(m_next_speed);
+}
+
+template <typename Precision>
+void Tracers<Precision>::emit_tracers()
+{
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+    for (size_t inflow_idx: m_lbm -> get_inflow_cells())
+    {
+        if (dist(m_rng) < m_emission_rate)
+            add_tracer(inflow_idx, dist(m_rng), dist(m_rng));
+    }
+}
+
+template <typename Precision>
+void Tracers<Precision>::get_positions(std::vector<std::array<float, 2>>& positions) const
+{
+    positions.resize(m_x.size());
+    std::transform(std::execution::par, m_x.begin(), m_x.end(), m_y.begin(), positions.begin(),
+                   [](float x, float y) { return std::array<float, 2>{x, y}; });
+}
+
+template <typename Precision>
+std::vector<std::array<float, 2>> Tracers<Precision>::get_positions() const
+{
+    std::vector<std::array<float, 2>> positions;
+    get_positions(positions);
+    return positions;
+}
+
+template <typename Precision>
+void Tracers<Precision>::get_attribute(TracerColoring coloring, std::vector<float>& values) const
+{
+    switch (coloring)
+    {
+        case TracerColoring::NONE: values.clear(); break;
+        case TracerColoring::AGE: values.assign(m_age.begin(), m_age.end()); break;
+        case TracerColoring::SPEED: values.assign(m_speed.begin(), m_speed.end()); break;
+    }
+}
+
+template <typename Precision>
+void Tracers<Precision>::set_positions(const std::vector<std::array<float, 2>>& positions, const std::vector<float>& ages)
+{
+    if (ages.size() != positions.size())
+        throw std::runtime_error("Every tracer needs a position and an age");
+    m_x.resize(positions.size());
+    m_y.resize(positions.size());
+    m_age = ages;
+    m_speed.assign(positions.size(), 0.0f);
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        m_x[i] = positions[i][0];
+        m_y[i] = positions[i][1];
+    }
+}
+
+
+template class Tracers<double>;
+template class Tracers<float>;
+template class Tracers<MixedPrecision>;
@@ -1,73 +1,44 @@
 #include "tracers_collection.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include "renderer.h"
 #include "shaders.h"
+#include "tracers.h"
 
-TracersCollection::TracersCollection(const D2Q9& lbm, const TracersParams& tracers_params)
-    : m_lbm(&lbm),
-      m_grid_width(lbm.get_dimensions()[0]),
-      m_grid_height(lbm.get_dimensions()[1]),
-      m_emission_rate(tracers_params.emission_rate),
-      m_num_tracers(tracers_params.random_initial),
-      m_rng(std::random_device{}())
+TracersCollection::TracersCollection(size_t grid_width, size_t grid_height, const TracersParams& tracers_params)
+    : m_grid_width(grid_width), m_grid_height(grid_height),
+      m_coloring(tracers_params.coloring != TracerColoring::NONE),
+      m_persistent(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)
 {
-    std::vector<size_t> fluid_cell_indices = m_lbm -> get_fluid_cells();
-
-    std::shuffle(fluid_cell_indices.begin(), fluid_cell_indices.end(), m_rng);
-    size_t tracers_counter = std::min(m_num_tracers, fluid_cell_indices.size());
-    
-    // Add randomly placed tracers
-    for (size_t i = 0; i < tracers_counter; i++)
-    {
-        auto coords = m_lbm -> index_to_coords(fluid_cell_indices[i]);
-        m_positions.push_back({static_cast<float>(coords[0]), 
-                               static_cast<float>(coords[1])});
-    }
-    // Add custom tracers from the initial data
-    for (size_t idx: tracers_params.initial_tracers)
-    {
-        auto coords = m_lbm -> index_to_coords(idx);
-        m_positions.push_back({static_cast<float>(coords[0]), 
-                               static_cast<float>(coords[1])});
-    }
-
     // Initialize the GL data
     init(tracers_params);
 }
 
 TracersCollection::~TracersCollection()
 {
-    glDeleteBuffers(1, &m_vbo);
+    release_buffers();
     glDeleteVertexArrays(1, &m_vao);
+    glDeleteProgram(m_shader_program);
 }
 
 void TracersCollection::init(const TracersParams& tracers_params)
 {
     GLuint vshader = compile_shader(tracer_vertex_shader_src, GL_VERTEX_SHADER);
-    GLuint fshader = compile_shader(tracer_fragment_shader_src, GL_FRAGMENT_SHADER);
+    GLuint fshader = compile_shader(tracer_fragment_shader_src.c_str(), GL_FRAGMENT_SHADER);
     m_shader_program = create_program(vshader, fshader);
     glDeleteShader(vshader);
     glDeleteShader(fshader);
 
     glGenVertexArrays(1, &m_vao);
-    glGenBuffers(1, &m_vbo);
-
-    glBindVertexArray(m_vao);
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-
-    glBufferData(GL_ARRAY_BUFFER, 
-                 m_positions.size() * sizeof(float) * 2,
-                 m_positions.data(), GL_DYNAMIC_DRAW);
+    reserve(MIN_CAPACITY);
 
-    glEnableVertexAttribArray(0); // location=0 in shader
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
-
-    glBindVertexArray(0);
-    
     // Set up the constant parameters for the tracers shader program
     glUseProgram(m_shader_program);
 
-    GLint gridSizeLoc = glGetUniformLocation(m_shader_program, "uGridSize");
-    glUniform2f(gridSizeLoc, (float)m_grid_width, (float)m_grid_height);
+    m_view = {0, 0, m_grid_width, m_grid_height};
+    m_view_loc = glGetUniformLocation(m_shader_program, "uView");
+    glUniform4f(m_view_loc, 0.0f, 0.0f, (float)m_grid_width, (float)m_grid_height);
 
     GLint screenSizeLoc = glGetUniformLocation(m_shader_program, "uScreenSize");
     glUniform2f(screenSizeLoc, (float)m_grid_width, (float)m_grid_height);
@@ -82,89 +53,149 @@ void TracersCollection::init(const TracersParams& tracers_params)
                 tracers_params.color[1],
                 tracers_params.color[2],
                 tracers_params.color[3]);
-    
+
+    // The colormap of the attribute, off until a frame comes with the values
+    GLint valueScaleLoc = glGetUniformLocation(m_shader_program, "uValueScale");
+    glUniform1f(valueScaleLoc, 1.0f / tracer_coloring_range(tracers_params));
+    m_colored_loc = glGetUniformLocation(m_shader_program, "uColored");
+    glUniform1i(m_colored_loc, GL_FALSE);
+
     glEnable(GL_PROGRAM_POINT_SIZE);
     glUseProgram(0); // unbind for safety
 }
 
-void TracersCollection::update_positions() 
+void TracersCollection::set_view(const GridRect& view)
 {
-    for (size_t i = 0; i < m_positions.size(); ) 
-        {
-            // Get the integer coordinates of the cell the tracer is in
-            int x_int = static_cast<int>(m_positions[i][0]);
-            int y_int = static_cast<int>(m_positions[i][1]); 
-            size_t idx = m_lbm -> coords_to_index(x_int, y_int);       
-
-            // Get the velocity at that cell
-            const auto& velocity = m_lbm -> get_velocity()[idx];
-
-            // Update the tracer's position
-            m_positions[i][0] += static_cast<float>(velocity[0] * 5);
-            m_positions[i][1] += static_cast<float>(velocity[1] * 5);
-
-            if (m_lbm -> is_periodic(0))
-            {
-                if (m_positions[i][0] < 0)
-                    m_positions[i][0] += m_grid_width;
-                else if (m_positions[i][0] >= m_grid_width)
-                    m_positions[i][0] -= m_grid_width;
-            }
-            if (m_lbm -> is_periodic(1))
-            {
-                if (m_positions[i][1] < 0)
-                    m_positions[i][1] += m_grid_height;
-                else if (m_positions[i][1] >= m_grid_height)
-                    m_positions[i][1] -= m_grid_height;
-            }
-
-            // Delete a tracer if it gets out of the grid
-            if (!(0 <= m_positions[i][0] && m_positions[i][0] < m_grid_width &&
-                  0 <= m_positions[i][1] && m_positions[i][1] < m_grid_height) ||
-                  m_lbm -> get_cell_type(idx) == CellType::OUTFLOW)
-            {
-                m_positions[i] = m_positions.back();
-                m_positions.pop_back();
-            }
-            else
-            {
-                // Regular update. Move on to the next tracer
-                i++;
-            }
-        }
+    if (view.x == m_view.x && view.y == m_view.y && view.width == m_view.width && view.height == m_view.height)
+        return;
+    m_view = view;
+    glUseProgram(m_shader_program);
+    glUniform4f(m_view_loc, (float)view.x, (float)view.y, (float)view.width, (float)view.height);
+    glUseProgram(0);
 }
 
-void TracersCollection::emit_tracers()
+void TracersCollection::reserve(size_t count)
 {
-    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
-    float r;
+    if (count <= m_capacity)
+        return;
+    const size_t capacity = std::max({count, 2 * m_capacity, MIN_CAPACITY});
+    release_buffers();
+    m_capacity = capacity;
+    m_region = 0;
+
+    const GLsizeiptr position_bytes = REGIONS * m_capacity * sizeof(std::array<float, 2>);
+    const GLsizeiptr value_bytes = REGIONS * m_capacity * sizeof(float);
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
 
-    for (size_t inflow_idx: m_lbm -> get_inflow_cells())
+    glBindVertexArray(m_vao);
+
+    glGenBuffers(1, &m_position_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m_position_vbo);
+    if (m_persistent)
     {
-        r = dist(m_rng);
-        if (r < m_emission_rate)
-        {
-            auto coords = m_lbm -> index_to_coords(inflow_idx);
-            m_positions.push_back({static_cast<float>(coords[0]), 
-                                   static_cast<float>(coords[1])});
-        }
+        glBufferStorage(GL_ARRAY_BUFFER, position_bytes, nullptr, flags);
+        m_mapped_positions = static_cast<std::array<float, 2>*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, position_bytes, flags));
     }
+    else
+        glBufferData(GL_ARRAY_BUFFER, position_bytes, nullptr, GL_STREAM_DRAW);
+    glEnableVertexAttribArray(0); // location=0 in shader
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+
+    // The attribute array is only enabled while the tracers are colored
+    glGenBuffers(1, &m_value_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m_value_vbo);
+    if (m_persistent)
+    {
+        glBufferStorage(GL_ARRAY_BUFFER, value_bytes, nullptr, flags);
+        m_mapped_values = static_cast<float*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, value_bytes, flags));
+    }
+    else
+        glBufferData(GL_ARRAY_BUFFER, value_bytes, nullptr, GL_STREAM_DRAW);
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    if (m_persistent && (!m_mapped_positions || !m_mapped_values))
+        throw std::runtime_error("Failed to map the tracer buffers");
 }
 
+void TracersCollection::release_buffers()
+{
+    for (GLsync& fence : m_fences)
+    {
+        if (fence)
+            glDeleteSync(fence);
+        fence = nullptr;
+    }
+    // Deleting a buffer unmaps it; the GPU keeps it until the draws from it are done
+    if (m_position_vbo)
+        glDeleteBuffers(1, &m_position_vbo);
+    if (m_value_vbo)
+        glDeleteBuffers(1, &m_value_vbo);
+    m_position_vbo = m_value_vbo = 0;
+    m_mapped_positions = nullptr;
+    m_mapped_values = nullptr;
+}
 
-void TracersCollection::render_tracers() 
+void TracersCollection::wait_for_region(size_t region)
 {
-    glUseProgram(m_shader_program);
+    GLsync& fence = m_fences[region];
+    if (!fence)
+        return;
+    // The region was drawn from REGIONS frames ago, so this seldom waits
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+void TracersCollection::render_tracers(const std::vector<std::array<float, 2>>& positions,
+                                       const std::vector<float>& values)
+{
+    const size_t count = positions.size();
+    if (!count)
+        return;
+    reserve(count);
+    const bool colored = m_coloring && values.size() == count;
+    const size_t first = m_region * m_capacity;
+
+    // Write this frame's region
+    if (m_persistent)
+    {
+        wait_for_region(m_region);
+        std::memcpy(m_mapped_positions + first, positions.data(), count * sizeof(std::array<float, 2>));
+        if (colored)
+            std::memcpy(m_mapped_values + first, values.data(), count * sizeof(float));
+    }
+    else
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, m_position_vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(std::array<float, 2>),
+                        count * sizeof(std::array<float, 2>), positions.data());
+        if (colored)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, m_value_vbo);
+            glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(float), count * sizeof(float), values.data());
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
 
-    // Bind VBO and update its data
+    glUseProgram(m_shader_program);
     glBindVertexArray(m_vao);
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-    glBufferData(GL_ARRAY_BUFFER, 
-                 m_positions.size() * sizeof(float) * 2,
-                 m_positions.data(), GL_DYNAMIC_DRAW);
-    glDrawArrays(GL_POINTS, 0, m_positions.size());
-    
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (colored != m_colored)
+    {
+        if (colored)
+            glEnableVertexAttribArray(1);
+        else
+            glDisableVertexAttribArray(1);
+        glUniform1i(m_colored_loc, colored);
+        m_colored = colored;
+    }
+    glDrawArrays(GL_POINTS, static_cast<GLint>(first), static_cast<GLsizei>(count));
+
+    if (m_persistent)
+        m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    m_region = (m_region + 1) % REGIONS;
+
     glBindVertexArray(0);
     glUseProgram(0);
-}
\ No newline at end of file
+}
@@ -0,0 +1,163 @@
+// Checks that a grid split into row slabs over the ranks of the local transport (--ranks R)
+// gives the densities and velocities of the whole grid stepped by the fused kernel, bit for bit,
+// in every precision, on the parallel algorithms and on the thread pool.
+// Runs the example setups and small synthetic grids, periodic and bounded, down to slabs of a
+// single row.
+// Usage: d2q9_decomposed_test [--steps N] [--examples <dir>]
+
+#include <iostream>
+#include <vector>
+#include <array>
+#include <cstring>
+#include <random>
+#include <string>
+#include <memory>
+
+#include "d2q9.h"
+#include "d2q9_decomposed.h"
+#include "halo_transport.h"
+#include "cli.h"
+
+#ifndef LBM_EXAMPLES_DIR
+#define LBM_EXAMPLES_DIR "examples"
+#endif
+
+struct TestCase
+{
+    std::string name;
+    LBM<2>::LBMParams params;
+    D2Q9InitialView initials;
+    // Keeps the initial conditions alive
+    std::shared_ptr<const SimulationSetup> setup;
+};
+
+// A grid of fluid cells with random solid cells, inflow on the west edge and outflow on the
+// east one when they are not periodic, and a random initial state near rest
+static TestCase synthetic_case(size_t nx, size_t ny, bool periodic_x, bool periodic_y, unsigned seed)
+{
+    auto initials = std::make_shared<SimulationSetup>();
+    TestCase tc{std::to_string(nx) + "x" + std::to_string(ny) + (periodic_x ? " px" : "") + (periodic_y ? " py" : ""),
+                {{nx, ny}, {periodic_x, periodic_y}, 0.8}, {}, initials};
+
+    D2Q9InitialConditions& ic = initials->initials;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    ic.cell_type.resize(nx * ny, CellType::FLUID);
+    ic.initial_rho.resize(nx * ny);
+    ic.initial_u.resize(nx * ny);
+    for (size_t y = 0; y < ny; y++)
+    {
+        for (size_t x = 0; x < nx; x++)
+        {
+            const size_t idx = y * nx + x;
+            ic.initial_rho[idx] = 1.0 + 0.02 * (uniform(rng) - 0.5);
+            ic.initial_u[idx] = {0.05 * (uniform(rng) - 0.5), 0.05 * (uniform(rng) - 0.5)};
+            if (!periodic_x && nx > 2 && x == 0)
+                ic.cell_type[idx] = CellType::INFLOW;
+            else if (!periodic_x && nx > 2 && x == nx - 1)
+                ic.cell_type[idx] = CellType::OUTFLOW;
+            else if (uniform(rng) < 0.15)
+                ic.cell_type[idx] = CellType::SOLID;
+        }
+    }
+    tc.initials = D2Q9InitialView(ic);
+    return tc;
+}
+
+static TestCase example_case(const std::string& filename)
+{
+    Args args;
+    args.input_file = filename;
+    auto setup = std::make_shared<const SimulationSetup>(load_setup(args));
+    return {filename, setup->lbm_params, setup->initial_view(), setup};
+}
+
+static size_t failures = 0;
+
+template <typename Precision>
+static void check_ranks(const TestCase& tc, const std::string& precision, size_t ranks, size_t threads, size_t steps)
+{
+    LBM<2>::LBMParams params = tc.params;
+    params.execution.threads = threads;
+    D2Q9<Precision> whole(params, tc.initials, D2Q9Kernel::FUSED);
+    whole.advance(steps);
+
+    std::vector<typename D2Q9Decomposed<Precision>::Scalar> rho;
+    std::vector<typename D2Q9Decomposed<Precision>::VelocityVec> u;
+    run_local_ranks(ranks, [&](HaloTransport& transport)
+                           {
+                               LBM<2>::LBMParams rank_params = params;
+                               rank_params.execution.pool = transport.rank();
+                               rank_params.execution.pools = transport.size();
+                               D2Q9Decomposed<Precision> lbm(rank_params, tc.initials, transport);
+                               lbm.advance(steps);
+                               // Only rank 0 gets the fields
+                               std::vector<typename D2Q9Decomposed<Precision>::Scalar> rank_rho;
+                               std::vector<typename D2Q9Decomposed<Precision>::VelocityVec> rank_u;
+                               lbm.gather_fields(rank_rho, rank_u);
+                               if (transport.rank() == 0)
+                               {
+                                   rho = std::move(rank_rho);
+                                   u = std::move(rank_u);
+                               }
+                           });
+
+    const auto& whole_rho = whole.get_density();
+    const auto& whole_u = whole.get_velocity();
+    const size_t cells = whole.get_total_size();
+    if (rho.size() != cells || u.size() != cells
+        || std::memcmp(rho.data(), whole_rho.data(), cells * sizeof(rho[0])) != 0
+        || std::memcmp(u.data(), whole_u.data(), cells * sizeof(u[0])) != 0)
+    {
+        std::cerr << "FAIL " << tc.name << " " << precision << " " << ranks << " ranks"
+                  << (threads ? " on the pool" : "") << ": the fields differ from the fused kernel" << std::endl;
+        failures++;
+    }
+}
+
+static void check_case(const TestCase& tc, size_t steps)
+{
+    for (size_t ranks : {2, 3})
+    {
+        if (tc.params.dimensions[1] < ranks)
+            continue;
+        for (size_t threads : {0, 2})
+        {
+            check_ranks<double>(tc, "double", ranks, threads, steps);
+            check_ranks<float>(tc, "float", ranks, threads, steps);
+            check_ranks<MixedPrecision>(tc, "mixed", ranks, threads, steps);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t steps = 25;
+    std::string examples = LBM_EXAMPLES_DIR;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--steps" && i + 1 < argc)
+            steps = std::stoul(argv[++i]);
+        else if (arg == "--examples" && i + 1 < argc)
+            examples = argv[++i];
+    }
+
+    std::vector<std::array<size_t, 2>> sizes = {{1, 6}, {5, 2}, {5, 3}, {7, 4}, {16, 12}, {33, 17}};
+    unsigned seed = 1;
+    for (const auto& size : sizes)
+        for (bool periodic_x : {false, true})
+            for (bool periodic_y : {false, true})
+                check_case(synthetic_case(size[0], size[1], periodic_x, periodic_y, seed++), steps);
+
+    for (const char* name : {"block", "boltzmann", "boltzmann_2", "cavern", "chamber", "nozzle"})
+        check_case(example_case(examples + "/" + name + ".dat"), 10);
+
+    if (failures)
+    {
+        std::cerr << failures << " failed comparisons" << std::endl;
+        return 1;
+    }
+    std::cout << "All decompositions agree with the fused kernel" << std::endl;
+    return 0;
+}
@@ -0,0 +1,211 @@
+// Checks that the D2Q9 update kernels agree: four-pass, fused, sparse, in-place and tiled
+// (on the parallel algorithms and on the thread pool) must give bit-identical densities and
+// velocities, in every precision; SoA and mixed precision must agree with the double precision
+// four-pass kernel within a tolerance. In mixed precision the populations are rounded to single
+// precision after the streaming by four-pass and sparse, and after the collision by the fused,
+// in-place and tiled kernels, so each group is only bit-identical within itself.
+// Runs the example setups and small synthetic grids, periodic and bounded, down to a single
+// row, column or cell.
+// Usage: d2q9_kernels_test [--steps N] [--examples <dir>]
+
+#include <iostream>
+#include <vector>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <string>
+#include <limits>
+#include <memory>
+
+#include "d2q9.h"
+#include "cli.h"
+
+#ifndef LBM_EXAMPLES_DIR
+#define LBM_EXAMPLES_DIR "examples"
+#endif
+
+struct TestCase
+{
+    std::string name;
+    LBM<2>::LBMParams params;
+    D2Q9InitialView initials;
+    // Keeps the initial conditions alive
+    std::shared_ptr<const SimulationSetup> setup;
+};
+
+struct KernelVariant
+{
+    std::string name;
+    D2Q9Kernel kernel;
+    D2Q9Tiling tiling;
+    size_t threads;
+};
+
+struct Fields
+{
+    std::vector<double> rho;
+    std::vector<std::array<double, 2>> u;
+};
+
+static const std::vector<KernelVariant> EXACT_VARIANTS = {
+    {"fused/pool", D2Q9Kernel::FUSED, {}, 2},
+    {"sparse", D2Q9Kernel::SPARSE, {}, 0},
+    {"sparse/pool", D2Q9Kernel::SPARSE, {}, 2},
+    {"in-place", D2Q9Kernel::IN_PLACE, {}, 0},
+    {"in-place/pool", D2Q9Kernel::IN_PLACE, {}, 2},
+    {"tiled 4x3", D2Q9Kernel::TILED, {4, 3, 1}, 0},
+    {"tiled 4x3x3", D2Q9Kernel::TILED, {4, 3, 3}, 0},
+    {"tiled 64x32x4/pool", D2Q9Kernel::TILED, {64, 32, 4}, 2},
+};
+
+// A grid of fluid cells with random solid cells, inflow on the west edge and outflow on the
+// east one when they are not periodic, and a random initial state near rest
+static TestCase synthetic_case(size_t nx, size_t ny, bool periodic_x, bool periodic_y, unsigned seed,
+                               double solid_fraction = 0.15)
+{
+    auto initials = std::make_shared<SimulationSetup>();
+    TestCase tc{std::to_string(nx) + "x" + std::to_string(ny) + (periodic_x ? " px" : "") + (periodic_y ? " py" : ""),
+                {{nx, ny}, {periodic_x, periodic_y}, 0.8}, {}, initials};
+
+    D2Q9InitialConditions& ic = initials->initials;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    ic.cell_type.resize(nx * ny, CellType::FLUID);
+    ic.initial_rho.resize(nx * ny);
+    ic.initial_u.resize(nx * ny);
+    for (size_t y = 0; y < ny; y++)
+    {
+        for (size_t x = 0; x < nx; x++)
+        {
+            const size_t idx = y * nx + x;
+            ic.initial_rho[idx] = 1.0 + 0.02 * (uniform(rng) - 0.5);
+            ic.initial_u[idx] = {0.05 * (uniform(rng) - 0.5), 0.05 * (uniform(rng) - 0.5)};
+            if (!periodic_x && nx > 2 && x == 0)
+                ic.cell_type[idx] = CellType::INFLOW;
+            else if (!periodic_x && nx > 2 && x == nx - 1)
+                ic.cell_type[idx] = CellType::OUTFLOW;
+            else if (uniform(rng) < solid_fraction)
+                ic.cell_type[idx] = CellType::SOLID;
+        }
+    }
+    tc.initials = D2Q9InitialView(ic);
+    return tc;
+}
+
+static TestCase example_case(const std::string& filename)
+{
+    Args args;
+    args.input_file = filename;
+    auto setup = std::make_shared<const SimulationSetup>(load_setup(args));
+    return {filename, setup->lbm_params, setup->initial_view(), setup};
+}
+
+template <typename Precision>
+static Fields run(const TestCase& tc, const KernelVariant& variant, size_t steps)
+{
+    LBM<2>::LBMParams params = tc.params;
+    params.execution.threads = variant.threads;
+    D2Q9<Precision> lbm(params, tc.initials, variant.kernel, variant.tiling);
+    lbm.advance(steps);
+
+    const auto& rho = lbm.get_density();
+    const auto& u = lbm.get_velocity();
+    Fields fields;
+    for (size_t idx = 0; idx < lbm.get_total_size(); idx++)
+    {
+        fields.rho.push_back(rho[idx]);
+        fields.u.push_back({u[idx][0], u[idx][1]});
+    }
+    return fields;
+}
+
+// The largest difference between the fields, 0 only if they are bit-identical
+static double max_difference(const Fields& a, const Fields& b)
+{
+    double diff = 0.0;
+    for (size_t idx = 0; idx < a.rho.size(); idx++)
+    {
+        diff = std::max(diff, std::abs(a.rho[idx] - b.rho[idx]));
+        for (size_t d = 0; d < 2; d++)
+            diff = std::max(diff, std::abs(a.u[idx][d] - b.u[idx][d]));
+    }
+    const bool identical = std::memcmp(a.rho.data(), b.rho.data(), a.rho.size() * sizeof(double)) == 0
+                        && std::memcmp(a.u.data(), b.u.data(), a.u.size() * sizeof(a.u[0])) == 0;
+    return identical ? 0.0 : std::max(diff, std::numeric_limits<double>::min());
+}
+
+static size_t failures = 0;
+
+static void check(const std::string& what, double diff, double tolerance)
+{
+    if (diff > tolerance)
+    {
+        std::cerr << "FAIL " << what << ": max difference " << diff << " (tolerance " << tolerance << ")" << std::endl;
+        failures++;
+    }
+}
+
+static bool stores_post_collision(D2Q9Kernel kernel)
+{
+    return kernel == D2Q9Kernel::FUSED || kernel == D2Q9Kernel::IN_PLACE || kernel == D2Q9Kernel::TILED;
+}
+
+// Every exact variant against the four-pass or the fused kernel of the same precision
+template <typename Precision>
+static Fields check_exact(const TestCase& tc, const std::string& precision, size_t steps)
+{
+    const Fields reference = run<Precision>(tc, {"four-pass", D2Q9Kernel::FOUR_PASS, {}, 0}, steps);
+    const Fields fused = run<Precision>(tc, {"fused", D2Q9Kernel::FUSED, {}, 0}, steps);
+    check(tc.name + " " + precision + " fused vs four-pass", max_difference(reference, fused),
+          D2Q9Precision<Precision>::STORES_DEVIATIONS ? 1e-6 : 0.0);
+    for (const KernelVariant& variant : EXACT_VARIANTS)
+        check(tc.name + " " + precision + " " + variant.name,
+              max_difference(stores_post_collision(variant.kernel) ? fused : reference, run<Precision>(tc, variant, steps)), 0.0);
+    return reference;
+}
+
+static void check_case(const TestCase& tc, size_t steps)
+{
+    const Fields reference = check_exact<double>(tc, "double", steps);
+    check_exact<float>(tc, "float", steps);
+    const Fields mixed = check_exact<MixedPrecision>(tc, "mixed", steps);
+
+    check(tc.name + " double soa", max_difference(reference, run<double>(tc, {"soa", D2Q9Kernel::SOA, {}, 0}, steps)), 1e-12);
+    check(tc.name + " double soa/pool", max_difference(reference, run<double>(tc, {"soa", D2Q9Kernel::SOA, {}, 2}, steps)), 1e-12);
+    check(tc.name + " mixed vs double", max_difference(reference, mixed), 1e-5);
+}
+
+int main(int argc, char** argv)
+{
+    size_t steps = 25;
+    std::string examples = LBM_EXAMPLES_DIR;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--steps" && i + 1 < argc)
+            steps = std::stoul(argv[++i]);
+        else if (arg == "--examples" && i + 1 < argc)
+            examples = argv[++i];
+    }
+
+    std::vector<std::array<size_t, 2>> sizes = {{1, 1}, {1, 5}, {5, 1}, {2, 2}, {2, 7}, {7, 2}, {3, 3}, {16, 12}, {33, 17}};
+    unsigned seed = 1;
+    for (const auto& size : sizes)
+        for (bool periodic_x : {false, true})
+            for (bool periodic_y : {false, true})
+                check_case(synthetic_case(size[0], size[1], periodic_x, periodic_y, seed++), steps);
+    // Without any fluid cell
+    check_case(synthetic_case(6, 4, true, true, seed++, 1.0), steps);
+
+    for (const char* name : {"block", "boltzmann", "boltzmann_2", "cavern", "chamber", "nozzle"})
+        check_case(example_case(examples + "/" + name + ".dat"), 10);
+
+    if (failures)
+    {
+        std::cerr << failures << " failed comparisons" << std::endl;
+        return 1;
+    }
+    std::cout << "All kernels agree" << std::endl;
+    return 0;
+}